@@ -0,0 +1,138 @@
+//! Latency and throughput per batch size.
+//!
+//! The scheduler section needs no model and measures the wait batching adds
+//! under a steady request rate.  The inference section runs `BatchRunner` on
+//! each model listed in VAAL_BENCH_BATCH_MODELS (comma separated, one model
+//! per batch size) on VAAL_BENCH_DEVICE, default cpu.  The box and score
+//! outputs are VAAL_BENCH_BOXES_OUTPUT and VAAL_BENCH_SCORES_OUTPUT, default
+//! 0 and 1.
+//!
+//! cargo bench --bench batch
+
+mod common;
+
+use common::percentile;
+use std::{
+    env,
+    sync::Arc,
+    thread,
+    time::{Duration, Instant},
+};
+use vaal::{
+    Context,
+    batch::{BatchRunner, BatchScheduler},
+    frame::{Frame, RGB3},
+    postprocess::Decoder,
+};
+
+const REQUESTS: usize = 2000;
+const REQUEST_INTERVAL: Duration = Duration::from_micros(250);
+const MAX_DELAY: Duration = Duration::from_millis(5);
+const ITERATIONS: usize = 50;
+
+/// Requests arrive every REQUEST_INTERVAL, the wait is measured from submit
+/// until the batch holding the request is handed out.
+fn scheduler(batch_size: usize) {
+    let scheduler = Arc::new(BatchScheduler::new(batch_size, MAX_DELAY));
+    let consumer = {
+        let scheduler = scheduler.clone();
+        thread::spawn(move || {
+            let mut batch = Vec::new();
+            let mut waits = Vec::with_capacity(REQUESTS);
+            let mut batches = 0;
+            while scheduler.next_batch(&mut batch) {
+                let now = Instant::now();
+                waits.extend(
+                    batch
+                        .iter()
+                        .map(|submitted: &Instant| (now - *submitted).as_secs_f64() * 1e3),
+                );
+                batches += 1;
+            }
+            (waits, batches)
+        })
+    };
+    let start = Instant::now();
+    for i in 0..REQUESTS {
+        let due = start + REQUEST_INTERVAL * i as u32;
+        if let Some(wait) = due.checked_duration_since(Instant::now()) {
+            thread::sleep(wait);
+        }
+        scheduler.submit(Instant::now()).unwrap();
+    }
+    scheduler.close();
+    let (mut waits, batches) = consumer.join().unwrap();
+    waits.sort_unstable_by(f64::total_cmp);
+    println!(
+        "scheduler batch {:>2}: mean batch {:.2}, wait p50 {:.3} ms, p99 {:.3} ms, max {:.3} ms",
+        batch_size,
+        REQUESTS as f64 / batches as f64,
+        percentile(&waits, 0.50),
+        percentile(&waits, 0.99),
+        percentile(&waits, 1.0)
+    );
+}
+
+fn inference(model: &str, device: &str, boxes_output: i32, scores_output: i32) {
+    let mut context = Context::new(device).unwrap();
+    context.load_model_file(model).unwrap();
+    let batch = BatchRunner::batch_size(&context).unwrap();
+    let (width, height) = (640, 480);
+    let data = vec![128u8; width * height * 3];
+    let frame = Frame::new(&data, RGB3, width as i32, height as i32).unwrap();
+    let frames = vec![frame; batch];
+    let mut runner = BatchRunner::new(Decoder::new(), boxes_output, scores_output);
+    let mut results = Vec::new();
+
+    for _ in 0..3 {
+        runner
+            .run(&context, &frames, None, 0, &mut results)
+            .unwrap();
+    }
+    let mut latencies = Vec::with_capacity(ITERATIONS);
+    let start = Instant::now();
+    for _ in 0..ITERATIONS {
+        let run = Instant::now();
+        runner
+            .run(&context, &frames, None, 0, &mut results)
+            .unwrap();
+        latencies.push(run.elapsed().as_secs_f64() * 1e3);
+    }
+    let elapsed = start.elapsed().as_secs_f64();
+    latencies.sort_unstable_by(f64::total_cmp);
+    println!(
+        "inference batch {:>2}: batch p50 {:.2} ms, p99 {:.2} ms, {:.2} ms per image, {:.1} images/s ({})",
+        batch,
+        percentile(&latencies, 0.50),
+        percentile(&latencies, 0.99),
+        percentile(&latencies, 0.50) / batch as f64,
+        (ITERATIONS * batch) as f64 / elapsed,
+        model
+    );
+}
+
+fn main() {
+    for batch_size in [1, 2, 4, 8, 16] {
+        scheduler(batch_size);
+    }
+
+    let models = match env::var("VAAL_BENCH_BATCH_MODELS") {
+        Ok(models) => models,
+        Err(_) => {
+            println!("inference skipped: set VAAL_BENCH_BATCH_MODELS");
+            return;
+        }
+    };
+    let device = env::var("VAAL_BENCH_DEVICE").unwrap_or_else(|_| "cpu".to_owned());
+    let output = |name: &str, default: i32| {
+        env::var(name)
+            .ok()
+            .and_then(|v| v.parse().ok())
+            .unwrap_or(default)
+    };
+    let boxes_output = output("VAAL_BENCH_BOXES_OUTPUT", 0);
+    let scores_output = output("VAAL_BENCH_SCORES_OUTPUT", 1);
+    for model in models.split(',').filter(|m| !m.is_empty()) {
+        inference(model, &device, boxes_output, scores_output);
+    }
+}
@@ -0,0 +1,20 @@
+//! Helpers shared by the benches, included with `mod common;`.
+
+#![allow(dead_code)]
+
+/// Nearest-rank percentile of sorted samples, 0 for no samples.
+pub fn percentile(sorted: &[f64], p: f64) -> f64 {
+    if sorted.is_empty() {
+        return 0.0;
+    }
+    let rank = ((p * sorted.len() as f64).ceil() as usize).clamp(1, sorted.len());
+    sorted[rank - 1]
+}
+
+/// Xorshift in [0, 1), reproducible inputs without a rand dependency.
+pub fn random(state: &mut u64) -> f64 {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    (*state >> 11) as f64 / (1u64 << 53) as f64
+}
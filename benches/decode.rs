@@ -0,0 +1,75 @@
+//! Box decoding time for all classes against a class allow-list.
+//!
+//! Synthetic SSD and YOLO sized outputs with 80 classes are decoded with the
+//! Rust `Decoder` for every class, a 10 class subset and a single class.
+//! Scores are uniform below the threshold apart from a few anchors per class
+//! above it, so most of the time is spent scanning scores.
+//!
+//! cargo bench --bench decode
+
+mod common;
+
+use common::{percentile, random};
+use std::time::Instant;
+use vaal::{VAALBox, postprocess::Decoder};
+
+const CLASSES: usize = 80;
+const ITERATIONS: usize = 200;
+/// Fraction of scores above the threshold.
+const HIT_RATE: f64 = 0.002;
+
+/// Boxes of 5% to 25% of the frame and scores for every class.
+fn outputs(anchors: usize) -> (Vec<f32>, Vec<f32>) {
+    let mut state = 0x2545_f491_4f6c_dd1d;
+    let mut boxes = Vec::with_capacity(anchors * 4);
+    for _ in 0..anchors {
+        let (x, y) = (random(&mut state) * 0.75, random(&mut state) * 0.75);
+        let (w, h) = (
+            0.05 + random(&mut state) * 0.2,
+            0.05 + random(&mut state) * 0.2,
+        );
+        boxes.extend([x, y, x + w, y + h].map(|v| v as f32));
+    }
+    let scores = (0..anchors * CLASSES)
+        .map(|_| {
+            if random(&mut state) < HIT_RATE {
+                0.5 + random(&mut state) as f32 * 0.5
+            } else {
+                random(&mut state) as f32 * 0.4
+            }
+        })
+        .collect();
+    (boxes, scores)
+}
+
+fn main() {
+    let subset: Vec<usize> = (0..10).map(|i| i * 8).collect();
+    for (name, anchors) in [("ssd", 1917), ("yolo", 8400)] {
+        let (boxes, scores) = outputs(anchors);
+        println!("{} {} anchors, {} classes", name, anchors, CLASSES);
+        for (filter, decoder) in [
+            ("all", Decoder::new()),
+            ("10 classes", Decoder::new().with_classes(&subset)),
+            ("1 class", Decoder::new().with_classes(&[0])),
+        ] {
+            let mut output: Vec<VAALBox> = Vec::new();
+            let mut times = Vec::with_capacity(ITERATIONS);
+            let mut found = 0;
+            for _ in 0..ITERATIONS {
+                let start = Instant::now();
+                found = decoder
+                    .decode(&boxes, &scores, CLASSES, &mut output)
+                    .unwrap();
+                times.push(start.elapsed().as_secs_f64() * 1e6);
+            }
+            times.sort_unstable_by(f64::total_cmp);
+            println!(
+                "  {:<10} p50 {:8.1} us, p99 {:8.1} us, {:3} boxes",
+                filter,
+                percentile(&times, 0.50),
+                percentile(&times, 0.99),
+                found
+            );
+        }
+    }
+}
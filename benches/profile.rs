@@ -0,0 +1,109 @@
+//! Reconfiguration cost of switching a pool of contexts between profiles.
+//!
+//! VAAL_BENCH_PROFILES names two parameter profiles, for example
+//! day.txt,night.txt, which are alternated on CONTEXTS contexts created on
+//! VAAL_BENCH_DEVICE, default cpu, with the optional VAAL_BENCH_MODEL loaded.
+//! Each switch is measured three ways: setting every value, `apply` which
+//! reads the current values back, and `apply_diff` against a snapshot kept
+//! per context.
+//!
+//! cargo bench --bench profile
+
+mod common;
+
+use common::percentile;
+use std::{env, time::Instant};
+use vaal::{Context, parameter::ParameterProfile};
+
+const CONTEXTS: usize = 32;
+const SWITCHES: usize = 200;
+
+/// Times SWITCHES alternating switches over every context, reconfigure is
+/// given the context index and the profile to switch to and returns the
+/// number of values written.
+fn measure(
+    name: &str,
+    contexts: &[Context],
+    profiles: &[ParameterProfile; 2],
+    mut reconfigure: impl FnMut(usize, &ParameterProfile) -> usize,
+) {
+    let mut times = Vec::with_capacity(SWITCHES);
+    let mut written = 0;
+    for switch in 0..SWITCHES {
+        let profile = &profiles[switch % 2];
+        let start = Instant::now();
+        for index in 0..contexts.len() {
+            written += reconfigure(index, profile);
+        }
+        times.push(start.elapsed().as_secs_f64() * 1e6);
+    }
+    times.sort_unstable_by(f64::total_cmp);
+    println!(
+        "{:<10} switch p50 {:9.1} us, p99 {:9.1} us, {:5.1} writes per context",
+        name,
+        percentile(&times, 0.50),
+        percentile(&times, 0.99),
+        written as f64 / (SWITCHES * contexts.len()) as f64
+    );
+}
+
+fn main() {
+    let profiles = match env::var("VAAL_BENCH_PROFILES") {
+        Ok(profiles) => profiles,
+        Err(_) => {
+            println!("skipped: set VAAL_BENCH_PROFILES to two comma separated profiles");
+            return;
+        }
+    };
+    let profiles: Vec<_> = profiles
+        .split(',')
+        .map(|path| ParameterProfile::load(path).unwrap())
+        .collect();
+    let profiles: [ParameterProfile; 2] = match profiles.try_into() {
+        Ok(profiles) => profiles,
+        Err(_) => panic!("VAAL_BENCH_PROFILES needs exactly two profiles"),
+    };
+    let device = env::var("VAAL_BENCH_DEVICE").unwrap_or_else(|_| "cpu".to_owned());
+    let model = env::var("VAAL_BENCH_MODEL")
+        .ok()
+        .map(|path| std::fs::read(path).unwrap());
+
+    let contexts: Vec<Context> = (0..CONTEXTS)
+        .map(|_| {
+            let mut context = Context::new(&device).unwrap();
+            if let Some(model) = &model {
+                context.load_model(model.clone()).unwrap();
+            }
+            for profile in &profiles {
+                profile.validate(&context).unwrap();
+            }
+            context
+        })
+        .collect();
+
+    println!(
+        "{} contexts, {} and {} values, {} differ",
+        CONTEXTS,
+        profiles[0].len(),
+        profiles[1].len(),
+        profiles[1].diff(&profiles[0]).count()
+    );
+    measure("set all", &contexts, &profiles, |index, profile| {
+        for (name, value) in profile.iter() {
+            contexts[index].set_parameter(name, value).unwrap();
+        }
+        profile.len()
+    });
+    measure("apply", &contexts, &profiles, |index, profile| {
+        profile.apply(&contexts[index]).unwrap()
+    });
+    let mut snapshots: Vec<_> = contexts
+        .iter()
+        .map(|context| ParameterProfile::from_context(context).unwrap())
+        .collect();
+    measure("apply diff", &contexts, &profiles, |index, profile| {
+        profile
+            .apply_diff(&contexts[index], &mut snapshots[index])
+            .unwrap()
+    });
+}
@@ -0,0 +1,150 @@
+//! Throughput and latency of the shared-memory ring with one producer and
+//! several consumers.
+//!
+//! cargo bench --bench shm
+
+mod common;
+
+use common::percentile;
+use std::{
+    sync::{
+        Barrier,
+        atomic::{AtomicBool, Ordering},
+    },
+    thread,
+    time::{Duration, Instant},
+};
+use vaal::{
+    VAALBox,
+    shm::{ShmPublisher, ShmSubscriber},
+};
+
+const SLOTS: usize = 256;
+const MAX_BOXES: usize = 32;
+const THROUGHPUT_FRAMES: u64 = 2_000_000;
+const LATENCY_FRAMES: u64 = 100_000;
+/// Publish interval of the latency run, well below saturation.
+const LATENCY_INTERVAL: Duration = Duration::from_micros(10);
+
+struct Consumer {
+    read: u64,
+    lost: u64,
+    /// Publish to read latency in nanoseconds, latency run only.
+    latencies: Vec<u64>,
+}
+
+fn run(consumers: usize, frames: u64, interval: Option<Duration>) -> (f64, Vec<Consumer>) {
+    let mut publisher = ShmPublisher::create_memfd(SLOTS, MAX_BOXES).unwrap();
+    let boxes = vec![
+        VAALBox {
+            xmin: 0.1,
+            ymin: 0.2,
+            xmax: 0.3,
+            ymax: 0.4,
+            score: 0.9,
+            label: 1,
+        };
+        10
+    ];
+    let origin = Instant::now();
+    let done = AtomicBool::new(false);
+    let barrier = Barrier::new(consumers + 1);
+
+    thread::scope(|scope| {
+        let workers: Vec<_> = (0..consumers)
+            .map(|_| {
+                let fd = publisher.fd().try_clone_to_owned().unwrap();
+                let mut subscriber = ShmSubscriber::from_fd(fd).unwrap();
+                let (done, barrier) = (&done, &barrier);
+                scope.spawn(move || {
+                    let mut read = Vec::new();
+                    let mut latencies = Vec::new();
+                    let mut count = 0;
+                    barrier.wait();
+                    loop {
+                        let finished = done.load(Ordering::Acquire);
+                        while let Some(frame) = subscriber.next(&mut read) {
+                            if interval.is_some() {
+                                let now = origin.elapsed().as_nanos() as i64;
+                                latencies.push((now - frame.timestamp) as u64);
+                            }
+                            count += 1;
+                        }
+                        if finished {
+                            break;
+                        }
+                        std::hint::spin_loop();
+                    }
+                    Consumer {
+                        read: count,
+                        lost: subscriber.lost(),
+                        latencies,
+                    }
+                })
+            })
+            .collect();
+
+        barrier.wait();
+        let start = Instant::now();
+        let mut deadline = start;
+        for frame in 0..frames {
+            if let Some(interval) = interval {
+                deadline += interval;
+                while Instant::now() < deadline {
+                    std::hint::spin_loop();
+                }
+            }
+            publisher.publish(frame, origin.elapsed().as_nanos() as i64, &boxes);
+        }
+        let elapsed = start.elapsed().as_secs_f64();
+        done.store(true, Ordering::Release);
+        let results = workers
+            .into_iter()
+            .map(|worker| worker.join().unwrap())
+            .collect();
+        (elapsed, results)
+    })
+}
+
+fn main() {
+    // Producer and consumers spin, sharing cores would measure the scheduler.
+    let cores = thread::available_parallelism().map_or(1, |n| n.get());
+    let counts: Vec<usize> = [1, 2, 4]
+        .into_iter()
+        .filter(|consumers| *consumers < cores)
+        .collect();
+    if counts.is_empty() {
+        println!("skipped: needs at least 2 cores, found {}", cores);
+        return;
+    }
+    println!("{} slots, 10 boxes per frame", SLOTS);
+    for consumers in counts.iter().copied() {
+        let (elapsed, results) = run(consumers, THROUGHPUT_FRAMES, None);
+        let read: u64 = results.iter().map(|c| c.read).sum();
+        let lost: u64 = results.iter().map(|c| c.lost).sum();
+        println!(
+            "throughput, {} consumers: publish {:.2} M frames/s, read {:.2} M frames/s per consumer, {:.2}% lost",
+            consumers,
+            THROUGHPUT_FRAMES as f64 / elapsed / 1e6,
+            read as f64 / consumers as f64 / elapsed / 1e6,
+            lost as f64 * 100.0 / (read + lost) as f64
+        );
+    }
+    for consumers in counts.iter().copied() {
+        let (_, results) = run(consumers, LATENCY_FRAMES, Some(LATENCY_INTERVAL));
+        let mut latencies: Vec<f64> = results
+            .iter()
+            .flat_map(|c| c.latencies.iter().map(|ns| *ns as f64 / 1e3))
+            .collect();
+        latencies.sort_unstable_by(f64::total_cmp);
+        let lost: u64 = results.iter().map(|c| c.lost).sum();
+        println!(
+            "latency, {} consumers: p50 {:.2} us, p99 {:.2} us, max {:.2} us, {} lost",
+            consumers,
+            percentile(&latencies, 0.50),
+            percentile(&latencies, 0.99),
+            percentile(&latencies, 1.0),
+            lost
+        );
+    }
+}
@@ -0,0 +1,76 @@
+//! Serial against parallel startup of a model manifest.
+//!
+//! Loads the manifest named by VAAL_BENCH_MANIFEST (see `loader`) with one
+//! loader thread and with one thread per core, VAAL_BENCH_STARTUP_RUNS times
+//! each, default 5, alternating so both see the same page cache state.  Drop
+//! the page cache before running for cold start numbers, later runs are warm.
+//!
+//! cargo bench --bench startup
+
+mod common;
+
+use common::percentile;
+use std::{env, time::Duration};
+use vaal::loader::{LoadTiming, Loader, load_manifest};
+
+fn ms(duration: Duration) -> f64 {
+    duration.as_secs_f64() * 1e3
+}
+
+fn report(name: &str, threads: usize, elapsed: &mut [f64], timings: &[LoadTiming]) {
+    elapsed.sort_unstable_by(f64::total_cmp);
+    let sum = |phase: fn(&LoadTiming) -> Duration| {
+        timings.iter().map(|t| ms(phase(t))).sum::<f64>() / elapsed.len() as f64
+    };
+    println!(
+        "{:<8} {:>2} threads: elapsed p50 {:8.1} ms, min {:8.1} ms, max {:8.1} ms",
+        name,
+        threads,
+        percentile(elapsed, 0.50),
+        percentile(elapsed, 0.0),
+        percentile(elapsed, 1.0)
+    );
+    println!(
+        "{:<8} per run sums: read {:.1} ms, create {:.1} ms, load {:.1} ms, parameters {:.1} ms",
+        "",
+        sum(|t| t.read),
+        sum(|t| t.create),
+        sum(|t| t.load),
+        sum(|t| t.parameters)
+    );
+}
+
+fn main() {
+    let manifest = match env::var("VAAL_BENCH_MANIFEST") {
+        Ok(manifest) => manifest,
+        Err(_) => {
+            println!("skipped: set VAAL_BENCH_MANIFEST to a startup manifest");
+            return;
+        }
+    };
+    let runs = env::var("VAAL_BENCH_STARTUP_RUNS")
+        .ok()
+        .and_then(|runs| runs.parse().ok())
+        .unwrap_or(5usize)
+        .max(1);
+    let specs = load_manifest(&manifest).unwrap();
+
+    let serial = Loader::new(1);
+    let parallel = Loader::default();
+    let mut results = [
+        ("serial", &serial, Vec::new(), Vec::new()),
+        ("parallel", &parallel, Vec::new(), Vec::new()),
+    ];
+    for _ in 0..runs {
+        for (_, loader, elapsed, timings) in results.iter_mut() {
+            let loaded = loader.load(&specs).unwrap();
+            elapsed.push(ms(loaded.elapsed));
+            timings.extend(loaded.timings);
+        }
+    }
+
+    println!("{} models, {} runs", specs.len(), runs);
+    for (name, loader, elapsed, timings) in results.iter_mut() {
+        report(name, loader.threads, elapsed, timings);
+    }
+}
@@ -0,0 +1,81 @@
+//! Append and scan throughput of the columnar detection store.
+//!
+//! cargo bench --bench store
+
+use std::time::Instant;
+use vaal::{
+    VAALBox,
+    store::{DetectionStore, DetectionWriter},
+};
+
+const FRAMES: u64 = 200_000;
+const BOXES: usize = 10;
+const CHUNK: usize = 256;
+
+fn main() {
+    let path = std::env::temp_dir().join(format!("vaal-bench-store-{}", std::process::id()));
+    let _ = std::fs::remove_file(&path);
+    let boxes: Vec<VAALBox> = (0..BOXES)
+        .map(|i| VAALBox {
+            xmin: 0.1,
+            ymin: 0.2,
+            xmax: 0.3 + i as f32 * 0.01,
+            ymax: 0.4,
+            score: 0.5,
+            label: i as i32,
+        })
+        .collect();
+
+    let start = Instant::now();
+    let mut writer = DetectionWriter::open(&path, CHUNK).unwrap();
+    for frame in 0..FRAMES {
+        writer.append(frame, frame as i64 * 33, &boxes).unwrap();
+    }
+    writer.flush().unwrap();
+    drop(writer);
+    let append = start.elapsed().as_secs_f64();
+    let bytes = std::fs::metadata(&path).unwrap().len() as f64;
+    println!(
+        "append: {} frames of {} boxes in {:.3} s, {:.0} frames/s, {:.1} MB/s",
+        FRAMES,
+        BOXES,
+        append,
+        FRAMES as f64 / append,
+        bytes / append / 1e6
+    );
+
+    let start = Instant::now();
+    let store = DetectionStore::open(&path).unwrap();
+    let open = start.elapsed().as_secs_f64();
+    let start = Instant::now();
+    let mut sum = 0.0f64;
+    for chunk in store.chunks() {
+        sum += chunk.score().iter().map(|v| *v as f64).sum::<f64>();
+    }
+    let scan = start.elapsed().as_secs_f64();
+    println!(
+        "scan: open {:.3} ms, {} boxes in {:.3} s, {:.0} boxes/s (checksum {:.0})",
+        open * 1e3,
+        store.boxes(),
+        scan,
+        store.boxes() as f64 / scan,
+        sum
+    );
+
+    let start = Instant::now();
+    let queries = 10_000;
+    let mut hits = 0;
+    for i in 0..queries {
+        let at = (i * 7919 % FRAMES) as i64 * 33;
+        hits += store.range(at, at + 1000).count();
+    }
+    let range = start.elapsed().as_secs_f64();
+    println!(
+        "range: {} queries in {:.3} s, {:.2} us per query ({} chunks)",
+        queries,
+        range,
+        range * 1e6 / queries as f64,
+        hits
+    );
+    std::fs::remove_file(&path).unwrap();
+}
@@ -0,0 +1,109 @@
+//! Zone engine update time from 10 to 10,000 zones.
+//!
+//! Square zones sized so together they cover about a quarter of the frame
+//! are scattered over the unit square with one counting line per ten zones.
+//! TRACKS tracks walk across the frame and every update is timed, with the
+//! default grid and with a single cell to show what the grid saves.
+//!
+//! cargo bench --bench zones
+
+mod common;
+
+use common::{percentile, random};
+use std::time::Instant;
+use vaal::{VAALBox, tracker::TrackedBox, zones::ZoneEngine};
+
+const TRACKS: usize = 100;
+const FRAMES: usize = 500;
+
+fn engine(zones: usize, grid: usize) -> ZoneEngine {
+    let mut state = 0x9e37_79b9_7f4a_7c15;
+    let mut engine = ZoneEngine::new(grid);
+    let size = (0.25 / zones as f32).sqrt();
+    for _ in 0..zones {
+        let (x, y) = (random(&mut state) as f32, random(&mut state) as f32);
+        engine.add_zone(&[[x, y], [x + size, y], [x + size, y + size], [x, y + size]]);
+    }
+    for _ in 0..zones / 10 {
+        let (x, y) = (random(&mut state) as f32, random(&mut state) as f32);
+        let (dx, dy) = (
+            random(&mut state) as f32 * 0.2 - 0.1,
+            random(&mut state) as f32 * 0.2 - 0.1,
+        );
+        engine.add_line([x, y], [x + dx, y + dy]);
+    }
+    engine
+}
+
+/// Tracks start at random points and move with a constant velocity,
+/// wrapping around the frame.
+fn frames() -> Vec<Vec<TrackedBox>> {
+    let mut state = 0x2545_f491_4f6c_dd1d;
+    let tracks: Vec<_> = (0..TRACKS)
+        .map(|_| {
+            let start = [random(&mut state) as f32, random(&mut state) as f32];
+            let velocity = [
+                random(&mut state) as f32 * 0.02 - 0.01,
+                random(&mut state) as f32 * 0.02 - 0.01,
+            ];
+            (start, velocity)
+        })
+        .collect();
+    (0..FRAMES)
+        .map(|frame| {
+            tracks
+                .iter()
+                .enumerate()
+                .map(|(id, (start, velocity))| {
+                    let x = (start[0] + velocity[0] * frame as f32).rem_euclid(1.0);
+                    let y = (start[1] + velocity[1] * frame as f32).rem_euclid(1.0);
+                    TrackedBox {
+                        id: id as u64,
+                        hits: 1,
+                        bbox: VAALBox {
+                            xmin: x - 0.02,
+                            ymin: y - 0.05,
+                            xmax: x + 0.02,
+                            ymax: y,
+                            score: 1.0,
+                            label: 0,
+                        },
+                    }
+                })
+                .collect()
+        })
+        .collect()
+}
+
+fn main() {
+    let frames = frames();
+    println!("{} tracks, {} frames", TRACKS, FRAMES);
+    for zones in [10, 100, 1000, 10_000] {
+        for grid in [32, 1] {
+            let mut engine = engine(zones, grid);
+            let mut times = Vec::with_capacity(FRAMES);
+            for boxes in &frames {
+                let start = Instant::now();
+                engine.update(boxes);
+                times.push(start.elapsed().as_secs_f64() * 1e6);
+            }
+            times.sort_unstable_by(f64::total_cmp);
+            let entries: u64 = engine.zone_stats().iter().map(|s| s.entries).sum();
+            let crossings: u64 = engine
+                .line_stats()
+                .iter()
+                .map(|s| s.forward + s.backward)
+                .sum();
+            println!(
+                "{:>6} zones {:>5} lines grid {:>2}: p50 {:8.1} us, p99 {:8.1} us, {} entries, {} crossings",
+                zones,
+                engine.line_count(),
+                grid,
+                percentile(&times, 0.50),
+                percentile(&times, 0.99),
+                entries,
+                crossings
+            );
+        }
+    }
+}
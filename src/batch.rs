@@ -0,0 +1,235 @@
+use crate::{
+    Context, Error, VAALBox,
+    frame::Frame,
+    postprocess::Decoder,
+    preproc::{Preprocessor, batch_input_size},
+    tensor::{dequantize_into, with_bytes},
+};
+use std::{
+    collections::VecDeque,
+    sync::{Condvar, Mutex},
+    time::{Duration, Instant},
+};
+
+/// Runs models whose input has a batch dimension greater than 1 on several
+/// frames at once.  Frames are pre-processed into consecutive images of the
+/// input tensor, the model runs once and the batched box and score outputs are
+/// decoded per image with the Rust decoder.
+pub struct BatchRunner {
+    pub decoder: Decoder,
+    pub boxes_output: i32,
+    pub scores_output: i32,
+    preproc: Preprocessor,
+    boxes_scratch: Vec<f32>,
+    scores_scratch: Vec<f32>,
+}
+
+impl BatchRunner {
+    pub fn new(decoder: Decoder, boxes_output: i32, scores_output: i32) -> Self {
+        Self::with_preprocessor(Preprocessor::new(), decoder, boxes_output, scores_output)
+    }
+
+    pub fn with_preprocessor(
+        preproc: Preprocessor,
+        decoder: Decoder,
+        boxes_output: i32,
+        scores_output: i32,
+    ) -> Self {
+        BatchRunner {
+            decoder,
+            boxes_output,
+            scores_output,
+            preproc,
+            boxes_scratch: Vec::new(),
+            scores_scratch: Vec::new(),
+        }
+    }
+
+    /// Number of images the model of the context takes per run.
+    pub fn batch_size(context: &Context) -> Result<usize, Error> {
+        let (batch, _, _) = batch_input_size(context.input_tensor(0)?.shape())?;
+        Ok(batch)
+    }
+
+    /// Dequantizes the output into scratch, returning its innermost dimension.
+    fn output(&mut self, context: &Context, index: i32, scores: bool) -> Result<i32, Error> {
+        let tensor = match context.output_tensor(index) {
+            Some(tensor) => tensor,
+            None => return Err(Error::WrapperError(format!("missing output {}", index))),
+        };
+        let scratch = if scores {
+            &mut self.scores_scratch
+        } else {
+            &mut self.boxes_scratch
+        };
+        with_bytes(&tensor, |vaal_type, bytes| {
+            dequantize_into(vaal_type, bytes, tensor.scales(), tensor.zeros(), scratch)
+        })??;
+        Ok(tensor.shape().last().copied().unwrap_or(0))
+    }
+
+    /// Loads up to batch size frames, runs the model once and decodes the
+    /// boxes of frame i into results[i].  Result buffers are reused so a
+    /// steady stream of batches does not allocate.
+    pub fn run(
+        &mut self,
+        context: &Context,
+        frames: &[Frame],
+        rois: Option<&[[i32; 4]]>,
+        proc: u32,
+        results: &mut Vec<Vec<VAALBox>>,
+    ) -> Result<usize, Error> {
+        let input = context.input_tensor(0)?;
+        let (batch, _, _) = batch_input_size(input.shape())?;
+        self.preproc.load_batch(&input, frames, rois, proc)?;
+        context.run_model()?;
+
+        self.output(context, self.boxes_output, false)?;
+        let num_classes = match self.output(context, self.scores_output, true)? {
+            classes if classes > 0 => classes as usize,
+            _ => return Err(Error::WrapperError("invalid score tensor shape".to_owned())),
+        };
+        if !self.boxes_scratch.len().is_multiple_of(batch)
+            || !self.scores_scratch.len().is_multiple_of(batch)
+        {
+            return Err(Error::WrapperError(format!(
+                "outputs are not batched by {}",
+                batch
+            )));
+        }
+        let boxes_len = self.boxes_scratch.len() / batch;
+        let scores_len = self.scores_scratch.len() / batch;
+
+        results.resize_with(frames.len(), Vec::new);
+        let mut total = 0;
+        for (i, output) in results.iter_mut().enumerate() {
+            total += self.decoder.decode(
+                &self.boxes_scratch[i * boxes_len..(i + 1) * boxes_len],
+                &self.scores_scratch[i * scores_len..(i + 1) * scores_len],
+                num_classes,
+                output,
+            )?;
+        }
+        Ok(total)
+    }
+}
+
+struct Queue<T> {
+    requests: VecDeque<(Instant, T)>,
+    closed: bool,
+}
+
+/// Gathers requests into batches, a batch is released once it is full or
+/// the oldest request has waited max_delay, bounding the latency batching
+/// adds when traffic is light.
+pub struct BatchScheduler<T> {
+    batch_size: usize,
+    max_delay: Duration,
+    queue: Mutex<Queue<T>>,
+    ready: Condvar,
+}
+
+impl<T> BatchScheduler<T> {
+    pub fn new(batch_size: usize, max_delay: Duration) -> Self {
+        BatchScheduler {
+            batch_size: batch_size.max(1),
+            max_delay,
+            queue: Mutex::new(Queue {
+                requests: VecDeque::new(),
+                closed: false,
+            }),
+            ready: Condvar::new(),
+        }
+    }
+
+    pub fn batch_size(&self) -> usize {
+        self.batch_size
+    }
+
+    pub fn max_delay(&self) -> Duration {
+        self.max_delay
+    }
+
+    /// Queues a request, handing it back if the scheduler was closed.
+    pub fn submit(&self, request: T) -> Result<(), T> {
+        let mut queue = self.queue.lock().unwrap();
+        if queue.closed {
+            return Err(request);
+        }
+        queue.requests.push_back((Instant::now(), request));
+        self.ready.notify_one();
+        Ok(())
+    }
+
+    /// Stops accepting requests, queued requests are still handed out.
+    pub fn close(&self) {
+        self.queue.lock().unwrap().closed = true;
+        self.ready.notify_all();
+    }
+
+    /// Blocks until a batch is due and moves it into batch, returning false
+    /// once the scheduler is closed and drained.
+    pub fn next_batch(&self, batch: &mut Vec<T>) -> bool {
+        batch.clear();
+        let mut queue = self.queue.lock().unwrap();
+        loop {
+            let oldest = match queue.requests.front() {
+                Some((arrival, _)) => *arrival,
+                None if queue.closed => return false,
+                None => {
+                    queue = self.ready.wait(queue).unwrap();
+                    continue;
+                }
+            };
+            let deadline = oldest + self.max_delay;
+            let now = Instant::now();
+            if queue.requests.len() >= self.batch_size || queue.closed || now >= deadline {
+                let count = queue.requests.len().min(self.batch_size);
+                batch.extend(queue.requests.drain(..count).map(|(_, request)| request));
+                return true;
+            }
+            queue = self.ready.wait_timeout(queue, deadline - now).unwrap().0;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn full_batch_released_at_once() {
+        let scheduler = BatchScheduler::new(3, Duration::from_secs(60));
+        for request in 0..7 {
+            scheduler.submit(request).unwrap();
+        }
+        let mut batch = Vec::new();
+        let start = Instant::now();
+        assert!(scheduler.next_batch(&mut batch));
+        assert_eq!(batch, [0, 1, 2]);
+        assert!(scheduler.next_batch(&mut batch));
+        assert_eq!(batch, [3, 4, 5]);
+        assert!(start.elapsed() < Duration::from_secs(1));
+
+        // Closing releases the partial batch, then reports the end.
+        scheduler.close();
+        assert_eq!(scheduler.submit(9), Err(9));
+        assert!(scheduler.next_batch(&mut batch));
+        assert_eq!(batch, [6]);
+        assert!(!scheduler.next_batch(&mut batch));
+        assert!(batch.is_empty());
+    }
+
+    #[test]
+    fn partial_batch_released_after_max_delay() {
+        let delay = Duration::from_millis(50);
+        let scheduler = BatchScheduler::new(4, delay);
+        let start = Instant::now();
+        scheduler.submit(1).unwrap();
+        scheduler.submit(2).unwrap();
+        let mut batch = Vec::new();
+        assert!(scheduler.next_batch(&mut batch));
+        assert!(start.elapsed() >= delay);
+        assert_eq!(batch, [1, 2]);
+    }
+}
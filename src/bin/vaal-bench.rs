@@ -0,0 +1,666 @@
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    fmt::Write as _,
+    fs,
+    path::PathBuf,
+    process::ExitCode,
+    sync::{
+        Arc, Barrier,
+        atomic::{AtomicU64, Ordering},
+    },
+    thread,
+    time::{Duration, Instant},
+};
+use vaal::{
+    Context, Error, ParameterProfile, VAALBox,
+    frame::{Frame, RGB3},
+    rawvideo::RawVideo,
+};
+
+const USAGE: &str = "\
+usage: vaal-bench --model MODEL [options]
+
+options:
+  -m, --model PATH       model to benchmark
+  -d, --device NAME      device to run on, auto picks the fastest (default cpu)
+      --images DIR       encoded images read from a directory
+      --video PATH       frames of a raw video file
+      --synthetic WxH    generated RGB frames (default 640x480)
+  -w, --warmup N         untimed iterations per context (default 10)
+  -n, --iterations N     timed iterations over all contexts (default 100)
+  -c, --contexts N       contexts to run (default 1)
+  -t, --threads N        threads driving the contexts (default contexts)
+      --max-boxes N      boxes decoded per frame (default 100)
+      --profile PATH     parameter profile applied to every context
+      --json             print the report as JSON
+  -h, --help             print this help";
+
+/// Counts heap allocations so the report can show allocations per frame.
+/// Only allocations made through the Rust allocator are seen, memory libvaal
+/// and DeepViewRT allocate with malloc is not counted.
+struct CountingAlloc;
+
+static ALLOCS: AtomicU64 = AtomicU64::new(0);
+static ALLOC_BYTES: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCS.fetch_add(1, Ordering::Relaxed);
+        ALLOC_BYTES.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        ALLOCS.fetch_add(1, Ordering::Relaxed);
+        ALLOC_BYTES.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        unsafe { System.alloc_zeroed(layout) }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCS.fetch_add(1, Ordering::Relaxed);
+        ALLOC_BYTES.fetch_add(new_size as u64, Ordering::Relaxed);
+        unsafe { System.realloc(ptr, layout, new_size) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAlloc = CountingAlloc;
+
+enum Input {
+    Images(PathBuf),
+    Video(PathBuf),
+    Synthetic(i32, i32),
+}
+
+struct Options {
+    model: PathBuf,
+    device: String,
+    input: Input,
+    warmup: u64,
+    iterations: u64,
+    contexts: usize,
+    threads: usize,
+    max_boxes: usize,
+    profile: Option<PathBuf>,
+    json: bool,
+}
+
+fn parse_size(value: &str) -> Option<(i32, i32)> {
+    let (width, height) = value.split_once(['x', 'X'])?;
+    match (width.parse(), height.parse()) {
+        (Ok(width), Ok(height)) if width > 0 && height > 0 => Some((width, height)),
+        _ => None,
+    }
+}
+
+fn parse_args(mut args: impl Iterator<Item = String>) -> Result<Option<Options>, String> {
+    let mut model = None;
+    let mut options = Options {
+        model: PathBuf::new(),
+        device: "cpu".to_owned(),
+        input: Input::Synthetic(640, 480),
+        warmup: 10,
+        iterations: 100,
+        contexts: 1,
+        threads: 0,
+        max_boxes: 100,
+        profile: None,
+        json: false,
+    };
+
+    while let Some(arg) = args.next() {
+        let (flag, inline) = match arg.split_once('=') {
+            Some((flag, value)) if flag.starts_with("--") => {
+                (flag.to_owned(), Some(value.to_owned()))
+            }
+            _ => (arg, None),
+        };
+        let mut value = || {
+            inline
+                .clone()
+                .or_else(|| args.next())
+                .ok_or_else(|| format!("{} requires a value", flag))
+        };
+        let number = |value: String| {
+            value
+                .parse::<u64>()
+                .map_err(|_| format!("invalid number {} for {}", value, flag))
+        };
+        match flag.as_str() {
+            "-h" | "--help" => return Ok(None),
+            "-m" | "--model" => model = Some(PathBuf::from(value()?)),
+            "-d" | "--device" => options.device = value()?,
+            "--images" => options.input = Input::Images(value()?.into()),
+            "--video" => options.input = Input::Video(value()?.into()),
+            "--synthetic" => {
+                let value = value()?;
+                let (width, height) =
+                    parse_size(&value).ok_or_else(|| format!("invalid size {}", value))?;
+                options.input = Input::Synthetic(width, height);
+            }
+            "-w" | "--warmup" => options.warmup = number(value()?)?,
+            "-n" | "--iterations" => options.iterations = number(value()?)?,
+            "-c" | "--contexts" => options.contexts = number(value()?)? as usize,
+            "-t" | "--threads" => options.threads = number(value()?)? as usize,
+            "--max-boxes" => options.max_boxes = number(value()?)? as usize,
+            "--profile" => options.profile = Some(value()?.into()),
+            "--json" => options.json = true,
+            _ => return Err(format!("unknown option {}", flag)),
+        }
+    }
+
+    options.model = model.ok_or("missing --model")?;
+    if options.contexts == 0 || options.iterations == 0 {
+        return Err("contexts and iterations must be at least 1".to_owned());
+    }
+    // Threads beyond the contexts would only wait on each other.
+    if options.threads == 0 || options.threads > options.contexts {
+        options.threads = options.contexts;
+    }
+    Ok(Some(options))
+}
+
+/// Frames cycled through by the benchmark, loaded up front so file IO is
+/// not part of the load stage.
+enum Source {
+    Images(Vec<Vec<u8>>),
+    Video(RawVideo),
+    Synthetic(Vec<u8>, i32, i32),
+}
+
+impl Source {
+    fn open(input: &Input) -> Result<Self, Error> {
+        match input {
+            Input::Images(dir) => {
+                let mut paths = fs::read_dir(dir)?
+                    .map(|entry| entry.map(|entry| entry.path()))
+                    .collect::<Result<Vec<_>, _>>()?;
+                paths.retain(|path| path.is_file());
+                paths.sort();
+                let images = paths.iter().map(fs::read).collect::<Result<Vec<_>, _>>()?;
+                if images.is_empty() {
+                    return Err(Error::WrapperError(format!(
+                        "no images in {}",
+                        dir.display()
+                    )));
+                }
+                Ok(Source::Images(images))
+            }
+            Input::Video(path) => {
+                let video = RawVideo::open(path)?;
+                if video.is_empty() {
+                    return Err(Error::WrapperError(format!(
+                        "no frames in {}",
+                        path.display()
+                    )));
+                }
+                Ok(Source::Video(video))
+            }
+            Input::Synthetic(width, height) => {
+                // A gradient rather than a flat frame so the decoder sees
+                // something resembling an image.
+                let (w, h) = (*width as usize, *height as usize);
+                let mut data = Vec::with_capacity(w * h * 3);
+                for y in 0..h {
+                    for x in 0..w {
+                        data.extend_from_slice(&[
+                            (x * 255 / w) as u8,
+                            (y * 255 / h) as u8,
+                            ((x + y) & 0xff) as u8,
+                        ]);
+                    }
+                }
+                Ok(Source::Synthetic(data, *width, *height))
+            }
+        }
+    }
+
+    fn len(&self) -> usize {
+        match self {
+            Source::Images(images) => images.len(),
+            Source::Video(video) => video.len(),
+            Source::Synthetic(..) => 1,
+        }
+    }
+
+    fn describe(&self) -> String {
+        match self {
+            Source::Images(images) => format!("{} images", images.len()),
+            Source::Video(video) => format!(
+                "raw video {}x{} {} frames",
+                video.width(),
+                video.height(),
+                video.len()
+            ),
+            Source::Synthetic(_, width, height) => format!("synthetic {}x{}", width, height),
+        }
+    }
+
+    fn load(&self, context: &mut Context, index: u64) -> Result<(), Error> {
+        let index = (index % self.len() as u64) as usize;
+        match self {
+            Source::Images(images) => context.load_image(None, &images[index], None, 0),
+            Source::Video(video) => {
+                context.load_frame_memory(None, &video.frame(index).unwrap(), None, 0)
+            }
+            Source::Synthetic(data, width, height) => {
+                context.load_frame_memory(None, &Frame::new(data, RGB3, *width, *height)?, None, 0)
+            }
+        }
+    }
+}
+
+const STAGES: [&str; 4] = ["load", "run", "decode", "total"];
+
+/// Nanoseconds spent in each stage of one frame, the last is their sum.
+type Sample = [u64; 4];
+
+fn step(
+    source: &Source,
+    context: &mut Context,
+    index: u64,
+    boxes: &mut Vec<VAALBox>,
+    max_boxes: usize,
+) -> Result<Sample, Error> {
+    let start = Instant::now();
+    source.load(context, index)?;
+    let loaded = Instant::now();
+    context.run_model()?;
+    let ran = Instant::now();
+    context.boxes(boxes, max_boxes)?;
+    let decoded = Instant::now();
+
+    let load = (loaded - start).as_nanos() as u64;
+    let run = (ran - loaded).as_nanos() as u64;
+    let decode = (decoded - ran).as_nanos() as u64;
+    Ok([load, run, decode, load + run + decode])
+}
+
+/// Runs the warmup on every context of a thread, waits for the other
+/// threads, then takes timed iterations from the shared counter until all
+/// are claimed.
+fn worker(
+    options: &Options,
+    source: &Source,
+    mut contexts: Vec<Context>,
+    barrier: &Barrier,
+    next: &AtomicU64,
+) -> Result<Vec<Sample>, Error> {
+    let mut boxes = Vec::with_capacity(options.max_boxes);
+    let mut samples = Vec::with_capacity(options.iterations as usize);
+    let warmup = (0..options.warmup).try_for_each(|index| {
+        for context in contexts.iter_mut() {
+            step(source, context, index, &mut boxes, options.max_boxes)?;
+        }
+        Ok::<_, Error>(())
+    });
+    // Reach the barrier even on failure so the other threads are released.
+    barrier.wait();
+    warmup?;
+
+    let mut turn = 0;
+    loop {
+        let index = next.fetch_add(1, Ordering::Relaxed);
+        if index >= options.iterations {
+            break;
+        }
+        let count = contexts.len();
+        let context = &mut contexts[turn % count];
+        turn += 1;
+        samples.push(step(source, context, index, &mut boxes, options.max_boxes)?);
+    }
+    Ok(samples)
+}
+
+struct Latency {
+    mean: u64,
+    p50: u64,
+    p90: u64,
+    p99: u64,
+    max: u64,
+}
+
+/// Nearest rank percentiles of sorted values.
+fn latency(sorted: &[u64]) -> Latency {
+    let rank =
+        |p: f64| sorted[((p * sorted.len() as f64).ceil() as usize).clamp(1, sorted.len()) - 1];
+    Latency {
+        mean: sorted.iter().sum::<u64>() / sorted.len() as u64,
+        p50: rank(0.50),
+        p90: rank(0.90),
+        p99: rank(0.99),
+        max: sorted[sorted.len() - 1],
+    }
+}
+
+fn page_size() -> u64 {
+    let size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) };
+    if size > 0 { size as u64 } else { 4096 }
+}
+
+/// Resident set size in bytes from /proc/self/statm.
+fn rss() -> Option<u64> {
+    let statm = fs::read_to_string("/proc/self/statm").ok()?;
+    let pages: u64 = statm.split_whitespace().nth(1)?.parse().ok()?;
+    Some(pages * page_size())
+}
+
+/// Peak resident set size in bytes from /proc/self/status.
+fn peak_rss() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+    let kb: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kb * 1024)
+}
+
+struct Report {
+    source: String,
+    frames: u64,
+    elapsed: Duration,
+    stages: Vec<Latency>,
+    rss: Option<u64>,
+    peak_rss: Option<u64>,
+    rust_allocs: u64,
+    rust_alloc_bytes: u64,
+}
+
+fn ms(nanos: u64) -> f64 {
+    nanos as f64 / 1e6
+}
+
+fn json_string(value: &str) -> String {
+    let mut out = String::with_capacity(value.len() + 2);
+    out.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if (c as u32) < 0x20 => {
+                let _ = write!(out, "\\u{:04x}", c as u32);
+            }
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
+
+fn json_option(value: Option<u64>) -> String {
+    value.map_or_else(|| "null".to_owned(), |value| value.to_string())
+}
+
+impl Report {
+    fn fps(&self) -> f64 {
+        self.frames as f64 / self.elapsed.as_secs_f64().max(f64::EPSILON)
+    }
+
+    fn text(&self, options: &Options) -> String {
+        let mib = |bytes: Option<u64>| {
+            bytes.map_or_else(
+                || "n/a".to_owned(),
+                |bytes| format!("{:.1} MiB", bytes as f64 / 1048576.0),
+            )
+        };
+        let mut out = String::new();
+        let _ = writeln!(out, "model:       {}", options.model.display());
+        let _ = writeln!(out, "device:      {}", options.device);
+        let _ = writeln!(out, "input:       {}", self.source);
+        let _ = writeln!(
+            out,
+            "contexts:    {} on {} threads",
+            options.contexts, options.threads
+        );
+        let _ = writeln!(
+            out,
+            "frames:      {} in {:.3} s, {:.2} fps",
+            self.frames,
+            self.elapsed.as_secs_f64(),
+            self.fps()
+        );
+        let _ = writeln!(
+            out,
+            "memory:      rss {}, peak {}",
+            mib(self.rss),
+            mib(self.peak_rss)
+        );
+        let _ = writeln!(
+            out,
+            "rust allocs: {:.1} per frame, {:.0} bytes per frame",
+            self.rust_allocs as f64 / self.frames as f64,
+            self.rust_alloc_bytes as f64 / self.frames as f64
+        );
+        let _ = writeln!(
+            out,
+            "\n{:<8}{:>10}{:>10}{:>10}{:>10}{:>10}",
+            "stage", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms"
+        );
+        for (name, stage) in STAGES.iter().zip(&self.stages) {
+            let _ = writeln!(
+                out,
+                "{:<8}{:>10.3}{:>10.3}{:>10.3}{:>10.3}{:>10.3}",
+                name,
+                ms(stage.mean),
+                ms(stage.p50),
+                ms(stage.p90),
+                ms(stage.p99),
+                ms(stage.max)
+            );
+        }
+        out
+    }
+
+    fn json(&self, options: &Options) -> String {
+        let mut out = String::from("{");
+        let _ = write!(
+            out,
+            "\"model\":{},\"device\":{},\"input\":{},\"contexts\":{},\"threads\":{},\"warmup\":{},",
+            json_string(&options.model.to_string_lossy()),
+            json_string(&options.device),
+            json_string(&self.source),
+            options.contexts,
+            options.threads,
+            options.warmup
+        );
+        let _ = write!(
+            out,
+            "\"frames\":{},\"elapsed_s\":{:.6},\"fps\":{:.3},\"stages\":{{",
+            self.frames,
+            self.elapsed.as_secs_f64(),
+            self.fps()
+        );
+        for (i, (name, stage)) in STAGES.iter().zip(&self.stages).enumerate() {
+            let _ = write!(
+                out,
+                "{}\"{}\":{{\"mean_ms\":{:.4},\"p50_ms\":{:.4},\"p90_ms\":{:.4},\"p99_ms\":{:.4},\"max_ms\":{:.4}}}",
+                if i > 0 { "," } else { "" },
+                name,
+                ms(stage.mean),
+                ms(stage.p50),
+                ms(stage.p90),
+                ms(stage.p99),
+                ms(stage.max)
+            );
+        }
+        let _ = write!(
+            out,
+            "}},\"rss_bytes\":{},\"peak_rss_bytes\":{},\"rust_allocs_per_frame\":{:.3},\"rust_alloc_bytes_per_frame\":{:.1}}}",
+            json_option(self.rss),
+            json_option(self.peak_rss),
+            self.rust_allocs as f64 / self.frames as f64,
+            self.rust_alloc_bytes as f64 / self.frames as f64
+        );
+        out
+    }
+}
+
+fn bench(options: &Options) -> Result<Report, Error> {
+    let model = Arc::new(fs::read(&options.model)?);
+    let profile = match &options.profile {
+        Some(path) => Some(ParameterProfile::load(path)?),
+        None => None,
+    };
+    let source = Source::open(&options.input)?;
+
+    let mut groups: Vec<Vec<Context>> = (0..options.threads).map(|_| Vec::new()).collect();
+    for index in 0..options.contexts {
+        let mut context = Context::new(&options.device)?;
+        context.load_model_shared(model.clone())?;
+        if let Some(profile) = &profile {
+            profile.apply(&context)?;
+        }
+        groups[index % options.threads].push(context);
+    }
+
+    let barrier = Barrier::new(options.threads + 1);
+    let next = AtomicU64::new(0);
+    let (results, elapsed, allocs, alloc_bytes) = thread::scope(|scope| {
+        let workers: Vec<_> = groups
+            .into_iter()
+            .map(|contexts| {
+                let (source, barrier, next) = (&source, &barrier, &next);
+                scope.spawn(move || worker(options, source, contexts, barrier, next))
+            })
+            .collect();
+        barrier.wait();
+        let allocs = ALLOCS.load(Ordering::Relaxed);
+        let alloc_bytes = ALLOC_BYTES.load(Ordering::Relaxed);
+        let start = Instant::now();
+        let results: Vec<_> = workers
+            .into_iter()
+            .map(|worker| worker.join().unwrap())
+            .collect();
+        let elapsed = start.elapsed();
+        (
+            results,
+            elapsed,
+            ALLOCS.load(Ordering::Relaxed) - allocs,
+            ALLOC_BYTES.load(Ordering::Relaxed) - alloc_bytes,
+        )
+    });
+
+    let mut columns: Vec<Vec<u64>> =
+        vec![Vec::with_capacity(options.iterations as usize); STAGES.len()];
+    for samples in results {
+        for sample in samples? {
+            for (column, nanos) in columns.iter_mut().zip(sample) {
+                column.push(nanos);
+            }
+        }
+    }
+    let frames = columns[0].len() as u64;
+    let stages = columns
+        .iter_mut()
+        .map(|column| {
+            column.sort_unstable();
+            latency(column)
+        })
+        .collect();
+    Ok(Report {
+        source: source.describe(),
+        frames,
+        elapsed,
+        stages,
+        rss: rss(),
+        peak_rss: peak_rss(),
+        rust_allocs: allocs,
+        rust_alloc_bytes: alloc_bytes,
+    })
+}
+
+fn main() -> ExitCode {
+    let options = match parse_args(std::env::args().skip(1)) {
+        Ok(Some(options)) => options,
+        Ok(None) => {
+            println!("{}", USAGE);
+            return ExitCode::SUCCESS;
+        }
+        Err(e) => {
+            eprintln!("vaal-bench: {}\n\n{}", e, USAGE);
+            return ExitCode::from(2);
+        }
+    };
+    match bench(&options) {
+        Ok(report) if options.json => println!("{}", report.json(&options)),
+        Ok(report) => print!("{}", report.text(&options)),
+        Err(e) => {
+            eprintln!("vaal-bench: {}", e);
+            return ExitCode::FAILURE;
+        }
+    }
+    ExitCode::SUCCESS
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn parse(args: &[&str]) -> Result<Option<Options>, String> {
+        parse_args(args.iter().map(|arg| arg.to_string()))
+    }
+
+    #[test]
+    fn sizes() {
+        assert_eq!(parse_size("640x480"), Some((640, 480)));
+        assert_eq!(parse_size("32X16"), Some((32, 16)));
+        for invalid in ["640", "0x480", "640x-1", "x480", "axb", "640x480x3"] {
+            assert_eq!(parse_size(invalid), None, "{}", invalid);
+        }
+    }
+
+    #[test]
+    fn arguments() {
+        let options = parse(&["-m", "a.rtm"]).unwrap().unwrap();
+        assert_eq!(options.model, PathBuf::from("a.rtm"));
+        assert_eq!((options.contexts, options.threads), (1, 1));
+        assert!(matches!(options.input, Input::Synthetic(640, 480)));
+
+        let options = parse(&[
+            "--model=a.rtm",
+            "--device",
+            "npu",
+            "--synthetic=32x16",
+            "-c",
+            "4",
+            "--threads=9",
+            "--json",
+        ])
+        .unwrap()
+        .unwrap();
+        assert_eq!(options.device, "npu");
+        assert!(matches!(options.input, Input::Synthetic(32, 16)));
+        // Threads are capped at the contexts they drive.
+        assert_eq!((options.contexts, options.threads), (4, 4));
+        assert!(options.json);
+
+        assert!(parse(&["-h", "--bogus"]).unwrap().is_none());
+        for invalid in [
+            &["--device", "cpu"][..],
+            &["-m", "a.rtm", "--bogus"],
+            &["-m", "a.rtm", "-n"],
+            &["-m", "a.rtm", "-n", "ten"],
+            &["-m", "a.rtm", "-c", "0"],
+            &["-m", "a.rtm", "--synthetic", "0x0"],
+        ] {
+            assert!(parse(invalid).is_err(), "{:?}", invalid);
+        }
+    }
+
+    #[test]
+    fn nearest_rank_percentiles() {
+        let sorted: Vec<u64> = (1..=100).collect();
+        let stats = latency(&sorted);
+        assert_eq!(
+            (stats.mean, stats.p50, stats.p90, stats.p99, stats.max),
+            (50, 50, 90, 99, 100)
+        );
+        let single = latency(&[7]);
+        assert_eq!(
+            (single.mean, single.p50, single.p99, single.max),
+            (7, 7, 7, 7)
+        );
+    }
+}
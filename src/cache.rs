@@ -0,0 +1,479 @@
+use crate::{Context, Error, ParameterProfile, VAALBox, mmap::Mmap, model_hash};
+use std::{
+    collections::HashMap,
+    fs::{File, OpenOptions},
+    io::{Read, Write},
+    os::fd::AsRawFd,
+    path::Path,
+    time::{Duration, Instant},
+};
+use xxhash_rust::xxh3::{Xxh3, xxh3_128};
+
+const MAGIC: &[u8; 8] = b"VCACHE01";
+/// Key (16), box count (4), padding (4).
+const RECORD_HEADER: usize = 24;
+const BOX_SIZE: usize = 24;
+
+/// Identifies what a context computes: the model, the device, its
+/// parameters and the box filter.  Computing it hashes the whole model so
+/// callers keep it and only recompute after changing the context.
+pub fn context_fingerprint(context: &Context) -> Result<u64, Error> {
+    let mut hasher = Xxh3::new();
+    hasher.update(&model_hash(context.model().unwrap_or(&[])).to_le_bytes());
+    hasher.update(context.device().as_bytes());
+    hasher.update(
+        ParameterProfile::from_context(context)?
+            .to_string()
+            .as_bytes(),
+    );
+    let filter = context.class_filter();
+    for class in filter.classes().into_iter().flatten() {
+        hasher.update(&class.to_le_bytes());
+    }
+    hasher.update(&[u8::MAX]);
+    for class in 0..filter.threshold_count() {
+        if let Some(threshold) = filter.threshold(class) {
+            hasher.update(&class.to_le_bytes());
+            hasher.update(&threshold.to_le_bytes());
+        }
+    }
+    hasher.update(&[context.nms() as u8]);
+    hasher.update(&context.nms_iou.to_le_bytes());
+    Ok(hasher.digest())
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct CacheStats {
+    pub lookups: u64,
+    /// Hits served from memory.
+    pub hits: u64,
+    /// Hits served from the spill file.
+    pub spill_hits: u64,
+    pub bytes_hashed: u64,
+    pub hash_time: Duration,
+}
+
+impl CacheStats {
+    pub fn misses(&self) -> u64 {
+        self.lookups - self.hits - self.spill_hits
+    }
+
+    pub fn hit_rate(&self) -> f64 {
+        if self.lookups == 0 {
+            return 0.0;
+        }
+        (self.hits + self.spill_hits) as f64 / self.lookups as f64
+    }
+
+    /// Bytes of encoded images hashed per second.
+    pub fn hash_throughput(&self) -> f64 {
+        self.bytes_hashed as f64 / self.hash_time.as_secs_f64().max(f64::EPSILON)
+    }
+}
+
+const NONE: usize = usize::MAX;
+
+struct Entry {
+    key: u128,
+    boxes: Vec<VAALBox>,
+    prev: usize,
+    next: usize,
+}
+
+/// Append-only file of results read through a memory map.  Every record is
+/// the key, the box count and the boxes as little endian xmin, ymin, xmax,
+/// ymax, score and label.
+struct Spill {
+    file: File,
+    map: Mmap,
+    len: usize,
+    index: HashMap<u128, (usize, usize)>,
+}
+
+fn read_u32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+fn read_f32(buf: &[u8], offset: usize) -> f32 {
+    f32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+impl Spill {
+    fn open(path: &Path) -> Result<Self, Error> {
+        let mut file = OpenOptions::new()
+            .read(true)
+            .append(true)
+            .create(true)
+            .open(path)?;
+        let mut len = file.metadata()?.len() as usize;
+        if len == 0 {
+            file.write_all(MAGIC)?;
+            len = MAGIC.len();
+        } else {
+            let mut magic = [0u8; 8];
+            file.read_exact(&mut magic)?;
+            if &magic != MAGIC {
+                return Err(Error::WrapperError("not an inference cache".to_owned()));
+            }
+        }
+
+        let map = Mmap::map(file.as_raw_fd(), len, false)?;
+        let buf = map.as_slice();
+        let mut index = HashMap::new();
+        let mut offset = MAGIC.len();
+        while offset + RECORD_HEADER <= len {
+            let key = u128::from_le_bytes(buf[offset..offset + 16].try_into().unwrap());
+            let count = read_u32(buf, offset + 16) as usize;
+            let end = offset + RECORD_HEADER + count * BOX_SIZE;
+            if end > len {
+                break;
+            }
+            index.insert(key, (offset + RECORD_HEADER, count));
+            offset = end;
+        }
+        // Drop a record cut short by a crash so appends stay aligned.
+        if offset != len {
+            file.set_len(offset as u64)?;
+            len = offset;
+        }
+        Ok(Spill {
+            file,
+            map,
+            len,
+            index,
+        })
+    }
+
+    fn get(&mut self, key: u128, output: &mut Vec<VAALBox>) -> Result<bool, Error> {
+        let (offset, count) = match self.index.get(&key) {
+            Some(entry) => *entry,
+            None => return Ok(false),
+        };
+        if self.map.as_slice().len() < self.len {
+            self.map = Mmap::map(self.file.as_raw_fd(), self.len, false)?;
+        }
+        let buf = self.map.as_slice();
+        output.clear();
+        output.extend((0..count).map(|i| {
+            let at = offset + i * BOX_SIZE;
+            VAALBox {
+                xmin: read_f32(buf, at),
+                ymin: read_f32(buf, at + 4),
+                xmax: read_f32(buf, at + 8),
+                ymax: read_f32(buf, at + 12),
+                score: read_f32(buf, at + 16),
+                label: read_u32(buf, at + 20) as i32,
+            }
+        }));
+        Ok(true)
+    }
+
+    fn put(&mut self, key: u128, boxes: &[VAALBox]) -> Result<(), Error> {
+        if self.index.contains_key(&key) {
+            return Ok(());
+        }
+        let mut record = Vec::with_capacity(RECORD_HEADER + boxes.len() * BOX_SIZE);
+        record.extend_from_slice(&key.to_le_bytes());
+        record.extend_from_slice(&(boxes.len() as u32).to_le_bytes());
+        record.extend_from_slice(&[0; 4]);
+        for b in boxes {
+            for v in [b.xmin, b.ymin, b.xmax, b.ymax, b.score] {
+                record.extend_from_slice(&v.to_le_bytes());
+            }
+            record.extend_from_slice(&b.label.to_le_bytes());
+        }
+        self.file.write_all(&record)?;
+        self.index
+            .insert(key, (self.len + RECORD_HEADER, boxes.len()));
+        self.len += record.len();
+        Ok(())
+    }
+}
+
+/// Detection results keyed by the content of the encoded image, so
+/// duplicate inputs skip decoding and inference.  The key is an xxh3 hash of
+/// the image combined with the context fingerprint, roi, pre-processing and
+/// box limit.  The most recent results are kept in memory up to capacity
+/// entries with least recently used eviction.  With a spill file every
+/// result is also appended to disk, which survives restarts and serves
+/// entries evicted from memory.
+pub struct InferenceCache {
+    capacity: usize,
+    map: HashMap<u128, usize>,
+    entries: Vec<Entry>,
+    head: usize,
+    tail: usize,
+    spill: Option<Spill>,
+    stats: CacheStats,
+}
+
+impl InferenceCache {
+    pub fn new(capacity: usize) -> Self {
+        InferenceCache {
+            capacity: capacity.max(1),
+            map: HashMap::new(),
+            entries: Vec::new(),
+            head: NONE,
+            tail: NONE,
+            spill: None,
+            stats: CacheStats::default(),
+        }
+    }
+
+    /// Creates a cache which also stores every result in the spill file,
+    /// loading the results already in it.
+    pub fn with_spill<P: AsRef<Path>>(capacity: usize, path: P) -> Result<Self, Error> {
+        let mut cache = Self::new(capacity);
+        cache.spill = Some(Spill::open(path.as_ref())?);
+        Ok(cache)
+    }
+
+    pub fn len(&self) -> usize {
+        self.map.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.map.is_empty()
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        self.stats
+    }
+
+    fn unlink(&mut self, index: usize) {
+        let (prev, next) = (self.entries[index].prev, self.entries[index].next);
+        match prev {
+            NONE => self.head = next,
+            prev => self.entries[prev].next = next,
+        }
+        match next {
+            NONE => self.tail = prev,
+            next => self.entries[next].prev = prev,
+        }
+    }
+
+    fn push_front(&mut self, index: usize) {
+        self.entries[index].prev = NONE;
+        self.entries[index].next = self.head;
+        if self.head != NONE {
+            self.entries[self.head].prev = index;
+        }
+        self.head = index;
+        if self.tail == NONE {
+            self.tail = index;
+        }
+    }
+
+    /// Copies the results for key to output, marking them recently used.
+    pub fn get(&mut self, key: u128, output: &mut Vec<VAALBox>) -> Result<bool, Error> {
+        self.stats.lookups += 1;
+        if let Some(index) = self.map.get(&key).copied() {
+            self.unlink(index);
+            self.push_front(index);
+            output.clear();
+            output.extend_from_slice(&self.entries[index].boxes);
+            self.stats.hits += 1;
+            return Ok(true);
+        }
+        let found = match &mut self.spill {
+            Some(spill) => spill.get(key, output)?,
+            None => false,
+        };
+        if found {
+            self.stats.spill_hits += 1;
+            self.insert_memory(key, output);
+        }
+        Ok(found)
+    }
+
+    fn insert_memory(&mut self, key: u128, boxes: &[VAALBox]) {
+        if let Some(index) = self.map.get(&key).copied() {
+            self.entries[index].boxes.clear();
+            self.entries[index].boxes.extend_from_slice(boxes);
+            self.unlink(index);
+            self.push_front(index);
+            return;
+        }
+        let index = if self.entries.len() < self.capacity {
+            self.entries.push(Entry {
+                key,
+                boxes: Vec::new(),
+                prev: NONE,
+                next: NONE,
+            });
+            self.entries.len() - 1
+        } else {
+            // Reuse the least recently used slot and its allocation.
+            let index = self.tail;
+            self.unlink(index);
+            self.map.remove(&self.entries[index].key);
+            self.entries[index].key = key;
+            index
+        };
+        self.entries[index].boxes.clear();
+        self.entries[index].boxes.extend_from_slice(boxes);
+        self.map.insert(key, index);
+        self.push_front(index);
+    }
+
+    pub fn insert(&mut self, key: u128, boxes: &[VAALBox]) -> Result<(), Error> {
+        self.insert_memory(key, boxes);
+        if let Some(spill) = &mut self.spill {
+            spill.put(key, boxes)?;
+        }
+        Ok(())
+    }
+
+    /// Cache key of an encoded image for a context with the given
+    /// `context_fingerprint`.
+    pub fn key(
+        &mut self,
+        fingerprint: u64,
+        image: &[u8],
+        roi: Option<&[i32; 4]>,
+        proc: u32,
+        max_boxes: usize,
+    ) -> u128 {
+        let start = Instant::now();
+        let content = xxh3_128(image);
+        self.stats.hash_time += start.elapsed();
+        self.stats.bytes_hashed += image.len() as u64;
+
+        let mut hasher = Xxh3::new();
+        hasher.update(&content.to_le_bytes());
+        hasher.update(&fingerprint.to_le_bytes());
+        for v in roi.unwrap_or(&[0, 0, -1, -1]) {
+            hasher.update(&v.to_le_bytes());
+        }
+        hasher.update(&proc.to_le_bytes());
+        hasher.update(&(max_boxes as u64).to_le_bytes());
+        hasher.digest128()
+    }
+
+    /// Detects boxes in an encoded image, from the cache when the same image
+    /// was seen before with the same fingerprint, otherwise by loading and
+    /// running the image on context.  Returns whether it was a cache hit.
+    #[allow(clippy::too_many_arguments)]
+    pub fn detect(
+        &mut self,
+        context: &mut Context,
+        fingerprint: u64,
+        image: &[u8],
+        roi: Option<&[i32; 4]>,
+        proc: u32,
+        max_boxes: usize,
+        output: &mut Vec<VAALBox>,
+    ) -> Result<bool, Error> {
+        let key = self.key(fingerprint, image, roi, proc, max_boxes);
+        if self.get(key, output)? {
+            return Ok(true);
+        }
+        context.load_image(None, image, roi.map(|roi| &roi[..]), proc)?;
+        context.run_model()?;
+        output.clear();
+        output.reserve(max_boxes);
+        context.boxes(output, max_boxes)?;
+        self.insert(key, output)?;
+        Ok(false)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn boxes(key: u128) -> Vec<VAALBox> {
+        (0..key % 4)
+            .map(|i| VAALBox {
+                xmin: key as f32,
+                ymin: i as f32,
+                xmax: 1.0,
+                ymax: 1.0,
+                score: 0.5,
+                label: i as i32,
+            })
+            .collect()
+    }
+
+    fn fields(boxes: &[VAALBox]) -> Vec<(f32, f32, f32, f32, f32, i32)> {
+        boxes
+            .iter()
+            .map(|b| (b.xmin, b.ymin, b.xmax, b.ymax, b.score, b.label))
+            .collect()
+    }
+
+    fn check(cache: &mut InferenceCache, key: u128) -> bool {
+        let mut output = Vec::new();
+        let found = cache.get(key, &mut output).unwrap();
+        if found {
+            assert_eq!(fields(&output), fields(&boxes(key)), "key {}", key);
+        }
+        found
+    }
+
+    #[test]
+    fn evicts_least_recently_used() {
+        let mut cache = InferenceCache::new(2);
+        cache.insert(3, &boxes(3)).unwrap();
+        cache.insert(6, &boxes(6)).unwrap();
+        assert!(check(&mut cache, 3));
+        // 6 is now the least recently used, its slot takes 7.
+        cache.insert(7, &boxes(7)).unwrap();
+        assert_eq!(cache.len(), 2);
+        assert_eq!(cache.entries.len(), 2);
+        assert!(!check(&mut cache, 6));
+        assert!(check(&mut cache, 7));
+        assert!(check(&mut cache, 3));
+
+        // Reinserting a key replaces its boxes in place.
+        cache.insert(3, &boxes(1)).unwrap();
+        assert_eq!(cache.len(), 2);
+        let mut output = Vec::new();
+        assert!(cache.get(3, &mut output).unwrap());
+        assert_eq!(fields(&output), fields(&boxes(1)));
+
+        let stats = cache.stats();
+        assert_eq!((stats.lookups, stats.hits, stats.misses()), (5, 4, 1));
+    }
+
+    #[test]
+    fn spill_serves_evicted_and_survives_torn_record() {
+        let path = std::env::temp_dir().join(format!("vaal-cache-{}", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+
+        let mut cache = InferenceCache::with_spill(1, &path).unwrap();
+        for key in [2, 3, 5] {
+            cache.insert(key, &boxes(key)).unwrap();
+        }
+        // Evicted from memory, read back through a map grown past open.
+        assert!(check(&mut cache, 3));
+        assert!(check(&mut cache, 2));
+        assert_eq!(cache.stats().spill_hits, 2);
+        drop(cache);
+
+        // A crash halfway through appending a record.
+        let len = std::fs::metadata(&path).unwrap().len();
+        let mut file = OpenOptions::new().append(true).open(&path).unwrap();
+        file.write_all(&[0xAB; RECORD_HEADER + 5]).unwrap();
+        drop(file);
+
+        let mut cache = InferenceCache::with_spill(1, &path).unwrap();
+        assert_eq!(std::fs::metadata(&path).unwrap().len(), len);
+        for key in [2, 3, 5] {
+            assert!(check(&mut cache, key));
+        }
+        cache.insert(7, &boxes(7)).unwrap();
+        drop(cache);
+
+        let mut cache = InferenceCache::with_spill(1, &path).unwrap();
+        for key in [2, 3, 5, 7] {
+            assert!(check(&mut cache, key));
+        }
+        assert_eq!(cache.stats().spill_hits, 4);
+        drop(cache);
+
+        std::fs::write(&path, b"not a cache").unwrap();
+        assert!(InferenceCache::with_spill(1, &path).is_err());
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,487 @@
+use crate::{
+    Context, Error, VAALBox,
+    mmap::Mmap,
+    postprocess::Decoder,
+    tensor::{dequantize_into, type_size, with_bytes},
+    tracker::{TrackedBox, Tracker},
+};
+use std::{
+    fs::{File, OpenOptions},
+    io::{Read, Write},
+    ops::Range,
+    os::fd::AsRawFd,
+    path::Path,
+    slice,
+    time::{Duration, Instant},
+};
+use vaal_sys as ffi;
+
+const MAGIC: &[u8; 8] = b"VCAPTUR1";
+const FRAME_MAGIC: &[u8; 4] = b"FRAM";
+const FRAME_HEADER: usize = 24;
+const TENSOR_HEADER: usize = 24;
+
+fn pad8(buf: &mut Vec<u8>) {
+    buf.resize(buf.len().next_multiple_of(8), 0);
+}
+
+fn read_u32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+fn read_u64(buf: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(buf[offset..offset + 8].try_into().unwrap())
+}
+
+/// Length of the file up to the end of its last complete record.
+fn complete_records(file: &File, len: usize) -> Result<usize, Error> {
+    let map = Mmap::map(file.as_raw_fd(), len, false)?;
+    let buf = map.as_slice();
+    let mut offset = MAGIC.len();
+    while offset + FRAME_HEADER <= len {
+        if &buf[offset..offset + 4] != FRAME_MAGIC {
+            return Err(Error::WrapperError(format!(
+                "corrupt capture record at {}",
+                offset
+            )));
+        }
+        let record_len = read_u64(buf, offset + 16) as usize;
+        if record_len < FRAME_HEADER || offset + record_len > len {
+            break;
+        }
+        offset += record_len;
+    }
+    Ok(offset)
+}
+
+/// Append-only recorder of the model outputs of every frame.  Each record
+/// holds the frame id followed by every output tensor's type, shape,
+/// quantization parameters and data, all 8 byte aligned so a reader can use
+/// the data in place.
+pub struct OutputCapture {
+    file: File,
+    record: Vec<u8>,
+}
+
+impl OutputCapture {
+    /// Opens the capture file for appending, creating it when missing.  A
+    /// trailing record cut short by a crash is removed so new records stay
+    /// readable.
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Self, Error> {
+        let mut file = OpenOptions::new()
+            .read(true)
+            .append(true)
+            .create(true)
+            .open(path)?;
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            file.write_all(MAGIC)?;
+        } else {
+            let mut magic = [0u8; 8];
+            file.read_exact(&mut magic)?;
+            if &magic != MAGIC {
+                return Err(Error::WrapperError("not an output capture file".to_owned()));
+            }
+            let end = complete_records(&file, len)?;
+            if end != len {
+                file.set_len(end as u64)?;
+            }
+        }
+        Ok(OutputCapture {
+            file,
+            record: Vec::new(),
+        })
+    }
+
+    /// Serializes every output tensor of the context after `run_model`.
+    pub fn record(&mut self, context: &Context, frame_id: u64) -> Result<(), Error> {
+        let count = context.output_count()?;
+        let mut record = std::mem::take(&mut self.record);
+        record.clear();
+        record.extend_from_slice(FRAME_MAGIC);
+        record.extend_from_slice(&(count as u32).to_le_bytes());
+        record.extend_from_slice(&frame_id.to_le_bytes());
+        record.extend_from_slice(&0u64.to_le_bytes());
+
+        for index in 0..count {
+            let tensor = match context.output_tensor(index) {
+                Some(tensor) => tensor,
+                None => return Err(Error::WrapperError("missing output tensor".to_owned())),
+            };
+            let shape = tensor.shape().to_vec();
+            let scales = tensor.scales().to_vec();
+            let zeros = tensor.zeros().to_vec();
+            with_bytes(&tensor, |vaal_type, data| {
+                record.extend_from_slice(&vaal_type.to_le_bytes());
+                record.extend_from_slice(&(shape.len() as u32).to_le_bytes());
+                record.extend_from_slice(&(scales.len() as u32).to_le_bytes());
+                record.extend_from_slice(&(zeros.len() as u32).to_le_bytes());
+                record.extend_from_slice(&(data.len() as u64).to_le_bytes());
+                shape
+                    .iter()
+                    .for_each(|v| record.extend_from_slice(&v.to_le_bytes()));
+                scales
+                    .iter()
+                    .for_each(|v| record.extend_from_slice(&v.to_le_bytes()));
+                zeros
+                    .iter()
+                    .for_each(|v| record.extend_from_slice(&v.to_le_bytes()));
+                pad8(&mut record);
+                record.extend_from_slice(data);
+                pad8(&mut record);
+            })?;
+        }
+
+        let len = record.len() as u64;
+        record[16..24].copy_from_slice(&len.to_le_bytes());
+        let result = self.file.write_all(&record);
+        self.record = record;
+        Ok(result?)
+    }
+
+    pub fn flush(&mut self) -> Result<(), Error> {
+        Ok(self.file.flush()?)
+    }
+}
+
+struct TensorRecord {
+    vaal_type: ffi::VAALType,
+    shape: Vec<i32>,
+    scales: Vec<f32>,
+    zeros: Vec<i32>,
+    data: Range<usize>,
+}
+
+struct FrameRecord {
+    frame_id: u64,
+    tensors: Range<usize>,
+}
+
+/// Memory-mapped reader of an `OutputCapture` file.  A trailing record which
+/// was only partially written is ignored.
+pub struct CaptureReader {
+    map: Mmap,
+    tensors: Vec<TensorRecord>,
+    frames: Vec<FrameRecord>,
+}
+
+impl CaptureReader {
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Self, Error> {
+        let file = File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        let map = Mmap::map(file.as_raw_fd(), len, false)?;
+        let buf = map.as_slice();
+        if len < MAGIC.len() || &buf[..MAGIC.len()] != MAGIC {
+            return Err(Error::WrapperError("not an output capture file".to_owned()));
+        }
+        map.advise(0, len, libc::MADV_WILLNEED);
+
+        let mut tensors = Vec::new();
+        let mut frames = Vec::new();
+        let mut offset = MAGIC.len();
+        while offset + FRAME_HEADER <= len {
+            if &buf[offset..offset + 4] != FRAME_MAGIC {
+                return Err(Error::WrapperError(format!(
+                    "corrupt capture record at {}",
+                    offset
+                )));
+            }
+            let count = read_u32(buf, offset + 4) as usize;
+            let frame_id = read_u64(buf, offset + 8);
+            let record_len = read_u64(buf, offset + 16) as usize;
+            if record_len < FRAME_HEADER || offset + record_len > len {
+                break;
+            }
+
+            let first = tensors.len();
+            let mut pos = offset + FRAME_HEADER;
+            let end = offset + record_len;
+            for _ in 0..count {
+                if pos + TENSOR_HEADER > end {
+                    return Err(Error::WrapperError(format!(
+                        "corrupt capture record at {}",
+                        offset
+                    )));
+                }
+                let vaal_type = read_u32(buf, pos);
+                let dims = read_u32(buf, pos + 4) as usize;
+                let n_scales = read_u32(buf, pos + 8) as usize;
+                let n_zeros = read_u32(buf, pos + 12) as usize;
+                let data_len = read_u64(buf, pos + 16) as usize;
+                pos += TENSOR_HEADER;
+                if pos + (dims + n_scales + n_zeros) * 4 + data_len > end {
+                    return Err(Error::WrapperError(format!(
+                        "corrupt capture record at {}",
+                        offset
+                    )));
+                }
+                let words = |pos: usize, n: usize| (0..n).map(move |i| read_u32(buf, pos + i * 4));
+                let shape = words(pos, dims).map(|v| v as i32).collect();
+                pos += dims * 4;
+                let scales = words(pos, n_scales).map(f32::from_bits).collect();
+                pos += n_scales * 4;
+                let zeros = words(pos, n_zeros).map(|v| v as i32).collect();
+                pos = (pos + n_zeros * 4).next_multiple_of(8);
+                tensors.push(TensorRecord {
+                    vaal_type,
+                    shape,
+                    scales,
+                    zeros,
+                    data: pos..pos + data_len,
+                });
+                pos = (pos + data_len).next_multiple_of(8);
+            }
+            if pos != end {
+                return Err(Error::WrapperError(format!(
+                    "corrupt capture record at {}",
+                    offset
+                )));
+            }
+            frames.push(FrameRecord {
+                frame_id,
+                tensors: first..tensors.len(),
+            });
+            offset += record_len;
+        }
+
+        Ok(CaptureReader {
+            map,
+            tensors,
+            frames,
+        })
+    }
+
+    pub fn len(&self) -> usize {
+        self.frames.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.frames.is_empty()
+    }
+
+    pub fn frame(&self, index: usize) -> Option<CapturedFrame<'_>> {
+        let frame = self.frames.get(index)?;
+        Some(CapturedFrame {
+            reader: self,
+            frame_id: frame.frame_id,
+            tensors: &self.tensors[frame.tensors.clone()],
+        })
+    }
+
+    pub fn frames(&self) -> impl Iterator<Item = CapturedFrame<'_>> {
+        (0..self.frames.len()).map(|i| self.frame(i).unwrap())
+    }
+}
+
+pub struct CapturedFrame<'a> {
+    reader: &'a CaptureReader,
+    frame_id: u64,
+    tensors: &'a [TensorRecord],
+}
+
+impl<'a> CapturedFrame<'a> {
+    pub fn frame_id(&self) -> u64 {
+        self.frame_id
+    }
+
+    pub fn len(&self) -> usize {
+        self.tensors.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.tensors.is_empty()
+    }
+
+    pub fn tensor(&self, index: usize) -> Option<CapturedTensor<'a>> {
+        let record = self.tensors.get(index)?;
+        Some(CapturedTensor {
+            record,
+            data: &self.reader.map.as_slice()[record.data.clone()],
+        })
+    }
+}
+
+pub struct CapturedTensor<'a> {
+    record: &'a TensorRecord,
+    data: &'a [u8],
+}
+
+impl<'a> CapturedTensor<'a> {
+    pub fn vaal_type(&self) -> ffi::VAALType {
+        self.record.vaal_type
+    }
+
+    pub fn shape(&self) -> &'a [i32] {
+        &self.record.shape
+    }
+
+    pub fn scales(&self) -> &'a [f32] {
+        &self.record.scales
+    }
+
+    pub fn zeros(&self) -> &'a [i32] {
+        &self.record.zeros
+    }
+
+    pub fn data(&self) -> &'a [u8] {
+        self.data
+    }
+
+    pub fn len(&self) -> usize {
+        match type_size(self.record.vaal_type) {
+            Some(size) => self.data.len() / size,
+            None => 0,
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Borrows float data in place, records are 8 byte aligned in the file.
+    pub fn as_f32(&self) -> Option<&'a [f32]> {
+        if self.record.vaal_type != ffi::VAALType_VAAL_F32
+            || !(self.data.as_ptr() as usize).is_multiple_of(4)
+        {
+            return None;
+        }
+        Some(unsafe {
+            slice::from_raw_parts(self.data.as_ptr() as *const f32, self.data.len() / 4)
+        })
+    }
+
+    /// Converts the tensor to floats, applying per-tensor quantization.
+    pub fn dequantize_into(&self, output: &mut Vec<f32>) -> Result<(), Error> {
+        dequantize_into(
+            self.record.vaal_type,
+            self.data,
+            &self.record.scales,
+            &self.record.zeros,
+            output,
+        )
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ReplayStats {
+    pub frames: u64,
+    pub boxes: u64,
+    pub elapsed: Duration,
+}
+
+impl ReplayStats {
+    pub fn fps(&self) -> f64 {
+        self.frames as f64 / self.elapsed.as_secs_f64().max(f64::EPSILON)
+    }
+}
+
+/// Runs decoding, NMS and tracking over captured outputs without a model so
+/// post-processing can be benchmarked in isolation from inference.
+pub struct Replay {
+    pub decoder: Decoder,
+    pub tracker: Tracker,
+    pub boxes_output: usize,
+    pub scores_output: usize,
+    boxes_scratch: Vec<f32>,
+    scores_scratch: Vec<f32>,
+    decoded: Vec<VAALBox>,
+    tracked: Vec<TrackedBox>,
+}
+
+impl Replay {
+    pub fn new(decoder: Decoder, boxes_output: usize, scores_output: usize) -> Self {
+        Replay {
+            decoder,
+            tracker: Tracker::new(),
+            boxes_output,
+            scores_output,
+            boxes_scratch: Vec::new(),
+            scores_scratch: Vec::new(),
+            decoded: Vec::new(),
+            tracked: Vec::new(),
+        }
+    }
+
+    pub fn run<F: FnMut(u64, &[TrackedBox])>(
+        &mut self,
+        reader: &CaptureReader,
+        mut f: F,
+    ) -> Result<ReplayStats, Error> {
+        let mut stats = ReplayStats::default();
+        let start = Instant::now();
+        for frame in reader.frames() {
+            let (boxes, scores) = match (
+                frame.tensor(self.boxes_output),
+                frame.tensor(self.scores_output),
+            ) {
+                (Some(boxes), Some(scores)) => (boxes, scores),
+                _ => return Err(Error::WrapperError("missing captured output".to_owned())),
+            };
+            let num_classes = match scores.shape().last() {
+                Some(classes) if *classes > 0 => *classes as usize,
+                _ => return Err(Error::WrapperError("invalid score tensor shape".to_owned())),
+            };
+            let boxes = match boxes.as_f32() {
+                Some(data) => data,
+                None => {
+                    boxes.dequantize_into(&mut self.boxes_scratch)?;
+                    &self.boxes_scratch
+                }
+            };
+            let scores = match scores.as_f32() {
+                Some(data) => data,
+                None => {
+                    scores.dequantize_into(&mut self.scores_scratch)?;
+                    &self.scores_scratch
+                }
+            };
+            self.decoder
+                .decode(boxes, scores, num_classes, &mut self.decoded)?;
+            self.tracker.update(&self.decoded, &mut self.tracked);
+            f(frame.frame_id(), &self.tracked);
+            stats.frames += 1;
+            stats.boxes += self.tracked.len() as u64;
+        }
+        stats.elapsed = start.elapsed();
+        Ok(stats)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn empty_record(frame_id: u64) -> Vec<u8> {
+        let mut record = Vec::new();
+        record.extend_from_slice(FRAME_MAGIC);
+        record.extend_from_slice(&0u32.to_le_bytes());
+        record.extend_from_slice(&frame_id.to_le_bytes());
+        record.extend_from_slice(&(FRAME_HEADER as u64).to_le_bytes());
+        record
+    }
+
+    #[test]
+    fn reopen_trims_partial_record() {
+        let path = std::env::temp_dir().join(format!("vaal-capture-{}", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+
+        let mut capture = OutputCapture::open(&path).unwrap();
+        for frame_id in 0..3 {
+            capture.file.write_all(&empty_record(frame_id)).unwrap();
+        }
+        // A crash in the middle of the fourth record.
+        capture.file.write_all(&empty_record(3)[..10]).unwrap();
+        drop(capture);
+
+        let mut capture = OutputCapture::open(&path).unwrap();
+        let len = std::fs::metadata(&path).unwrap().len() as usize;
+        assert_eq!(len, MAGIC.len() + 3 * FRAME_HEADER);
+        capture.file.write_all(&empty_record(4)).unwrap();
+        drop(capture);
+
+        let reader = CaptureReader::open(&path).unwrap();
+        let ids: Vec<_> = reader.frames().map(|frame| frame.frame_id()).collect();
+        assert_eq!(ids, [0, 1, 2, 4]);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,401 @@
+use crate::{
+    Context, Error,
+    tensor::vaal_type,
+    view::{F16, Quantization},
+};
+use std::cmp::Ordering;
+use vaal_sys as ffi;
+
+/// One of the top classes of a classifier output row.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Class {
+    pub index: usize,
+    /// Softmax probability, or the dequantized output when softmax is off.
+    pub score: f32,
+}
+
+/// exp(x) for x <= 0 as a branch-free polynomial the compiler can vectorize,
+/// relative error below 1e-5.
+#[inline(always)]
+fn exp_neg(x: f32) -> f32 {
+    let t = x.max(-87.0) * std::f32::consts::LOG2_E;
+    // Truncating t - 0.5 rounds to nearest for t <= 0, leaving f in
+    // [-0.5, 0.5] for the 2^f polynomial.
+    let n = (t - 0.5) as i32;
+    let f = t - n as f32;
+    let p = 1.0
+        + f * (std::f32::consts::LN_2
+            + f * (0.240_226_5 + f * (0.055_504_11 + f * (0.009_618_129 + f * 0.001_333_355_8))));
+    f32::from_bits(((n + 127) as u32) << 23) * p
+}
+
+/// Indices of the k largest values in descending order, ties keep the lower
+/// index first.  Small k keeps a sorted insertion list so the common case is
+/// one comparison per value, large k selects with a partial sort.
+fn top_k<T: Copy + PartialOrd>(values: &[T], k: usize, output: &mut Vec<usize>) {
+    output.clear();
+    let k = k.min(values.len());
+    if k == 0 {
+        return;
+    }
+    if k > 32 {
+        output.extend(0..values.len());
+        let order = |a: &usize, b: &usize| {
+            values[*b]
+                .partial_cmp(&values[*a])
+                .unwrap_or(Ordering::Equal)
+                .then(a.cmp(b))
+        };
+        output.select_nth_unstable_by(k - 1, order);
+        output.truncate(k);
+        output.sort_unstable_by(order);
+        return;
+    }
+    for (i, v) in values.iter().enumerate() {
+        if output.len() == k {
+            if v.partial_cmp(&values[output[k - 1]]) != Some(Ordering::Greater) {
+                continue;
+            }
+            output.pop();
+        }
+        let mut at = output.len();
+        while at > 0 && *v > values[output[at - 1]] {
+            at -= 1;
+        }
+        output.insert(at, i);
+    }
+}
+
+fn max<T: Copy + PartialOrd>(values: &[T]) -> T {
+    values
+        .iter()
+        .copied()
+        .fold(values[0], |m, v| if v > m { v } else { m })
+}
+
+/// Top-K post-processing for classifier outputs of shape [C] or [N, C].
+/// Labels are read from the model once, all working buffers are reused so
+/// classifying a row does not allocate once they have grown.
+///
+/// Quantized outputs are ranked on the raw integers and the softmax uses a
+/// table of exp(-scale * d) for every difference d to the row maximum, so
+/// only the K results are ever converted to floats.
+pub struct Classifier {
+    pub output: i32,
+    /// Apply softmax to the outputs, disable for models which end in one.
+    pub softmax: bool,
+    labels: Vec<String>,
+    lut_scale: f32,
+    lut: Vec<f32>,
+    scratch: Vec<f32>,
+    order: Vec<usize>,
+    results: Vec<Class>,
+    row_len: usize,
+}
+
+impl Classifier {
+    pub fn new(context: &Context, output: i32) -> Self {
+        Classifier {
+            output,
+            softmax: true,
+            labels: context.labels().into_iter().map(str::to_owned).collect(),
+            lut_scale: f32::NAN,
+            lut: vec![0.0; 256],
+            scratch: Vec::new(),
+            order: Vec::new(),
+            results: Vec::new(),
+            row_len: 0,
+        }
+    }
+
+    pub fn labels(&self) -> &[String] {
+        &self.labels
+    }
+
+    /// Label of a class index, empty when the model has no label for it.
+    pub fn label(&self, index: usize) -> &str {
+        self.labels.get(index).map_or("", |label| label.as_str())
+    }
+
+    /// Results of the last call with their labels.
+    pub fn results(&self) -> impl Iterator<Item = (usize, f32, &str)> {
+        self.results
+            .iter()
+            .map(|class| (class.index, class.score, self.label(class.index)))
+    }
+
+    /// Results of the last call split per row.
+    pub fn rows(&self) -> std::slice::Chunks<'_, Class> {
+        self.results.chunks(self.row_len.max(1))
+    }
+
+    /// Top k classes of the first output row of the last run.
+    pub fn classify(&mut self, context: &mut Context, k: usize) -> Result<&[Class], Error> {
+        self.classify_batch(context, k)?;
+        let row = self.row_len.min(self.results.len());
+        Ok(&self.results[..row])
+    }
+
+    /// Top k classes of every row of a batched output, see `rows`.  Returns
+    /// the number of rows.
+    pub fn classify_batch(&mut self, context: &mut Context, k: usize) -> Result<usize, Error> {
+        let tensor = match context.output_tensor(self.output) {
+            Some(tensor) => tensor,
+            None => {
+                return Err(Error::WrapperError(format!(
+                    "no output tensor {}",
+                    self.output
+                )));
+            }
+        };
+        let classes = match tensor.shape().last() {
+            Some(classes) if *classes > 0 => *classes as usize,
+            _ => return Err(Error::WrapperError("empty classifier output".to_owned())),
+        };
+        self.results.clear();
+        self.row_len = k.min(classes);
+        match vaal_type(&tensor) {
+            ffi::VAALType_VAAL_U8 => {
+                let view = context.output_view::<u8>(self.output)?;
+                let quantization = view.quantization();
+                for row in view.chunks_exact(classes) {
+                    self.quantized_row(row, quantization, k, |v| v as i32);
+                }
+            }
+            ffi::VAALType_VAAL_I8 => {
+                let view = context.output_view::<i8>(self.output)?;
+                let quantization = view.quantization();
+                for row in view.chunks_exact(classes) {
+                    self.quantized_row(row, quantization, k, |v| v as i32);
+                }
+            }
+            ffi::VAALType_VAAL_F32 => {
+                let view = context.output_view::<f32>(self.output)?;
+                for row in view.chunks_exact(classes) {
+                    self.float_row(row, k);
+                }
+            }
+            ffi::VAALType_VAAL_F16 => {
+                let view = context.output_view::<F16>(self.output)?;
+                let mut scratch = std::mem::take(&mut self.scratch);
+                scratch.resize(view.len(), 0.0);
+                view.dequantize_into(&mut scratch)?;
+                for row in scratch.chunks_exact(classes) {
+                    self.float_row(row, k);
+                }
+                self.scratch = scratch;
+            }
+            found => {
+                return Err(Error::WrapperError(format!(
+                    "unsupported classifier output type {}",
+                    found
+                )));
+            }
+        }
+        Ok(self.results.len() / self.row_len.max(1))
+    }
+
+    /// Top k classes of scores already in memory, such as crops classified
+    /// one at a time, with `classes` values per row.
+    pub fn classify_scores(
+        &mut self,
+        scores: &[f32],
+        classes: usize,
+        k: usize,
+    ) -> Result<&[Class], Error> {
+        if classes == 0 || !scores.len().is_multiple_of(classes) {
+            return Err(Error::WrapperError("invalid score shape".to_owned()));
+        }
+        self.results.clear();
+        self.row_len = k.min(classes);
+        for row in scores.chunks_exact(classes) {
+            self.float_row(row, k);
+        }
+        Ok(&self.results)
+    }
+
+    fn float_row(&mut self, row: &[f32], k: usize) {
+        top_k(row, k, &mut self.order);
+        if !self.softmax {
+            self.results.extend(self.order.iter().map(|i| Class {
+                index: *i,
+                score: row[*i],
+            }));
+            return;
+        }
+        let max = max(row);
+        let sum: f32 = row.iter().map(|v| exp_neg(v - max)).sum();
+        self.results.extend(self.order.iter().map(|i| Class {
+            index: *i,
+            score: exp_neg(row[*i] - max) / sum,
+        }));
+    }
+
+    fn quantized_row<T: Copy + PartialOrd>(
+        &mut self,
+        row: &[T],
+        quantization: Quantization,
+        k: usize,
+        widen: fn(T) -> i32,
+    ) {
+        let Quantization { scale, zero } = quantization;
+        if scale <= 0.0 || scale.is_nan() {
+            // Ranking on the integers only holds for a positive scale.
+            let mut scratch = std::mem::take(&mut self.scratch);
+            scratch.clear();
+            scratch.extend(row.iter().map(|v| (widen(*v) - zero) as f32 * scale));
+            self.float_row(&scratch, k);
+            self.scratch = scratch;
+            return;
+        }
+        top_k(row, k, &mut self.order);
+        if !self.softmax {
+            self.results.extend(self.order.iter().map(|i| Class {
+                index: *i,
+                score: (widen(row[*i]) - zero) as f32 * scale,
+            }));
+            return;
+        }
+        if self.lut_scale != scale {
+            for (d, v) in self.lut.iter_mut().enumerate() {
+                *v = (-scale * d as f32).exp();
+            }
+            self.lut_scale = scale;
+        }
+        let max = widen(max(row));
+        let lut = &self.lut;
+        let sum: f32 = row.iter().map(|v| lut[(max - widen(*v)) as usize]).sum();
+        self.results.extend(self.order.iter().map(|i| Class {
+            index: *i,
+            score: lut[(max - widen(row[*i])) as usize] / sum,
+        }));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn classifier() -> Classifier {
+        Classifier {
+            output: 0,
+            softmax: true,
+            labels: Vec::new(),
+            lut_scale: f32::NAN,
+            lut: vec![0.0; 256],
+            scratch: Vec::new(),
+            order: Vec::new(),
+            results: Vec::new(),
+            row_len: 0,
+        }
+    }
+
+    /// Values from a small range so most of them are tied.
+    fn tied_values(len: usize) -> Vec<f32> {
+        let mut state = 12345u32;
+        (0..len)
+            .map(|_| {
+                state = state.wrapping_mul(1_664_525).wrapping_add(1_013_904_223);
+                (state >> 28) as f32
+            })
+            .collect()
+    }
+
+    #[test]
+    fn top_k_matches_stable_sort() {
+        let values = tied_values(1000);
+        let mut sorted: Vec<usize> = (0..values.len()).collect();
+        sorted.sort_by(|a, b| values[*b].total_cmp(&values[*a]));
+
+        let mut output = Vec::new();
+        for k in [0, 1, 5, 31, 32, 33, 100, 999, 1000, 2000] {
+            top_k(&values, k, &mut output);
+            assert_eq!(output, sorted[..k.min(values.len())], "k {}", k);
+        }
+    }
+
+    #[test]
+    fn top_k_ties_keep_lower_index() {
+        let mut output = Vec::new();
+        top_k(&[1, 3, 3, 2, 3], 2, &mut output);
+        assert_eq!(output, [1, 2]);
+        top_k(&[1, 3, 3, 2, 3], 4, &mut output);
+        assert_eq!(output, [1, 2, 4, 3]);
+        top_k(&[0u8; 40], 33, &mut output);
+        assert_eq!(output, (0..33).collect::<Vec<_>>());
+        top_k::<u8>(&[], 5, &mut output);
+        assert!(output.is_empty());
+    }
+
+    #[test]
+    fn exp_neg_error_bound() {
+        let mut x = 0.0f32;
+        while x >= -87.0 {
+            let (approx, exact) = (exp_neg(x), (x as f64).exp());
+            let error = ((approx as f64 - exact) / exact).abs();
+            assert!(error < 1e-5, "exp({}) = {} not {}", x, approx, exact);
+            x -= 0.0137;
+        }
+        assert_eq!(exp_neg(0.0), 1.0);
+        assert!(exp_neg(-200.0) < 1e-37);
+        assert!(exp_neg(f32::NEG_INFINITY) < 1e-37);
+    }
+
+    fn assert_close(quantized: &[Class], float: &[Class]) {
+        assert_eq!(quantized.len(), float.len());
+        for (q, f) in quantized.iter().zip(float) {
+            assert_eq!(q.index, f.index);
+            assert!((q.score - f.score).abs() < 1e-5, "{:?} {:?}", q, f);
+        }
+    }
+
+    #[test]
+    fn quantized_matches_float() {
+        let quantization = Quantization {
+            scale: 0.1,
+            zero: 128,
+        };
+        let row: Vec<u8> = (0..1000u32).map(|i| ((i * 7919) % 256) as u8).collect();
+        let floats: Vec<f32> = row
+            .iter()
+            .map(|v| (*v as i32 - quantization.zero) as f32 * quantization.scale)
+            .collect();
+        let signed: Vec<i8> = row.iter().map(|v| (*v as i32 - 128) as i8).collect();
+        let signed_quantization = Quantization {
+            scale: 0.1,
+            zero: 0,
+        };
+
+        let mut classifier = classifier();
+        for softmax in [true, false] {
+            classifier.softmax = softmax;
+            for k in [1, 5, 40] {
+                classifier.results.clear();
+                classifier.float_row(&floats, k);
+                let float = classifier.results.clone();
+
+                classifier.results.clear();
+                classifier.quantized_row(&row, quantization, k, |v| v as i32);
+                assert_close(&classifier.results, &float);
+
+                classifier.results.clear();
+                classifier.quantized_row(&signed, signed_quantization, k, |v| v as i32);
+                assert_close(&classifier.results, &float);
+            }
+        }
+    }
+
+    #[test]
+    fn classify_scores_rows() {
+        let mut classifier = classifier();
+        let classes = classifier
+            .classify_scores(&[0.0, 1.0, 2.0, 5.0, 1.0, 0.0], 3, 2)
+            .unwrap();
+        let indices: Vec<_> = classes.iter().map(|class| class.index).collect();
+        assert_eq!(indices, [2, 1, 0, 1]);
+        let sum: f32 = [0.0f32, 1.0, 2.0].iter().map(|v| v.exp()).sum();
+        assert!((classes[0].score - 2.0f32.exp() / sum).abs() < 1e-6);
+        assert_eq!(classifier.rows().count(), 2);
+        assert!(classifier.classify_scores(&[0.0; 5], 3, 2).is_err());
+    }
+}
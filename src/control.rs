@@ -0,0 +1,252 @@
+use crate::{Context, Error, ParameterValue};
+use std::{
+    cell::UnsafeCell,
+    collections::{BTreeMap, HashMap},
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicUsize, Ordering},
+    },
+};
+
+const INDEX: usize = 0b11;
+const DIRTY: usize = 0b100;
+
+#[derive(Default)]
+struct Snapshot {
+    generation: u64,
+    values: Vec<(String, ParameterValue)>,
+}
+
+struct Publishers {
+    back: usize,
+    generation: u64,
+    values: BTreeMap<String, ParameterValue>,
+}
+
+/// Triple buffer of parameter snapshots.  Publishers fill the back slot and
+/// exchange it with the middle slot, the receiver exchanges its front slot
+/// with the middle one when it is marked dirty.  Each slot is only touched by
+/// the side which currently owns its index.
+struct Shared {
+    slots: [UnsafeCell<Snapshot>; 3],
+    middle: AtomicUsize,
+    publishers: Mutex<Publishers>,
+}
+
+unsafe impl Sync for Shared {}
+
+/// Creates a channel for pushing parameter changes to a context owned by an
+/// inference thread.
+pub fn parameter_channel() -> (ParameterPublisher, ParameterReceiver) {
+    let shared = Arc::new(Shared {
+        slots: Default::default(),
+        middle: AtomicUsize::new(1),
+        publishers: Mutex::new(Publishers {
+            back: 2,
+            generation: 0,
+            values: BTreeMap::new(),
+        }),
+    });
+    (
+        ParameterPublisher {
+            shared: shared.clone(),
+        },
+        ParameterReceiver {
+            shared,
+            front: 0,
+            generation: 0,
+            applied: HashMap::new(),
+            retry: false,
+        },
+    )
+}
+
+/// Control side of a parameter channel, cloneable for several control
+/// threads.  Publishing never waits for the inference thread, publishers
+/// only serialize among themselves.
+#[derive(Clone)]
+pub struct ParameterPublisher {
+    shared: Arc<Shared>,
+}
+
+impl ParameterPublisher {
+    pub fn publish(&self, name: &str, value: ParameterValue) {
+        self.publish_all([(name.to_owned(), value)]);
+    }
+
+    /// Publishes several values as one update, the receiver applies all of
+    /// them at the same frame boundary.
+    pub fn publish_all<I: IntoIterator<Item = (String, ParameterValue)>>(&self, values: I) {
+        let mut publishers = self.shared.publishers.lock().unwrap();
+        publishers.values.extend(values);
+        publishers.generation += 1;
+
+        let slot = unsafe { &mut *self.shared.slots[publishers.back].get() };
+        slot.generation = publishers.generation;
+        slot.values.clear();
+        slot.values.extend(
+            publishers
+                .values
+                .iter()
+                .map(|(name, value)| (name.clone(), value.clone())),
+        );
+        let old = self
+            .shared
+            .middle
+            .swap(publishers.back | DIRTY, Ordering::AcqRel);
+        publishers.back = old & INDEX;
+    }
+}
+
+/// Inference side of a parameter channel.
+pub struct ParameterReceiver {
+    shared: Arc<Shared>,
+    front: usize,
+    generation: u64,
+    applied: HashMap<String, ParameterValue>,
+    /// The front snapshot has values which failed to set.
+    retry: bool,
+}
+
+impl ParameterReceiver {
+    /// Generation of the last snapshot taken, increasing with every publish.
+    pub fn generation(&self) -> u64 {
+        self.generation
+    }
+
+    /// Exchanges the front slot for the middle one if it holds a new
+    /// snapshot, a single atomic load when nothing was published.
+    fn take(&mut self) -> Option<&Snapshot> {
+        if self.shared.middle.load(Ordering::Relaxed) & DIRTY == 0 {
+            return None;
+        }
+        let old = self.shared.middle.swap(self.front, Ordering::AcqRel);
+        self.front = old & INDEX;
+        let slot = unsafe { &*self.shared.slots[self.front].get() };
+        self.generation = slot.generation;
+        Some(slot)
+    }
+
+    /// Takes the latest snapshot of all published values if there is a new
+    /// one.
+    pub fn latest(&mut self) -> Option<&[(String, ParameterValue)]> {
+        self.take().map(|slot| slot.values.as_slice())
+    }
+
+    /// Call at the start of a frame, sets the values which changed since the
+    /// last applied snapshot and returns whether there was an update.  All
+    /// values are attempted, the first failure is returned and the values
+    /// which failed are tried again by the next apply, with or without a new
+    /// publish.
+    pub fn apply(&mut self, context: &Context) -> Result<bool, Error> {
+        if self.take().is_none() && !self.retry {
+            return Ok(false);
+        }
+        let slot = unsafe { &*self.shared.slots[self.front].get() };
+
+        let mut result = Ok(true);
+        for (name, value) in &slot.values {
+            if self.applied.get(name) == Some(value) {
+                continue;
+            }
+            match context.set_parameter(name, value) {
+                Ok(()) => {
+                    self.applied.insert(name.clone(), value.clone());
+                }
+                Err(e) => {
+                    if result.is_ok() {
+                        result = Err(e);
+                    }
+                }
+            }
+        }
+        self.retry = result.is_err();
+        result
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::thread;
+
+    const PUBLISHERS: usize = 4;
+    const UPDATES: usize = 20_000;
+    const NAMES: [&str; 4] = ["score_threshold", "iou_threshold", "max_detection", "nms"];
+
+    /// Every update writes the same value to all names, a snapshot mixing two
+    /// updates shows up as differing values.  The receiver may skip updates
+    /// but generations only increase.
+    #[test]
+    fn snapshots_are_never_torn() {
+        let (publisher, mut receiver) = parameter_channel();
+        let total = (PUBLISHERS * UPDATES) as u64;
+
+        let publishers: Vec<_> =
+            (0..PUBLISHERS)
+                .map(|thread| {
+                    let publisher = publisher.clone();
+                    thread::spawn(move || {
+                        for update in 0..UPDATES {
+                            let value = (thread * UPDATES + update) as i32;
+                            publisher.publish_all(NAMES.iter().map(|name| {
+                                (name.to_string(), ParameterValue::I32(vec![value; 3]))
+                            }));
+                        }
+                    })
+                })
+                .collect();
+
+        let mut generation = 0;
+        let mut last = [None; PUBLISHERS];
+        while generation < total {
+            let values = match receiver.latest() {
+                Some(values) => values,
+                None => {
+                    thread::yield_now();
+                    continue;
+                }
+            };
+            assert_eq!(values.len(), NAMES.len());
+            let first = &values[0].1;
+            assert!(
+                values.iter().all(|(_, value)| value == first),
+                "{:?}",
+                values
+            );
+            // Updates of one publisher are seen in the order published.
+            let value = match first {
+                ParameterValue::I32(value) => value[0] as usize,
+                _ => unreachable!(),
+            };
+            let (thread, update) = (value / UPDATES, value % UPDATES);
+            assert!(last[thread] < Some(update));
+            last[thread] = Some(update);
+            assert!(receiver.generation() > generation);
+            generation = receiver.generation();
+        }
+        for publisher in publishers {
+            publisher.join().unwrap();
+        }
+        assert_eq!(generation, total);
+        assert!(last.contains(&Some(UPDATES - 1)));
+        assert!(receiver.latest().is_none());
+    }
+
+    #[test]
+    fn failed_values_are_retried() {
+        let context = Context::new("cpu").unwrap();
+        let (publisher, mut receiver) = parameter_channel();
+        publisher.publish("score_threshold", ParameterValue::F32(vec![0.5]));
+        assert!(receiver.apply(&context).unwrap());
+        assert!(!receiver.apply(&context).unwrap());
+
+        // A name the library rejects keeps failing on every frame without a
+        // new publish instead of being forgotten after the first attempt.
+        publisher.publish("bad\0name", ParameterValue::F32(vec![1.0]));
+        assert!(receiver.apply(&context).is_err());
+        assert!(receiver.apply(&context).is_err());
+        assert!(receiver.applied.contains_key("score_threshold"));
+        assert!(!receiver.applied.contains_key("bad\0name"));
+    }
+}
@@ -0,0 +1,431 @@
+use crate::{Context, Error, VAALBox};
+use std::{
+    collections::BTreeMap,
+    fs,
+    io::Write,
+    panic::{self, AssertUnwindSafe},
+    path::{Path, PathBuf},
+    sync::{
+        Arc, Mutex,
+        mpsc::{Receiver, SyncSender, sync_channel},
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+/// One image of a dataset, a file to read or an encoded image in memory.
+#[derive(Debug, Clone)]
+pub enum Input {
+    Path(PathBuf),
+    Bytes(Vec<u8>),
+}
+
+impl From<PathBuf> for Input {
+    fn from(path: PathBuf) -> Self {
+        Input::Path(path)
+    }
+}
+
+impl From<Vec<u8>> for Input {
+    fn from(bytes: Vec<u8>) -> Self {
+        Input::Bytes(bytes)
+    }
+}
+
+/// Receives results in input order.
+pub trait Sink {
+    /// Called once per input, path is None for in-memory inputs.  An error
+    /// stops the run.
+    fn write(
+        &mut self,
+        index: u64,
+        path: Option<&Path>,
+        result: Result<&[VAALBox], &Error>,
+    ) -> Result<(), Error>;
+
+    /// Makes everything written so far durable, called before each
+    /// checkpoint so a resumed run never skips unwritten results.
+    fn flush(&mut self) -> Result<(), Error> {
+        Ok(())
+    }
+}
+
+impl<F> Sink for F
+where
+    F: FnMut(u64, Option<&Path>, Result<&[VAALBox], &Error>) -> Result<(), Error>,
+{
+    fn write(
+        &mut self,
+        index: u64,
+        path: Option<&Path>,
+        result: Result<&[VAALBox], &Error>,
+    ) -> Result<(), Error> {
+        self(index, path, result)
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct DatasetStats {
+    /// Inputs written to the sink by this run.
+    pub processed: u64,
+    /// Inputs which failed to read or run, included in processed.
+    pub failed: u64,
+    /// Inputs skipped as done by a previous run.
+    pub skipped: u64,
+    pub elapsed: Duration,
+}
+
+impl DatasetStats {
+    pub fn throughput(&self) -> f64 {
+        self.processed as f64 / self.elapsed.as_secs_f64().max(f64::EPSILON)
+    }
+}
+
+struct Done {
+    index: u64,
+    path: Option<PathBuf>,
+    result: Result<Vec<VAALBox>, Error>,
+}
+
+/// Runs detection over datasets larger than memory.  Reader threads load
+/// the encoded images, each context runs on its own thread which decodes,
+/// infers and reads the boxes, and results are reordered for the sink.
+/// Image decoding happens inside VAAL on the context threads, so the readers
+/// only overlap file IO with inference.
+///
+/// At most window inputs are in flight between the reader and the sink, so
+/// memory stays bounded even when one image is slow.  With a checkpoint file
+/// the number of inputs written is saved every checkpoint_every inputs, a
+/// later run over the same input sequence skips them.
+pub struct DatasetRunner {
+    pub readers: usize,
+    pub window: usize,
+    pub max_boxes: usize,
+    pub proc: u32,
+    pub checkpoint: Option<PathBuf>,
+    pub checkpoint_every: u64,
+}
+
+impl Default for DatasetRunner {
+    fn default() -> Self {
+        DatasetRunner {
+            readers: 2,
+            window: 64,
+            max_boxes: 100,
+            proc: 0,
+            checkpoint: None,
+            checkpoint_every: 1000,
+        }
+    }
+}
+
+fn read_checkpoint(path: &Path) -> Result<u64, Error> {
+    match fs::read_to_string(path) {
+        Ok(text) => text
+            .trim()
+            .parse()
+            .map_err(|_| Error::WrapperError(format!("invalid checkpoint {}", path.display()))),
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => Ok(0),
+        Err(e) => Err(e.into()),
+    }
+}
+
+/// Written to a temporary file and renamed so a crash never leaves a
+/// truncated checkpoint.
+fn write_checkpoint(path: &Path, done: u64) -> Result<(), Error> {
+    let tmp = path.with_extension(format!("tmp{}", std::process::id()));
+    let mut file = fs::File::create(&tmp)?;
+    writeln!(file, "{}", done)?;
+    file.sync_all()?;
+    fs::rename(&tmp, path)?;
+    Ok(())
+}
+
+fn next<T>(receiver: &Mutex<Receiver<T>>) -> Option<T> {
+    receiver.lock().unwrap().recv().ok()
+}
+
+impl DatasetRunner {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    fn detect(&self, context: &mut Context, image: &[u8]) -> Result<Vec<VAALBox>, Error> {
+        context.load_image(None, image, None, self.proc)?;
+        context.run_model()?;
+        let mut boxes = Vec::with_capacity(self.max_boxes);
+        context.boxes(&mut boxes, self.max_boxes)?;
+        Ok(boxes)
+    }
+
+    /// Runs every input on the contexts, one thread each, writing results to
+    /// sink in input order.  The contexts are borrowed for the run and are
+    /// back in contexts when it returns, also when a sink or checkpoint error
+    /// stopped it, so a failed run can be resumed on the same contexts.  A
+    /// context whose thread panicked is dropped, its input goes to the sink
+    /// as failed and the run returns an error once the others are back.
+    pub fn run<I, S>(
+        &self,
+        contexts: &mut Vec<Context>,
+        inputs: I,
+        sink: &mut S,
+    ) -> Result<DatasetStats, Error>
+    where
+        I: IntoIterator,
+        I::Item: Into<Input>,
+        I::IntoIter: Send,
+        S: Sink + ?Sized,
+    {
+        if contexts.is_empty() {
+            return Err(Error::WrapperError("no contexts to run on".to_owned()));
+        }
+        let start = Instant::now();
+        let resume = match &self.checkpoint {
+            Some(path) => read_checkpoint(path)?,
+            None => 0,
+        };
+        let window = self.window.max(contexts.len());
+        let mut stats = DatasetStats {
+            skipped: resume,
+            ..Default::default()
+        };
+
+        let (input_tx, input_rx) = sync_channel::<(u64, Input)>(window);
+        let (bytes_tx, bytes_rx) =
+            sync_channel::<(u64, Option<PathBuf>, Result<Vec<u8>, Error>)>(contexts.len());
+        let (done_tx, done_rx) = sync_channel::<Done>(window);
+        // Tokens limit the inputs between the feeder and the sink.
+        let (token_tx, token_rx) = sync_channel::<()>(window);
+        for _ in 0..window {
+            token_tx.send(()).unwrap();
+        }
+        // Shared so the receivers close once their last thread exits,
+        // unblocking the stage before it when the run stops early.
+        let input_rx = Arc::new(Mutex::new(input_rx));
+        let bytes_rx = Arc::new(Mutex::new(bytes_rx));
+        let mut inputs = inputs.into_iter();
+
+        let result = thread::scope(|scope| {
+            scope.spawn(move || {
+                for (index, input) in (&mut inputs).enumerate() {
+                    let index = index as u64;
+                    if index < resume {
+                        continue;
+                    }
+                    if token_rx.recv().is_err() || input_tx.send((index, input.into())).is_err() {
+                        break;
+                    }
+                }
+            });
+
+            for _ in 0..self.readers.max(1) {
+                let bytes_tx: SyncSender<_> = bytes_tx.clone();
+                let input_rx = input_rx.clone();
+                scope.spawn(move || {
+                    while let Some((index, input)) = next(&input_rx) {
+                        let item = match input {
+                            Input::Path(path) => {
+                                let bytes = fs::read(&path).map_err(Error::from);
+                                (index, Some(path), bytes)
+                            }
+                            Input::Bytes(bytes) => (index, None, Ok(bytes)),
+                        };
+                        if bytes_tx.send(item).is_err() {
+                            break;
+                        }
+                    }
+                });
+            }
+            drop(bytes_tx);
+            drop(input_rx);
+
+            let workers: Vec<_> = contexts
+                .drain(..)
+                .map(|mut context| {
+                    let done_tx = done_tx.clone();
+                    let bytes_rx = bytes_rx.clone();
+                    scope.spawn(move || {
+                        while let Some((index, path, bytes)) = next(&bytes_rx) {
+                            let result = panic::catch_unwind(AssertUnwindSafe(|| {
+                                bytes.and_then(|bytes| self.detect(&mut context, &bytes))
+                            }));
+                            // The input is still reported so the sink does not
+                            // wait on it, then this context stops.
+                            let (result, panicked) = match result {
+                                Ok(result) => (result, false),
+                                Err(_) => (
+                                    Err(Error::WrapperError("dataset worker panicked".to_owned())),
+                                    true,
+                                ),
+                            };
+                            let sent = done_tx
+                                .send(Done {
+                                    index,
+                                    path,
+                                    result,
+                                })
+                                .is_ok();
+                            if panicked {
+                                return None;
+                            }
+                            if !sent {
+                                break;
+                            }
+                        }
+                        Some(context)
+                    })
+                })
+                .collect();
+            drop(done_tx);
+            drop(bytes_rx);
+
+            let result = self.drain(done_rx, token_tx, resume, sink, &mut stats);
+            let mut panicked = false;
+            for worker in workers {
+                match worker.join() {
+                    Ok(Some(context)) => contexts.push(context),
+                    _ => panicked = true,
+                }
+            }
+            if panicked && result.is_ok() {
+                return Err(Error::WrapperError(
+                    "dataset worker panicked, its context was dropped".to_owned(),
+                ));
+            }
+            result
+        });
+        result?;
+        stats.elapsed = start.elapsed();
+        Ok(stats)
+    }
+
+    /// Writes results to the sink in order, returning a token per result so
+    /// the feeder can admit the next input.
+    fn drain<S: Sink + ?Sized>(
+        &self,
+        done_rx: Receiver<Done>,
+        token_tx: SyncSender<()>,
+        resume: u64,
+        sink: &mut S,
+        stats: &mut DatasetStats,
+    ) -> Result<(), Error> {
+        let mut pending = BTreeMap::new();
+        let mut next_index = resume;
+        let mut since_checkpoint = 0;
+        for done in done_rx {
+            pending.insert(done.index, done);
+            while let Some(done) = pending.remove(&next_index) {
+                let result = done.result.as_deref();
+                sink.write(done.index, done.path.as_deref(), result)?;
+                stats.processed += 1;
+                if result.is_err() {
+                    stats.failed += 1;
+                }
+                next_index += 1;
+                let _ = token_tx.send(());
+
+                since_checkpoint += 1;
+                if since_checkpoint >= self.checkpoint_every.max(1) {
+                    self.save(sink, next_index)?;
+                    since_checkpoint = 0;
+                }
+            }
+        }
+        if since_checkpoint > 0 {
+            self.save(sink, next_index)?;
+        }
+        Ok(())
+    }
+
+    fn save<S: Sink + ?Sized>(&self, sink: &mut S, done: u64) -> Result<(), Error> {
+        sink.flush()?;
+        match &self.checkpoint {
+            Some(path) => write_checkpoint(path, done),
+            None => Ok(()),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn inputs(count: usize) -> Vec<Vec<u8>> {
+        (0..count).map(|i| vec![i as u8; 16]).collect()
+    }
+
+    #[test]
+    fn contexts_survive_sink_errors() {
+        let runner = DatasetRunner {
+            window: 4,
+            ..DatasetRunner::default()
+        };
+        let mut contexts = vec![Context::new("cpu").unwrap(), Context::new("cpu").unwrap()];
+
+        let mut written = Vec::new();
+        let mut failing = |index: u64, _: Option<&Path>, _: Result<&[VAALBox], &Error>| {
+            if index == 5 {
+                return Err(Error::WrapperError("sink full".to_owned()));
+            }
+            written.push(index);
+            Ok(())
+        };
+        assert!(runner.run(&mut contexts, inputs(20), &mut failing).is_err());
+        assert_eq!(contexts.len(), 2);
+        assert_eq!(written, [0, 1, 2, 3, 4]);
+
+        let mut written = Vec::new();
+        let mut sink = |index: u64, _: Option<&Path>, _: Result<&[VAALBox], &Error>| {
+            written.push(index);
+            Ok(())
+        };
+        let stats = runner.run(&mut contexts, inputs(20), &mut sink).unwrap();
+        assert_eq!(contexts.len(), 2);
+        assert_eq!(stats.processed, 20);
+        assert_eq!(written, (0..20).collect::<Vec<_>>());
+    }
+
+    #[test]
+    fn checkpoint_errors_keep_contexts() {
+        let path = std::env::temp_dir().join(format!("vaal-dataset-{}", std::process::id()));
+        fs::write(&path, "not a number").unwrap();
+        let runner = DatasetRunner {
+            checkpoint: Some(path.clone()),
+            ..DatasetRunner::default()
+        };
+        let mut contexts = vec![Context::new("cpu").unwrap()];
+        let mut sink = |_: u64, _: Option<&Path>, _: Result<&[VAALBox], &Error>| Ok(());
+        let result = runner.run(&mut contexts, inputs(4), &mut sink);
+        fs::remove_file(&path).unwrap();
+        assert!(result.is_err());
+        assert_eq!(contexts.len(), 1);
+    }
+
+    #[test]
+    fn panicking_worker_drops_only_its_context() {
+        // Every detect panics on the box capacity, the missing files fail
+        // before detect so only the worker given the bytes panics.
+        let runner = DatasetRunner {
+            max_boxes: usize::MAX,
+            ..DatasetRunner::default()
+        };
+        let missing =
+            std::env::temp_dir().join(format!("vaal-dataset-{}-missing", std::process::id()));
+        let mut inputs = vec![Input::Path(missing); 9];
+        inputs[4] = Input::Bytes(vec![0; 16]);
+        let mut contexts = vec![Context::new("cpu").unwrap(), Context::new("cpu").unwrap()];
+
+        let mut failed = Vec::new();
+        let mut sink = |index: u64, _: Option<&Path>, result: Result<&[VAALBox], &Error>| {
+            if let Err(e) = result {
+                failed.push((index, e.to_string().contains("panicked")));
+            }
+            Ok(())
+        };
+        let result = runner.run(&mut contexts, inputs, &mut sink);
+        assert!(result.unwrap_err().to_string().contains("panicked"));
+        assert_eq!(contexts.len(), 1);
+        assert_eq!(failed.len(), 9);
+        assert_eq!(failed[4], (4, true));
+    }
+}
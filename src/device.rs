@@ -0,0 +1,382 @@
+use crate::{
+    AUTO_DEVICE, Context, Error,
+    frame::{Frame, RGB3},
+    model_hash,
+    tensor::with_bytes_mut,
+};
+use std::{
+    env, fs,
+    io::Write,
+    path::PathBuf,
+    sync::Arc,
+    thread,
+    time::{Duration, Instant},
+};
+use vaal_sys as ffi;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Policy {
+    /// Lowest median latency of a single inference.
+    Latency,
+    /// Most inferences per second over the measured runs, with
+    /// `DeviceSelector::streams` contexts running concurrently.
+    Throughput,
+}
+
+impl Policy {
+    fn name(&self) -> &'static str {
+        match self {
+            Policy::Latency => "latency",
+            Policy::Throughput => "throughput",
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct DeviceChoice {
+    pub device: String,
+    pub latency: Duration,
+    pub throughput: f64,
+    /// The choice was read from the cache file rather than measured.
+    pub cached: bool,
+}
+
+/// Picks the fastest device for a model by trying each candidate device with
+/// a few synthetic runs.  Decisions are cached per model hash and host so
+/// only the first start on a machine pays for the probe, devices which are
+/// missing or fail to load the model are skipped.
+pub struct DeviceSelector {
+    pub devices: Vec<String>,
+    pub policy: Policy,
+    pub warmup: usize,
+    pub iterations: usize,
+    /// Contexts sharing the device while measuring throughput, each runs the
+    /// iterations.
+    pub streams: usize,
+    pub cache: Option<PathBuf>,
+}
+
+impl Default for DeviceSelector {
+    fn default() -> Self {
+        DeviceSelector {
+            devices: ["npu", "gpu", "opencl", "cpu"]
+                .iter()
+                .map(|d| d.to_string())
+                .collect(),
+            policy: Policy::Latency,
+            warmup: 3,
+            iterations: 10,
+            streams: 2,
+            cache: default_cache(),
+        }
+    }
+}
+
+fn default_cache() -> Option<PathBuf> {
+    let base = match env::var_os("XDG_CACHE_HOME") {
+        Some(dir) => PathBuf::from(dir),
+        None => PathBuf::from(env::var_os("HOME")?).join(".cache"),
+    };
+    Some(base.join("vaal").join("devices"))
+}
+
+/// Stable identifier of this machine, the systemd machine-id when available
+/// otherwise the hostname.
+pub fn host_id() -> String {
+    for path in ["/etc/machine-id", "/var/lib/dbus/machine-id"] {
+        if let Ok(id) = fs::read_to_string(path) {
+            let id = id.trim();
+            if !id.is_empty() {
+                return id.to_owned();
+            }
+        }
+    }
+    match fs::read_to_string("/proc/sys/kernel/hostname") {
+        Ok(name) if !name.trim().is_empty() => name.trim().to_owned(),
+        _ => "unknown".to_owned(),
+    }
+}
+
+/// Side of the noise frame loaded into inputs which cannot be mapped.
+const NOISE_SIZE: i32 = 64;
+
+/// Xorshift generator for synthetic input data.
+fn next_random(state: &mut u64) -> u64 {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    *state
+}
+
+/// Fills mapped tensor memory with pseudo-random values valid for the type,
+/// floats are in [0, 1) so no NaN or infinity reaches the model.
+fn fill_random(vaal_type: ffi::VAALType, bytes: &mut [u8], state: &mut u64) {
+    match vaal_type {
+        ffi::VAALType_VAAL_F32 => {
+            for value in bytes.chunks_exact_mut(4) {
+                let x = (next_random(state) >> 40) as f32 / (1u32 << 24) as f32;
+                value.copy_from_slice(&x.to_ne_bytes());
+            }
+        }
+        _ => {
+            for byte in bytes.iter_mut() {
+                *byte = (next_random(state) >> 56) as u8;
+            }
+        }
+    }
+}
+
+/// Fills the inputs with pseudo-random values so measurements do not benefit
+/// from all-zero data.  Inputs the wrapper cannot map are loaded from a noise
+/// frame, VAAL converts it to the tensor type, and inputs which are not images
+/// are left as allocated.
+pub(crate) fn fill_inputs(context: &Context) -> Result<(), Error> {
+    let mut state = 0x9e37_79b9_7f4a_7c15u64;
+    let mut index = 0;
+    while let Ok(input) = context.input_tensor(index) {
+        index += 1;
+        let filled = with_bytes_mut(&input, |vaal_type, bytes| {
+            fill_random(vaal_type, bytes, &mut state)
+        });
+        if filled.is_ok() {
+            continue;
+        }
+        let mut noise = vec![0; (NOISE_SIZE * NOISE_SIZE * 3) as usize];
+        fill_random(ffi::VAALType_VAAL_U8, &mut noise, &mut state);
+        let frame = Frame::new(&noise, RGB3, NOISE_SIZE, NOISE_SIZE)?;
+        let _ = context.load_frame_memory(Some(&input), &frame, None, 0);
+    }
+    Ok(())
+}
+
+impl DeviceSelector {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    fn cache_key(&self, model: &[u8]) -> String {
+        let policy = match self.policy {
+            Policy::Latency => self.policy.name().to_owned(),
+            Policy::Throughput => format!("{}/{}", self.policy.name(), self.streams.max(1)),
+        };
+        format!("{} {:016x} {}", host_id(), model_hash(model), policy)
+    }
+
+    fn cached(&self, key: &str) -> Option<DeviceChoice> {
+        let text = fs::read_to_string(self.cache.as_ref()?).ok()?;
+        text.lines().rev().find_map(|line| {
+            let rest = line.strip_prefix(key)?.strip_prefix(' ')?;
+            let mut fields = rest.split_whitespace();
+            let device = fields.next()?.to_owned();
+            let latency = Duration::from_nanos(fields.next()?.parse().ok()?);
+            let throughput = fields.next()?.parse().ok()?;
+            Some(DeviceChoice {
+                device,
+                latency,
+                throughput,
+                cached: true,
+            })
+        })
+    }
+
+    /// Replaces the entry for key, written to a temporary file and renamed so
+    /// concurrent readers never see a partial cache.
+    fn store(&self, key: &str, choice: &DeviceChoice) -> Result<(), Error> {
+        let path = match &self.cache {
+            Some(path) => path,
+            None => return Ok(()),
+        };
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+        let mut text = String::new();
+        if let Ok(old) = fs::read_to_string(path) {
+            for line in old.lines().filter(|line| !line.starts_with(key)) {
+                text.push_str(line);
+                text.push('\n');
+            }
+        }
+        text.push_str(&format!(
+            "{} {} {} {}\n",
+            key,
+            choice.device,
+            choice.latency.as_nanos(),
+            choice.throughput
+        ));
+        let tmp = path.with_extension(format!("tmp{}", std::process::id()));
+        fs::File::create(&tmp)?.write_all(text.as_bytes())?;
+        fs::rename(&tmp, path)?;
+        Ok(())
+    }
+
+    /// Loads the model on the device and measures it, returning None when the
+    /// device is not available or cannot run the model.  Throughput runs the
+    /// iterations on every stream at once and counts the runs completed over
+    /// the wall time, latency is the median of all runs.
+    pub fn measure(&self, device: &str, model: &Arc<Vec<u8>>) -> Option<DeviceChoice> {
+        if device == AUTO_DEVICE {
+            return None;
+        }
+        let streams = match self.policy {
+            Policy::Latency => 1,
+            Policy::Throughput => self.streams.max(1),
+        };
+        let mut contexts = Vec::with_capacity(streams);
+        for _ in 0..streams {
+            let mut context = Context::new(device).ok()?;
+            context.load_model_shared(model.clone()).ok()?;
+            fill_inputs(&context).ok()?;
+            for _ in 0..self.warmup {
+                context.run_model().ok()?;
+            }
+            contexts.push(context);
+        }
+
+        let iterations = self.iterations.max(1);
+        let start = Instant::now();
+        let runs = thread::scope(|scope| {
+            let handles: Vec<_> = contexts
+                .into_iter()
+                .map(|context| {
+                    scope.spawn(move || {
+                        let mut times = Vec::with_capacity(iterations);
+                        for _ in 0..iterations {
+                            let run = Instant::now();
+                            context.run_model().ok()?;
+                            times.push(run.elapsed());
+                        }
+                        Some(times)
+                    })
+                })
+                .collect();
+            handles
+                .into_iter()
+                .map(|handle| handle.join().ok().flatten())
+                .collect::<Option<Vec<_>>>()
+        })?;
+        let total = start.elapsed();
+        let mut times: Vec<_> = runs.into_iter().flatten().collect();
+        times.sort_unstable();
+        Some(DeviceChoice {
+            device: device.to_owned(),
+            latency: times[times.len() / 2],
+            throughput: times.len() as f64 / total.as_secs_f64().max(f64::EPSILON),
+            cached: false,
+        })
+    }
+
+    /// Returns the best device for the model, from the cache when possible.
+    pub fn select(&self, model: &Arc<Vec<u8>>) -> Result<DeviceChoice, Error> {
+        let key = self.cache_key(model);
+        if let Some(choice) = self.cached(&key) {
+            return Ok(choice);
+        }
+
+        let best = self
+            .devices
+            .iter()
+            .filter_map(|device| self.measure(device, model))
+            .reduce(|best, choice| {
+                let better = match self.policy {
+                    Policy::Latency => choice.latency < best.latency,
+                    Policy::Throughput => choice.throughput > best.throughput,
+                };
+                if better { choice } else { best }
+            });
+        match best {
+            Some(choice) => {
+                // Failing to write the cache only costs a probe next start.
+                let _ = self.store(&key, &choice);
+                Ok(choice)
+            }
+            None => Err(Error::WrapperError(
+                "no device could run the model".to_owned(),
+            )),
+        }
+    }
+
+    /// Creates a context on the selected device with the model loaded.  A
+    /// cached device which can no longer be opened or load the model triggers
+    /// a new probe.
+    pub fn open(&self, model: Vec<u8>) -> Result<(Context, DeviceChoice), Error> {
+        let model = Arc::new(model);
+        let choice = self.select(&model)?;
+        match Self::load(&choice.device, model.clone()) {
+            Ok(context) => return Ok((context, choice)),
+            Err(e) if !choice.cached => return Err(e),
+            Err(_) => {}
+        }
+
+        let probe = DeviceSelector {
+            cache: None,
+            devices: self.devices.clone(),
+            ..*self
+        };
+        let choice = probe.select(&model)?;
+        let _ = self.store(&self.cache_key(&model), &choice);
+        Ok((Self::load(&choice.device, model)?, choice))
+    }
+
+    fn load(device: &str, model: Arc<Vec<u8>>) -> Result<Context, Error> {
+        let mut context = Context::new(device)?;
+        context.load_model_shared(model)?;
+        Ok(context)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn random_values_are_valid() {
+        let mut state = 1;
+        let mut bytes = vec![0u8; 4096];
+        fill_random(ffi::VAALType_VAAL_F32, &mut bytes, &mut state);
+        for value in bytes.chunks_exact(4) {
+            let x = f32::from_ne_bytes(value.try_into().unwrap());
+            assert!((0.0..1.0).contains(&x), "{}", x);
+        }
+        fill_random(ffi::VAALType_VAAL_I32, &mut bytes, &mut state);
+        assert!(bytes.iter().filter(|b| **b == 0).count() < 64);
+    }
+
+    #[test]
+    fn auto_is_never_measured() {
+        let selector = DeviceSelector {
+            devices: vec![AUTO_DEVICE.to_owned()],
+            cache: None,
+            ..DeviceSelector::default()
+        };
+        let model = Arc::new(Vec::new());
+        assert!(selector.measure(AUTO_DEVICE, &model).is_none());
+        assert!(selector.select(&model).is_err());
+    }
+
+    #[test]
+    fn throughput_counts_every_stream() {
+        let model = Arc::new(b"model".to_vec());
+        let selector = DeviceSelector {
+            devices: vec!["cpu".to_owned()],
+            policy: Policy::Throughput,
+            warmup: 0,
+            iterations: 4,
+            streams: 3,
+            cache: None,
+        };
+        assert_ne!(
+            selector.cache_key(&model),
+            DeviceSelector {
+                streams: 1,
+                devices: Vec::new(),
+                cache: None,
+                ..selector
+            }
+            .cache_key(&model)
+        );
+        let choice = selector.select(&model).unwrap();
+        assert_eq!(choice.device, "cpu");
+        assert!(!choice.cached);
+        assert!(choice.throughput > 0.0);
+    }
+}
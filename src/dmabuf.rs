@@ -0,0 +1,390 @@
+use crate::{Error, frame::frame_size, mmap::Mmap};
+use std::{
+    ffi::CString,
+    fs::OpenOptions,
+    io,
+    os::fd::{AsFd, AsRawFd, BorrowedFd, FromRawFd, OwnedFd},
+    slice,
+    sync::{Condvar, Mutex},
+    time::{Duration, Instant},
+};
+
+const DMA_HEAPS: [&str; 3] = [
+    "/dev/dma_heap/linux,cma",
+    "/dev/dma_heap/reserved",
+    "/dev/dma_heap/system",
+];
+
+// _IOWR('H', 0, struct dma_heap_allocation_data)
+const DMA_HEAP_IOCTL_ALLOC: libc::c_ulong = 0xc018_4800;
+// _IOW('u', 0x42, struct udmabuf_create)
+const UDMABUF_CREATE: libc::c_ulong = 0x4018_7542;
+// _IOW('b', 0, struct dma_buf_sync)
+const DMA_BUF_IOCTL_SYNC: libc::c_ulong = 0x4008_6200;
+
+const DMA_BUF_SYNC_RW: u64 = 3;
+const DMA_BUF_SYNC_START: u64 = 0;
+const DMA_BUF_SYNC_END: u64 = 4;
+const UDMABUF_FLAGS_CLOEXEC: u32 = 1;
+
+#[repr(C)]
+struct DmaHeapAllocationData {
+    len: u64,
+    fd: u32,
+    fd_flags: u32,
+    heap_flags: u64,
+}
+
+#[repr(C)]
+struct UdmabufCreate {
+    memfd: u32,
+    flags: u32,
+    offset: u64,
+    size: u64,
+}
+
+#[repr(C)]
+struct DmaBufSync {
+    flags: u64,
+}
+
+/// Allocator used for the buffers of a pool.  Memfd buffers are not dmabufs
+/// and will be rejected by `vaal_load_frame_dmabuf`, they exist so the pool can
+/// be used on machines without dma-heap or udmabuf support and are loaded from
+/// their mapping by `Context::load_frame_lease`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Backing {
+    DmaHeap,
+    Udmabuf,
+    Memfd,
+}
+
+struct Buffer {
+    map: Mmap,
+    fd: OwnedFd,
+}
+
+fn page_align(size: usize) -> usize {
+    let page = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+    size.div_ceil(page) * page
+}
+
+fn alloc_dma_heap(size: usize) -> Result<OwnedFd, Error> {
+    let mut last = Error::IoError(io::ErrorKind::NotFound);
+    for heap in DMA_HEAPS {
+        let file = match OpenOptions::new().read(true).write(true).open(heap) {
+            Ok(file) => file,
+            Err(e) => {
+                last = Error::from(e);
+                continue;
+            }
+        };
+        let mut data = DmaHeapAllocationData {
+            len: size as u64,
+            fd: 0,
+            fd_flags: (libc::O_RDWR | libc::O_CLOEXEC) as u32,
+            heap_flags: 0,
+        };
+        let ret = unsafe { libc::ioctl(file.as_raw_fd(), DMA_HEAP_IOCTL_ALLOC, &mut data) };
+        if ret < 0 {
+            last = Error::from(io::Error::last_os_error());
+            continue;
+        }
+        return Ok(unsafe { OwnedFd::from_raw_fd(data.fd as i32) });
+    }
+    Err(last)
+}
+
+fn alloc_memfd(size: usize, seal: bool) -> Result<OwnedFd, Error> {
+    let name = CString::new("vaal-dmabuf").unwrap();
+    let mut flags = libc::MFD_CLOEXEC;
+    if seal {
+        flags |= libc::MFD_ALLOW_SEALING;
+    }
+    let fd = unsafe { libc::memfd_create(name.as_ptr(), flags) };
+    if fd < 0 {
+        return Err(Error::from(io::Error::last_os_error()));
+    }
+    let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+    if unsafe { libc::ftruncate(fd.as_raw_fd(), size as libc::off_t) } < 0 {
+        return Err(Error::from(io::Error::last_os_error()));
+    }
+    if seal && unsafe { libc::fcntl(fd.as_raw_fd(), libc::F_ADD_SEALS, libc::F_SEAL_SHRINK) } < 0 {
+        return Err(Error::from(io::Error::last_os_error()));
+    }
+    Ok(fd)
+}
+
+fn alloc_udmabuf(size: usize) -> Result<OwnedFd, Error> {
+    let memfd = alloc_memfd(size, true)?;
+    let dev = OpenOptions::new()
+        .read(true)
+        .write(true)
+        .open("/dev/udmabuf")?;
+    let create = UdmabufCreate {
+        memfd: memfd.as_raw_fd() as u32,
+        flags: UDMABUF_FLAGS_CLOEXEC,
+        offset: 0,
+        size: size as u64,
+    };
+    let fd = unsafe { libc::ioctl(dev.as_raw_fd(), UDMABUF_CREATE, &create) };
+    if fd < 0 {
+        return Err(Error::from(io::Error::last_os_error()));
+    }
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
+
+fn alloc(backing: Backing, size: usize) -> Result<OwnedFd, Error> {
+    match backing {
+        Backing::DmaHeap => alloc_dma_heap(size),
+        Backing::Udmabuf => alloc_udmabuf(size),
+        Backing::Memfd => alloc_memfd(size, false),
+    }
+}
+
+/// Fixed ring of dmabufs which are allocated and mapped once then handed out
+/// as leases.  A lease borrows the pool so the file descriptor it submits can
+/// never outlive the buffer and returns the buffer to the pool on drop.
+pub struct DmaBufPool {
+    buffers: Vec<Buffer>,
+    size: usize,
+    backing: Backing,
+    format: Option<(u32, i32, i32)>,
+    free: Mutex<Vec<usize>>,
+    available: Condvar,
+}
+
+impl DmaBufPool {
+    /// Allocates count buffers of size bytes from the first backing which
+    /// works on this system, in order dma-heap, udmabuf then memfd.
+    pub fn new(count: usize, size: usize) -> Result<Self, Error> {
+        let mut last = Error::WrapperError("no dmabuf backing available".to_owned());
+        for backing in [Backing::DmaHeap, Backing::Udmabuf, Backing::Memfd] {
+            match Self::with_backing(backing, count, size) {
+                Ok(pool) => return Ok(pool),
+                Err(e) => last = e,
+            }
+        }
+        Err(last)
+    }
+
+    /// Allocates a pool whose buffers each hold one frame of the given format,
+    /// leases from such a pool can be loaded with `Context::load_frame_lease`.
+    pub fn for_frame(count: usize, fourcc: u32, width: i32, height: i32) -> Result<Self, Error> {
+        let size = match frame_size(fourcc, width, height) {
+            Some(size) => size,
+            None => return Err(Error::WrapperError("unsupported frame format".to_owned())),
+        };
+        let mut pool = Self::new(count, size)?;
+        pool.format = Some((fourcc, width, height));
+        Ok(pool)
+    }
+
+    pub fn with_backing(backing: Backing, count: usize, size: usize) -> Result<Self, Error> {
+        if count == 0 || size == 0 {
+            return Err(Error::WrapperError("empty dmabuf pool".to_owned()));
+        }
+        let aligned = page_align(size);
+        let mut buffers = Vec::with_capacity(count);
+        for _ in 0..count {
+            let fd = alloc(backing, aligned)?;
+            let map = Mmap::map(fd.as_raw_fd(), aligned, true)?;
+            buffers.push(Buffer { map, fd });
+        }
+        Ok(DmaBufPool {
+            buffers,
+            size,
+            backing,
+            format: None,
+            free: Mutex::new((0..count).rev().collect()),
+            available: Condvar::new(),
+        })
+    }
+
+    pub fn backing(&self) -> Backing {
+        self.backing
+    }
+
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.buffers.len()
+    }
+
+    pub fn available(&self) -> usize {
+        self.free.lock().unwrap().len()
+    }
+
+    pub fn try_acquire(&self) -> Option<DmaBufLease<'_>> {
+        let index = self.free.lock().unwrap().pop()?;
+        Some(DmaBufLease { pool: self, index })
+    }
+
+    /// Blocks until a buffer is returned to the pool.
+    pub fn acquire(&self) -> DmaBufLease<'_> {
+        let mut free = self.free.lock().unwrap();
+        loop {
+            if let Some(index) = free.pop() {
+                return DmaBufLease { pool: self, index };
+            }
+            free = self.available.wait(free).unwrap();
+        }
+    }
+
+    pub fn acquire_timeout(&self, timeout: Duration) -> Option<DmaBufLease<'_>> {
+        let deadline = Instant::now() + timeout;
+        let mut free = self.free.lock().unwrap();
+        loop {
+            if let Some(index) = free.pop() {
+                return Some(DmaBufLease { pool: self, index });
+            }
+            let now = Instant::now();
+            if now >= deadline {
+                return None;
+            }
+            free = self.available.wait_timeout(free, deadline - now).unwrap().0;
+        }
+    }
+
+    fn release(&self, index: usize) {
+        self.free.lock().unwrap().push(index);
+        self.available.notify_one();
+    }
+}
+
+/// Exclusive use of one buffer of a `DmaBufPool`.
+pub struct DmaBufLease<'a> {
+    pool: &'a DmaBufPool,
+    index: usize,
+}
+
+impl<'a> DmaBufLease<'a> {
+    pub fn index(&self) -> usize {
+        self.index
+    }
+
+    pub fn len(&self) -> usize {
+        self.pool.size
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.pool.size == 0
+    }
+
+    pub fn backing(&self) -> Backing {
+        self.pool.backing
+    }
+
+    pub fn fd(&self) -> BorrowedFd<'_> {
+        self.pool.buffers[self.index].fd.as_fd()
+    }
+
+    /// The (fourcc, width, height) of the frames held by the pool, if any.
+    pub fn format(&self) -> Option<(u32, i32, i32)> {
+        self.pool.format
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        &self.pool.buffers[self.index].map.as_slice()[..self.pool.size]
+    }
+
+    /// Maps the buffer for CPU writes, bracketing the access with dmabuf
+    /// cache synchronization until the returned guard is dropped.
+    pub fn map_mut(&mut self) -> DmaBufMapMut<'_, 'a> {
+        self.sync(DMA_BUF_SYNC_START);
+        DmaBufMapMut { lease: self }
+    }
+
+    fn sync(&self, flags: u64) {
+        if self.pool.backing == Backing::Memfd {
+            return;
+        }
+        let sync = DmaBufSync {
+            flags: flags | DMA_BUF_SYNC_RW,
+        };
+        unsafe { libc::ioctl(self.fd().as_raw_fd(), DMA_BUF_IOCTL_SYNC, &sync) };
+    }
+}
+
+impl Drop for DmaBufLease<'_> {
+    fn drop(&mut self) {
+        self.pool.release(self.index);
+    }
+}
+
+pub struct DmaBufMapMut<'l, 'a> {
+    lease: &'l mut DmaBufLease<'a>,
+}
+
+impl std::ops::Deref for DmaBufMapMut<'_, '_> {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        self.lease.as_slice()
+    }
+}
+
+impl std::ops::DerefMut for DmaBufMapMut<'_, '_> {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        let map = &self.lease.pool.buffers[self.lease.index].map;
+        unsafe { slice::from_raw_parts_mut(map.as_ptr(), self.lease.pool.size) }
+    }
+}
+
+impl Drop for DmaBufMapMut<'_, '_> {
+    fn drop(&mut self) {
+        self.lease.sync(DMA_BUF_SYNC_END);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::mem::size_of;
+
+    // _IOC(dir, type, nr, size) from asm-generic/ioctl.h.
+    fn ioc(dir: libc::c_ulong, kind: u8, nr: u8, size: usize) -> libc::c_ulong {
+        dir << 30
+            | (size as libc::c_ulong) << 16
+            | (kind as libc::c_ulong) << 8
+            | nr as libc::c_ulong
+    }
+
+    #[test]
+    fn ioctl_structs_match_kernel() {
+        assert_eq!(size_of::<DmaHeapAllocationData>(), 24);
+        assert_eq!(size_of::<UdmabufCreate>(), 24);
+        assert_eq!(size_of::<DmaBufSync>(), 8);
+
+        let (write, read_write) = (1, 3);
+        assert_eq!(
+            DMA_HEAP_IOCTL_ALLOC,
+            ioc(read_write, b'H', 0, size_of::<DmaHeapAllocationData>())
+        );
+        assert_eq!(
+            UDMABUF_CREATE,
+            ioc(write, b'u', 0x42, size_of::<UdmabufCreate>())
+        );
+        assert_eq!(
+            DMA_BUF_IOCTL_SYNC,
+            ioc(write, b'b', 0, size_of::<DmaBufSync>())
+        );
+    }
+
+    #[test]
+    fn memfd_pool_leases() {
+        let pool = DmaBufPool::with_backing(Backing::Memfd, 2, 100).unwrap();
+        assert_eq!(pool.size(), 100);
+        let mut lease = pool.acquire();
+        lease.map_mut()[..3].copy_from_slice(b"abc");
+        assert_eq!(&lease.as_slice()[..3], b"abc");
+        assert_eq!(lease.len(), 100);
+        let other = pool.try_acquire().unwrap();
+        assert!(pool.try_acquire().is_none());
+        assert!(pool.acquire_timeout(Duration::from_millis(1)).is_none());
+        drop(other);
+        assert_eq!(pool.available(), 1);
+    }
+}
@@ -1,3 +1,4 @@
+use deepviewrt as dvrt;
 use std::{ffi::CStr, fmt, io};
 use vaal_sys as ffi;
 
@@ -23,6 +24,16 @@ impl From<ffi::VAALError> for Error {
     }
 }
 
+impl From<dvrt::error::Error> for Error {
+    #[allow(unreachable_patterns)]
+    fn from(value: dvrt::error::Error) -> Self {
+        match value {
+            dvrt::error::Error::WrapperError(e) => Error::WrapperError(e),
+            _ => Error::Null(),
+        }
+    }
+}
+
 impl From<std::io::Error> for Error {
     fn from(value: std::io::Error) -> Self {
         Error::IoError(value.kind())
@@ -0,0 +1,66 @@
+use crate::Error;
+
+pub const fn fourcc(code: &[u8; 4]) -> u32 {
+    (code[0] as u32) | (code[1] as u32) << 8 | (code[2] as u32) << 16 | (code[3] as u32) << 24
+}
+
+pub const YUYV: u32 = fourcc(b"YUYV");
+pub const NV12: u32 = fourcc(b"NV12");
+pub const RGB3: u32 = fourcc(b"RGB3");
+pub const RGBA: u32 = fourcc(b"RGBA");
+
+/// Size in bytes of a tightly packed frame, None for unsupported fourcc codes
+/// and for sizes the format cannot represent: YUYV shares chroma between
+/// pixel pairs so needs an even width, NV12 subsamples both axes so needs an
+/// even width and height.
+pub fn frame_size(fourcc: u32, width: i32, height: i32) -> Option<usize> {
+    if width <= 0 || height <= 0 {
+        return None;
+    }
+    let pixels = width as usize * height as usize;
+    match fourcc {
+        YUYV if width % 2 == 0 => Some(pixels * 2),
+        NV12 if width % 2 == 0 && height % 2 == 0 => Some(pixels + pixels / 2),
+        RGB3 => Some(pixels * 3),
+        RGBA => Some(pixels * 4),
+        _ => None,
+    }
+}
+
+/// A video frame in virtual memory using the same packing rules as
+/// `vaal_load_frame_memory`: stride is derived from the width and planar
+/// formats store their planes back to back.
+#[derive(Debug, Clone, Copy)]
+pub struct Frame<'a> {
+    pub data: &'a [u8],
+    pub fourcc: u32,
+    pub width: i32,
+    pub height: i32,
+}
+
+impl<'a> Frame<'a> {
+    pub fn new(data: &'a [u8], fourcc: u32, width: i32, height: i32) -> Result<Self, Error> {
+        let size = match frame_size(fourcc, width, height) {
+            Some(size) => size,
+            None => {
+                return Err(Error::WrapperError(format!(
+                    "unsupported frame {:08x} {}x{}",
+                    fourcc, width, height
+                )));
+            }
+        };
+        if data.len() < size {
+            return Err(Error::WrapperError(format!(
+                "frame buffer too small: {} < {}",
+                data.len(),
+                size
+            )));
+        }
+        Ok(Frame {
+            data,
+            fourcc,
+            width,
+            height,
+        })
+    }
+}
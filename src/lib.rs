@@ -3,29 +3,129 @@ use std::{
     ffi::{CStr, CString},
     fs::read,
     io,
-    path::Path,
+    path::{Path, PathBuf},
     ptr,
+    sync::Arc,
 };
 use vaal_sys as ffi;
+pub mod batch;
+pub mod cache;
+pub mod capture;
+pub mod classify;
+pub mod control;
+pub mod dataset;
+pub mod device;
+pub mod dmabuf;
 pub mod error;
+pub mod frame;
+pub mod loader;
+mod mmap;
+pub mod multi;
+pub mod mux;
+pub mod parameter;
+pub mod pose;
+pub mod postprocess;
+pub mod preproc;
+pub mod rate;
+pub mod rawvideo;
+pub mod registry;
+pub mod shm;
+pub mod store;
+pub mod swap;
+mod tensor;
+pub mod tracker;
+pub mod view;
+pub mod zones;
 pub use deepviewrt;
+use device::DeviceSelector;
+use dmabuf::{Backing, DmaBufLease};
 pub use error::Error;
-pub use ffi::VAALBox;
+pub use ffi::{VAALBox, VAALEuler, VAALKeypoint};
+use frame::Frame;
+pub use parameter::{ParameterInfo, ParameterProfile, ParameterValue};
+use pose::{EulerBuffer, KeypointBuffer};
+use postprocess::{ClassFilter, Nms};
+use preproc::Preprocessor;
+use std::os::fd::AsRawFd;
+use view::{Element, OutputView};
+use xxhash_rust::xxh3::xxh3_64;
+
+pub const IMAGE_PROC_UNSIGNED_NORM: u32 = 0x0001;
+pub const IMAGE_PROC_WHITENING: u32 = 0x0002;
+pub const IMAGE_PROC_SIGNED_NORM: u32 = 0x0004;
+pub const IMAGE_PROC_IMAGENET: u32 = 0x0008;
+pub const IMAGE_PROC_MIRROR: u32 = 0x1000;
+pub const IMAGE_PROC_FLIP: u32 = 0x2000;
+
 pub fn clock_now() -> i64 {
     unsafe { ffi::vaal_clock_now() }
 }
 
+/// Directory VAAL searches for the models requested by `Context::probe`.
+pub fn model_path() -> Option<PathBuf> {
+    let ret = unsafe { ffi::vaal_model_path() };
+    if ret.is_null() {
+        return None;
+    }
+    let path = unsafe { CStr::from_ptr(ret) };
+    path.to_str().ok().map(PathBuf::from)
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum ModelType {
+    PeopleDetection,
+    FaceDetection,
+    HeadPose,
+    HumanPose,
+}
+
+impl From<ModelType> for ffi::vaal_model_type {
+    fn from(value: ModelType) -> Self {
+        match value {
+            ModelType::PeopleDetection => ffi::vaal_model_type_model_type_people_detection,
+            ModelType::FaceDetection => ffi::vaal_model_type_model_type_face_detection,
+            ModelType::HeadPose => ffi::vaal_model_type_model_type_head_pose,
+            ModelType::HumanPose => ffi::vaal_model_type_model_type_human_pose,
+        }
+    }
+}
+
+/// Device name which selects the fastest device once the model is loaded.
+pub const AUTO_DEVICE: &str = "auto";
+
+/// Hash identifying a model blob in caches, stable across runs and hosts.
+pub fn model_hash(model: &[u8]) -> u64 {
+    xxh3_64(model)
+}
+
+/// A VAAL context running one model on one device.
+///
+/// The class filter and NMS mode set on a context are applied to the boxes
+/// returned by `boxes`.  libvaal still decodes every class before they are
+/// applied: `vaal_set_class_filter` and `vaal_set_nms_type` take a decoder
+/// output tensor which the context does not expose and vaal.h does not
+/// define the NMS type values, so neither is called.  Models with raw box
+/// and score outputs can filter before decoding with `postprocess::Decoder`.
 pub struct Context {
     ptr: *mut ffi::VAALContext,
     dvrt_context: Option<dvrt::context::Context>,
-    model: Vec<u8>,
+    model: Arc<Vec<u8>>,
+    device: String,
+    class_filter: ClassFilter,
+    nms: Nms,
+    nms_iou: f32,
 }
 
 unsafe impl Send for Context {}
 
 impl Context {
+    /// Creates a context on the device, such as `cpu`, `npu` or `gpu:1`.  The
+    /// `auto` device defers the choice to `load_model` which picks the fastest
+    /// device for the model with the default `DeviceSelector`, the context is
+    /// then re-created so parameters should be set after loading the model.
     pub fn new(device: &str) -> Result<Self, Error> {
-        let device_cstring = match CString::new(device.as_bytes()) {
+        let target = if device == AUTO_DEVICE { "cpu" } else { device };
+        let device_cstring = match CString::new(target.as_bytes()) {
             Ok(device_cstring) => device_cstring,
             Err(e) => return Err(Error::WrapperError(e.to_string())),
         };
@@ -37,7 +137,44 @@ impl Context {
         Ok(Context {
             ptr,
             dvrt_context: None,
-            model: Vec::new(),
+            model: Arc::default(),
+            device: device.to_owned(),
+            class_filter: ClassFilter::new(),
+            nms: Nms::PerClass,
+            nms_iou: 0.5,
+        })
+    }
+
+    /// Creates a context on the device loaded with the model of the given type
+    /// found in the `model_path()`.  The model is owned by VAAL so `model()`
+    /// is empty for probed contexts.
+    pub fn probe(device: &str, model_type: ModelType) -> Result<Self, Error> {
+        let device_cstring = match CString::new(device.as_bytes()) {
+            Ok(device_cstring) => device_cstring,
+            Err(e) => return Err(Error::WrapperError(e.to_string())),
+        };
+        let ptr = unsafe { ffi::vaal_model_probe(device_cstring.as_ptr(), model_type.into()) };
+        if ptr.is_null() {
+            return Err(Error::IoError(io::Error::last_os_error().kind()));
+        }
+        if unsafe { ffi::vaal_context_model(ptr) }.is_null() {
+            unsafe { ffi::vaal_context_release(ptr) };
+            return Err(Error::WrapperError(format!(
+                "no {:?} model found in the model path",
+                model_type
+            )));
+        }
+
+        let ret = unsafe { ffi::vaal_context_deepviewrt(ptr) };
+        let dvrt_context = unsafe { dvrt::context::Context::from_ptr(ret as _) }.ok();
+        Ok(Context {
+            ptr,
+            dvrt_context,
+            model: Arc::default(),
+            device: device.to_owned(),
+            class_filter: ClassFilter::new(),
+            nms: Nms::PerClass,
+            nms_iou: 0.5,
         })
     }
 
@@ -57,7 +194,25 @@ impl Context {
         }
     }
 
+    pub fn device(&self) -> &str {
+        &self.device
+    }
+
     pub fn load_model(&mut self, memory: Vec<u8>) -> Result<(), Error> {
+        self.load_model_shared(Arc::new(memory))
+    }
+
+    /// Loads a model blob which may be shared with other contexts, VAAL only
+    /// reads the model memory.
+    pub fn load_model_shared(&mut self, memory: Arc<Vec<u8>>) -> Result<(), Error> {
+        if self.device == AUTO_DEVICE {
+            let choice = DeviceSelector::default().select(&memory)?;
+            let mut context = Context::new(&choice.device)?;
+            context.class_filter = std::mem::take(&mut self.class_filter);
+            context.nms = self.nms;
+            context.nms_iou = self.nms_iou;
+            *self = context;
+        }
         self.model = memory;
 
         let ret = unsafe {
@@ -88,6 +243,36 @@ impl Context {
         self.load_model(model)
     }
 
+    /// Loads an encoded JPEG, PNG, BMP or TIFF image from memory into the
+    /// tensor, or the model's first input when None.
+    pub fn load_image(
+        &mut self,
+        tensor: Option<&mut dvrt::tensor::Tensor>,
+        image: &[u8],
+        roi: Option<&[i32]>,
+        proc: u32,
+    ) -> Result<(), Error> {
+        let tensor_: *mut ffi::NNTensor = if let Some(tensor_) = tensor {
+            tensor_.to_mut_ptr() as *mut ffi::NNTensor
+        } else {
+            std::ptr::null_mut() as *mut ffi::NNTensor
+        };
+
+        let roi_: *const i32 = if let Some(roi_) = roi {
+            roi_.as_ptr()
+        } else {
+            std::ptr::null()
+        };
+
+        let ret = unsafe {
+            ffi::vaal_load_image(self.ptr, tensor_, image.as_ptr(), image.len(), roi_, proc)
+        };
+        if ret != ffi::VAALError_VAAL_SUCCESS {
+            return Err(Error::from(ret));
+        }
+        Ok(())
+    }
+
     pub fn load_image_file(
         &mut self,
         tensor: Option<&mut dvrt::tensor::Tensor>,
@@ -118,7 +303,12 @@ impl Context {
         Ok(())
     }
 
+    /// Reads up to max_len boxes of the last run, after the class filter and
+    /// NMS mode of the context.  The filter runs on the boxes libvaal
+    /// returns, so allow for filtered classes in max_len.
     pub fn boxes(&self, boxes: &mut Vec<VAALBox>, max_len: usize) -> Result<usize, Error> {
+        boxes.clear();
+        boxes.reserve(max_len);
         let mut num_boxes: usize = 0;
         let ret = unsafe {
             ffi::vaal_boxes(
@@ -132,7 +322,95 @@ impl Context {
         if ret != ffi::VAALError_VAAL_SUCCESS {
             return Err(Error::from(ret));
         }
-        Ok(num_boxes)
+        self.filter_boxes(boxes);
+        Ok(boxes.len())
+    }
+
+    fn filter_boxes(&self, boxes: &mut Vec<VAALBox>) {
+        if !self.class_filter.is_empty() {
+            // libvaal already applied its score threshold, classes without
+            // their own threshold keep every box.
+            boxes.retain(|b| {
+                b.label >= 0
+                    && self.class_filter.allows(b.label as usize)
+                    && self
+                        .class_filter
+                        .passes(b.label as usize, b.score, f32::MIN)
+            });
+        }
+        if self.nms == Nms::ClassAgnostic {
+            postprocess::nms(boxes, self.nms_iou, Nms::ClassAgnostic, usize::MAX);
+        }
+    }
+
+    /// Sets the classes and per-class score thresholds `boxes` keeps.
+    pub fn set_class_filter(&mut self, filter: ClassFilter) {
+        self.class_filter = filter;
+    }
+
+    pub fn class_filter(&self) -> &ClassFilter {
+        &self.class_filter
+    }
+
+    /// Sets how boxes of different classes suppress each other.  libvaal
+    /// suppresses per class, class agnostic suppression runs on its output
+    /// with iou_threshold.
+    pub fn set_nms(&mut self, nms: Nms, iou_threshold: f32) {
+        self.nms = nms;
+        self.nms_iou = iou_threshold;
+    }
+
+    pub fn nms(&self) -> Nms {
+        self.nms
+    }
+
+    /// Reads the keypoints of the last run into the buffer, up to its
+    /// capacity, returning the number read.
+    pub fn keypoints(&self, keypoints: &mut KeypointBuffer) -> Result<usize, Error> {
+        self.keypoint_count(keypoints)?;
+        Ok(keypoints.len())
+    }
+
+    /// Reads the keypoints of the last run into the buffer like `keypoints`
+    /// but returns the number VAAL detected, which exceeds the capacity of a
+    /// buffer too small for the frame.  Unlike vaal_boxes, vaal_keypoints does
+    /// not document a counting call with max_keypoints of 0 so the count is
+    /// always taken with the buffer's storage.
+    pub fn keypoint_count(&self, keypoints: &mut KeypointBuffer) -> Result<usize, Error> {
+        let storage = keypoints.storage();
+        let mut num_keypoints: usize = 0;
+        let ret = unsafe {
+            ffi::vaal_keypoints(
+                self.ptr,
+                storage.as_mut_ptr(),
+                storage.len(),
+                &mut num_keypoints as *mut usize,
+            )
+        };
+        if ret != ffi::VAALError_VAAL_SUCCESS {
+            keypoints.clear();
+            return Err(Error::from(ret));
+        }
+        keypoints.set_len(num_keypoints);
+        Ok(num_keypoints)
+    }
+
+    /// Reads the orientation of the last run of a head pose model.
+    pub fn euler(&self, orientations: &mut EulerBuffer) -> Result<usize, Error> {
+        let mut num_orientations: usize = 0;
+        let ret = unsafe {
+            ffi::vaal_euler(
+                self.ptr,
+                orientations.storage().as_mut_ptr(),
+                &mut num_orientations as *mut usize,
+            )
+        };
+        if ret != ffi::VAALError_VAAL_SUCCESS {
+            orientations.clear();
+            return Err(Error::from(ret));
+        }
+        orientations.set_len(num_orientations);
+        Ok(orientations.len())
     }
 
     pub fn model(&self) -> Result<&[u8], Error> {
@@ -182,6 +460,98 @@ impl Context {
         Ok(())
     }
 
+    pub fn load_frame_memory(
+        &self,
+        tensor: Option<&dvrt::tensor::Tensor>,
+        frame: &Frame,
+        roi: Option<&[i32; 4]>,
+        proc: u32,
+    ) -> Result<(), Error> {
+        let frame = Frame::new(frame.data, frame.fourcc, frame.width, frame.height)?;
+        let roi_ = if let Some(roi) = roi {
+            roi.as_ptr()
+        } else {
+            std::ptr::null()
+        };
+
+        let ptr = if let Some(tensor) = tensor {
+            tensor.to_mut_ptr() as *mut ffi::NNTensor
+        } else {
+            ptr::null_mut()
+        };
+        let result = unsafe {
+            ffi::vaal_load_frame_memory(
+                self.ptr,
+                ptr,
+                frame.data.as_ptr() as *const std::ffi::c_void,
+                frame.fourcc,
+                frame.width,
+                frame.height,
+                roi_,
+                proc,
+            )
+        };
+        if result != ffi::VAALError_VAAL_SUCCESS {
+            return Err(Error::from(result));
+        }
+        Ok(())
+    }
+
+    /// Loads the frame held by a lease of a `DmaBufPool::for_frame` pool.
+    /// Memfd backed leases are not dmabufs so are loaded from their mapping.
+    pub fn load_frame_lease(
+        &self,
+        tensor: Option<&dvrt::tensor::Tensor>,
+        lease: &DmaBufLease,
+        roi: Option<&[i32; 4]>,
+        proc: u32,
+    ) -> Result<(), Error> {
+        let (fourcc, width, height) = match lease.format() {
+            Some(format) => format,
+            None => {
+                return Err(Error::WrapperError(
+                    "dmabuf pool has no frame format".to_owned(),
+                ));
+            }
+        };
+        if lease.backing() == Backing::Memfd {
+            let frame = Frame::new(lease.as_slice(), fourcc, width, height)?;
+            return self.load_frame_memory(tensor, &frame, roi, proc);
+        }
+        self.load_frame_dmabuf(
+            tensor,
+            lease.fd().as_raw_fd(),
+            fourcc,
+            width,
+            height,
+            roi,
+            proc,
+        )
+    }
+
+    pub fn load_frame_preproc(
+        &self,
+        preproc: &Preprocessor,
+        tensor: Option<&dvrt::tensor::Tensor>,
+        frame: &Frame,
+        roi: Option<&[i32; 4]>,
+        proc: u32,
+    ) -> Result<(), Error> {
+        match tensor {
+            Some(tensor) => preproc.load_frame(tensor, frame, roi, proc),
+            None => preproc.load_frame(&self.input_tensor(0)?, frame, roi, proc),
+        }
+    }
+
+    pub fn input_tensor(&self, index: usize) -> Result<dvrt::tensor::Tensor, Error> {
+        let inputs = dvrt::model::inputs(self.model()?)?;
+        let layer = match inputs.get(index) {
+            Some(layer) => *layer,
+            None => return Err(Error::WrapperError("invalid input index".to_string())),
+        };
+        Ok(self.dvrt_context_const()?.tensor_index(layer as usize)?)
+    }
+
     pub fn run_model(&self) -> Result<(), Error> {
         let ret = unsafe { ffi::vaal_run_model(self.ptr) };
         if ret != 0 {
@@ -204,6 +574,16 @@ impl Context {
         Some(tensor.unwrap())
     }
 
+    /// Maps output index in place as a slice of T, failing if the tensor
+    /// holds another type.  The view borrows the context so it cannot
+    /// outlive the results of the current run.
+    pub fn output_view<T: Element>(&mut self, index: i32) -> Result<OutputView<'_, T>, Error> {
+        match self.output_tensor(index) {
+            Some(tensor) => OutputView::new(tensor),
+            None => Err(Error::WrapperError(format!("no output tensor {}", index))),
+        }
+    }
+
     pub fn output_count(&self) -> Result<i32, Error> {
         let ret = unsafe { ffi::vaal_output_count(self.ptr) };
         if ret == 0 {
@@ -256,7 +636,195 @@ impl Context {
         }
     }
 
-    pub fn parameter_gets() {}
+    pub fn set_parameter(&self, name: &str, value: &ParameterValue) -> Result<(), Error> {
+        match value {
+            ParameterValue::Str(value) => self.parameter_sets(name, value),
+            ParameterValue::F32(values) => self.parameter_setf(name, values),
+            ParameterValue::I32(values) => self.parameter_seti(name, values),
+            ParameterValue::U32(values) => self.parameter_setu(name, values),
+        }
+    }
+
+    /// Reads the parameter with the getter matching its type, None for types
+    /// which have no `ParameterValue` representation.
+    pub fn parameter(&self, name: &str) -> Result<Option<ParameterValue>, Error> {
+        let info = self.parameter_info(name)?;
+        let value = match info.vaal_type {
+            ffi::VAALType_VAAL_STR => ParameterValue::Str(self.parameter_gets(name)?),
+            ffi::VAALType_VAAL_F32 => ParameterValue::F32(self.parameter_getf(name)?),
+            ffi::VAALType_VAAL_I32 => ParameterValue::I32(self.parameter_geti(name)?),
+            ffi::VAALType_VAAL_U32 => ParameterValue::U32(self.parameter_getu(name)?),
+            _ => return Ok(None),
+        };
+        Ok(Some(value))
+    }
+
+    pub fn parameter_count(&self) -> usize {
+        unsafe { ffi::vaal_parameter_count(self.ptr) }
+    }
+
+    pub fn parameter_name(&self, index: usize) -> Result<String, Error> {
+        let mut name = vec![0u8; 256];
+        let mut length = 0;
+        loop {
+            let ret = unsafe {
+                ffi::vaal_parameter_name(
+                    self.ptr,
+                    index,
+                    name.as_mut_ptr() as *mut std::os::raw::c_char,
+                    name.len(),
+                    &mut length,
+                )
+            };
+            if ret != ffi::VAALError_VAAL_SUCCESS {
+                return Err(Error::from(ret));
+            }
+            if length < name.len() {
+                break;
+            }
+            name.resize(length + 1, 0);
+        }
+        name.truncate(length);
+        match String::from_utf8(name) {
+            Ok(name) => Ok(name),
+            Err(e) => Err(Error::WrapperError(e.to_string())),
+        }
+    }
+
+    pub fn parameter_names(&self) -> Result<Vec<String>, Error> {
+        (0..self.parameter_count())
+            .map(|index| self.parameter_name(index))
+            .collect()
+    }
+
+    pub fn parameter_info(&self, name: &str) -> Result<ParameterInfo, Error> {
+        let name = match CString::new(name) {
+            Ok(name) => name,
+            Err(e) => return Err(Error::WrapperError(e.to_string())),
+        };
+        let mut vaal_type = 0;
+        let mut length = 0;
+        let mut readonly = 0;
+        let ret = unsafe {
+            ffi::vaal_parameter_info(
+                self.ptr,
+                name.as_ptr(),
+                &mut vaal_type,
+                &mut length,
+                &mut readonly,
+            )
+        };
+        if ret != ffi::VAALError_VAAL_SUCCESS {
+            return Err(Error::from(ret));
+        }
+        Ok(ParameterInfo {
+            vaal_type,
+            length,
+            readonly: readonly != 0,
+        })
+    }
+
+    /// Current value of every parameter which can be represented, the
+    /// readonly flag tells which of them can be set.
+    pub fn parameters(&self) -> Result<Vec<(String, ParameterInfo, ParameterValue)>, Error> {
+        let mut parameters = Vec::new();
+        for name in self.parameter_names()? {
+            let info = self.parameter_info(&name)?;
+            if let Some(value) = self.parameter(&name)? {
+                parameters.push((name, info, value));
+            }
+        }
+        Ok(parameters)
+    }
+
+    /// Creates a context on the same device running the same model with the
+    /// same parameters, see `try_clone_on`.
+    pub fn try_clone(&self) -> Result<Self, Error> {
+        self.try_clone_on(&self.device)
+    }
+
+    /// Creates a context on device running the same model blob, shared rather
+    /// than copied, and copies every writable parameter.
+    pub fn try_clone_on(&self, device: &str) -> Result<Self, Error> {
+        if self.model.is_empty() {
+            return Err(Error::WrapperError(String::from("No model available")));
+        }
+        let mut context = Context::new(device)?;
+        context.load_model_shared(self.model.clone())?;
+        for (name, info, value) in self.parameters()? {
+            if !info.readonly {
+                context.set_parameter(&name, &value)?;
+            }
+        }
+        context.class_filter = self.class_filter.clone();
+        context.nms = self.nms;
+        context.nms_iou = self.nms_iou;
+        Ok(context)
+    }
+
+    fn parameter_values<T: Copy + Default>(
+        &self,
+        name: &str,
+        get: unsafe extern "C" fn(
+            *mut ffi::VAALContext,
+            *const std::os::raw::c_char,
+            *mut T,
+            usize,
+            *mut usize,
+        ) -> ffi::VAALError,
+    ) -> Result<Vec<T>, Error> {
+        let length = self.parameter_info(name)?.length;
+        let name = match CString::new(name) {
+            Ok(name) => name,
+            Err(e) => return Err(Error::WrapperError(e.to_string())),
+        };
+        let mut values = vec![T::default(); length];
+        let mut count = 0;
+        let ret = unsafe {
+            get(
+                self.ptr,
+                name.as_ptr(),
+                values.as_mut_ptr(),
+                values.len(),
+                &mut count,
+            )
+        };
+        if ret != ffi::VAALError_VAAL_SUCCESS {
+            return Err(Error::from(ret));
+        }
+        values.truncate(count);
+        Ok(values)
+    }
+
+    pub fn parameter_gets(&self, name: &str) -> Result<String, Error> {
+        let length = self.parameter_info(name)?.length;
+        let name = match CString::new(name) {
+            Ok(name) => name,
+            Err(e) => return Err(Error::WrapperError(e.to_string())),
+        };
+        let mut value = vec![0u8; length + 1];
+        let mut count = 0;
+        let ret = unsafe {
+            ffi::vaal_parameter_gets(
+                self.ptr,
+                name.as_ptr(),
+                value.as_mut_ptr() as *mut std::os::raw::c_char,
+                value.len(),
+                &mut count,
+            )
+        };
+        if ret != ffi::VAALError_VAAL_SUCCESS {
+            return Err(Error::from(ret));
+        }
+        value.truncate(count.min(length));
+        if let Some(end) = value.iter().position(|c| *c == 0) {
+            value.truncate(end);
+        }
+        match String::from_utf8(value) {
+            Ok(value) => Ok(value),
+            Err(e) => Err(Error::WrapperError(e.to_string())),
+        }
+    }
 
     pub fn parameter_sets(&self, name: &str, value: &str) -> Result<(), Error> {
         let len = value.len();
@@ -268,15 +836,16 @@ impl Context {
             Ok(value) => value,
             Err(e) => return Err(Error::WrapperError(e.to_string())),
         };
-        let ret =
-            unsafe { ffi::vaal_parameter_sets(self.ptr, name.into_raw(), value.into_raw(), len) };
+        let ret = unsafe { ffi::vaal_parameter_sets(self.ptr, name.as_ptr(), value.as_ptr(), len) };
         if ret != ffi::VAALError_VAAL_SUCCESS {
             return Err(Error::from(ret));
         }
         Ok(())
     }
 
-    pub fn parameter_getf() {}
+    pub fn parameter_getf(&self, name: &str) -> Result<Vec<f32>, Error> {
+        self.parameter_values(name, ffi::vaal_parameter_getf)
+    }
 
     pub fn parameter_setf(&self, name: &str, value: &[f32]) -> Result<(), Error> {
         let len = value.len();
@@ -284,15 +853,16 @@ impl Context {
             Ok(name) => name,
             Err(e) => return Err(Error::WrapperError(e.to_string())),
         };
-        let ret =
-            unsafe { ffi::vaal_parameter_setf(self.ptr, name.into_raw(), value.as_ptr(), len) };
+        let ret = unsafe { ffi::vaal_parameter_setf(self.ptr, name.as_ptr(), value.as_ptr(), len) };
         if ret != ffi::VAALError_VAAL_SUCCESS {
             return Err(Error::from(ret));
         }
         Ok(())
     }
 
-    pub fn parameter_geti() {}
+    pub fn parameter_geti(&self, name: &str) -> Result<Vec<i32>, Error> {
+        self.parameter_values(name, ffi::vaal_parameter_geti)
+    }
 
     pub fn parameter_seti(&self, name: &str, value: &[i32]) -> Result<(), Error> {
         let len = value.len();
@@ -300,15 +870,16 @@ impl Context {
             Ok(name) => name,
             Err(e) => return Err(Error::WrapperError(e.to_string())),
         };
-        let ret =
-            unsafe { ffi::vaal_parameter_seti(self.ptr, name.into_raw(), value.as_ptr(), len) };
+        let ret = unsafe { ffi::vaal_parameter_seti(self.ptr, name.as_ptr(), value.as_ptr(), len) };
         if ret != ffi::VAALError_VAAL_SUCCESS {
             return Err(Error::from(ret));
         }
         Ok(())
     }
 
-    pub fn parameter_getu() {}
+    pub fn parameter_getu(&self, name: &str) -> Result<Vec<u32>, Error> {
+        self.parameter_values(name, ffi::vaal_parameter_getu)
+    }
 
     pub fn parameter_setu(&self, name: &str, value: &[u32]) -> Result<(), Error> {
         let len = value.len();
@@ -316,8 +887,7 @@ impl Context {
             Ok(name) => name,
             Err(e) => return Err(Error::WrapperError(e.to_string())),
         };
-        let ret =
-            unsafe { ffi::vaal_parameter_setu(self.ptr, name.into_raw(), value.as_ptr(), len) };
+        let ret = unsafe { ffi::vaal_parameter_setu(self.ptr, name.as_ptr(), value.as_ptr(), len) };
         if ret != ffi::VAALError_VAAL_SUCCESS {
             return Err(Error::from(ret));
         }
@@ -330,3 +900,52 @@ impl Drop for Context {
         unsafe { ffi::vaal_context_release(self.ptr) };
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn bbox(label: i32, score: f32, x: f32) -> VAALBox {
+        VAALBox {
+            xmin: x,
+            ymin: 0.0,
+            xmax: x + 0.2,
+            ymax: 0.2,
+            score,
+            label,
+        }
+    }
+
+    #[test]
+    fn boxes_follow_class_filter_and_nms() {
+        let mut context = Context::new("cpu").unwrap();
+        let found = vec![
+            bbox(0, 0.9, 0.0),
+            bbox(1, 0.8, 0.01),
+            bbox(2, 0.7, 0.5),
+            bbox(2, 0.6, 0.8),
+            bbox(-1, 0.85, 0.3),
+        ];
+
+        let mut boxes = found.clone();
+        context.filter_boxes(&mut boxes);
+        assert_eq!(boxes.len(), found.len());
+
+        context.set_class_filter(
+            ClassFilter::new()
+                .with_classes(&[1, 2])
+                .with_threshold(2, 0.65),
+        );
+        let mut boxes = found.clone();
+        context.filter_boxes(&mut boxes);
+        let kept: Vec<_> = boxes.iter().map(|b| (b.label, b.score)).collect();
+        assert_eq!(kept, [(1, 0.8), (2, 0.7)]);
+
+        context.set_class_filter(ClassFilter::new());
+        context.set_nms(Nms::ClassAgnostic, 0.5);
+        let mut boxes = found.clone();
+        context.filter_boxes(&mut boxes);
+        let kept: Vec<_> = boxes.iter().map(|b| (b.label, b.score)).collect();
+        assert_eq!(kept, [(0, 0.9), (-1, 0.85), (2, 0.7), (2, 0.6)]);
+    }
+}
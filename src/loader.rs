@@ -0,0 +1,277 @@
+use crate::{Context, Error, ParameterValue};
+use std::{
+    fs::{self, File},
+    os::fd::AsRawFd,
+    path::{Path, PathBuf},
+    sync::{
+        Mutex,
+        atomic::{AtomicUsize, Ordering},
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+/// One model of a startup manifest.
+#[derive(Debug, Clone, PartialEq)]
+pub struct ModelSpec {
+    pub device: String,
+    pub path: PathBuf,
+    pub parameters: Vec<(String, ParameterValue)>,
+}
+
+impl ModelSpec {
+    pub fn new<P: AsRef<Path>>(device: &str, path: P) -> Self {
+        ModelSpec {
+            device: device.to_owned(),
+            path: path.as_ref().to_owned(),
+            parameters: Vec::new(),
+        }
+    }
+
+    pub fn parameter(mut self, name: &str, value: ParameterValue) -> Self {
+        self.parameters.push((name.to_owned(), value));
+        self
+    }
+}
+
+/// Parses a manifest with one model per line given as the device, the model
+/// path and any parameters as name=value, for example
+///
+/// npu /models/detect.rtm score_threshold=f:0.4 max_detection=i:50
+///
+/// Blank lines and lines starting with # are ignored.
+pub fn parse_manifest(text: &str) -> Result<Vec<ModelSpec>, Error> {
+    let mut specs = Vec::new();
+    for (number, line) in text.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let mut fields = line.split_whitespace();
+        let (device, path) = match (fields.next(), fields.next()) {
+            (Some(device), Some(path)) => (device, path),
+            _ => {
+                return Err(Error::WrapperError(format!(
+                    "manifest line {}: expected device and model path",
+                    number + 1
+                )));
+            }
+        };
+        let mut spec = ModelSpec::new(device, path);
+        for field in fields {
+            let (name, value) = match field.split_once('=') {
+                Some((name, value)) => (name, value.parse()?),
+                None => {
+                    return Err(Error::WrapperError(format!(
+                        "manifest line {}: expected name=value, got {:?}",
+                        number + 1,
+                        field
+                    )));
+                }
+            };
+            spec = spec.parameter(name, value);
+        }
+        specs.push(spec);
+    }
+    Ok(specs)
+}
+
+pub fn load_manifest<P: AsRef<Path>>(path: P) -> Result<Vec<ModelSpec>, Error> {
+    parse_manifest(&fs::read_to_string(path)?)
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct LoadTiming {
+    /// Waiting for a loader thread.
+    pub queued: Duration,
+    pub read: Duration,
+    pub create: Duration,
+    pub load: Duration,
+    pub parameters: Duration,
+}
+
+impl LoadTiming {
+    pub fn total(&self) -> Duration {
+        self.queued + self.read + self.create + self.load + self.parameters
+    }
+}
+
+pub struct Loaded {
+    /// Contexts in manifest order.
+    pub contexts: Vec<Context>,
+    pub timings: Vec<LoadTiming>,
+    pub elapsed: Duration,
+}
+
+/// Loads the models of a manifest concurrently.  Readahead is requested for
+/// every model file up front so the reads overlap with context creation,
+/// then a pool of threads each creates a context, loads a model and applies
+/// its parameters.
+pub struct Loader {
+    pub threads: usize,
+}
+
+impl Default for Loader {
+    fn default() -> Self {
+        Loader {
+            threads: thread::available_parallelism()
+                .map(|n| n.get())
+                .unwrap_or(1),
+        }
+    }
+}
+
+fn readahead(path: &Path) {
+    if let Ok(file) = File::open(path) {
+        unsafe { libc::posix_fadvise(file.as_raw_fd(), 0, 0, libc::POSIX_FADV_WILLNEED) };
+    }
+}
+
+fn load_one(spec: &ModelSpec, timing: &mut LoadTiming) -> Result<Context, Error> {
+    let start = Instant::now();
+    let model = fs::read(&spec.path)?;
+    timing.read = start.elapsed();
+
+    let start = Instant::now();
+    let mut context = Context::new(&spec.device)?;
+    timing.create = start.elapsed();
+
+    let start = Instant::now();
+    context.load_model(model)?;
+    timing.load = start.elapsed();
+
+    let start = Instant::now();
+    for (name, value) in &spec.parameters {
+        context.set_parameter(name, value)?;
+    }
+    timing.parameters = start.elapsed();
+    Ok(context)
+}
+
+impl Loader {
+    pub fn new(threads: usize) -> Self {
+        Loader {
+            threads: threads.max(1),
+        }
+    }
+
+    /// Loads every model of the manifest, failing with the first error
+    /// annotated with the model path.
+    pub fn load(&self, specs: &[ModelSpec]) -> Result<Loaded, Error> {
+        let start = Instant::now();
+        for spec in specs {
+            readahead(&spec.path);
+        }
+
+        let next = AtomicUsize::new(0);
+        let results: Vec<Mutex<Option<Result<Context, Error>>>> =
+            specs.iter().map(|_| Mutex::new(None)).collect();
+        let timings: Vec<Mutex<LoadTiming>> = specs
+            .iter()
+            .map(|_| Mutex::new(LoadTiming::default()))
+            .collect();
+        thread::scope(|scope| {
+            for _ in 0..self.threads.min(specs.len()) {
+                scope.spawn(|| {
+                    loop {
+                        let index = next.fetch_add(1, Ordering::Relaxed);
+                        let spec = match specs.get(index) {
+                            Some(spec) => spec,
+                            None => break,
+                        };
+                        let mut timing = LoadTiming {
+                            queued: start.elapsed(),
+                            ..Default::default()
+                        };
+                        let result = load_one(spec, &mut timing);
+                        *timings[index].lock().unwrap() = timing;
+                        *results[index].lock().unwrap() = Some(result);
+                    }
+                });
+            }
+        });
+
+        let mut contexts = Vec::with_capacity(specs.len());
+        for (spec, result) in specs.iter().zip(results) {
+            match result.into_inner().unwrap() {
+                Some(Ok(context)) => contexts.push(context),
+                Some(Err(e)) => {
+                    return Err(Error::WrapperError(format!(
+                        "{}: {}",
+                        spec.path.display(),
+                        e
+                    )));
+                }
+                None => unreachable!(),
+            }
+        }
+        Ok(Loaded {
+            contexts,
+            timings: timings
+                .into_iter()
+                .map(|t| t.into_inner().unwrap())
+                .collect(),
+            elapsed: start.elapsed(),
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn manifest_lines() {
+        let specs = parse_manifest(
+            "# detector first\n\
+             \n\
+             npu /models/detect.rtm score_threshold=f:0.4 max_detection=i:50\n\
+             \x20 cpu /models/pose.rtm  \n\
+             cpu /models/empty.rtm anchors=f: labels=s:\n",
+        )
+        .unwrap();
+        assert_eq!(
+            specs,
+            [
+                ModelSpec::new("npu", "/models/detect.rtm")
+                    .parameter("score_threshold", ParameterValue::F32(vec![0.4]))
+                    .parameter("max_detection", ParameterValue::I32(vec![50])),
+                ModelSpec::new("cpu", "/models/pose.rtm"),
+                ModelSpec::new("cpu", "/models/empty.rtm")
+                    .parameter("anchors", ParameterValue::F32(vec![]))
+                    .parameter("labels", ParameterValue::Str(String::new())),
+            ]
+        );
+        assert!(parse_manifest("# nothing\n\n").unwrap().is_empty());
+    }
+
+    #[test]
+    fn manifest_errors() {
+        let error = |text: &str| parse_manifest(text).unwrap_err().to_string();
+        assert!(error("cpu /m.rtm\nnpu\n").contains("line 2: expected device and model path"));
+        assert!(error("cpu /m.rtm threshold\n").contains("expected name=value, got \"threshold\""));
+        assert!(error("cpu /m.rtm threshold=0.4\n").contains("type prefix"));
+        assert!(error("cpu /m.rtm threshold=f:0.4,x\n").contains("invalid parameter value \"x\""));
+    }
+
+    #[test]
+    fn loads_in_manifest_order() {
+        let path = std::env::temp_dir().join(format!("vaal-loader-{}", std::process::id()));
+        fs::write(&path, b"model").unwrap();
+        let specs = [
+            ModelSpec::new("cpu", &path),
+            ModelSpec::new("cpu", &path).parameter("anchors", ParameterValue::F32(vec![])),
+        ];
+        let loaded = Loader::new(2).load(&specs).unwrap();
+        assert_eq!(loaded.contexts.len(), 2);
+        assert_eq!(loaded.timings.len(), 2);
+        assert!(Loader::new(2).load(&[]).unwrap().contexts.is_empty());
+
+        let missing = [ModelSpec::new("cpu", path.with_extension("missing"))];
+        match Loader::new(1).load(&missing) {
+            Err(e) => assert!(e.to_string().contains("missing")),
+            Ok(_) => panic!("loaded a missing model"),
+        }
+        fs::remove_file(&path).unwrap();
+    }
+}
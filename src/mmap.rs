@@ -0,0 +1,68 @@
+use crate::Error;
+use std::{io, os::fd::RawFd, ptr, slice};
+
+/// Owned memory mapping which is unmapped on drop.  Empty mappings are
+/// represented without calling mmap as the kernel refuses zero lengths.
+pub(crate) struct Mmap {
+    ptr: *mut u8,
+    len: usize,
+}
+
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    pub fn map(fd: RawFd, len: usize, writable: bool) -> Result<Self, Error> {
+        if len == 0 {
+            return Ok(Mmap {
+                ptr: ptr::NonNull::dangling().as_ptr(),
+                len: 0,
+            });
+        }
+        let prot = if writable {
+            libc::PROT_READ | libc::PROT_WRITE
+        } else {
+            libc::PROT_READ
+        };
+        let ptr = unsafe { libc::mmap(ptr::null_mut(), len, prot, libc::MAP_SHARED, fd, 0) };
+        if ptr == libc::MAP_FAILED {
+            return Err(Error::from(io::Error::last_os_error()));
+        }
+        Ok(Mmap {
+            ptr: ptr as *mut u8,
+            len,
+        })
+    }
+
+    /// Applies madvise to the pages covering offset..offset+len.
+    pub fn advise(&self, offset: usize, len: usize, advice: libc::c_int) {
+        let end = (offset + len).min(self.len);
+        let page = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+        let start = offset / page * page;
+        if start < end {
+            unsafe {
+                libc::madvise(
+                    self.ptr.add(start) as *mut libc::c_void,
+                    end - start,
+                    advice,
+                )
+            };
+        }
+    }
+
+    pub fn as_ptr(&self) -> *mut u8 {
+        self.ptr
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+        }
+    }
+}
@@ -0,0 +1,225 @@
+use crate::{
+    Context, Error,
+    dmabuf::DmaBufLease,
+    frame::Frame,
+    preproc::Preprocessor,
+    tensor::{vaal_type, with_bytes, with_bytes_mut},
+};
+use vaal_sys as ffi;
+
+/// Everything which determines the bytes pre-processing writes into an input
+/// tensor, quantized inputs must also agree on their scales and zero points.
+#[derive(Debug, PartialEq, Eq)]
+struct InputKey {
+    shape: Vec<i32>,
+    vaal_type: ffi::VAALType,
+    scales: Vec<u32>,
+    zeros: Vec<i32>,
+    proc: u32,
+}
+
+impl InputKey {
+    fn new(context: &Context, proc: u32) -> Result<Self, Error> {
+        let input = context.input_tensor(0)?;
+        Ok(InputKey {
+            shape: input.shape().to_vec(),
+            vaal_type: vaal_type(&input),
+            scales: input.scales().iter().map(|s| s.to_bits()).collect(),
+            zeros: input.zeros().to_vec(),
+            proc,
+        })
+    }
+}
+
+struct Group {
+    key: InputKey,
+    /// Indices into the runner's contexts, the first loads the frame.
+    members: Vec<usize>,
+}
+
+/// Runs several models on the same frame, pre-processing once per group of
+/// models with identical input shape, type and proc flags.  The first context
+/// of a group loads the frame and its input tensor is copied into the inputs
+/// of the others, replacing a colorspace conversion and resize per model with
+/// a memcpy.
+#[derive(Default)]
+pub struct MultiRunner {
+    contexts: Vec<Context>,
+    groups: Vec<Group>,
+}
+
+impl MultiRunner {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Adds a context with a loaded model which will be fed frames using the
+    /// proc flags, returning its index.
+    pub fn add(&mut self, context: Context, proc: u32) -> Result<usize, Error> {
+        let key = InputKey::new(&context, proc)?;
+        let index = self.contexts.len();
+        self.join(key, index);
+        self.contexts.push(context);
+        Ok(index)
+    }
+
+    /// Adds the context index to the group of its key, opening a new group
+    /// for a key not seen before.
+    fn join(&mut self, key: InputKey, index: usize) {
+        match self.groups.iter_mut().find(|group| group.key == key) {
+            Some(group) => group.members.push(index),
+            None => self.groups.push(Group {
+                key,
+                members: vec![index],
+            }),
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.contexts.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.contexts.is_empty()
+    }
+
+    /// Number of pre-processing passes per frame.
+    pub fn groups(&self) -> usize {
+        self.groups.len()
+    }
+
+    pub fn context(&self, index: usize) -> Option<&Context> {
+        self.contexts.get(index)
+    }
+
+    pub fn context_mut(&mut self, index: usize) -> Option<&mut Context> {
+        self.contexts.get_mut(index)
+    }
+
+    pub fn contexts(&self) -> &[Context] {
+        &self.contexts
+    }
+
+    /// Loads the input of each group leader with load and copies it to the
+    /// other members of the group.
+    fn load(&self, load: impl Fn(&Context, u32) -> Result<(), Error>) -> Result<(), Error> {
+        for group in &self.groups {
+            let leader = &self.contexts[group.members[0]];
+            load(leader, group.key.proc)?;
+            if group.members.len() == 1 {
+                continue;
+            }
+
+            let input = leader.input_tensor(0)?;
+            with_bytes(&input, |_, src| -> Result<(), Error> {
+                for index in &group.members[1..] {
+                    let dst = self.contexts[*index].input_tensor(0)?;
+                    with_bytes_mut(&dst, |_, dst| {
+                        if dst.len() != src.len() {
+                            return Err(Error::WrapperError(format!(
+                                "input size mismatch: {} != {}",
+                                dst.len(),
+                                src.len()
+                            )));
+                        }
+                        dst.copy_from_slice(src);
+                        Ok(())
+                    })??;
+                }
+                Ok(())
+            })??;
+        }
+        Ok(())
+    }
+
+    pub fn load_frame_dmabuf(
+        &self,
+        handle: i32,
+        fourcc: u32,
+        width: i32,
+        height: i32,
+        roi: Option<&[i32; 4]>,
+    ) -> Result<(), Error> {
+        self.load(|context, proc| {
+            context.load_frame_dmabuf(None, handle, fourcc, width, height, roi, proc)
+        })
+    }
+
+    pub fn load_frame_memory(&self, frame: &Frame, roi: Option<&[i32; 4]>) -> Result<(), Error> {
+        self.load(|context, proc| context.load_frame_memory(None, frame, roi, proc))
+    }
+
+    pub fn load_frame_lease(
+        &self,
+        lease: &DmaBufLease,
+        roi: Option<&[i32; 4]>,
+    ) -> Result<(), Error> {
+        self.load(|context, proc| context.load_frame_lease(None, lease, roi, proc))
+    }
+
+    pub fn load_frame_preproc(
+        &self,
+        preproc: &Preprocessor,
+        frame: &Frame,
+        roi: Option<&[i32; 4]>,
+    ) -> Result<(), Error> {
+        self.load(|context, proc| context.load_frame_preproc(preproc, None, frame, roi, proc))
+    }
+
+    /// Runs every model on the currently loaded frame.
+    pub fn run(&self) -> Result<(), Error> {
+        for context in &self.contexts {
+            context.run_model()?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{IMAGE_PROC_MIRROR, IMAGE_PROC_UNSIGNED_NORM};
+
+    fn key(shape: &[i32], vaal_type: ffi::VAALType, scale: f32, proc: u32) -> InputKey {
+        InputKey {
+            shape: shape.to_vec(),
+            vaal_type,
+            scales: vec![scale.to_bits()],
+            zeros: vec![0],
+            proc,
+        }
+    }
+
+    #[test]
+    fn identical_inputs_share_a_group() {
+        let (u8, i8) = (ffi::VAALType_VAAL_U8, ffi::VAALType_VAAL_I8);
+        let mut runner = MultiRunner::new();
+        let keys = [
+            key(&[1, 224, 224, 3], u8, 1.0, 0),
+            key(&[1, 224, 224, 3], u8, 1.0, 0),
+            key(&[1, 320, 320, 3], u8, 1.0, 0),
+            key(&[1, 224, 224, 3], i8, 1.0, 0),
+            key(&[1, 224, 224, 3], u8, 0.5, 0),
+            key(&[1, 224, 224, 3], u8, 1.0, IMAGE_PROC_MIRROR),
+            key(&[1, 320, 320, 3], u8, 1.0, 0),
+            key(&[1, 224, 224, 3], u8, 1.0, IMAGE_PROC_UNSIGNED_NORM),
+        ];
+        for (index, key) in keys.into_iter().enumerate() {
+            runner.join(key, index);
+        }
+        let members: Vec<_> = runner.groups.iter().map(|g| g.members.clone()).collect();
+        assert_eq!(
+            members,
+            [vec![0, 1], vec![2, 6], vec![3], vec![4], vec![5], vec![7]]
+        );
+        assert_eq!(runner.groups(), 6);
+    }
+
+    #[test]
+    fn context_without_model_rejected() {
+        let mut runner = MultiRunner::new();
+        assert!(runner.add(Context::new("cpu").unwrap(), 0).is_err());
+        assert!(runner.is_empty());
+        assert_eq!(runner.groups(), 0);
+    }
+}
@@ -0,0 +1,493 @@
+use crate::Error;
+use std::{
+    collections::{BTreeMap, VecDeque},
+    panic::{self, AssertUnwindSafe},
+    sync::{Arc, Condvar, Mutex},
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+/// Virtual time a stream of weight 1 advances per dispatched frame.
+const STRIDE: u64 = 1 << 20;
+
+#[derive(Debug, Clone, Copy)]
+pub struct StreamConfig {
+    /// Relative share of the contexts when streams compete.
+    pub weight: u32,
+    /// Frames of the stream which may be running at once.
+    pub max_in_flight: usize,
+    /// Frames waiting for a context before the oldest is dropped.
+    pub max_queued: usize,
+}
+
+impl Default for StreamConfig {
+    fn default() -> Self {
+        StreamConfig {
+            weight: 1,
+            max_in_flight: 1,
+            max_queued: 2,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct StreamStats {
+    pub submitted: u64,
+    pub completed: u64,
+    pub dropped: u64,
+    pub errors: u64,
+    pub latency_total: Duration,
+    pub latency_max: Duration,
+}
+
+impl StreamStats {
+    pub fn latency_mean(&self) -> Duration {
+        match self.completed {
+            0 => Duration::ZERO,
+            n => self.latency_total.div_f64(n as f64),
+        }
+    }
+}
+
+/// Result of a frame in submission order, latency covers queueing and
+/// processing.
+pub struct StreamOutput<R> {
+    pub seq: u64,
+    pub latency: Duration,
+    pub result: Result<R, Error>,
+}
+
+struct Job<T> {
+    stream: usize,
+    seq: u64,
+    submitted: Instant,
+    frame: T,
+}
+
+struct Stream<T, R> {
+    config: StreamConfig,
+    queue: VecDeque<Job<T>>,
+    in_flight: usize,
+    pass: u64,
+    next_seq: u64,
+    /// Next sequence number to hand back, completed frames wait here until
+    /// every earlier frame completed or was dropped.  Dropped frames are
+    /// stored as None.
+    next_out: u64,
+    reorder: BTreeMap<u64, Option<StreamOutput<R>>>,
+    ready: VecDeque<StreamOutput<R>>,
+    stats: StreamStats,
+}
+
+impl<T, R> Stream<T, R> {
+    fn finish(&mut self, seq: u64, output: Option<StreamOutput<R>>) {
+        self.reorder.insert(seq, output);
+        while let Some(output) = self.reorder.remove(&self.next_out) {
+            if let Some(output) = output {
+                self.ready.push_back(output);
+            }
+            self.next_out += 1;
+        }
+    }
+
+    fn eligible(&self) -> bool {
+        !self.queue.is_empty() && self.in_flight < self.config.max_in_flight
+    }
+}
+
+struct State<T, R> {
+    streams: Vec<Stream<T, R>>,
+    queued: usize,
+    closed: bool,
+}
+
+impl<T, R> State<T, R> {
+    /// Stride scheduling: the eligible stream which has received the least
+    /// weighted service goes next.
+    fn pick(&mut self) -> Option<Job<T>> {
+        let stream = self
+            .streams
+            .iter_mut()
+            .filter(|stream| stream.eligible())
+            .min_by_key(|stream| stream.pass)?;
+        stream.pass += STRIDE / stream.config.weight.max(1) as u64;
+        stream.in_flight += 1;
+        self.queued -= 1;
+        stream.queue.pop_front()
+    }
+}
+
+struct Shared<T, R> {
+    state: Mutex<State<T, R>>,
+    work: Condvar,
+    done: Condvar,
+}
+
+/// Dispatches frames from many streams to a pool of worker threads each
+/// owning a `Context`, or any other per-worker state.  Streams share the
+/// workers in proportion to their weights, a stream which falls behind loses
+/// its oldest queued frames and results are handed back per stream in
+/// submission order.
+pub struct Multiplexer<T, R> {
+    shared: Arc<Shared<T, R>>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl<T: Send + 'static, R: Send + 'static> Multiplexer<T, R> {
+    /// Starts one worker per context, process runs a frame on the worker's
+    /// context and returns its result.  A panic in process is the frame's
+    /// error result and the worker carries on with the next frame.
+    pub fn new<C, F>(contexts: Vec<C>, process: F) -> Self
+    where
+        C: Send + 'static,
+        F: Fn(&C, &T) -> Result<R, Error> + Send + Sync + 'static,
+    {
+        let shared = Arc::new(Shared {
+            state: Mutex::new(State {
+                streams: Vec::new(),
+                queued: 0,
+                closed: false,
+            }),
+            work: Condvar::new(),
+            done: Condvar::new(),
+        });
+        let process = Arc::new(process);
+        let workers = contexts
+            .into_iter()
+            .map(|context| {
+                let shared = shared.clone();
+                let process = process.clone();
+                thread::spawn(move || worker(context, &shared, &*process))
+            })
+            .collect();
+        Multiplexer { shared, workers }
+    }
+
+    /// Registers a stream, returning its id.
+    pub fn add_stream(&self, config: StreamConfig) -> usize {
+        let mut state = self.shared.state.lock().unwrap();
+        // Start level with the least served stream so a new stream cannot
+        // claim the service it missed.
+        let pass = state.streams.iter().map(|s| s.pass).min().unwrap_or(0);
+        state.streams.push(Stream {
+            config,
+            queue: VecDeque::new(),
+            in_flight: 0,
+            pass,
+            next_seq: 0,
+            next_out: 0,
+            reorder: BTreeMap::new(),
+            ready: VecDeque::new(),
+            stats: StreamStats::default(),
+        });
+        state.streams.len() - 1
+    }
+
+    /// Queues a frame for the stream and returns its sequence number.  When
+    /// the stream already has max_queued frames waiting the oldest is dropped.
+    pub fn submit(&self, stream: usize, frame: T) -> Result<u64, Error> {
+        let mut state = self.shared.state.lock().unwrap();
+        if state.closed {
+            return Err(Error::WrapperError("multiplexer is closed".to_owned()));
+        }
+        let idle = state
+            .streams
+            .iter()
+            .filter(|s| s.eligible())
+            .map(|s| s.pass)
+            .min();
+        let s = match state.streams.get_mut(stream) {
+            Some(s) => s,
+            None => return Err(Error::WrapperError(format!("invalid stream {}", stream))),
+        };
+        // A stream returning from idle resumes at the current virtual time.
+        if s.queue.is_empty() {
+            if let Some(pass) = idle {
+                s.pass = s.pass.max(pass);
+            }
+        }
+
+        let seq = s.next_seq;
+        s.next_seq += 1;
+        s.stats.submitted += 1;
+        s.queue.push_back(Job {
+            stream,
+            seq,
+            submitted: Instant::now(),
+            frame,
+        });
+        let mut dropped = 0;
+        while s.queue.len() > s.config.max_queued.max(1) {
+            let job = s.queue.pop_front().unwrap();
+            s.stats.dropped += 1;
+            s.finish(job.seq, None);
+            dropped += 1;
+        }
+        state.queued = state.queued + 1 - dropped;
+        self.shared.work.notify_one();
+        if dropped > 0 {
+            self.shared.done.notify_all();
+        }
+        Ok(seq)
+    }
+
+    /// Returns the next in-order result of the stream if it is available.
+    pub fn try_recv(&self, stream: usize) -> Option<StreamOutput<R>> {
+        let mut state = self.shared.state.lock().unwrap();
+        state.streams.get_mut(stream)?.ready.pop_front()
+    }
+
+    /// Waits up to timeout for the next in-order result of the stream.
+    pub fn recv_timeout(&self, stream: usize, timeout: Duration) -> Option<StreamOutput<R>> {
+        let deadline = Instant::now() + timeout;
+        let mut state = self.shared.state.lock().unwrap();
+        loop {
+            if let Some(output) = state.streams.get_mut(stream)?.ready.pop_front() {
+                return Some(output);
+            }
+            let now = Instant::now();
+            if now >= deadline {
+                return None;
+            }
+            state = self
+                .shared
+                .done
+                .wait_timeout(state, deadline - now)
+                .unwrap()
+                .0;
+        }
+    }
+
+    pub fn stats(&self, stream: usize) -> Option<StreamStats> {
+        let state = self.shared.state.lock().unwrap();
+        state.streams.get(stream).map(|s| s.stats)
+    }
+
+    /// Frames of the stream waiting for or running on a context.
+    pub fn pending(&self, stream: usize) -> usize {
+        let state = self.shared.state.lock().unwrap();
+        state
+            .streams
+            .get(stream)
+            .map_or(0, |s| s.queue.len() + s.in_flight)
+    }
+}
+
+impl<T, R> Multiplexer<T, R> {
+    /// Stops accepting frames and waits for the queued ones to finish, the
+    /// remaining results can still be received.
+    pub fn close(&mut self) {
+        self.shared.state.lock().unwrap().closed = true;
+        self.shared.work.notify_all();
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+impl<T, R> Drop for Multiplexer<T, R> {
+    fn drop(&mut self) {
+        self.close();
+    }
+}
+
+fn worker<C, T, R>(
+    context: C,
+    shared: &Shared<T, R>,
+    process: &(dyn Fn(&C, &T) -> Result<R, Error> + Send + Sync),
+) {
+    loop {
+        let job = {
+            let mut state = shared.state.lock().unwrap();
+            loop {
+                if let Some(job) = state.pick() {
+                    break job;
+                }
+                if state.closed && state.queued == 0 {
+                    return;
+                }
+                state = shared.work.wait(state).unwrap();
+            }
+        };
+
+        // Every picked job must reach finish, or in_flight stays raised and
+        // the stream's later results wait behind it forever.
+        let result = panic::catch_unwind(AssertUnwindSafe(|| process(&context, &job.frame)))
+            .unwrap_or_else(|_| Err(Error::WrapperError("frame processing panicked".to_owned())));
+        drop(job.frame);
+
+        let mut state = shared.state.lock().unwrap();
+        let stream = &mut state.streams[job.stream];
+        let latency = job.submitted.elapsed();
+        stream.in_flight -= 1;
+        stream.stats.completed += 1;
+        if result.is_err() {
+            stream.stats.errors += 1;
+        }
+        stream.stats.latency_total += latency;
+        stream.stats.latency_max = stream.stats.latency_max.max(latency);
+        stream.finish(
+            job.seq,
+            Some(StreamOutput {
+                seq: job.seq,
+                latency,
+                result,
+            }),
+        );
+        // Completing a frame may make its stream eligible again.
+        shared.work.notify_one();
+        shared.done.notify_all();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::mpsc;
+
+    fn stream(index: usize, weight: u32, jobs: u64) -> Stream<u64, ()> {
+        Stream {
+            config: StreamConfig {
+                weight,
+                max_in_flight: usize::MAX,
+                max_queued: usize::MAX,
+            },
+            queue: (0..jobs)
+                .map(|seq| Job {
+                    stream: index,
+                    seq,
+                    submitted: Instant::now(),
+                    frame: seq,
+                })
+                .collect(),
+            in_flight: 0,
+            pass: 0,
+            next_seq: jobs,
+            next_out: 0,
+            reorder: BTreeMap::new(),
+            ready: VecDeque::new(),
+            stats: StreamStats::default(),
+        }
+    }
+
+    #[test]
+    fn stride_shares_follow_weights() {
+        let mut state = State {
+            streams: vec![stream(0, 1, 1000), stream(1, 3, 1000), stream(2, 1, 1000)],
+            queued: 3000,
+            closed: false,
+        };
+        let mut picks = [0; 3];
+        for _ in 0..500 {
+            picks[state.pick().unwrap().stream] += 1;
+        }
+        assert_eq!(picks, [100, 300, 100]);
+    }
+
+    #[test]
+    fn stride_skips_streams_at_in_flight_limit() {
+        let mut busy = stream(0, 100, 10);
+        busy.config.max_in_flight = 2;
+        let mut state = State {
+            streams: vec![busy, stream(1, 1, 10)],
+            queued: 20,
+            closed: false,
+        };
+        for _ in 0..12 {
+            state.pick().unwrap();
+        }
+        assert_eq!(state.streams[0].in_flight, 2);
+        assert_eq!(state.streams[1].in_flight, 10);
+        assert!(state.pick().is_none());
+    }
+
+    #[test]
+    fn results_delivered_in_order() {
+        // Later frames finish first so only the reorder buffer keeps order.
+        let mut mux = Multiplexer::new(vec![(); 3], |_, frame: &u64| {
+            thread::sleep(Duration::from_millis(30 - frame % 3 * 10));
+            Ok(*frame * 2)
+        });
+        let stream = mux.add_stream(StreamConfig {
+            weight: 1,
+            max_in_flight: 3,
+            max_queued: 100,
+        });
+        for frame in 0..30 {
+            assert_eq!(mux.submit(stream, frame).unwrap(), frame);
+        }
+        mux.close();
+
+        let mut seqs = Vec::new();
+        while let Some(output) = mux.try_recv(stream) {
+            assert_eq!(output.result.unwrap(), output.seq * 2);
+            seqs.push(output.seq);
+        }
+        assert_eq!(seqs, (0..30).collect::<Vec<_>>());
+        let stats = mux.stats(stream).unwrap();
+        assert_eq!((stats.completed, stats.dropped), (30, 0));
+        assert!(mux.submit(stream, 0).is_err());
+    }
+
+    #[test]
+    fn oldest_frames_dropped() {
+        let (started_tx, started) = mpsc::channel();
+        let (release, release_rx) = mpsc::channel::<()>();
+        let (started_tx, release_rx) = (Mutex::new(started_tx), Mutex::new(release_rx));
+        let mut mux = Multiplexer::new(vec![()], move |_, frame: &u64| {
+            started_tx.lock().unwrap().send(*frame).unwrap();
+            release_rx.lock().unwrap().recv().unwrap();
+            Ok(*frame)
+        });
+        let stream = mux.add_stream(StreamConfig {
+            weight: 1,
+            max_in_flight: 1,
+            max_queued: 2,
+        });
+
+        mux.submit(stream, 0).unwrap();
+        assert_eq!(started.recv().unwrap(), 0);
+        // Frame 0 holds the only context, 1 and 2 are pushed out by 3 and 4.
+        for frame in 1..5 {
+            mux.submit(stream, frame).unwrap();
+        }
+        assert_eq!(mux.pending(stream), 3);
+        for _ in 0..3 {
+            release.send(()).unwrap();
+        }
+        mux.close();
+
+        let frames: Vec<_> = std::iter::from_fn(|| mux.try_recv(stream))
+            .map(|output| output.result.unwrap())
+            .collect();
+        assert_eq!(frames, [0, 3, 4]);
+        let stats = mux.stats(stream).unwrap();
+        assert_eq!((stats.submitted, stats.completed, stats.dropped), (5, 3, 2));
+    }
+
+    #[test]
+    fn panicking_frame_is_an_error() {
+        let mut mux = Multiplexer::new(vec![()], |_, frame: &u64| {
+            if *frame == 1 {
+                panic!("frame {}", frame);
+            }
+            Ok(*frame)
+        });
+        let stream = mux.add_stream(StreamConfig {
+            weight: 1,
+            max_in_flight: 1,
+            max_queued: 10,
+        });
+        for frame in 0..3 {
+            mux.submit(stream, frame).unwrap();
+        }
+        let results: Vec<_> = (0..3)
+            .map(|_| mux.recv_timeout(stream, Duration::from_secs(10)).unwrap())
+            .map(|output| output.result.ok())
+            .collect();
+        assert_eq!(results, [Some(0), None, Some(2)]);
+        assert_eq!(mux.pending(stream), 0);
+        assert_eq!(mux.stats(stream).unwrap().errors, 1);
+        mux.close();
+    }
+}
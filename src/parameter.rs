@@ -0,0 +1,336 @@
+use crate::{Context, Error};
+use std::{collections::BTreeMap, fmt, fs, path::Path, str::FromStr};
+use vaal_sys as ffi;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ParameterInfo {
+    pub vaal_type: ffi::VAALType,
+    /// Number of elements.
+    pub length: usize,
+    pub readonly: bool,
+}
+
+/// Value of a context parameter.  The text form prefixes the type, s:text,
+/// f:0.5,0.25, i:-1,2 or u:3, as used by loader manifests.
+#[derive(Debug, Clone, PartialEq)]
+pub enum ParameterValue {
+    Str(String),
+    F32(Vec<f32>),
+    I32(Vec<i32>),
+    U32(Vec<u32>),
+}
+
+/// Parses comma separated values, empty text is an empty list as written by
+/// `Display` for a parameter without elements.
+fn parse_list<T: FromStr>(text: &str) -> Result<Vec<T>, Error> {
+    if text.trim().is_empty() {
+        return Ok(Vec::new());
+    }
+    text.split(',')
+        .map(|v| {
+            v.trim()
+                .parse()
+                .map_err(|_| Error::WrapperError(format!("invalid parameter value {:?}", v)))
+        })
+        .collect()
+}
+
+fn write_list<T: fmt::Display>(f: &mut fmt::Formatter<'_>, values: &[T]) -> fmt::Result {
+    for (i, v) in values.iter().enumerate() {
+        if i > 0 {
+            write!(f, ",")?;
+        }
+        write!(f, "{}", v)?;
+    }
+    Ok(())
+}
+
+impl FromStr for ParameterValue {
+    type Err = Error;
+
+    fn from_str(text: &str) -> Result<Self, Error> {
+        match text.split_once(':') {
+            Some(("s", value)) => Ok(ParameterValue::Str(value.to_owned())),
+            Some(("f", value)) => Ok(ParameterValue::F32(parse_list(value)?)),
+            Some(("i", value)) => Ok(ParameterValue::I32(parse_list(value)?)),
+            Some(("u", value)) => Ok(ParameterValue::U32(parse_list(value)?)),
+            _ => Err(Error::WrapperError(format!(
+                "parameter value {:?} needs a s:, f:, i: or u: type prefix",
+                text
+            ))),
+        }
+    }
+}
+
+impl fmt::Display for ParameterValue {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            ParameterValue::Str(value) => write!(f, "s:{}", value),
+            ParameterValue::F32(values) => {
+                write!(f, "f:")?;
+                write_list(f, values)
+            }
+            ParameterValue::I32(values) => {
+                write!(f, "i:")?;
+                write_list(f, values)
+            }
+            ParameterValue::U32(values) => {
+                write!(f, "u:")?;
+                write_list(f, values)
+            }
+        }
+    }
+}
+
+impl ParameterValue {
+    /// Whether the value can be written to a parameter of the VAAL type.
+    pub fn matches(&self, vaal_type: ffi::VAALType) -> bool {
+        matches!(
+            (self, vaal_type),
+            (ParameterValue::Str(_), ffi::VAALType_VAAL_STR)
+                | (ParameterValue::F32(_), ffi::VAALType_VAAL_F32)
+                | (ParameterValue::I32(_), ffi::VAALType_VAAL_I32)
+                | (ParameterValue::U32(_), ffi::VAALType_VAAL_U32)
+        )
+    }
+}
+
+/// Named set of parameter values such as a day or night configuration.  The
+/// text form has one name=value line per parameter using the typed value
+/// form of `ParameterValue`, blank lines and lines starting with # are
+/// ignored.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct ParameterProfile {
+    values: BTreeMap<String, ParameterValue>,
+}
+
+impl ParameterProfile {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Captures the current value of every writable parameter of the context.
+    pub fn from_context(context: &Context) -> Result<Self, Error> {
+        let values = context
+            .parameters()?
+            .into_iter()
+            .filter(|(_, info, _)| !info.readonly)
+            .map(|(name, _, value)| (name, value))
+            .collect();
+        Ok(ParameterProfile { values })
+    }
+
+    pub fn parse(text: &str) -> Result<Self, Error> {
+        let mut profile = ParameterProfile::new();
+        for (number, line) in text.lines().enumerate() {
+            let line = line.trim();
+            if line.is_empty() || line.starts_with('#') {
+                continue;
+            }
+            match line.split_once('=') {
+                Some((name, value)) => profile.set(name.trim(), value.trim().parse()?),
+                None => {
+                    return Err(Error::WrapperError(format!(
+                        "profile line {}: expected name=value",
+                        number + 1
+                    )));
+                }
+            }
+        }
+        Ok(profile)
+    }
+
+    pub fn load<P: AsRef<Path>>(path: P) -> Result<Self, Error> {
+        Self::parse(&fs::read_to_string(path)?)
+    }
+
+    pub fn save<P: AsRef<Path>>(&self, path: P) -> Result<(), Error> {
+        fs::write(path, self.to_string())?;
+        Ok(())
+    }
+
+    pub fn set(&mut self, name: &str, value: ParameterValue) {
+        self.values.insert(name.to_owned(), value);
+    }
+
+    pub fn get(&self, name: &str) -> Option<&ParameterValue> {
+        self.values.get(name)
+    }
+
+    pub fn remove(&mut self, name: &str) -> Option<ParameterValue> {
+        self.values.remove(name)
+    }
+
+    pub fn len(&self) -> usize {
+        self.values.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.values.is_empty()
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (&str, &ParameterValue)> {
+        self.values
+            .iter()
+            .map(|(name, value)| (name.as_str(), value))
+    }
+
+    /// Checks that every parameter exists on the context's model, is writable
+    /// and has a matching type and length, so applying cannot fail half way.
+    pub fn validate(&self, context: &Context) -> Result<(), Error> {
+        for (name, value) in &self.values {
+            let info = match context.parameter_info(name) {
+                Ok(info) => info,
+                Err(e) => return Err(Error::WrapperError(format!("{}: {}", name, e))),
+            };
+            if info.readonly {
+                return Err(Error::WrapperError(format!("{} is read only", name)));
+            }
+            if !value.matches(info.vaal_type) {
+                return Err(Error::WrapperError(format!(
+                    "{} is VAAL type {} but the profile holds {}",
+                    name, info.vaal_type, value
+                )));
+            }
+            let len = match value {
+                ParameterValue::Str(_) => 0,
+                ParameterValue::F32(v) => v.len(),
+                ParameterValue::I32(v) => v.len(),
+                ParameterValue::U32(v) => v.len(),
+            };
+            if info.length > 0 && len > info.length {
+                return Err(Error::WrapperError(format!(
+                    "{} holds {} values but the profile has {}",
+                    name, info.length, len
+                )));
+            }
+        }
+        Ok(())
+    }
+
+    /// Values of this profile which differ from snapshot.
+    pub fn diff<'a>(
+        &'a self,
+        snapshot: &'a ParameterProfile,
+    ) -> impl Iterator<Item = (&'a str, &'a ParameterValue)> + 'a {
+        self.iter()
+            .filter(move |(name, value)| snapshot.get(name) != Some(*value))
+    }
+
+    /// Writes the values which differ from snapshot, the known state of the
+    /// context, and updates snapshot.  Keeping the snapshot with the context
+    /// avoids reading parameters back, a repeated apply writes nothing.
+    pub fn apply_diff(
+        &self,
+        context: &Context,
+        snapshot: &mut ParameterProfile,
+    ) -> Result<usize, Error> {
+        let mut written = 0;
+        for (name, value) in &self.values {
+            if snapshot.get(name) == Some(value) {
+                continue;
+            }
+            context.set_parameter(name, value)?;
+            snapshot.set(name, value.clone());
+            written += 1;
+        }
+        Ok(written)
+    }
+
+    /// Writes the values which differ from the context's current values,
+    /// returning how many were written.
+    pub fn apply(&self, context: &Context) -> Result<usize, Error> {
+        let mut written = 0;
+        for (name, value) in &self.values {
+            if context.parameter(name)?.as_ref() == Some(value) {
+                continue;
+            }
+            context.set_parameter(name, value)?;
+            written += 1;
+        }
+        Ok(written)
+    }
+}
+
+impl fmt::Display for ParameterProfile {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        for (name, value) in &self.values {
+            writeln!(f, "{}={}", name, value)?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn empty_lists_round_trip() {
+        for text in ["f:", "i:", "u:", "s:"] {
+            let value: ParameterValue = text.parse().unwrap();
+            assert_eq!(value.to_string(), text);
+        }
+        assert!("f:1,".parse::<ParameterValue>().is_err());
+    }
+
+    #[test]
+    fn profile_round_trips_through_file() {
+        let context = Context::new("cpu").unwrap();
+        let mut profile = ParameterProfile::from_context(&context).unwrap();
+        profile.set("score_threshold", ParameterValue::F32(vec![0.25, 1e-7]));
+        profile.set("anchors", ParameterValue::F32(Vec::new()));
+        profile.set("max_detection", ParameterValue::I32(vec![-1, 50]));
+        profile.set("classes", ParameterValue::U32(Vec::new()));
+        profile.set("labels", ParameterValue::Str("person,car".to_owned()));
+        profile.set("empty", ParameterValue::Str(String::new()));
+
+        let path = std::env::temp_dir().join(format!("vaal-profile-{}", std::process::id()));
+        profile.save(&path).unwrap();
+        let loaded = ParameterProfile::load(&path);
+        std::fs::remove_file(&path).unwrap();
+        assert_eq!(loaded.unwrap(), profile);
+    }
+
+    fn profile(score: f32, boxes: i32, labels: &str) -> ParameterProfile {
+        let mut profile = ParameterProfile::new();
+        profile.set("score_threshold", ParameterValue::F32(vec![score]));
+        profile.set("max_detection", ParameterValue::I32(vec![boxes]));
+        profile.set("labels", ParameterValue::Str(labels.to_owned()));
+        profile
+    }
+
+    #[test]
+    fn diff_lists_changed_values() {
+        let day = profile(0.5, 50, "person");
+        let night = profile(0.3, 50, "person");
+        let changed: Vec<_> = night.diff(&day).collect();
+        assert_eq!(
+            changed,
+            [("score_threshold", &ParameterValue::F32(vec![0.3]))]
+        );
+        assert_eq!(day.diff(&day).count(), 0);
+        assert_eq!(day.diff(&ParameterProfile::new()).count(), day.len());
+    }
+
+    #[test]
+    fn apply_diff_writes_only_changes() {
+        let context = Context::new("cpu").unwrap();
+        let day = profile(0.5, 50, "person");
+        let night = profile(0.3, 20, "person");
+
+        let mut snapshot = ParameterProfile::new();
+        assert_eq!(day.apply_diff(&context, &mut snapshot).unwrap(), 3);
+        assert_eq!(snapshot, day);
+        assert_eq!(day.apply_diff(&context, &mut snapshot).unwrap(), 0);
+        assert_eq!(night.apply_diff(&context, &mut snapshot).unwrap(), 2);
+        assert_eq!(snapshot, night);
+
+        // Values outside the profile are kept in the snapshot.
+        let mut partial = ParameterProfile::new();
+        partial.set("iou_threshold", ParameterValue::F32(vec![0.45]));
+        assert_eq!(partial.apply_diff(&context, &mut snapshot).unwrap(), 1);
+        assert_eq!(snapshot.len(), 4);
+        assert_eq!(snapshot.get("max_detection"), night.get("max_detection"));
+    }
+}
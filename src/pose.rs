@@ -0,0 +1,322 @@
+use crate::{Context, Error, VAALBox, VAALEuler, VAALKeypoint};
+use std::ops::Deref;
+
+const NO_KEYPOINT: VAALKeypoint = VAALKeypoint {
+    x: 0.0,
+    y: 0.0,
+    score: 0.0,
+};
+
+const NO_BOX: VAALBox = VAALBox {
+    xmin: 0.0,
+    ymin: 0.0,
+    xmax: 0.0,
+    ymax: 0.0,
+    score: 0.0,
+    label: 0,
+};
+
+/// Fixed capacity keypoint storage for `Context::keypoints`, allocated once
+/// and reused for every frame.
+#[derive(Debug, Clone)]
+pub struct KeypointBuffer {
+    keypoints: Vec<VAALKeypoint>,
+    len: usize,
+}
+
+impl KeypointBuffer {
+    pub fn new(capacity: usize) -> Self {
+        KeypointBuffer {
+            keypoints: vec![NO_KEYPOINT; capacity],
+            len: 0,
+        }
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.keypoints.len()
+    }
+
+    pub fn clear(&mut self) {
+        self.len = 0;
+    }
+
+    /// Full storage for vaal_keypoints, the caller sets the length after.
+    pub(crate) fn storage(&mut self) -> &mut [VAALKeypoint] {
+        &mut self.keypoints
+    }
+
+    pub(crate) fn set_len(&mut self, len: usize) {
+        self.len = len.min(self.keypoints.len());
+    }
+}
+
+impl Deref for KeypointBuffer {
+    type Target = [VAALKeypoint];
+
+    fn deref(&self) -> &[VAALKeypoint] {
+        &self.keypoints[..self.len]
+    }
+}
+
+/// Storage for `Context::euler`.  vaal_euler takes no capacity and returns a
+/// single orientation, so the buffer holds exactly one.
+#[derive(Debug, Clone)]
+pub struct EulerBuffer {
+    orientations: [VAALEuler; 1],
+    len: usize,
+}
+
+impl Default for EulerBuffer {
+    fn default() -> Self {
+        EulerBuffer {
+            orientations: [VAALEuler {
+                yaw: 0.0,
+                pitch: 0.0,
+                roll: 0.0,
+            }],
+            len: 0,
+        }
+    }
+}
+
+impl EulerBuffer {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn clear(&mut self) {
+        self.len = 0;
+    }
+
+    pub(crate) fn storage(&mut self) -> &mut [VAALEuler; 1] {
+        &mut self.orientations
+    }
+
+    pub(crate) fn set_len(&mut self, len: usize) {
+        self.len = len.min(self.orientations.len());
+    }
+}
+
+impl Deref for EulerBuffer {
+    type Target = [VAALEuler];
+
+    fn deref(&self) -> &[VAALEuler] {
+        &self.orientations[..self.len]
+    }
+}
+
+/// One person of a pose result with its K keypoints stored inline, so a
+/// slice of people is a single contiguous block.
+#[derive(Debug, Clone, Copy)]
+pub struct Person<const K: usize> {
+    pub bbox: VAALBox,
+    pub keypoints: [VAALKeypoint; K],
+    pub pose: Option<VAALEuler>,
+}
+
+/// Bounds of the keypoints with a positive score, scored with their mean.
+fn keypoint_box(keypoints: &[VAALKeypoint]) -> VAALBox {
+    let mut bbox = VAALBox {
+        xmin: f32::MAX,
+        ymin: f32::MAX,
+        xmax: f32::MIN,
+        ymax: f32::MIN,
+        score: 0.0,
+        label: 0,
+    };
+    let mut count = 0;
+    for keypoint in keypoints.iter().filter(|k| k.score > 0.0) {
+        bbox.xmin = bbox.xmin.min(keypoint.x);
+        bbox.ymin = bbox.ymin.min(keypoint.y);
+        bbox.xmax = bbox.xmax.max(keypoint.x);
+        bbox.ymax = bbox.ymax.max(keypoint.y);
+        bbox.score += keypoint.score;
+        count += 1;
+    }
+    if count == 0 {
+        return NO_BOX;
+    }
+    bbox.score /= count as f32;
+    bbox
+}
+
+/// Reads boxes, keypoints and Euler angles of a pose model into per-person
+/// results of K keypoints each.  All buffers are sized for max_people up
+/// front so reading a frame does not allocate.  Person i pairs box i, the
+/// i-th group of K keypoints and orientation i, a person without a box gets
+/// the bounds of its keypoints.
+pub struct PoseResults<const K: usize> {
+    /// Read person boxes with vaal_boxes.
+    pub read_boxes: bool,
+    /// Read head orientations with vaal_euler.
+    pub read_euler: bool,
+    boxes: Vec<VAALBox>,
+    keypoints: KeypointBuffer,
+    euler: EulerBuffer,
+    people: Vec<Person<K>>,
+}
+
+impl<const K: usize> PoseResults<K> {
+    pub fn new(max_people: usize) -> Self {
+        PoseResults {
+            read_boxes: true,
+            read_euler: false,
+            boxes: Vec::with_capacity(max_people),
+            keypoints: KeypointBuffer::new(max_people * K),
+            euler: EulerBuffer::new(),
+            people: Vec::with_capacity(max_people),
+        }
+    }
+
+    pub fn max_people(&self) -> usize {
+        self.people.capacity()
+    }
+
+    pub fn people(&self) -> &[Person<K>] {
+        &self.people
+    }
+
+    /// Reads the results of the last `run_model` on context.
+    pub fn update(&mut self, context: &Context) -> Result<&[Person<K>], Error> {
+        let max_people = self.max_people();
+        self.boxes.clear();
+        if self.read_boxes {
+            context.boxes(&mut self.boxes, max_people)?;
+        }
+        self.keypoints.clear();
+        if K > 0 {
+            context.keypoints(&mut self.keypoints)?;
+        }
+        self.euler.clear();
+        if self.read_euler {
+            context.euler(&mut self.euler)?;
+        }
+        self.group();
+        Ok(&self.people)
+    }
+
+    /// Pairs the boxes, keypoint groups and orientations read into people.
+    fn group(&mut self) {
+        let max_people = self.max_people();
+        let count = if K > 0 { self.keypoints.len() / K } else { 0 }
+            .max(self.boxes.len())
+            .max(self.euler.len())
+            .min(max_people);
+        self.people.clear();
+        for i in 0..count {
+            let mut keypoints = [NO_KEYPOINT; K];
+            if let Some(group) = self.keypoints.get(i * K..i * K + K) {
+                keypoints.copy_from_slice(group);
+            }
+            let bbox = match self.boxes.get(i) {
+                Some(bbox) => *bbox,
+                None => keypoint_box(&keypoints),
+            };
+            self.people.push(Person {
+                bbox,
+                keypoints,
+                pose: self.euler.get(i).copied(),
+            });
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn keypoint(x: f32, y: f32, score: f32) -> VAALKeypoint {
+        VAALKeypoint { x, y, score }
+    }
+
+    fn bounds(b: &VAALBox) -> [f32; 5] {
+        [b.xmin, b.ymin, b.xmax, b.ymax, b.score]
+    }
+
+    #[test]
+    fn keypoint_box_skips_unscored() {
+        let keypoints = [
+            keypoint(0.2, 0.5, 0.5),
+            keypoint(9.0, 9.0, 0.0),
+            keypoint(0.6, 0.1, 1.0),
+        ];
+        assert_eq!(
+            bounds(&keypoint_box(&keypoints)),
+            [0.2, 0.1, 0.6, 0.5, 0.75]
+        );
+        assert_eq!(bounds(&keypoint_box(&keypoints[1..2])), bounds(&NO_BOX));
+        assert_eq!(bounds(&keypoint_box(&[])), bounds(&NO_BOX));
+    }
+
+    #[test]
+    fn buffers_clamp_to_capacity() {
+        let mut keypoints = KeypointBuffer::new(4);
+        keypoints.storage()[1] = keypoint(1.0, 2.0, 0.5);
+        keypoints.set_len(9);
+        assert_eq!(keypoints.len(), 4);
+        assert_eq!(keypoints[1].y, 2.0);
+        keypoints.clear();
+        assert!(keypoints.is_empty());
+        assert_eq!(keypoints.capacity(), 4);
+
+        let mut euler = EulerBuffer::new();
+        euler.storage()[0].yaw = 0.5;
+        euler.set_len(3);
+        assert_eq!(euler.len(), 1);
+        assert_eq!(euler[0].yaw, 0.5);
+        euler.clear();
+        assert!(euler.is_empty());
+    }
+
+    #[test]
+    fn people_pair_boxes_keypoints_and_pose() {
+        let mut results = PoseResults::<2>::new(3);
+        let bbox = VAALBox {
+            xmin: 0.0,
+            ymin: 0.0,
+            xmax: 1.0,
+            ymax: 1.0,
+            score: 0.9,
+            label: 0,
+        };
+        results.boxes.push(bbox);
+        // Two people of keypoints, the first with a box and an orientation.
+        let storage = results.keypoints.storage();
+        storage[0] = keypoint(0.1, 0.1, 1.0);
+        storage[1] = keypoint(0.2, 0.2, 1.0);
+        storage[2] = keypoint(0.3, 0.4, 0.5);
+        storage[3] = keypoint(0.5, 0.6, 0.5);
+        results.keypoints.set_len(4);
+        results.euler.storage()[0].pitch = 0.25;
+        results.euler.set_len(1);
+        results.group();
+
+        let people = results.people();
+        assert_eq!(people.len(), 2);
+        assert_eq!(bounds(&people[0].bbox), bounds(&bbox));
+        assert_eq!(people[0].keypoints[1].x, 0.2);
+        assert_eq!(people[0].pose.map(|pose| pose.pitch), Some(0.25));
+        assert_eq!(bounds(&people[1].bbox), [0.3, 0.4, 0.5, 0.6, 0.5]);
+        assert!(people[1].pose.is_none());
+
+        // A trailing partial group is dropped, extra boxes become people
+        // without keypoints, and nothing goes past max_people.
+        results.keypoints.set_len(3);
+        results.boxes.extend([bbox; 3]);
+        results.group();
+        let people = results.people();
+        assert_eq!(people.len(), 3);
+        assert_eq!(people[1].keypoints[0].score, 0.0);
+        assert_eq!(bounds(&people[2].bbox), bounds(&bbox));
+    }
+
+    #[test]
+    fn update_reads_empty_results() {
+        let context = Context::new("cpu").unwrap();
+        let mut results = PoseResults::<17>::new(4);
+        results.read_euler = true;
+        assert!(results.update(&context).unwrap().is_empty());
+        let mut keypoints = KeypointBuffer::new(17);
+        assert_eq!(context.keypoint_count(&mut keypoints).unwrap(), 0);
+    }
+}
@@ -0,0 +1,458 @@
+use crate::{Error, VAALBox};
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum BoxFormat {
+    /// xmin, ymin, xmax, ymax
+    Xyxy,
+    /// ymin, xmin, ymax, xmax as produced by TensorFlow detection models.
+    Yxyx,
+    /// center x, center y, width, height
+    Cxcywh,
+}
+
+pub fn iou(a: &VAALBox, b: &VAALBox) -> f32 {
+    let w = (a.xmax.min(b.xmax) - a.xmin.max(b.xmin)).max(0.0);
+    let h = (a.ymax.min(b.ymax) - a.ymin.max(b.ymin)).max(0.0);
+    let inter = w * h;
+    let union =
+        (a.xmax - a.xmin) * (a.ymax - a.ymin) + (b.xmax - b.xmin) * (b.ymax - b.ymin) - inter;
+    if union <= 0.0 { 0.0 } else { inter / union }
+}
+
+/// Which boxes suppress each other during non-maximum suppression.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Hash)]
+pub enum Nms {
+    /// Boxes only suppress boxes of the same class.
+    #[default]
+    PerClass,
+    /// Boxes suppress overlapping boxes of any class.
+    ClassAgnostic,
+}
+
+/// Greedy non-maximum suppression over boxes sorted by descending score,
+/// boxes of different labels never suppress each other unless class
+/// agnostic.
+pub fn nms(boxes: &mut Vec<VAALBox>, iou_threshold: f32, mode: Nms, max_boxes: usize) {
+    boxes.sort_unstable_by(|a, b| b.score.total_cmp(&a.score));
+    let mut keep = 0;
+    for i in 0..boxes.len() {
+        if keep >= max_boxes {
+            break;
+        }
+        let candidate = boxes[i];
+        let suppressed = boxes[..keep].iter().any(|kept| {
+            (mode == Nms::ClassAgnostic || kept.label == candidate.label)
+                && iou(kept, &candidate) > iou_threshold
+        });
+        if !suppressed {
+            boxes[keep] = candidate;
+            keep += 1;
+        }
+    }
+    boxes.truncate(keep);
+}
+
+/// Class allow-list and per-class score thresholds.  The allow-list is kept
+/// sorted without duplicates so every class is decoded at most once.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct ClassFilter {
+    classes: Option<Vec<usize>>,
+    thresholds: Vec<Option<f32>>,
+}
+
+impl ClassFilter {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Keeps only the given classes, None keeps every class.
+    pub fn set_classes(&mut self, classes: Option<&[usize]>) {
+        self.classes = classes.map(|classes| {
+            let mut classes = classes.to_vec();
+            classes.sort_unstable();
+            classes.dedup();
+            classes
+        });
+    }
+
+    pub fn with_classes(mut self, classes: &[usize]) -> Self {
+        self.set_classes(Some(classes));
+        self
+    }
+
+    /// Sorted allowed classes, None when every class is allowed.
+    pub fn classes(&self) -> Option<&[usize]> {
+        self.classes.as_deref()
+    }
+
+    /// Overrides the score threshold of a class, None restores the default.
+    pub fn set_threshold(&mut self, class: usize, threshold: Option<f32>) {
+        if self.thresholds.len() <= class {
+            if threshold.is_none() {
+                return;
+            }
+            self.thresholds.resize(class + 1, None);
+        }
+        self.thresholds[class] = threshold;
+    }
+
+    pub fn with_threshold(mut self, class: usize, threshold: f32) -> Self {
+        self.set_threshold(class, Some(threshold));
+        self
+    }
+
+    /// Classes below which thresholds may be set.
+    pub fn threshold_count(&self) -> usize {
+        self.thresholds.len()
+    }
+
+    pub fn threshold(&self, class: usize) -> Option<f32> {
+        self.thresholds.get(class).copied().flatten()
+    }
+
+    /// Whether the filter allows every class with the default threshold.
+    pub fn is_empty(&self) -> bool {
+        self.classes.is_none() && self.thresholds.iter().all(Option::is_none)
+    }
+
+    pub fn allows(&self, class: usize) -> bool {
+        match &self.classes {
+            Some(classes) => classes.binary_search(&class).is_ok(),
+            None => true,
+        }
+    }
+
+    /// Whether a score of the class passes, default is the threshold of
+    /// classes without their own.
+    #[inline]
+    pub fn passes(&self, class: usize, score: f32, default: f32) -> bool {
+        score >= self.threshold(class).unwrap_or(default)
+    }
+}
+
+/// Rust decoder for models which output decoded boxes [N, 4] and class scores
+/// [N, C], the layout used by the SSD and YOLO style decoders of vaal_boxes.
+/// Candidates are collected in the output buffer so decoding does not allocate
+/// once the buffer has grown.
+pub struct Decoder {
+    pub score_threshold: f32,
+    /// Classes to decode and their score thresholds.  Scores of classes
+    /// outside the allow-list are never read and their boxes never built.
+    pub filter: ClassFilter,
+    pub iou_threshold: f32,
+    pub max_boxes: usize,
+    pub box_format: BoxFormat,
+    pub nms: Nms,
+}
+
+impl Default for Decoder {
+    fn default() -> Self {
+        Decoder {
+            score_threshold: 0.5,
+            filter: ClassFilter::new(),
+            iou_threshold: 0.5,
+            max_boxes: 100,
+            box_format: BoxFormat::Xyxy,
+            nms: Nms::PerClass,
+        }
+    }
+}
+
+impl Decoder {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Decodes only the given classes, see `ClassFilter`.
+    pub fn with_classes(mut self, classes: &[usize]) -> Self {
+        self.filter.set_classes(Some(classes));
+        self
+    }
+
+    pub fn with_class_threshold(mut self, class: usize, threshold: f32) -> Self {
+        self.filter.set_threshold(class, Some(threshold));
+        self
+    }
+
+    fn make_box(&self, coords: &[f32], score: f32, label: usize) -> VAALBox {
+        let (xmin, ymin, xmax, ymax) = match self.box_format {
+            BoxFormat::Xyxy => (coords[0], coords[1], coords[2], coords[3]),
+            BoxFormat::Yxyx => (coords[1], coords[0], coords[3], coords[2]),
+            BoxFormat::Cxcywh => (
+                coords[0] - coords[2] * 0.5,
+                coords[1] - coords[3] * 0.5,
+                coords[0] + coords[2] * 0.5,
+                coords[1] + coords[3] * 0.5,
+            ),
+        };
+        VAALBox {
+            xmin,
+            ymin,
+            xmax,
+            ymax,
+            score,
+            label: label as i32,
+        }
+    }
+
+    /// Decodes boxes above the score threshold followed by NMS into output,
+    /// returning the number of boxes.
+    pub fn decode(
+        &self,
+        boxes: &[f32],
+        scores: &[f32],
+        num_classes: usize,
+        output: &mut Vec<VAALBox>,
+    ) -> Result<usize, Error> {
+        if num_classes == 0 || !scores.len().is_multiple_of(num_classes) {
+            return Err(Error::WrapperError("invalid score tensor shape".to_owned()));
+        }
+        let anchors = scores.len() / num_classes;
+        if boxes.len() < anchors * 4 {
+            return Err(Error::WrapperError(format!(
+                "box tensor too small for {} anchors",
+                anchors
+            )));
+        }
+
+        output.clear();
+        match self.filter.classes() {
+            Some(classes) => {
+                if let Some(label) = classes.iter().find(|label| **label >= num_classes) {
+                    return Err(Error::WrapperError(format!(
+                        "class {} out of range for {} classes",
+                        label, num_classes
+                    )));
+                }
+                for (anchor, class_scores) in scores.chunks_exact(num_classes).enumerate() {
+                    for label in classes {
+                        let score = class_scores[*label];
+                        if self.filter.passes(*label, score, self.score_threshold) {
+                            let coords = &boxes[anchor * 4..anchor * 4 + 4];
+                            output.push(self.make_box(coords, score, *label));
+                        }
+                    }
+                }
+            }
+            None => {
+                for (anchor, class_scores) in scores.chunks_exact(num_classes).enumerate() {
+                    for (label, score) in class_scores.iter().enumerate() {
+                        if self.filter.passes(label, *score, self.score_threshold) {
+                            let coords = &boxes[anchor * 4..anchor * 4 + 4];
+                            output.push(self.make_box(coords, *score, label));
+                        }
+                    }
+                }
+            }
+        }
+        nms(output, self.iou_threshold, self.nms, self.max_boxes);
+        Ok(output.len())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const CLASSES: usize = 8;
+
+    fn random(state: &mut u64) -> f32 {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        (*state >> 40) as f32 / (1u64 << 24) as f32
+    }
+
+    /// Overlapping boxes with scores spread over all classes.
+    fn outputs(anchors: usize) -> (Vec<f32>, Vec<f32>) {
+        let mut state = 0x2545_f491_4f6c_dd1d;
+        let mut boxes = Vec::new();
+        for _ in 0..anchors {
+            let (x, y) = (random(&mut state) * 0.5, random(&mut state) * 0.5);
+            boxes.extend([x, y, x + 0.3, y + 0.3]);
+        }
+        let scores = (0..anchors * CLASSES).map(|_| random(&mut state)).collect();
+        (boxes, scores)
+    }
+
+    fn key(b: &VAALBox) -> (i32, u32, [u32; 4]) {
+        (
+            b.label,
+            b.score.to_bits(),
+            [b.xmin, b.ymin, b.xmax, b.ymax].map(f32::to_bits),
+        )
+    }
+
+    fn decode(decoder: &Decoder, boxes: &[f32], scores: &[f32]) -> Vec<(i32, u32, [u32; 4])> {
+        let mut output = Vec::new();
+        decoder.decode(boxes, scores, CLASSES, &mut output).unwrap();
+        let mut keys: Vec<_> = output.iter().map(key).collect();
+        keys.sort_unstable();
+        keys
+    }
+
+    #[test]
+    fn filtered_decode_matches_restricted_decode() {
+        let (boxes, scores) = outputs(200);
+        let all = Decoder {
+            max_boxes: usize::MAX,
+            ..Decoder::default()
+        };
+        let classes = [1, 4, 6];
+        let filtered = Decoder {
+            max_boxes: usize::MAX,
+            ..Decoder::default()
+        }
+        .with_classes(&classes);
+
+        let expected: Vec<_> = decode(&all, &boxes, &scores)
+            .into_iter()
+            .filter(|(label, _, _)| classes.contains(&(*label as usize)))
+            .collect();
+        assert!(!expected.is_empty());
+        assert_eq!(decode(&filtered, &boxes, &scores), expected);
+    }
+
+    #[test]
+    fn duplicate_classes_decode_once() {
+        let (boxes, scores) = outputs(50);
+        let once = Decoder::new().with_classes(&[2, 5]);
+        let repeated = Decoder::new().with_classes(&[5, 2, 5, 2, 2]);
+        assert_eq!(repeated.filter.classes(), Some(&[2, 5][..]));
+        assert_eq!(
+            decode(&repeated, &boxes, &scores),
+            decode(&once, &boxes, &scores)
+        );
+    }
+
+    #[test]
+    fn out_of_range_class_rejected() {
+        let (boxes, scores) = outputs(4);
+        let decoder = Decoder::new().with_classes(&[1, CLASSES]);
+        let mut output = Vec::new();
+        assert!(
+            decoder
+                .decode(&boxes, &scores, CLASSES, &mut output)
+                .is_err()
+        );
+    }
+
+    #[test]
+    fn class_thresholds_fall_back_to_default() {
+        let mut filter = ClassFilter::new().with_threshold(3, 0.9);
+        assert_eq!(filter.threshold(3), Some(0.9));
+        assert_eq!(filter.threshold(2), None);
+        assert_eq!(filter.threshold(100), None);
+        assert!(!filter.passes(3, 0.8, 0.5));
+        assert!(filter.passes(2, 0.8, 0.5));
+        assert!(filter.passes(100, 0.5, 0.5));
+        filter.set_threshold(3, None);
+        assert!(filter.passes(3, 0.8, 0.5));
+        assert!(filter.is_empty());
+        filter.set_threshold(50, None);
+        assert!(filter.is_empty());
+
+        // A single anchor scoring 0.8 for every class.
+        let boxes = [0.1, 0.1, 0.5, 0.5];
+        let scores = [0.8; CLASSES];
+        let decoder = Decoder::new()
+            .with_class_threshold(3, 0.9)
+            .with_class_threshold(5, 0.2);
+        let labels: Vec<_> = decode(&decoder, &boxes, &scores)
+            .into_iter()
+            .map(|(label, _, _)| label)
+            .collect();
+        assert_eq!(labels, [0, 1, 2, 4, 5, 6, 7]);
+    }
+
+    fn bbox(label: i32, score: f32, x: f32) -> VAALBox {
+        VAALBox {
+            xmin: x,
+            ymin: 0.0,
+            xmax: x + 1.0,
+            ymax: 1.0,
+            score,
+            label,
+        }
+    }
+
+    #[test]
+    fn box_formats_convert_to_xyxy() {
+        let scores = [0.9];
+        let expected = (0, 0.9f32.to_bits(), [0.1, 0.2, 0.5, 0.8].map(f32::to_bits));
+        for (format, coords) in [
+            (BoxFormat::Xyxy, [0.1, 0.2, 0.5, 0.8]),
+            (BoxFormat::Yxyx, [0.2, 0.1, 0.8, 0.5]),
+            (BoxFormat::Cxcywh, [0.3, 0.5, 0.4, 0.6]),
+        ] {
+            let decoder = Decoder {
+                box_format: format,
+                ..Decoder::default()
+            };
+            let mut output = Vec::new();
+            decoder.decode(&coords, &scores, 1, &mut output).unwrap();
+            let got = key(&output[0]);
+            assert_eq!((got.0, got.1), (expected.0, expected.1));
+            for (g, e) in got.2.iter().zip(expected.2) {
+                let (g, e) = (f32::from_bits(*g), f32::from_bits(e));
+                assert!((g - e).abs() < 1e-6, "{:?}: {} != {}", format, g, e);
+            }
+        }
+    }
+
+    #[test]
+    fn nms_modes() {
+        // Two overlapping boxes of different classes and a duplicate of the
+        // first one with a lower score.
+        let input = [bbox(0, 0.9, 0.0), bbox(1, 0.8, 0.1), bbox(0, 0.7, 0.05)];
+        let labels = |mode| {
+            let mut boxes = input.to_vec();
+            nms(&mut boxes, 0.5, mode, usize::MAX);
+            boxes.iter().map(|b| (b.label, b.score)).collect::<Vec<_>>()
+        };
+        assert_eq!(labels(Nms::PerClass), [(0, 0.9), (1, 0.8)]);
+        assert_eq!(labels(Nms::ClassAgnostic), [(0, 0.9)]);
+
+        // Disjoint boxes all survive either way.
+        let mut boxes = vec![bbox(0, 0.5, 0.0), bbox(1, 0.6, 5.0), bbox(0, 0.7, 10.0)];
+        nms(&mut boxes, 0.5, Nms::ClassAgnostic, usize::MAX);
+        let scores: Vec<_> = boxes.iter().map(|b| b.score).collect();
+        assert_eq!(scores, [0.7, 0.6, 0.5]);
+    }
+
+    #[test]
+    fn max_boxes_keeps_highest_scores() {
+        let mut boxes: Vec<_> = (0..10)
+            .map(|i| bbox(0, i as f32 / 10.0, i as f32 * 2.0))
+            .collect();
+        nms(&mut boxes, 0.5, Nms::PerClass, 3);
+        let scores: Vec<_> = boxes.iter().map(|b| b.score).collect();
+        assert_eq!(scores, [0.9, 0.8, 0.7]);
+
+        let (boxes, scores) = outputs(200);
+        let decoder = Decoder {
+            max_boxes: 5,
+            ..Decoder::default()
+        };
+        let mut output = Vec::new();
+        assert_eq!(
+            decoder
+                .decode(&boxes, &scores, CLASSES, &mut output)
+                .unwrap(),
+            5
+        );
+        let unlimited = Decoder {
+            max_boxes: usize::MAX,
+            ..Decoder::default()
+        };
+        let mut all = Vec::new();
+        unlimited
+            .decode(&boxes, &scores, CLASSES, &mut all)
+            .unwrap();
+        assert!(all.len() > 5);
+        assert_eq!(
+            output.iter().map(key).collect::<Vec<_>>(),
+            all[..5].iter().map(key).collect::<Vec<_>>()
+        );
+    }
+}
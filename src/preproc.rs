@@ -0,0 +1,905 @@
+use crate::{
+    Error, IMAGE_PROC_FLIP, IMAGE_PROC_IMAGENET, IMAGE_PROC_MIRROR, IMAGE_PROC_SIGNED_NORM,
+    IMAGE_PROC_UNSIGNED_NORM, IMAGE_PROC_WHITENING,
+    frame::{Frame, NV12, RGB3, RGBA, YUYV},
+};
+use deepviewrt as dvrt;
+use std::{
+    collections::HashMap,
+    sync::{Arc, Mutex},
+    thread,
+};
+
+const IMAGENET_MEAN: [f32; 3] = [0.485, 0.456, 0.406];
+const IMAGENET_STD: [f32; 3] = [0.229, 0.224, 0.225];
+const MIN_BAND_ROWS: usize = 16;
+const NORMALIZATIONS: u32 =
+    IMAGE_PROC_WHITENING | IMAGE_PROC_IMAGENET | IMAGE_PROC_SIGNED_NORM | IMAGE_PROC_UNSIGNED_NORM;
+
+/// Destination of the pre-processed image, an interleaved RGB (HWC) buffer.
+/// Normalizations only apply to F32 outputs, U8 receives the raw pixels and
+/// I8 the raw pixels shifted by -128, requesting one for them is an error.
+pub enum Output<'a> {
+    F32(&'a mut [f32]),
+    U8(&'a mut [u8]),
+    I8(&'a mut [i8]),
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct TableKey {
+    src_width: i32,
+    src_height: i32,
+    dst_width: usize,
+    dst_height: usize,
+    roi: [i32; 4],
+    mirror: bool,
+    flip: bool,
+}
+
+struct Axis {
+    lo: Vec<u32>,
+    hi: Vec<u32>,
+    weight: Vec<f32>,
+}
+
+impl Axis {
+    fn new(offset: i32, length: i32, dst: usize, reverse: bool) -> Self {
+        let scale = length as f32 / dst as f32;
+        let last = (length - 1) as f32;
+        let mut axis = Axis {
+            lo: Vec::with_capacity(dst),
+            hi: Vec::with_capacity(dst),
+            weight: Vec::with_capacity(dst),
+        };
+        for i in 0..dst {
+            let d = if reverse { dst - 1 - i } else { i };
+            let s = ((d as f32 + 0.5) * scale - 0.5).clamp(0.0, last);
+            let lo = s.floor();
+            let hi = (lo + 1.0).min(last);
+            axis.lo.push((lo as i32 + offset) as u32);
+            axis.hi.push((hi as i32 + offset) as u32);
+            axis.weight.push(s - lo);
+        }
+        axis
+    }
+}
+
+/// Per-channel scale and offset applied to the 0..255 RGB values, every
+/// normalization other than whitening reduces to one.
+struct Affine {
+    mul: [f32; 3],
+    add: [f32; 3],
+}
+
+impl Affine {
+    const IDENTITY: Affine = Affine {
+        mul: [1.0; 3],
+        add: [0.0; 3],
+    };
+
+    fn normalization(proc: u32) -> Self {
+        if proc & IMAGE_PROC_IMAGENET != 0 {
+            let mut affine = Affine::IDENTITY;
+            for c in 0..3 {
+                affine.mul[c] = 1.0 / (255.0 * IMAGENET_STD[c]);
+                affine.add[c] = -IMAGENET_MEAN[c] / IMAGENET_STD[c];
+            }
+            affine
+        } else if proc & IMAGE_PROC_SIGNED_NORM != 0 {
+            Affine {
+                mul: [1.0 / 127.5; 3],
+                add: [-1.0; 3],
+            }
+        } else if proc & IMAGE_PROC_UNSIGNED_NORM != 0 {
+            Affine {
+                mul: [1.0 / 255.0; 3],
+                add: [0.0; 3],
+            }
+        } else {
+            Affine::IDENTITY
+        }
+    }
+}
+
+struct ResizeTable {
+    x: Axis,
+    y: Axis,
+}
+
+#[derive(Debug, Clone, Copy)]
+enum Kernel {
+    Scalar,
+    #[cfg(target_arch = "x86_64")]
+    Avx2,
+    #[cfg(target_arch = "aarch64")]
+    Neon,
+}
+
+impl Kernel {
+    fn detect() -> Self {
+        #[cfg(target_arch = "x86_64")]
+        if is_x86_feature_detected!("avx2") && is_x86_feature_detected!("fma") {
+            return Kernel::Avx2;
+        }
+        #[cfg(target_arch = "aarch64")]
+        return Kernel::Neon;
+        #[allow(unreachable_code)]
+        Kernel::Scalar
+    }
+
+    /// out = lerp(a, b, w) * mul[c] + add[c] over interleaved RGB rows.
+    fn lerp_affine(self, a: &[f32], b: &[f32], w: f32, affine: &Affine, out: &mut [f32]) {
+        assert!(a.len() >= out.len() && b.len() >= out.len());
+        match self {
+            Kernel::Scalar => lerp_affine_scalar(a, b, w, affine, out),
+            #[cfg(target_arch = "x86_64")]
+            Kernel::Avx2 => unsafe { lerp_affine_avx2(a, b, w, affine, out) },
+            #[cfg(target_arch = "aarch64")]
+            Kernel::Neon => unsafe { lerp_affine_neon(a, b, w, affine, out) },
+        }
+    }
+}
+
+fn lerp_affine_scalar(a: &[f32], b: &[f32], w: f32, affine: &Affine, out: &mut [f32]) {
+    for (i, o) in out.iter_mut().enumerate() {
+        let v = a[i] + (b[i] - a[i]) * w;
+        *o = v * affine.mul[i % 3] + affine.add[i % 3];
+    }
+}
+
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2,fma")]
+unsafe fn lerp_affine_avx2(a: &[f32], b: &[f32], w: f32, affine: &Affine, out: &mut [f32]) {
+    use std::arch::x86_64::*;
+
+    // Three registers of 8 lanes cover 24 floats which realigns the RGB phase.
+    let mut mp = [0f32; 24];
+    let mut ap = [0f32; 24];
+    for i in 0..24 {
+        mp[i] = affine.mul[i % 3];
+        ap[i] = affine.add[i % 3];
+    }
+    let m = [
+        _mm256_loadu_ps(mp.as_ptr()),
+        _mm256_loadu_ps(mp.as_ptr().add(8)),
+        _mm256_loadu_ps(mp.as_ptr().add(16)),
+    ];
+    let k = [
+        _mm256_loadu_ps(ap.as_ptr()),
+        _mm256_loadu_ps(ap.as_ptr().add(8)),
+        _mm256_loadu_ps(ap.as_ptr().add(16)),
+    ];
+    let wv = _mm256_set1_ps(w);
+    let n = out.len();
+    let mut i = 0;
+    while i + 24 <= n {
+        for j in 0..3 {
+            let o = i + j * 8;
+            let va = _mm256_loadu_ps(a.as_ptr().add(o));
+            let vb = _mm256_loadu_ps(b.as_ptr().add(o));
+            let v = _mm256_fmadd_ps(_mm256_sub_ps(vb, va), wv, va);
+            _mm256_storeu_ps(out.as_mut_ptr().add(o), _mm256_fmadd_ps(v, m[j], k[j]));
+        }
+        i += 24;
+    }
+    lerp_affine_scalar(&a[i..n], &b[i..n], w, affine, &mut out[i..]);
+}
+
+#[cfg(target_arch = "aarch64")]
+unsafe fn lerp_affine_neon(a: &[f32], b: &[f32], w: f32, affine: &Affine, out: &mut [f32]) {
+    use std::arch::aarch64::*;
+
+    // Three registers of 4 lanes cover 12 floats which realigns the RGB phase.
+    let mut mp = [0f32; 12];
+    let mut ap = [0f32; 12];
+    for i in 0..12 {
+        mp[i] = affine.mul[i % 3];
+        ap[i] = affine.add[i % 3];
+    }
+    let m = [
+        vld1q_f32(mp.as_ptr()),
+        vld1q_f32(mp.as_ptr().add(4)),
+        vld1q_f32(mp.as_ptr().add(8)),
+    ];
+    let k = [
+        vld1q_f32(ap.as_ptr()),
+        vld1q_f32(ap.as_ptr().add(4)),
+        vld1q_f32(ap.as_ptr().add(8)),
+    ];
+    let wv = vdupq_n_f32(w);
+    let n = out.len();
+    let mut i = 0;
+    while i + 12 <= n {
+        for j in 0..3 {
+            let o = i + j * 4;
+            let va = vld1q_f32(a.as_ptr().add(o));
+            let vb = vld1q_f32(b.as_ptr().add(o));
+            let v = vfmaq_f32(va, vsubq_f32(vb, va), wv);
+            vst1q_f32(out.as_mut_ptr().add(o), vfmaq_f32(k[j], v, m[j]));
+        }
+        i += 12;
+    }
+    lerp_affine_scalar(&a[i..n], &b[i..n], w, affine, &mut out[i..]);
+}
+
+#[inline(always)]
+fn yuv_to_rgb(y: f32, u: f32, v: f32, out: &mut [f32]) {
+    let c = 1.164 * (y - 16.0);
+    let d = u - 128.0;
+    let e = v - 128.0;
+    out[0] = (c + 1.596 * e).clamp(0.0, 255.0);
+    out[1] = (c - 0.392 * d - 0.813 * e).clamp(0.0, 255.0);
+    out[2] = (c + 2.017 * d).clamp(0.0, 255.0);
+}
+
+/// Horizontally resamples source row y into an RGB row of the destination
+/// width.  YUV formats are interpolated before colorspace conversion.
+fn resample_row(frame: &Frame, y: usize, xs: &Axis, out: &mut [f32]) {
+    let width = frame.width as usize;
+    let height = frame.height as usize;
+    match frame.fourcc {
+        RGB3 | RGBA => {
+            let bpp = if frame.fourcc == RGB3 { 3 } else { 4 };
+            let row = &frame.data[y * width * bpp..(y + 1) * width * bpp];
+            for (i, px) in out.chunks_exact_mut(3).enumerate() {
+                let p0 = &row[xs.lo[i] as usize * bpp..];
+                let p1 = &row[xs.hi[i] as usize * bpp..];
+                let w = xs.weight[i];
+                for c in 0..3 {
+                    px[c] = p0[c] as f32 + (p1[c] as f32 - p0[c] as f32) * w;
+                }
+            }
+        }
+        YUYV => {
+            let row = &frame.data[y * width * 2..(y + 1) * width * 2];
+            for (i, px) in out.chunks_exact_mut(3).enumerate() {
+                let x0 = xs.lo[i] as usize;
+                let x1 = xs.hi[i] as usize;
+                let w = xs.weight[i];
+                let (c0, c1) = ((x0 & !1) * 2, (x1 & !1) * 2);
+                let luma = row[x0 * 2] as f32 + (row[x1 * 2] as f32 - row[x0 * 2] as f32) * w;
+                let u = row[c0 + 1] as f32 + (row[c1 + 1] as f32 - row[c0 + 1] as f32) * w;
+                let v = row[c0 + 3] as f32 + (row[c1 + 3] as f32 - row[c0 + 3] as f32) * w;
+                yuv_to_rgb(luma, u, v, px);
+            }
+        }
+        NV12 => {
+            let row = &frame.data[y * width..(y + 1) * width];
+            let uv_offset = width * height + (y / 2) * width;
+            let uv = &frame.data[uv_offset..uv_offset + width];
+            for (i, px) in out.chunks_exact_mut(3).enumerate() {
+                let x0 = xs.lo[i] as usize;
+                let x1 = xs.hi[i] as usize;
+                let w = xs.weight[i];
+                let (c0, c1) = (x0 & !1, x1 & !1);
+                let luma = row[x0] as f32 + (row[x1] as f32 - row[x0] as f32) * w;
+                let u = uv[c0] as f32 + (uv[c1] as f32 - uv[c0] as f32) * w;
+                let v = uv[c0 + 1] as f32 + (uv[c1 + 1] as f32 - uv[c0 + 1] as f32) * w;
+                yuv_to_rgb(luma, u, v, px);
+            }
+        }
+        _ => unreachable!(),
+    }
+}
+
+trait Store: Sized + Send {
+    fn lerp_into(
+        kernel: Kernel,
+        a: &[f32],
+        b: &[f32],
+        w: f32,
+        affine: &Affine,
+        dst: &mut [Self],
+        scratch: &mut [f32],
+    );
+}
+
+impl Store for f32 {
+    fn lerp_into(
+        kernel: Kernel,
+        a: &[f32],
+        b: &[f32],
+        w: f32,
+        affine: &Affine,
+        dst: &mut [f32],
+        _scratch: &mut [f32],
+    ) {
+        kernel.lerp_affine(a, b, w, affine, dst);
+    }
+}
+
+impl Store for u8 {
+    fn lerp_into(
+        kernel: Kernel,
+        a: &[f32],
+        b: &[f32],
+        w: f32,
+        affine: &Affine,
+        dst: &mut [u8],
+        scratch: &mut [f32],
+    ) {
+        kernel.lerp_affine(a, b, w, affine, scratch);
+        for (d, s) in dst.iter_mut().zip(scratch.iter()) {
+            *d = s.round() as u8;
+        }
+    }
+}
+
+impl Store for i8 {
+    fn lerp_into(
+        kernel: Kernel,
+        a: &[f32],
+        b: &[f32],
+        w: f32,
+        affine: &Affine,
+        dst: &mut [i8],
+        scratch: &mut [f32],
+    ) {
+        kernel.lerp_affine(a, b, w, affine, scratch);
+        for (d, s) in dst.iter_mut().zip(scratch.iter()) {
+            *d = (s.round() - 128.0) as i8;
+        }
+    }
+}
+
+/// Resizes and converts the rows of one band starting at first_row.
+fn process_band<T: Store>(
+    kernel: Kernel,
+    frame: &Frame,
+    table: &ResizeTable,
+    first_row: usize,
+    affine: &Affine,
+    dst: &mut [T],
+) {
+    let row_len = table.x.lo.len() * 3;
+    let mut rows = [vec![0f32; row_len], vec![0f32; row_len]];
+    let mut cached = [usize::MAX, usize::MAX];
+    let mut scratch = vec![0f32; row_len];
+
+    for (i, out) in dst.chunks_exact_mut(row_len).enumerate() {
+        let dy = first_row + i;
+        let y0 = table.y.lo[dy] as usize;
+        let y1 = table.y.hi[dy] as usize;
+
+        // Neighbouring output rows usually share source rows, keep the last
+        // two resampled rows around and only resample what is missing.
+        if cached[0] != y0 {
+            if cached[1] == y0 {
+                rows.swap(0, 1);
+                cached.swap(0, 1);
+            } else {
+                resample_row(frame, y0, &table.x, &mut rows[0]);
+                cached[0] = y0;
+            }
+        }
+        if cached[1] != y1 {
+            resample_row(frame, y1, &table.x, &mut rows[1]);
+            cached[1] = y1;
+        }
+
+        T::lerp_into(
+            kernel,
+            &rows[0],
+            &rows[1],
+            table.y.weight[dy],
+            affine,
+            out,
+            &mut scratch,
+        );
+    }
+}
+
+/// Pure-Rust alternative to the pre-processing performed by the
+/// `vaal_load_frame_*` functions: colorspace conversion to RGB, cropping,
+/// bilinear resizing and the VAAL_IMAGE_PROC normalizations.  Resize
+/// coefficients are cached per source size, destination size and roi.
+///
+/// By default frames are processed on the calling thread, `with_threads`
+/// splits the rows of each frame across scoped threads spawned per call which
+/// only pays off for large outputs with idle cores to spare.
+pub struct Preprocessor {
+    threads: usize,
+    kernel: Kernel,
+    tables: Mutex<HashMap<TableKey, Arc<ResizeTable>>>,
+}
+
+impl Default for Preprocessor {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Preprocessor {
+    pub fn new() -> Self {
+        Self::with_threads(1)
+    }
+
+    pub fn with_threads(threads: usize) -> Self {
+        Preprocessor {
+            threads: threads.max(1),
+            kernel: Kernel::detect(),
+            tables: Mutex::new(HashMap::new()),
+        }
+    }
+
+    pub fn threads(&self) -> usize {
+        self.threads
+    }
+
+    fn table(&self, key: TableKey) -> Arc<ResizeTable> {
+        let mut tables = self.tables.lock().unwrap();
+        tables
+            .entry(key)
+            .or_insert_with(|| {
+                Arc::new(ResizeTable {
+                    x: Axis::new(key.roi[0], key.roi[2], key.dst_width, key.mirror),
+                    y: Axis::new(key.roi[1], key.roi[3], key.dst_height, key.flip),
+                })
+            })
+            .clone()
+    }
+
+    /// Converts the frame into the output buffer of width x height RGB pixels.
+    /// The optional roi is given as [x, y, width, height] in source pixels.
+    pub fn process(
+        &self,
+        frame: &Frame,
+        roi: Option<&[i32; 4]>,
+        width: usize,
+        height: usize,
+        proc: u32,
+        output: Output,
+    ) -> Result<(), Error> {
+        let frame = Frame::new(frame.data, frame.fourcc, frame.width, frame.height)?;
+        if width == 0 || height == 0 {
+            return Err(Error::WrapperError("empty output size".to_owned()));
+        }
+
+        let roi = match roi {
+            Some(roi) => *roi,
+            None => [0, 0, frame.width, frame.height],
+        };
+        if roi[0] < 0
+            || roi[1] < 0
+            || roi[2] <= 0
+            || roi[3] <= 0
+            || roi[0].checked_add(roi[2]).is_none_or(|x| x > frame.width)
+            || roi[1].checked_add(roi[3]).is_none_or(|y| y > frame.height)
+        {
+            return Err(Error::WrapperError(format!(
+                "roi {:?} outside of {}x{} frame",
+                roi, frame.width, frame.height
+            )));
+        }
+
+        let table = self.table(TableKey {
+            src_width: frame.width,
+            src_height: frame.height,
+            dst_width: width,
+            dst_height: height,
+            roi,
+            mirror: proc & IMAGE_PROC_MIRROR != 0,
+            flip: proc & IMAGE_PROC_FLIP != 0,
+        });
+
+        let len = width * height * 3;
+        if proc & NORMALIZATIONS != 0 && !matches!(output, Output::F32(_)) {
+            return Err(Error::WrapperError(format!(
+                "normalization {:#x} requires a float output",
+                proc & NORMALIZATIONS
+            )));
+        }
+        match output {
+            Output::F32(dst) => {
+                let dst = output_slice(dst, len)?;
+                if proc & IMAGE_PROC_WHITENING != 0 {
+                    self.run(&frame, &table, &Affine::IDENTITY, dst);
+                    let (sum, sum_sq) = dst.iter().fold((0f64, 0f64), |(s, sq), v| {
+                        (s + *v as f64, sq + (*v as f64) * (*v as f64))
+                    });
+                    let n = len as f64;
+                    let mean = sum / n;
+                    let std = (sum_sq / n - mean * mean).max(0.0).sqrt();
+                    let std = std.max(1.0 / n.sqrt());
+                    let (mul, add) = ((1.0 / std) as f32, (-mean / std) as f32);
+                    for v in dst.iter_mut() {
+                        *v = *v * mul + add;
+                    }
+                    Ok(())
+                } else {
+                    self.run(&frame, &table, &Affine::normalization(proc), dst);
+                    Ok(())
+                }
+            }
+            Output::U8(dst) => {
+                let dst = output_slice(dst, len)?;
+                self.run(&frame, &table, &Affine::IDENTITY, dst);
+                Ok(())
+            }
+            Output::I8(dst) => {
+                let dst = output_slice(dst, len)?;
+                self.run(&frame, &table, &Affine::IDENTITY, dst);
+                Ok(())
+            }
+        }
+    }
+
+    fn run<T: Store>(&self, frame: &Frame, table: &ResizeTable, affine: &Affine, dst: &mut [T]) {
+        let row_len = table.x.lo.len() * 3;
+        let height = table.y.lo.len();
+        let bands = self.threads.min(height.div_ceil(MIN_BAND_ROWS)).max(1);
+        let band_rows = height.div_ceil(bands);
+        let kernel = self.kernel;
+
+        if bands == 1 {
+            return process_band(kernel, frame, table, 0, affine, dst);
+        }
+
+        thread::scope(|scope| {
+            let mut chunks = dst.chunks_mut(band_rows * row_len).enumerate();
+            let (_, first) = chunks.next().unwrap();
+            for (band, chunk) in chunks {
+                scope.spawn(move || {
+                    process_band(kernel, frame, table, band * band_rows, affine, chunk)
+                });
+            }
+            process_band(kernel, frame, table, 0, affine, first);
+        })
+    }
+
+    /// Pre-processes the frame directly into the mapped memory of the tensor
+    /// which must have an NHWC shape with a batch of 1 and 3 channels.
+    pub fn load_frame(
+        &self,
+        tensor: &dvrt::tensor::Tensor,
+        frame: &Frame,
+        roi: Option<&[i32; 4]>,
+        proc: u32,
+    ) -> Result<(), Error> {
+        let (height, width) = input_size(tensor.shape())?;
+        let result = match tensor.tensor_type() {
+            dvrt::tensor::TensorType::F32 => {
+                let dst = tensor.maprw_f32()?;
+                self.process(frame, roi, width, height, proc, Output::F32(dst))
+            }
+            dvrt::tensor::TensorType::U8 => {
+                let dst = tensor.maprw_u8()?;
+                self.process(frame, roi, width, height, proc, Output::U8(dst))
+            }
+            dvrt::tensor::TensorType::I8 => {
+                let dst = tensor.maprw_i8()?;
+                self.process(frame, roi, width, height, proc, Output::I8(dst))
+            }
+            _ => {
+                return Err(Error::WrapperError(
+                    "unsupported input tensor type".to_owned(),
+                ));
+            }
+        };
+        tensor.unmap();
+        result
+    }
+
+    /// Pre-processes frames into consecutive images of a batched NHWC input
+    /// tensor.  Fewer frames than the batch size leave the remaining images
+    /// untouched, rois when given must hold one entry per frame.
+    pub fn load_batch(
+        &self,
+        tensor: &dvrt::tensor::Tensor,
+        frames: &[Frame],
+        rois: Option<&[[i32; 4]]>,
+        proc: u32,
+    ) -> Result<(), Error> {
+        let (batch, height, width) = batch_input_size(tensor.shape())?;
+        if frames.len() > batch {
+            return Err(Error::WrapperError(format!(
+                "{} frames exceed batch size {}",
+                frames.len(),
+                batch
+            )));
+        }
+        if rois.is_some_and(|rois| rois.len() != frames.len()) {
+            return Err(Error::WrapperError("one roi required per frame".to_owned()));
+        }
+
+        let image = height * width * 3;
+        let roi = |i: usize| rois.map(|rois| &rois[i]);
+        let result = match tensor.tensor_type() {
+            dvrt::tensor::TensorType::F32 => output_slice(tensor.maprw_f32()?, batch * image)
+                .and_then(|dst| {
+                    frames
+                        .iter()
+                        .zip(dst.chunks_exact_mut(image))
+                        .enumerate()
+                        .try_for_each(|(i, (frame, dst))| {
+                            self.process(frame, roi(i), width, height, proc, Output::F32(dst))
+                        })
+                }),
+            dvrt::tensor::TensorType::U8 => output_slice(tensor.maprw_u8()?, batch * image)
+                .and_then(|dst| {
+                    frames
+                        .iter()
+                        .zip(dst.chunks_exact_mut(image))
+                        .enumerate()
+                        .try_for_each(|(i, (frame, dst))| {
+                            self.process(frame, roi(i), width, height, proc, Output::U8(dst))
+                        })
+                }),
+            dvrt::tensor::TensorType::I8 => output_slice(tensor.maprw_i8()?, batch * image)
+                .and_then(|dst| {
+                    frames
+                        .iter()
+                        .zip(dst.chunks_exact_mut(image))
+                        .enumerate()
+                        .try_for_each(|(i, (frame, dst))| {
+                            self.process(frame, roi(i), width, height, proc, Output::I8(dst))
+                        })
+                }),
+            _ => {
+                return Err(Error::WrapperError(
+                    "unsupported input tensor type".to_owned(),
+                ));
+            }
+        };
+        tensor.unmap();
+        result
+    }
+}
+
+fn output_slice<T>(dst: &mut [T], len: usize) -> Result<&mut [T], Error> {
+    if dst.len() < len {
+        return Err(Error::WrapperError(format!(
+            "output buffer too small: {} < {}",
+            dst.len(),
+            len
+        )));
+    }
+    Ok(&mut dst[..len])
+}
+
+pub(crate) fn input_size(shape: &[i32]) -> Result<(usize, usize), Error> {
+    let hwc = match shape {
+        [1, h, w, 3] | [h, w, 3] => (*h, *w),
+        _ => {
+            return Err(Error::WrapperError(format!(
+                "expected NHWC input with 3 channels, got {:?}",
+                shape
+            )));
+        }
+    };
+    Ok((hwc.0 as usize, hwc.1 as usize))
+}
+
+/// Batch, height and width of an NHWC input with 3 channels.
+pub(crate) fn batch_input_size(shape: &[i32]) -> Result<(usize, usize, usize), Error> {
+    match shape {
+        [n, h, w, 3] if *n > 0 => Ok((*n as usize, *h as usize, *w as usize)),
+        [h, w, 3] => Ok((1, *h as usize, *w as usize)),
+        _ => Err(Error::WrapperError(format!(
+            "expected NHWC input with 3 channels, got {:?}",
+            shape
+        ))),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pattern(len: usize, seed: usize) -> Vec<u8> {
+        (0..len).map(|i| ((i * 7 + seed) % 251) as u8).collect()
+    }
+
+    #[test]
+    fn simd_matches_scalar() {
+        let kernel = Kernel::detect();
+        let affine = Affine::normalization(IMAGE_PROC_IMAGENET);
+        // Lengths around the 24 and 12 float blocks exercise the tails.
+        for len in [3, 12, 21, 24, 27, 48, 51, 999] {
+            let a: Vec<f32> = pattern(len, 1).into_iter().map(f32::from).collect();
+            let b: Vec<f32> = pattern(len, 90).into_iter().map(f32::from).collect();
+            for w in [0.0, 0.3, 1.0] {
+                let mut scalar = vec![0.0; len];
+                let mut simd = vec![0.0; len];
+                Kernel::Scalar.lerp_affine(&a, &b, w, &affine, &mut scalar);
+                kernel.lerp_affine(&a, &b, w, &affine, &mut simd);
+                for (s, v) in scalar.iter().zip(&simd) {
+                    assert!((s - v).abs() < 1e-4, "len {} w {}: {} != {}", len, w, s, v);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn threads_do_not_change_output() {
+        let (w, h) = (640, 480);
+        let data = pattern(w * h * 2, 0);
+        let frame = Frame::new(&data, YUYV, w as i32, h as i32).unwrap();
+        let roi = [10, 20, 400, 300];
+        let mut expected = vec![0f32; 300 * 200 * 3];
+        Preprocessor::with_threads(1)
+            .process(
+                &frame,
+                Some(&roi),
+                300,
+                200,
+                IMAGE_PROC_IMAGENET,
+                Output::F32(&mut expected),
+            )
+            .unwrap();
+        for threads in [2, 3, 7, 64] {
+            let mut out = vec![0f32; expected.len()];
+            Preprocessor::with_threads(threads)
+                .process(
+                    &frame,
+                    Some(&roi),
+                    300,
+                    200,
+                    IMAGE_PROC_IMAGENET,
+                    Output::F32(&mut out),
+                )
+                .unwrap();
+            assert_eq!(out, expected, "{} threads", threads);
+        }
+    }
+
+    #[test]
+    fn rgb_identity_and_mirror() {
+        let (w, h) = (37, 23);
+        let data = pattern(w * h * 3, 0);
+        let frame = Frame::new(&data, RGB3, w as i32, h as i32).unwrap();
+        let preproc = Preprocessor::with_threads(3);
+        let mut out = vec![0u8; w * h * 3];
+        preproc
+            .process(&frame, None, w, h, 0, Output::U8(&mut out))
+            .unwrap();
+        assert_eq!(out, data);
+
+        let mut mirrored = vec![0f32; w * h * 3];
+        preproc
+            .process(
+                &frame,
+                None,
+                w,
+                h,
+                IMAGE_PROC_UNSIGNED_NORM | IMAGE_PROC_MIRROR,
+                Output::F32(&mut mirrored),
+            )
+            .unwrap();
+        for y in 0..h {
+            for x in 0..w {
+                for c in 0..3 {
+                    let got = mirrored[(y * w + x) * 3 + c];
+                    let want = data[(y * w + w - 1 - x) * 3 + c] as f32 / 255.0;
+                    assert!((got - want).abs() < 1e-5);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn rgba_matches_rgb() {
+        let (w, h) = (20, 10);
+        let rgb = pattern(w * h * 3, 5);
+        let rgba: Vec<u8> = rgb
+            .chunks_exact(3)
+            .flat_map(|p| [p[0], p[1], p[2], 255])
+            .collect();
+        let preproc = Preprocessor::with_threads(1);
+        let mut a = vec![0u8; 8 * 8 * 3];
+        let mut b = vec![0u8; 8 * 8 * 3];
+        preproc
+            .process(
+                &Frame::new(&rgb, RGB3, 20, 10).unwrap(),
+                None,
+                8,
+                8,
+                0,
+                Output::U8(&mut a),
+            )
+            .unwrap();
+        preproc
+            .process(
+                &Frame::new(&rgba, RGBA, 20, 10).unwrap(),
+                None,
+                8,
+                8,
+                0,
+                Output::U8(&mut b),
+            )
+            .unwrap();
+        assert_eq!(a, b);
+    }
+
+    #[test]
+    fn yuv_gray() {
+        let gray = (1.164f32 * 84.0).round() as u8;
+        let (w, h) = (64, 32);
+
+        let mut nv12 = vec![128u8; w * h * 3 / 2];
+        nv12[..w * h].fill(100);
+        let mut yuyv = vec![128u8; w * h * 2];
+        for luma in yuyv.iter_mut().step_by(2) {
+            *luma = 100;
+        }
+
+        let preproc = Preprocessor::new();
+        for (data, fourcc) in [(&nv12, NV12), (&yuyv, YUYV)] {
+            let frame = Frame::new(data, fourcc, w as i32, h as i32).unwrap();
+            let mut out = vec![0u8; 16 * 16 * 3];
+            preproc
+                .process(&frame, None, 16, 16, 0, Output::U8(&mut out))
+                .unwrap();
+            assert!(out.iter().all(|v| *v == gray), "{:08x}", fourcc);
+            let mut signed = vec![0i8; 16 * 16 * 3];
+            preproc
+                .process(&frame, None, 16, 16, 0, Output::I8(&mut signed))
+                .unwrap();
+            assert!(signed.iter().all(|v| *v as i32 == gray as i32 - 128));
+        }
+    }
+
+    #[test]
+    fn odd_subsampled_sizes_rejected() {
+        let data = vec![0u8; 64];
+        assert!(Frame::new(&data, YUYV, 5, 2).is_err());
+        assert!(Frame::new(&data, NV12, 5, 2).is_err());
+        assert!(Frame::new(&data, NV12, 4, 3).is_err());
+        assert!(Frame::new(&data, NV12, 4, 2).is_ok());
+        assert!(Frame::new(&data, RGB3, 5, 3).is_ok());
+
+        // Frames built without new are checked again by process.
+        let frame = Frame {
+            data: &data,
+            fourcc: YUYV,
+            width: 5,
+            height: 2,
+        };
+        let mut out = vec![0u8; 4 * 4 * 3];
+        assert!(
+            Preprocessor::new()
+                .process(&frame, None, 4, 4, 0, Output::U8(&mut out))
+                .is_err()
+        );
+    }
+
+    #[test]
+    fn invalid_roi_and_output() {
+        let data = pattern(16 * 16 * 3, 0);
+        let frame = Frame::new(&data, RGB3, 16, 16).unwrap();
+        let preproc = Preprocessor::new();
+        let mut out = vec![0u8; 8 * 8 * 3];
+        for roi in [
+            [-1, 0, 4, 4],
+            [0, 0, 0, 4],
+            [10, 10, 8, 4],
+            [i32::MAX, 0, 1, 1],
+            [0, i32::MAX, 1, 1],
+        ] {
+            assert!(
+                preproc
+                    .process(&frame, Some(&roi), 8, 8, 0, Output::U8(&mut out))
+                    .is_err()
+            );
+        }
+        for proc in [IMAGE_PROC_UNSIGNED_NORM, IMAGE_PROC_WHITENING] {
+            assert!(
+                preproc
+                    .process(&frame, None, 8, 8, proc, Output::U8(&mut out))
+                    .is_err()
+            );
+            let mut signed = vec![0i8; 8 * 8 * 3];
+            assert!(
+                preproc
+                    .process(&frame, None, 8, 8, proc, Output::I8(&mut signed))
+                    .is_err()
+            );
+        }
+        let mut small = vec![0u8; 10];
+        assert!(
+            preproc
+                .process(&frame, None, 8, 8, 0, Output::U8(&mut small))
+                .is_err()
+        );
+    }
+}
@@ -0,0 +1,360 @@
+use std::time::{Duration, Instant};
+
+#[derive(Debug, Clone, Copy)]
+pub struct RateConfig {
+    /// End-to-end latency from capture to the end of the last stage.
+    pub budget: Duration,
+    /// Weight of a new measurement in the moving averages.
+    pub alpha: f64,
+    /// Deviations added to the mean service time, trading dropped frames
+    /// for fewer missed deadlines.
+    pub margin: f64,
+    /// max_boxes hint when there is slack, reduced towards min_boxes as the
+    /// predicted latency approaches the budget.
+    pub max_boxes: usize,
+    pub min_boxes: usize,
+    /// Consecutive frames with optional stages skipped after which one frame
+    /// runs them anyway, so their estimates follow a system that recovered.
+    /// Zero never forces a probe.
+    pub probe_interval: u32,
+}
+
+impl Default for RateConfig {
+    fn default() -> Self {
+        RateConfig {
+            budget: Duration::from_millis(100),
+            alpha: 0.125,
+            margin: 2.0,
+            max_boxes: 100,
+            min_boxes: 10,
+            probe_interval: 30,
+        }
+    }
+}
+
+/// Moving estimate of a stage's service time, kept as a mean and mean
+/// absolute deviation in the manner of TCP round-trip estimation.
+#[derive(Debug, Clone)]
+pub struct StageEstimate {
+    pub name: String,
+    pub optional: bool,
+    pub mean: Duration,
+    pub deviation: Duration,
+    pub samples: u64,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Hints {
+    /// Second-stage models should be skipped for this frame.
+    pub skip_optional: bool,
+    /// Boxes to request from `Context::boxes` or the decoder.
+    pub max_boxes: usize,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Admit {
+    Process(Hints),
+    Drop,
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct RateStats {
+    pub admitted: u64,
+    pub dropped: u64,
+    pub skipped_optional: u64,
+    pub completed: u64,
+    pub missed: u64,
+    pub latency_max: Duration,
+}
+
+/// Admission control in front of `run_model`.  Each frame is admitted only
+/// if its age plus the predicted service time of the remaining stages fits
+/// in the latency budget, so a pipeline which falls behind sheds frames
+/// instead of letting latency grow.  Under pressure optional stages are
+/// skipped first and max_boxes is reduced before frames are dropped.
+pub struct RateController {
+    config: RateConfig,
+    stages: Vec<StageEstimate>,
+    stats: RateStats,
+    /// Frames admitted in a row with the optional stages skipped.
+    skip_run: u32,
+}
+
+impl RateController {
+    pub fn new(config: RateConfig) -> Self {
+        RateController {
+            config,
+            stages: Vec::new(),
+            stats: RateStats::default(),
+            skip_run: 0,
+        }
+    }
+
+    pub fn config(&self) -> &RateConfig {
+        &self.config
+    }
+
+    pub fn set_budget(&mut self, budget: Duration) {
+        self.config.budget = budget;
+    }
+
+    /// Registers a pipeline stage such as pre-processing, a model or decoding
+    /// and returns its index for `record`.  Optional stages are the ones which
+    /// may be skipped under overload.
+    pub fn add_stage(&mut self, name: &str, optional: bool) -> usize {
+        self.stages.push(StageEstimate {
+            name: name.to_owned(),
+            optional,
+            mean: Duration::ZERO,
+            deviation: Duration::ZERO,
+            samples: 0,
+        });
+        self.stages.len() - 1
+    }
+
+    pub fn stages(&self) -> &[StageEstimate] {
+        &self.stages
+    }
+
+    pub fn stats(&self) -> &RateStats {
+        &self.stats
+    }
+
+    fn predict(&self, optional: bool) -> Duration {
+        self.stages
+            .iter()
+            .filter(|stage| optional || !stage.optional)
+            .map(|stage| stage.mean + stage.deviation.mul_f64(self.config.margin))
+            .sum()
+    }
+
+    /// Decides whether the frame captured at captured should be processed.
+    pub fn admit(&mut self, captured: Instant) -> Admit {
+        let age = captured.elapsed();
+        let budget = self.config.budget;
+        let required = age + self.predict(false);
+        if required > budget {
+            self.stats.dropped += 1;
+            return Admit::Drop;
+        }
+
+        let full = age + self.predict(true);
+        let probe = self.config.probe_interval > 0 && self.skip_run >= self.config.probe_interval;
+        let skip_optional = full > budget && !probe;
+        if skip_optional {
+            self.skip_run += 1;
+            // Skipped stages get no new measurements, let their uncertainty
+            // decay so a pessimistic estimate does not skip them forever.
+            let alpha = self.config.alpha;
+            for stage in self.stages.iter_mut().filter(|stage| stage.optional) {
+                stage.deviation = stage.deviation.mul_f64(1.0 - alpha);
+            }
+            self.stats.skipped_optional += 1;
+        } else {
+            self.skip_run = 0;
+        }
+        // Reduce max_boxes once less than a quarter of the budget is left
+        // after the stages which will run.
+        let planned = if skip_optional { required } else { full };
+        let slack = 1.0 - planned.as_secs_f64() / budget.as_secs_f64().max(f64::EPSILON);
+        let max = self.config.max_boxes;
+        let min = self.config.min_boxes.min(max);
+        let scale = (slack * 4.0).clamp(0.0, 1.0);
+        let max_boxes = min + ((max - min) as f64 * scale) as usize;
+        self.stats.admitted += 1;
+        Admit::Process(Hints {
+            skip_optional,
+            max_boxes,
+        })
+    }
+
+    /// Adds a service time measurement for the stage.
+    pub fn record(&mut self, stage: usize, elapsed: Duration) {
+        let alpha = self.config.alpha;
+        let stage = &mut self.stages[stage];
+        if stage.samples == 0 {
+            stage.mean = elapsed;
+            stage.deviation = elapsed / 2;
+        } else {
+            let error = elapsed.abs_diff(stage.mean);
+            stage.deviation = stage.deviation.mul_f64(1.0 - alpha) + error.mul_f64(alpha);
+            stage.mean = stage.mean.mul_f64(1.0 - alpha) + elapsed.mul_f64(alpha);
+        }
+        stage.samples += 1;
+    }
+
+    /// Runs f as the stage and records its service time.
+    pub fn time<R>(&mut self, stage: usize, f: impl FnOnce() -> R) -> R {
+        let start = Instant::now();
+        let result = f();
+        self.record(stage, start.elapsed());
+        result
+    }
+
+    /// Marks the frame captured at captured as done, counting a missed
+    /// deadline if it exceeded the budget.
+    pub fn complete(&mut self, captured: Instant) -> Duration {
+        let latency = captured.elapsed();
+        self.stats.completed += 1;
+        if latency > self.config.budget {
+            self.stats.missed += 1;
+        }
+        self.stats.latency_max = self.stats.latency_max.max(latency);
+        latency
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MS: Duration = Duration::from_millis(1);
+
+    /// Controller with a 100 ms budget whose estimates have converged on the
+    /// given service times.
+    fn converged(required: Duration, optional: Duration) -> RateController {
+        let mut rate = RateController::new(RateConfig::default());
+        rate.add_stage("model", false);
+        rate.add_stage("second", true);
+        for _ in 0..500 {
+            rate.record(0, required);
+            rate.record(1, optional);
+        }
+        rate
+    }
+
+    fn hints(admit: Admit) -> Hints {
+        match admit {
+            Admit::Process(hints) => hints,
+            Admit::Drop => panic!("frame dropped"),
+        }
+    }
+
+    #[test]
+    fn estimate_follows_measurements() {
+        let mut rate = RateController::new(RateConfig::default());
+        let stage = rate.add_stage("model", false);
+        rate.record(stage, 10 * MS);
+        assert_eq!(rate.stages()[stage].mean, 10 * MS);
+        assert_eq!(rate.stages()[stage].deviation, 5 * MS);
+        for _ in 0..200 {
+            rate.record(stage, 20 * MS);
+        }
+        let estimate = &rate.stages()[stage];
+        assert!(estimate.mean.abs_diff(20 * MS) < Duration::from_micros(10));
+        assert!(estimate.deviation < Duration::from_micros(10));
+        assert_eq!(estimate.samples, 201);
+    }
+
+    #[test]
+    fn slack_admits_everything() {
+        let mut rate = converged(20 * MS, 50 * MS);
+        let hints = hints(rate.admit(Instant::now()));
+        assert!(!hints.skip_optional);
+        assert_eq!(hints.max_boxes, 100);
+
+        // Running the optional stage leaves 20% of the budget, which the
+        // boxes hint accounts for.
+        let mut rate = converged(20 * MS, 60 * MS);
+        let hints = self::hints(rate.admit(Instant::now()));
+        assert!(!hints.skip_optional);
+        assert!((80..=84).contains(&hints.max_boxes), "{}", hints.max_boxes);
+    }
+
+    #[test]
+    fn overload_skips_optional_then_reduces_boxes_then_drops() {
+        let mut rate = converged(20 * MS, 90 * MS);
+        let skipped = hints(rate.admit(Instant::now()));
+        assert!(skipped.skip_optional);
+        assert_eq!(skipped.max_boxes, 100);
+
+        // 85 ms of the budget leaves 15% slack, boxes scale down from 100
+        // towards 10 over the last quarter.
+        let mut rate = converged(85 * MS, 90 * MS);
+        let reduced = hints(rate.admit(Instant::now()));
+        assert!(reduced.skip_optional);
+        assert!(
+            (60..=64).contains(&reduced.max_boxes),
+            "{}",
+            reduced.max_boxes
+        );
+
+        let mut rate = converged(110 * MS, Duration::ZERO);
+        assert_eq!(rate.admit(Instant::now()), Admit::Drop);
+
+        // An old frame is dropped even when the stages are fast.
+        let mut rate = converged(20 * MS, Duration::ZERO);
+        let captured = Instant::now() - 90 * MS;
+        assert_eq!(rate.admit(captured), Admit::Drop);
+        assert_eq!(rate.stats().dropped, 1);
+        assert_eq!(rate.stats().admitted, 0);
+    }
+
+    #[test]
+    fn skipped_stage_deviation_decays() {
+        let mut rate = RateController::new(RateConfig::default());
+        rate.add_stage("model", false);
+        let second = rate.add_stage("second", true);
+        for _ in 0..500 {
+            rate.record(0, 20 * MS);
+        }
+        // One slow sample leaves the optional stage at 60 ms +- 30 ms, which
+        // predicts 20 + 60 + 2 * 30 > 100 ms.
+        rate.record(second, 60 * MS);
+
+        let before = rate.stages()[second].deviation;
+        assert!(hints(rate.admit(Instant::now())).skip_optional);
+        let after = rate.stages()[second].deviation;
+        let expected = before.mul_f64(1.0 - rate.config().alpha);
+        assert!(after.abs_diff(expected) < Duration::from_micros(1));
+
+        // Without new measurements the stage is retried once 20 + 60 + 2 *
+        // deviation fits, after a bounded number of frames.
+        let resumed = (0..100).position(|_| !hints(rate.admit(Instant::now())).skip_optional);
+        assert!(resumed.is_some());
+        assert!(rate.stages()[second].deviation < 10 * MS);
+        assert!(rate.stats().skipped_optional >= 2);
+    }
+
+    #[test]
+    fn skipped_stage_probed() {
+        // A 90 ms optional stage never fits next to a 20 ms required one, so
+        // only the forced probes measure it again.
+        let mut rate = converged(20 * MS, 90 * MS);
+        let interval = rate.config().probe_interval as usize;
+        let runs: Vec<_> = (0..3 * (interval + 1))
+            .map(|_| !hints(rate.admit(Instant::now())).skip_optional)
+            .collect();
+        let probes: Vec<_> = (0..runs.len()).filter(|i| runs[*i]).collect();
+        assert_eq!(probes, [interval, 2 * interval + 1, 3 * interval + 2]);
+
+        // Once the stage speeds up the probes bring its estimate down.
+        let second = 1;
+        for _ in 0..100 {
+            if !hints(rate.admit(Instant::now())).skip_optional {
+                rate.record(second, 10 * MS);
+            }
+        }
+        assert!(rate.stages()[second].mean < 50 * MS);
+
+        let mut rate = RateController::new(RateConfig {
+            probe_interval: 0,
+            ..RateConfig::default()
+        });
+        rate.add_stage("model", false);
+        rate.add_stage("second", true);
+        rate.record(0, 20 * MS);
+        rate.record(1, 90 * MS);
+        assert!((0..100).all(|_| hints(rate.admit(Instant::now())).skip_optional));
+    }
+
+    #[test]
+    fn complete_counts_missed_deadlines() {
+        let mut rate = converged(10 * MS, Duration::ZERO);
+        rate.complete(Instant::now());
+        rate.complete(Instant::now() - 150 * MS);
+        let stats = rate.stats();
+        assert_eq!((stats.completed, stats.missed), (2, 1));
+        assert!(stats.latency_max >= 150 * MS);
+    }
+}
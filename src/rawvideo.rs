@@ -0,0 +1,345 @@
+use crate::{
+    Error,
+    frame::{Frame, frame_size},
+    mmap::Mmap,
+};
+use std::{
+    fs::File,
+    io::{BufWriter, Seek, SeekFrom, Write},
+    os::fd::AsRawFd,
+    path::Path,
+    thread,
+    time::{Duration, Instant},
+};
+
+const MAGIC: &[u8; 4] = b"VRAW";
+const VERSION: u16 = 1;
+pub const HEADER_SIZE: usize = 32;
+
+/// Raw video file of tightly packed frames following a 32 byte little-endian
+/// header: magic "VRAW", version u16, header size u16, fourcc u32, width u32,
+/// height u32, frame count u32 and 8 reserved bytes.  A frame count of zero
+/// means the count is derived from the file size.
+pub struct RawVideo {
+    map: Mmap,
+    header_size: usize,
+    fourcc: u32,
+    width: i32,
+    height: i32,
+    frames: usize,
+    frame_size: usize,
+}
+
+fn read_u16(buf: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes([buf[offset], buf[offset + 1]])
+}
+
+fn read_u32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+impl RawVideo {
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Self, Error> {
+        let file = File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        if len < HEADER_SIZE {
+            return Err(Error::WrapperError("raw video header truncated".to_owned()));
+        }
+        let map = Mmap::map(file.as_raw_fd(), len, false)?;
+        let header = &map.as_slice()[..HEADER_SIZE];
+        if &header[0..4] != MAGIC || read_u16(header, 4) != VERSION {
+            return Err(Error::WrapperError("not a raw video file".to_owned()));
+        }
+        let header_size = read_u16(header, 6) as usize;
+        let fourcc = read_u32(header, 8);
+        let width = read_u32(header, 12) as i32;
+        let height = read_u32(header, 16) as i32;
+        let count = read_u32(header, 20) as usize;
+
+        let frame_size = match frame_size(fourcc, width, height) {
+            Some(size) => size,
+            None => {
+                return Err(Error::WrapperError(format!(
+                    "unsupported raw video {:08x} {}x{}",
+                    fourcc, width, height
+                )));
+            }
+        };
+        if header_size < HEADER_SIZE || header_size > len {
+            return Err(Error::WrapperError("invalid raw video header".to_owned()));
+        }
+        let available = (len - header_size) / frame_size;
+        let frames = if count == 0 { available } else { count };
+        if frames > available {
+            return Err(Error::WrapperError(format!(
+                "raw video truncated: {} of {} frames",
+                available, frames
+            )));
+        }
+
+        map.advise(0, len, libc::MADV_SEQUENTIAL);
+        Ok(RawVideo {
+            map,
+            header_size,
+            fourcc,
+            width,
+            height,
+            frames,
+            frame_size,
+        })
+    }
+
+    pub fn fourcc(&self) -> u32 {
+        self.fourcc
+    }
+
+    pub fn width(&self) -> i32 {
+        self.width
+    }
+
+    pub fn height(&self) -> i32 {
+        self.height
+    }
+
+    pub fn len(&self) -> usize {
+        self.frames
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.frames == 0
+    }
+
+    pub fn frame_size(&self) -> usize {
+        self.frame_size
+    }
+
+    /// Borrows the frame at index straight from the mapping.
+    pub fn frame(&self, index: usize) -> Option<Frame<'_>> {
+        if index >= self.frames {
+            return None;
+        }
+        let offset = self.header_size + index * self.frame_size;
+        Some(Frame {
+            data: &self.map.as_slice()[offset..offset + self.frame_size],
+            fourcc: self.fourcc,
+            width: self.width,
+            height: self.height,
+        })
+    }
+
+    fn prefetch(&self, index: usize) {
+        let offset = self.header_size + index * self.frame_size;
+        self.map
+            .advise(offset, self.frame_size, libc::MADV_WILLNEED);
+    }
+
+    pub fn iter(&self) -> RawVideoSource<'_> {
+        RawVideoSource::new(self)
+    }
+}
+
+/// Streams the frames of a `RawVideo`, optionally looping forever and pacing
+/// the frames to a fixed rate for repeatable throughput benchmarks.
+pub struct RawVideoSource<'a> {
+    video: &'a RawVideo,
+    next: usize,
+    count: u64,
+    looping: bool,
+    interval: Option<Duration>,
+    deadline: Option<Instant>,
+}
+
+impl<'a> RawVideoSource<'a> {
+    pub fn new(video: &'a RawVideo) -> Self {
+        RawVideoSource {
+            video,
+            next: 0,
+            count: 0,
+            looping: false,
+            interval: None,
+            deadline: None,
+        }
+    }
+
+    pub fn looping(mut self, looping: bool) -> Self {
+        self.looping = looping;
+        self
+    }
+
+    /// Paces frames to the given rate, a rate of zero disables pacing.
+    pub fn rate(mut self, fps: f64) -> Self {
+        self.interval = if fps > 0.0 {
+            Some(Duration::from_secs_f64(1.0 / fps))
+        } else {
+            None
+        };
+        self
+    }
+
+    /// Number of frames produced so far, keeps counting across loops.
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    fn pace(&mut self) {
+        let interval = match self.interval {
+            Some(interval) => interval,
+            None => return,
+        };
+        let now = Instant::now();
+        match self.deadline {
+            Some(deadline) if deadline > now => {
+                thread::sleep(deadline - now);
+                self.deadline = Some(deadline + interval);
+            }
+            // A late consumer restarts the schedule instead of bursting to
+            // catch up on the frames it missed.
+            _ => self.deadline = Some(now + interval),
+        }
+    }
+}
+
+impl<'a> Iterator for RawVideoSource<'a> {
+    type Item = Frame<'a>;
+
+    fn next(&mut self) -> Option<Frame<'a>> {
+        if self.next >= self.video.frames {
+            if !self.looping || self.video.frames == 0 {
+                return None;
+            }
+            self.next = 0;
+            self.video.prefetch(0);
+        }
+        self.pace();
+        let frame = self.video.frame(self.next);
+        self.next += 1;
+        self.count += 1;
+        frame
+    }
+}
+
+/// Records frames into the raw video format read by `RawVideo`.
+pub struct RawVideoWriter {
+    file: BufWriter<File>,
+    frame_size: usize,
+    frames: u32,
+}
+
+impl RawVideoWriter {
+    pub fn create<P: AsRef<Path>>(
+        path: P,
+        fourcc: u32,
+        width: i32,
+        height: i32,
+    ) -> Result<Self, Error> {
+        let frame_size = match frame_size(fourcc, width, height) {
+            Some(size) => size,
+            None => return Err(Error::WrapperError("unsupported frame format".to_owned())),
+        };
+        let mut header = [0u8; HEADER_SIZE];
+        header[0..4].copy_from_slice(MAGIC);
+        header[4..6].copy_from_slice(&VERSION.to_le_bytes());
+        header[6..8].copy_from_slice(&(HEADER_SIZE as u16).to_le_bytes());
+        header[8..12].copy_from_slice(&fourcc.to_le_bytes());
+        header[12..16].copy_from_slice(&(width as u32).to_le_bytes());
+        header[16..20].copy_from_slice(&(height as u32).to_le_bytes());
+
+        let mut file = BufWriter::new(File::create(path)?);
+        file.write_all(&header)?;
+        Ok(RawVideoWriter {
+            file,
+            frame_size,
+            frames: 0,
+        })
+    }
+
+    pub fn write_frame(&mut self, data: &[u8]) -> Result<(), Error> {
+        if data.len() != self.frame_size {
+            return Err(Error::WrapperError(format!(
+                "frame size mismatch: {} != {}",
+                data.len(),
+                self.frame_size
+            )));
+        }
+        self.file.write_all(data)?;
+        self.frames += 1;
+        Ok(())
+    }
+
+    /// Flushes the frames and records the final frame count in the header.
+    pub fn finish(mut self) -> Result<(), Error> {
+        self.file.seek(SeekFrom::Start(20))?;
+        self.file.write_all(&self.frames.to_le_bytes())?;
+        self.file.flush()?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::frame::{NV12, RGB3};
+
+    fn record(name: &str, frames: u8) -> std::path::PathBuf {
+        let path =
+            std::env::temp_dir().join(format!("vaal-rawvideo-{}-{}", name, std::process::id()));
+        let mut writer = RawVideoWriter::create(&path, NV12, 4, 2).unwrap();
+        for frame in 0..frames {
+            writer.write_frame(&[frame; 12]).unwrap();
+        }
+        assert!(writer.write_frame(&[0; 11]).is_err());
+        writer.finish().unwrap();
+        path
+    }
+
+    #[test]
+    fn header_round_trip() {
+        let path = record("header", 3);
+        let video = RawVideo::open(&path).unwrap();
+        assert_eq!(
+            (video.fourcc(), video.width(), video.height()),
+            (NV12, 4, 2)
+        );
+        assert_eq!((video.len(), video.frame_size()), (3, 12));
+        let frame = video.frame(2).unwrap();
+        assert_eq!(frame.data, [2; 12]);
+        assert!(video.frame(3).is_none());
+
+        // A count beyond the frames in the file is a truncated recording.
+        let mut data = std::fs::read(&path).unwrap();
+        data[20] = 4;
+        std::fs::write(&path, &data).unwrap();
+        assert!(RawVideo::open(&path).is_err());
+        // Zero derives the count from the file size.
+        data[20] = 0;
+        std::fs::write(&path, &data).unwrap();
+        assert_eq!(RawVideo::open(&path).unwrap().len(), 3);
+        data[0] = b'X';
+        std::fs::write(&path, &data).unwrap();
+        assert!(RawVideo::open(&path).is_err());
+        std::fs::remove_file(&path).unwrap();
+
+        let path = std::env::temp_dir().join(format!("vaal-rawvideo-odd-{}", std::process::id()));
+        assert!(RawVideoWriter::create(&path, RGB3, 0, 2).is_err());
+    }
+
+    #[test]
+    fn looping_and_pacing() {
+        let path = record("loop", 3);
+        let video = RawVideo::open(&path).unwrap();
+        let once: Vec<_> = video.iter().map(|frame| frame.data[0]).collect();
+        assert_eq!(once, [0, 1, 2]);
+
+        let mut source = video.iter().looping(true);
+        let looped: Vec<_> = source.by_ref().take(7).map(|frame| frame.data[0]).collect();
+        assert_eq!(looped, [0, 1, 2, 0, 1, 2, 0]);
+        // Iterator::count would take the endless source by value.
+        assert_eq!(RawVideoSource::count(&source), 7);
+
+        // Five frames at 100 fps take at least four intervals.
+        let start = Instant::now();
+        assert_eq!(video.iter().looping(true).rate(100.0).take(5).count(), 5);
+        assert!(start.elapsed() >= Duration::from_millis(40));
+        std::fs::remove_file(&path).unwrap();
+    }
+}
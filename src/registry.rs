@@ -0,0 +1,492 @@
+use crate::{
+    Context, Error, ModelType, ParameterProfile, model_hash, model_path,
+    postprocess::{ClassFilter, Nms},
+};
+use std::{
+    collections::HashMap,
+    fs,
+    ops::{Deref, DerefMut},
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex, Weak},
+    thread,
+    time::SystemTime,
+};
+
+#[derive(Debug, Clone)]
+pub struct ModelEntry {
+    pub name: String,
+    pub path: PathBuf,
+    pub hash: u64,
+    pub size: u64,
+    /// Modification time when indexed, a file whose size or time differs
+    /// when loaded has changed since.
+    pub modified: Option<SystemTime>,
+}
+
+/// Identifies the model of a context, either a file of the registry by its
+/// hash or the model VAAL resolves for a type through `Context::probe`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum ModelKey {
+    Hash(u64),
+    Type(ModelType),
+}
+
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+struct PoolKey {
+    model: ModelKey,
+    device: String,
+}
+
+/// A context with the parameters it had when loaded, restored before it is
+/// handed to the next lessee.
+struct Loaded {
+    context: Context,
+    parameters: ParameterProfile,
+}
+
+struct Warm {
+    key: PoolKey,
+    loaded: Loaded,
+    used: u64,
+}
+
+/// Model blob shared while any context holds it, locked while it is read.
+type BlobSlot = Arc<Mutex<Weak<Vec<u8>>>>;
+
+#[derive(Default)]
+struct Pool {
+    idle: Vec<Warm>,
+    tick: u64,
+}
+
+/// Index of the models in a directory with a bounded pool of warm contexts.
+/// Contexts are created on first use and handed out as leases, a returned
+/// lease keeps its context loaded for the next user of the same model and
+/// device until it becomes the least recently used beyond capacity.
+///
+/// Model files are read once while any context holds them, concurrent
+/// leases of a cold model wait for the same read and load their contexts
+/// from the shared blob.
+pub struct ModelRegistry {
+    root: PathBuf,
+    models: Vec<ModelEntry>,
+    by_hash: HashMap<u64, usize>,
+    capacity: usize,
+    pool: Mutex<Pool>,
+    blobs: Mutex<HashMap<u64, BlobSlot>>,
+}
+
+fn hash_file(path: &Path) -> Result<ModelEntry, Error> {
+    let data = fs::read(path)?;
+    let modified = fs::metadata(path)?.modified().ok();
+    Ok(ModelEntry {
+        name: path
+            .file_stem()
+            .map(|stem| stem.to_string_lossy().into_owned())
+            .unwrap_or_default(),
+        path: path.to_owned(),
+        hash: model_hash(&data),
+        size: data.len() as u64,
+        modified,
+    })
+}
+
+impl ModelRegistry {
+    /// Scans the VAAL model path.
+    pub fn open(capacity: usize) -> Result<Self, Error> {
+        match model_path() {
+            Some(path) => Self::scan(path, capacity),
+            None => Err(Error::WrapperError("VAAL has no model path".to_owned())),
+        }
+    }
+
+    /// Indexes the .rtm models of the directory, hashing them in parallel,
+    /// keeping at most capacity idle contexts warm.
+    pub fn scan<P: AsRef<Path>>(dir: P, capacity: usize) -> Result<Self, Error> {
+        let mut paths = Vec::new();
+        for entry in fs::read_dir(dir.as_ref())? {
+            let path = entry?.path();
+            if path.is_file() && path.extension().is_some_and(|ext| ext == "rtm") {
+                paths.push(path);
+            }
+        }
+        paths.sort();
+
+        let threads = thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1);
+        let per_thread = paths.len().div_ceil(threads).max(1);
+        let models = thread::scope(|scope| {
+            let handles: Vec<_> = paths
+                .chunks(per_thread)
+                .map(|chunk| {
+                    scope.spawn(move || {
+                        chunk
+                            .iter()
+                            .map(|path| hash_file(path))
+                            .collect::<Result<Vec<_>, _>>()
+                    })
+                })
+                .collect();
+            let mut models = Vec::with_capacity(paths.len());
+            for handle in handles {
+                models.extend(handle.join().unwrap()?);
+            }
+            Ok::<_, Error>(models)
+        })?;
+
+        let by_hash = models
+            .iter()
+            .enumerate()
+            .map(|(index, model)| (model.hash, index))
+            .collect();
+        Ok(ModelRegistry {
+            root: dir.as_ref().to_owned(),
+            models,
+            by_hash,
+            capacity,
+            pool: Mutex::new(Pool::default()),
+            blobs: Mutex::new(HashMap::new()),
+        })
+    }
+
+    pub fn root(&self) -> &Path {
+        &self.root
+    }
+
+    pub fn models(&self) -> &[ModelEntry] {
+        &self.models
+    }
+
+    pub fn by_hash(&self, hash: u64) -> Option<&ModelEntry> {
+        self.by_hash.get(&hash).map(|index| &self.models[*index])
+    }
+
+    pub fn by_name(&self, name: &str) -> Option<&ModelEntry> {
+        self.models.iter().find(|model| model.name == name)
+    }
+
+    /// Number of contexts kept warm while not leased.
+    pub fn idle(&self) -> usize {
+        self.pool.lock().unwrap().idle.len()
+    }
+
+    /// Model file of the entry, shared with the contexts already running it.
+    /// The file is checked by size and modification time rather than hashed
+    /// again.
+    fn blob(&self, entry: &ModelEntry) -> Result<Arc<Vec<u8>>, Error> {
+        let slot = self
+            .blobs
+            .lock()
+            .unwrap()
+            .entry(entry.hash)
+            .or_default()
+            .clone();
+        let mut slot = slot.lock().unwrap();
+        if let Some(blob) = slot.upgrade() {
+            return Ok(blob);
+        }
+        let metadata = fs::metadata(&entry.path)?;
+        if metadata.len() != entry.size || metadata.modified().ok() != entry.modified {
+            return Err(Error::WrapperError(format!(
+                "{} changed since it was indexed",
+                entry.path.display()
+            )));
+        }
+        let blob = Arc::new(fs::read(&entry.path)?);
+        *slot = Arc::downgrade(&blob);
+        Ok(blob)
+    }
+
+    fn load(&self, key: &PoolKey) -> Result<Loaded, Error> {
+        let context = match key.model {
+            ModelKey::Type(model_type) => Context::probe(&key.device, model_type)?,
+            ModelKey::Hash(hash) => {
+                let entry = match self.by_hash(hash) {
+                    Some(entry) => entry,
+                    None => {
+                        return Err(Error::WrapperError(format!(
+                            "model {:016x} not in registry",
+                            hash
+                        )));
+                    }
+                };
+                let mut context = Context::new(&key.device)?;
+                context.load_model_shared(self.blob(entry)?)?;
+                context
+            }
+        };
+        let parameters = ParameterProfile::from_context(&context)?;
+        Ok(Loaded {
+            context,
+            parameters,
+        })
+    }
+
+    /// Restores the state the context was loaded with, None when it can no
+    /// longer serve the key, such as after loading another model.
+    fn reset(&self, mut loaded: Loaded, model: Option<(*const u8, usize)>) -> Option<Loaded> {
+        let current = loaded.context.model().ok().map(|m| (m.as_ptr(), m.len()));
+        if current != model {
+            return None;
+        }
+        loaded.parameters.apply(&loaded.context).ok()?;
+        loaded.context.set_class_filter(ClassFilter::new());
+        loaded.context.set_nms(Nms::PerClass, 0.5);
+        Some(loaded)
+    }
+
+    fn release(&self, key: PoolKey, loaded: Loaded) {
+        let evicted = {
+            let mut pool = self.pool.lock().unwrap();
+            pool.tick += 1;
+            let used = pool.tick;
+            pool.idle.push(Warm { key, loaded, used });
+            let mut evicted = Vec::new();
+            while pool.idle.len() > self.capacity {
+                let oldest = pool
+                    .idle
+                    .iter()
+                    .enumerate()
+                    .min_by_key(|(_, warm)| warm.used)
+                    .map(|(index, _)| index)
+                    .unwrap();
+                evicted.push(pool.idle.swap_remove(oldest));
+            }
+            evicted
+        };
+        // Releasing contexts can be slow, keep it outside the lock.
+        drop(evicted);
+    }
+
+    /// Leases a context running the model on the device, reusing a warm
+    /// context when one is idle and loading a new one otherwise.
+    pub fn lease(&self, model: ModelKey, device: &str) -> Result<ContextLease<'_>, Error> {
+        let key = PoolKey {
+            model,
+            device: device.to_owned(),
+        };
+        let warm = {
+            let mut pool = self.pool.lock().unwrap();
+            let index = pool.idle.iter().position(|warm| warm.key == key);
+            index.map(|index| pool.idle.swap_remove(index).loaded)
+        };
+        let loaded = match warm {
+            Some(loaded) => loaded,
+            None => self.load(&key)?,
+        };
+        let model = loaded.context.model().ok().map(|m| (m.as_ptr(), m.len()));
+        Ok(ContextLease {
+            registry: self,
+            key: Some(key),
+            loaded: Some(loaded),
+            model,
+        })
+    }
+
+    /// Loads contexts for the models in parallel and leaves them warm, so
+    /// startup pays for the slowest model rather than the sum of all.  The
+    /// result of each load is returned in the order requested.
+    pub fn preload(&self, models: &[(ModelKey, &str)]) -> Vec<Result<(), Error>> {
+        thread::scope(|scope| {
+            let handles: Vec<_> = models
+                .iter()
+                .map(|(model, device)| {
+                    scope.spawn(move || {
+                        let key = PoolKey {
+                            model: *model,
+                            device: device.to_string(),
+                        };
+                        let loaded = self.load(&key)?;
+                        self.release(key, loaded);
+                        Ok(())
+                    })
+                })
+                .collect();
+            handles
+                .into_iter()
+                .map(|handle| handle.join().unwrap())
+                .collect()
+        })
+    }
+}
+
+/// Context on loan from a `ModelRegistry`, returned to its warm pool on drop.
+/// Parameters, class filter and NMS mode changed during the lease are reset
+/// to their values at load time, a context loaded with another model is
+/// released instead of pooled.
+pub struct ContextLease<'a> {
+    registry: &'a ModelRegistry,
+    key: Option<PoolKey>,
+    loaded: Option<Loaded>,
+    /// Model blob of the context when leased.
+    model: Option<(*const u8, usize)>,
+}
+
+unsafe impl Send for ContextLease<'_> {}
+
+impl ContextLease<'_> {
+    pub fn model(&self) -> ModelKey {
+        self.key.as_ref().unwrap().model
+    }
+
+    pub fn device(&self) -> &str {
+        &self.key.as_ref().unwrap().device
+    }
+
+    /// Takes the context out of the registry's pool for good.
+    pub fn detach(mut self) -> Context {
+        self.key = None;
+        self.loaded.take().unwrap().context
+    }
+}
+
+impl Deref for ContextLease<'_> {
+    type Target = Context;
+
+    fn deref(&self) -> &Context {
+        &self.loaded.as_ref().unwrap().context
+    }
+}
+
+impl DerefMut for ContextLease<'_> {
+    fn deref_mut(&mut self) -> &mut Context {
+        &mut self.loaded.as_mut().unwrap().context
+    }
+}
+
+impl Drop for ContextLease<'_> {
+    fn drop(&mut self) {
+        if let (Some(key), Some(loaded)) = (self.key.take(), self.loaded.take()) {
+            if let Some(loaded) = self.registry.reset(loaded, self.model) {
+                self.registry.release(key, loaded);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn models(name: &str, files: &[(&str, &[u8])]) -> PathBuf {
+        let dir =
+            std::env::temp_dir().join(format!("vaal-registry-{}-{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        for (file, data) in files {
+            fs::write(dir.join(file), data).unwrap();
+        }
+        dir
+    }
+
+    fn hash(registry: &ModelRegistry, name: &str) -> ModelKey {
+        ModelKey::Hash(registry.by_name(name).unwrap().hash)
+    }
+
+    #[test]
+    fn scan_indexes_models() {
+        let dir = models(
+            "scan",
+            &[
+                ("a.rtm", b"model a"),
+                ("b.rtm", b"model bb"),
+                ("notes.txt", b"x"),
+            ],
+        );
+        let registry = ModelRegistry::scan(&dir, 2).unwrap();
+        fs::remove_dir_all(&dir).unwrap();
+        let names: Vec<_> = registry.models().iter().map(|m| m.name.as_str()).collect();
+        assert_eq!(names, ["a", "b"]);
+        let b = registry.by_name("b").unwrap();
+        assert_eq!(b.size, 8);
+        assert_eq!(b.hash, model_hash(b"model bb"));
+        assert_eq!(registry.by_hash(b.hash).unwrap().name, "b");
+        assert!(registry.by_name("notes").is_none());
+    }
+
+    #[test]
+    fn lease_reuses_and_evicts_least_recent() {
+        let dir = models(
+            "lru",
+            &[
+                ("a.rtm", b"model a"),
+                ("b.rtm", b"model b"),
+                ("c.rtm", b"model c"),
+            ],
+        );
+        let registry = ModelRegistry::scan(&dir, 2).unwrap();
+        let (a, b, c) = (
+            hash(&registry, "a"),
+            hash(&registry, "b"),
+            hash(&registry, "c"),
+        );
+
+        drop(registry.lease(a, "cpu").unwrap());
+        assert_eq!(registry.idle(), 1);
+        let lease = registry.lease(a, "cpu").unwrap();
+        assert_eq!(registry.idle(), 0);
+        drop(lease);
+
+        drop(registry.lease(b, "cpu").unwrap());
+        drop(registry.lease(c, "cpu").unwrap());
+        assert_eq!(registry.idle(), 2);
+
+        // a was used least recently, so b and c are the warm pair.
+        let b = registry.lease(b, "cpu").unwrap();
+        let c = registry.lease(c, "cpu").unwrap();
+        assert_eq!(registry.idle(), 0);
+        drop((b, c));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn concurrent_leases_share_model() {
+        let dir = models("shared", &[("a.rtm", b"model a")]);
+        let registry = ModelRegistry::scan(&dir, 2).unwrap();
+        let a = hash(&registry, "a");
+        let first = registry.lease(a, "cpu").unwrap();
+        let second = registry.lease(a, "cpu").unwrap();
+        assert_eq!(
+            Context::model(&first).unwrap().as_ptr(),
+            Context::model(&second).unwrap().as_ptr()
+        );
+        drop((first, second));
+        assert_eq!(registry.idle(), 2);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn lease_state_reset_on_return() {
+        let dir = models("reset", &[("a.rtm", b"model a")]);
+        let registry = ModelRegistry::scan(&dir, 2).unwrap();
+        let a = hash(&registry, "a");
+
+        let mut lease = registry.lease(a, "cpu").unwrap();
+        lease.set_class_filter(ClassFilter::new().with_classes(&[1]));
+        lease.set_nms(Nms::ClassAgnostic, 0.3);
+        drop(lease);
+        let lease = registry.lease(a, "cpu").unwrap();
+        assert!(lease.class_filter().is_empty());
+        assert_eq!(lease.nms(), Nms::PerClass);
+        drop(lease);
+
+        // A context now running another model cannot serve the key.
+        let mut lease = registry.lease(a, "cpu").unwrap();
+        lease.load_model(b"model z".to_vec()).unwrap();
+        drop(lease);
+        assert_eq!(registry.idle(), 0);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn changed_model_rejected() {
+        let dir = models("changed", &[("a.rtm", b"model a")]);
+        let registry = ModelRegistry::scan(&dir, 2).unwrap();
+        let a = hash(&registry, "a");
+        fs::write(dir.join("a.rtm"), b"model a, retrained").unwrap();
+        assert!(registry.lease(a, "cpu").is_err());
+        assert!(registry.lease(ModelKey::Hash(0), "cpu").is_err());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,451 @@
+use crate::{Error, VAALBox, mmap::Mmap};
+use std::{
+    ffi::CString,
+    io,
+    os::fd::{AsFd, AsRawFd, BorrowedFd, FromRawFd, OwnedFd},
+    sync::atomic::{AtomicU32, AtomicU64, Ordering, fence},
+};
+
+const MAGIC: u64 = u64::from_le_bytes(*b"VSHMRNG1");
+const HEADER_SIZE: usize = 128;
+const WRITE_SEQ_OFFSET: usize = 64;
+const SLOT_HEADER: usize = 32;
+const BOX_WORDS: usize = 6;
+
+/// Layout of the segment, shared by publisher and subscribers.
+///
+/// header: magic u64, slots u32, max_boxes u32, slot_size u64 then the
+/// published sequence number on its own cache line at offset 64.
+///
+/// slot: seq u64, frame_id u64, timestamp i64, count u32, pad u32 followed by
+/// max_boxes boxes of six 32-bit words.  Slot n holds message n % slots and
+/// its seq is 2n+1 while being written and 2n+2 once complete.
+#[derive(Clone, Copy)]
+struct Layout {
+    slots: usize,
+    max_boxes: usize,
+    slot_size: usize,
+}
+
+impl Layout {
+    fn new(slots: usize, max_boxes: usize) -> Self {
+        Layout {
+            slots,
+            max_boxes,
+            slot_size: (SLOT_HEADER + max_boxes * BOX_WORDS * 4).next_multiple_of(64),
+        }
+    }
+
+    fn len(&self) -> usize {
+        HEADER_SIZE + self.slots * self.slot_size
+    }
+}
+
+struct Segment {
+    map: Mmap,
+    fd: OwnedFd,
+    layout: Layout,
+}
+
+impl Segment {
+    fn u64_at(&self, offset: usize) -> &AtomicU64 {
+        unsafe { &*(self.map.as_ptr().add(offset) as *const AtomicU64) }
+    }
+
+    fn u32_at(&self, offset: usize) -> &AtomicU32 {
+        unsafe { &*(self.map.as_ptr().add(offset) as *const AtomicU32) }
+    }
+
+    fn write_seq(&self) -> &AtomicU64 {
+        self.u64_at(WRITE_SEQ_OFFSET)
+    }
+
+    fn slot(&self, message: u64) -> usize {
+        HEADER_SIZE + (message % self.layout.slots as u64) as usize * self.layout.slot_size
+    }
+}
+
+fn create_memfd(len: usize) -> Result<OwnedFd, Error> {
+    let name = CString::new("vaal-shm-ring").unwrap();
+    let fd = unsafe { libc::memfd_create(name.as_ptr(), libc::MFD_CLOEXEC) };
+    if fd < 0 {
+        return Err(Error::from(io::Error::last_os_error()));
+    }
+    let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+    if unsafe { libc::ftruncate(fd.as_raw_fd(), len as libc::off_t) } < 0 {
+        return Err(Error::from(io::Error::last_os_error()));
+    }
+    Ok(fd)
+}
+
+fn shm_name(name: &str) -> Result<CString, Error> {
+    let name = if name.starts_with('/') {
+        name.to_owned()
+    } else {
+        format!("/{}", name)
+    };
+    match CString::new(name) {
+        Ok(name) => Ok(name),
+        Err(e) => Err(Error::WrapperError(e.to_string())),
+    }
+}
+
+/// Single producer of a shared-memory ring of detection results.  Publishing
+/// is plain memory writes guarded by per-slot sequence numbers (a seqlock), so
+/// neither the producer nor the subscribers make syscalls per frame and a slow
+/// subscriber can never block the producer, it only loses old frames.
+pub struct ShmPublisher {
+    segment: Segment,
+    name: Option<CString>,
+    next: u64,
+}
+
+impl ShmPublisher {
+    /// Creates an anonymous ring in a memfd, share it with other processes by
+    /// passing the descriptor from `fd()`.
+    pub fn create_memfd(slots: usize, max_boxes: usize) -> Result<Self, Error> {
+        let layout = Layout::new(slots.max(1), max_boxes);
+        let fd = create_memfd(layout.len())?;
+        Self::init(fd, layout, None)
+    }
+
+    /// Creates (or truncates) the named POSIX shared memory ring found under
+    /// /dev/shm, the name is unlinked when the publisher is dropped.
+    pub fn create(name: &str, slots: usize, max_boxes: usize) -> Result<Self, Error> {
+        let layout = Layout::new(slots.max(1), max_boxes);
+        let name = shm_name(name)?;
+        let fd = unsafe {
+            libc::shm_open(
+                name.as_ptr(),
+                libc::O_CREAT | libc::O_TRUNC | libc::O_RDWR | libc::O_CLOEXEC,
+                0o600,
+            )
+        };
+        if fd < 0 {
+            return Err(Error::from(io::Error::last_os_error()));
+        }
+        let fd = unsafe { OwnedFd::from_raw_fd(fd) };
+        if unsafe { libc::ftruncate(fd.as_raw_fd(), layout.len() as libc::off_t) } < 0 {
+            let err = io::Error::last_os_error();
+            unsafe { libc::shm_unlink(name.as_ptr()) };
+            return Err(Error::from(err));
+        }
+        Self::init(fd, layout, Some(name))
+    }
+
+    fn init(fd: OwnedFd, layout: Layout, name: Option<CString>) -> Result<Self, Error> {
+        let map = Mmap::map(fd.as_raw_fd(), layout.len(), true)?;
+        let segment = Segment { map, fd, layout };
+        segment
+            .u32_at(8)
+            .store(layout.slots as u32, Ordering::Relaxed);
+        segment
+            .u32_at(12)
+            .store(layout.max_boxes as u32, Ordering::Relaxed);
+        segment
+            .u64_at(16)
+            .store(layout.slot_size as u64, Ordering::Relaxed);
+        segment.write_seq().store(0, Ordering::Relaxed);
+        segment.u64_at(0).store(MAGIC, Ordering::Release);
+        Ok(ShmPublisher {
+            segment,
+            name,
+            next: 0,
+        })
+    }
+
+    pub fn fd(&self) -> BorrowedFd<'_> {
+        self.segment.fd.as_fd()
+    }
+
+    pub fn max_boxes(&self) -> usize {
+        self.segment.layout.max_boxes
+    }
+
+    /// Publishes the frame, truncating boxes to max_boxes, and returns the
+    /// sequence number of the message.
+    pub fn publish(&mut self, frame_id: u64, timestamp: i64, boxes: &[VAALBox]) -> u64 {
+        let segment = &self.segment;
+        let message = self.next;
+        let slot = segment.slot(message);
+        let seq = segment.u64_at(slot);
+        let count = boxes.len().min(segment.layout.max_boxes);
+
+        seq.store(message * 2 + 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        segment.u64_at(slot + 8).store(frame_id, Ordering::Relaxed);
+        segment
+            .u64_at(slot + 16)
+            .store(timestamp as u64, Ordering::Relaxed);
+        segment
+            .u32_at(slot + 24)
+            .store(count as u32, Ordering::Relaxed);
+        for (i, b) in boxes[..count].iter().enumerate() {
+            let offset = slot + SLOT_HEADER + i * BOX_WORDS * 4;
+            let words = [
+                b.xmin.to_bits(),
+                b.ymin.to_bits(),
+                b.xmax.to_bits(),
+                b.ymax.to_bits(),
+                b.score.to_bits(),
+                b.label as u32,
+            ];
+            for (j, word) in words.iter().enumerate() {
+                segment
+                    .u32_at(offset + j * 4)
+                    .store(*word, Ordering::Relaxed);
+            }
+        }
+        seq.store(message * 2 + 2, Ordering::Release);
+        segment.write_seq().store(message + 1, Ordering::Release);
+        self.next += 1;
+        message
+    }
+}
+
+impl Drop for ShmPublisher {
+    fn drop(&mut self) {
+        if let Some(name) = &self.name {
+            unsafe { libc::shm_unlink(name.as_ptr()) };
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ShmFrame {
+    pub seq: u64,
+    pub frame_id: u64,
+    pub timestamp: i64,
+}
+
+/// Reader of a ring created by `ShmPublisher`, any number may attach.
+pub struct ShmSubscriber {
+    segment: Segment,
+    next: u64,
+    lost: u64,
+}
+
+impl ShmSubscriber {
+    pub fn open(name: &str) -> Result<Self, Error> {
+        let name = shm_name(name)?;
+        let fd = unsafe { libc::shm_open(name.as_ptr(), libc::O_RDONLY | libc::O_CLOEXEC, 0) };
+        if fd < 0 {
+            return Err(Error::from(io::Error::last_os_error()));
+        }
+        Self::from_fd(unsafe { OwnedFd::from_raw_fd(fd) })
+    }
+
+    /// Attaches to a ring from a descriptor received from the publisher.
+    pub fn from_fd(fd: OwnedFd) -> Result<Self, Error> {
+        let mut stat: libc::stat = unsafe { std::mem::zeroed() };
+        if unsafe { libc::fstat(fd.as_raw_fd(), &mut stat) } < 0 {
+            return Err(Error::from(io::Error::last_os_error()));
+        }
+        let len = stat.st_size as usize;
+        if len < HEADER_SIZE {
+            return Err(Error::WrapperError(
+                "shared memory ring too small".to_owned(),
+            ));
+        }
+        let map = Mmap::map(fd.as_raw_fd(), len, false)?;
+        let header = Segment {
+            map,
+            fd,
+            layout: Layout::new(1, 0),
+        };
+        if header.u64_at(0).load(Ordering::Acquire) != MAGIC {
+            return Err(Error::WrapperError("not a shared memory ring".to_owned()));
+        }
+        let layout = Layout::new(
+            header.u32_at(8).load(Ordering::Relaxed) as usize,
+            header.u32_at(12).load(Ordering::Relaxed) as usize,
+        );
+        if layout.slots == 0
+            || layout.slot_size as u64 != header.u64_at(16).load(Ordering::Relaxed)
+            || layout.len() > len
+        {
+            return Err(Error::WrapperError("invalid shared memory ring".to_owned()));
+        }
+        let segment = Segment { layout, ..header };
+        // New subscribers start with the next frame to be published.
+        let next = segment.write_seq().load(Ordering::Acquire);
+        Ok(ShmSubscriber {
+            segment,
+            next,
+            lost: 0,
+        })
+    }
+
+    /// Frames overwritten before this subscriber could read them.
+    pub fn lost(&self) -> u64 {
+        self.lost
+    }
+
+    /// Number of published frames not yet read.
+    pub fn pending(&self) -> u64 {
+        self.segment
+            .write_seq()
+            .load(Ordering::Acquire)
+            .saturating_sub(self.next)
+    }
+
+    /// Reads the next frame into boxes without blocking, returning None when
+    /// the subscriber has caught up with the publisher.  If the subscriber
+    /// fell more than a ring behind it skips to the oldest frame still held.
+    pub fn next(&mut self, boxes: &mut Vec<VAALBox>) -> Option<ShmFrame> {
+        let segment = &self.segment;
+        let slots = segment.layout.slots as u64;
+        loop {
+            let head = segment.write_seq().load(Ordering::Acquire);
+            if self.next >= head {
+                return None;
+            }
+            if head - self.next > slots {
+                self.lost += head - slots - self.next;
+                self.next = head - slots;
+            }
+
+            let message = self.next;
+            let slot = segment.slot(message);
+            let seq = segment.u64_at(slot);
+            let before = seq.load(Ordering::Acquire);
+            if before != message * 2 + 2 {
+                // The slot was already reused for a later message.
+                self.lost += 1;
+                self.next += 1;
+                continue;
+            }
+
+            let frame_id = segment.u64_at(slot + 8).load(Ordering::Relaxed);
+            let timestamp = segment.u64_at(slot + 16).load(Ordering::Relaxed) as i64;
+            let count = (segment.u32_at(slot + 24).load(Ordering::Relaxed) as usize)
+                .min(segment.layout.max_boxes);
+            boxes.clear();
+            for i in 0..count {
+                let offset = slot + SLOT_HEADER + i * BOX_WORDS * 4;
+                let word = |j: usize| segment.u32_at(offset + j * 4).load(Ordering::Relaxed);
+                boxes.push(VAALBox {
+                    xmin: f32::from_bits(word(0)),
+                    ymin: f32::from_bits(word(1)),
+                    xmax: f32::from_bits(word(2)),
+                    ymax: f32::from_bits(word(3)),
+                    score: f32::from_bits(word(4)),
+                    label: word(5) as i32,
+                });
+            }
+
+            fence(Ordering::Acquire);
+            if seq.load(Ordering::Relaxed) != before {
+                self.lost += 1;
+                self.next += 1;
+                continue;
+            }
+            self.next += 1;
+            return Some(ShmFrame {
+                seq: message,
+                frame_id,
+                timestamp,
+            });
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::{sync::atomic::AtomicBool, thread};
+
+    /// Boxes whose every field is derived from the frame id, so a torn read
+    /// mixing two frames is detectable.
+    fn frame_boxes(frame_id: u64, boxes: &mut Vec<VAALBox>) {
+        boxes.clear();
+        for i in 0..(frame_id % 8 + 1) {
+            let v = (frame_id * 8 + i) as f32;
+            boxes.push(VAALBox {
+                xmin: v,
+                ymin: v + 1.0,
+                xmax: v + 2.0,
+                ymax: v + 3.0,
+                score: v + 4.0,
+                label: frame_id as i32,
+            });
+        }
+    }
+
+    #[test]
+    fn subscribers_never_see_torn_frames() {
+        const FRAMES: u64 = 200_000;
+        let mut publisher = ShmPublisher::create_memfd(4, 8).unwrap();
+        let done = AtomicBool::new(false);
+
+        thread::scope(|scope| {
+            let readers: Vec<_> = (0..3)
+                .map(|_| {
+                    let fd = publisher.fd().try_clone_to_owned().unwrap();
+                    let mut subscriber = ShmSubscriber::from_fd(fd).unwrap();
+                    let done = &done;
+                    scope.spawn(move || {
+                        let (mut boxes, mut expected) = (Vec::new(), Vec::new());
+                        let mut last = None;
+                        let mut read = 0;
+                        loop {
+                            // Read the flag first so a final drain sees every
+                            // frame published before it was set.
+                            let finished = done.load(Ordering::Acquire);
+                            while let Some(frame) = subscriber.next(&mut boxes) {
+                                assert!(last < Some(frame.seq));
+                                last = Some(frame.seq);
+                                assert_eq!(frame.frame_id, frame.seq);
+                                assert_eq!(frame.timestamp, -(frame.seq as i64));
+                                frame_boxes(frame.frame_id, &mut expected);
+                                assert_eq!(boxes.len(), expected.len());
+                                for (a, b) in boxes.iter().zip(&expected) {
+                                    assert_eq!(
+                                        (a.xmin, a.ymin, a.xmax, a.ymax, a.score, a.label),
+                                        (b.xmin, b.ymin, b.xmax, b.ymax, b.score, b.label)
+                                    );
+                                }
+                                read += 1;
+                            }
+                            if finished {
+                                break;
+                            }
+                        }
+                        (read, subscriber.lost())
+                    })
+                })
+                .collect();
+
+            let mut boxes = Vec::new();
+            for frame_id in 0..FRAMES {
+                frame_boxes(frame_id, &mut boxes);
+                assert_eq!(
+                    publisher.publish(frame_id, -(frame_id as i64), &boxes),
+                    frame_id
+                );
+            }
+            done.store(true, Ordering::Release);
+
+            for reader in readers {
+                let (read, lost) = reader.join().unwrap();
+                assert!(read > 0);
+                assert_eq!(read + lost, FRAMES);
+            }
+        });
+    }
+
+    #[test]
+    fn boxes_truncated_to_slot() {
+        let mut publisher = ShmPublisher::create_memfd(2, 3).unwrap();
+        let fd = publisher.fd().try_clone_to_owned().unwrap();
+        let mut subscriber = ShmSubscriber::from_fd(fd).unwrap();
+        let mut boxes = Vec::new();
+        frame_boxes(7, &mut boxes);
+        publisher.publish(7, 0, &boxes);
+        assert_eq!(subscriber.pending(), 1);
+        let mut read = Vec::new();
+        assert!(subscriber.next(&mut read).is_some());
+        assert_eq!(read.len(), 3);
+        assert!(subscriber.next(&mut read).is_none());
+    }
+}
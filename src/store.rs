@@ -0,0 +1,500 @@
+use crate::{Error, VAALBox, mmap::Mmap};
+use std::{
+    fs::{File, OpenOptions},
+    io::{Read, Write},
+    mem::size_of,
+    os::fd::AsRawFd,
+    path::Path,
+    slice,
+};
+
+const MAGIC: &[u8; 8] = b"VDETSTR1";
+const CHUNK_MAGIC: &[u8; 4] = b"CHNK";
+const CHUNK_HEADER: usize = 64;
+
+fn read_u32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+fn read_u64(buf: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(buf[offset..offset + 8].try_into().unwrap())
+}
+
+fn column_len<T>(count: usize) -> usize {
+    (count * size_of::<T>()).next_multiple_of(8)
+}
+
+fn extend_column<T: Copy>(buf: &mut Vec<u8>, values: &[T]) {
+    let bytes = unsafe {
+        slice::from_raw_parts(values.as_ptr() as *const u8, std::mem::size_of_val(values))
+    };
+    buf.extend_from_slice(bytes);
+    buf.resize(buf.len().next_multiple_of(8), 0);
+}
+
+fn chunk_len(frames: usize, boxes: usize) -> usize {
+    CHUNK_HEADER
+        + column_len::<u64>(frames) * 2
+        + column_len::<u32>(frames + 1)
+        + column_len::<f32>(boxes) * 6
+}
+
+/// Length of the file up to the end of its last complete chunk.
+fn complete_chunks(file: &File, len: usize) -> Result<usize, Error> {
+    let map = Mmap::map(file.as_raw_fd(), len, false)?;
+    let buf = map.as_slice();
+    let mut offset = MAGIC.len();
+    while offset + CHUNK_HEADER <= len {
+        let frames = read_u32(buf, offset + 8) as usize;
+        let boxes = read_u32(buf, offset + 12) as usize;
+        let length = read_u64(buf, offset + 48) as usize;
+        if &buf[offset..offset + 4] != CHUNK_MAGIC || length != chunk_len(frames, boxes) {
+            return Err(Error::WrapperError(format!(
+                "corrupt detection chunk at {}",
+                offset
+            )));
+        }
+        if offset + length > len {
+            break;
+        }
+        offset += length;
+    }
+    Ok(offset)
+}
+
+/// Appends detections in chunks of columnar arrays.  Every chunk starts with a
+/// 64 byte header holding the frame and box counts and the frame id and
+/// timestamp ranges, followed by 8 byte aligned columns: frame ids (u64),
+/// timestamps (i64), per-frame box offsets (u32, frames + 1), then xmin, ymin,
+/// xmax, ymax, score (f32) and label (i32).  Columns use the native little
+/// endian layout so readers can use them in place.
+pub struct DetectionWriter {
+    file: File,
+    chunk_frames: usize,
+    frame_ids: Vec<u64>,
+    timestamps: Vec<i64>,
+    offsets: Vec<u32>,
+    xmin: Vec<f32>,
+    ymin: Vec<f32>,
+    xmax: Vec<f32>,
+    ymax: Vec<f32>,
+    score: Vec<f32>,
+    label: Vec<i32>,
+    chunk: Vec<u8>,
+}
+
+impl DetectionWriter {
+    /// Opens the store for appending, creating it when missing.  A chunk is
+    /// written out every chunk_frames frames.  A trailing chunk cut short by a
+    /// crash is removed so new chunks stay readable.
+    pub fn open<P: AsRef<Path>>(path: P, chunk_frames: usize) -> Result<Self, Error> {
+        let mut file = OpenOptions::new()
+            .read(true)
+            .append(true)
+            .create(true)
+            .open(path)?;
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            file.write_all(MAGIC)?;
+        } else {
+            let mut magic = [0u8; 8];
+            file.read_exact(&mut magic)?;
+            if &magic != MAGIC {
+                return Err(Error::WrapperError("not a detection store".to_owned()));
+            }
+            let end = complete_chunks(&file, len)?;
+            if end != len {
+                file.set_len(end as u64)?;
+            }
+        }
+        Ok(DetectionWriter {
+            file,
+            chunk_frames: chunk_frames.max(1),
+            frame_ids: Vec::new(),
+            timestamps: Vec::new(),
+            offsets: vec![0],
+            xmin: Vec::new(),
+            ymin: Vec::new(),
+            xmax: Vec::new(),
+            ymax: Vec::new(),
+            score: Vec::new(),
+            label: Vec::new(),
+            chunk: Vec::new(),
+        })
+    }
+
+    pub fn append(
+        &mut self,
+        frame_id: u64,
+        timestamp: i64,
+        boxes: &[VAALBox],
+    ) -> Result<(), Error> {
+        self.frame_ids.push(frame_id);
+        self.timestamps.push(timestamp);
+        for b in boxes {
+            self.xmin.push(b.xmin);
+            self.ymin.push(b.ymin);
+            self.xmax.push(b.xmax);
+            self.ymax.push(b.ymax);
+            self.score.push(b.score);
+            self.label.push(b.label);
+        }
+        self.offsets.push(self.xmin.len() as u32);
+        if self.frame_ids.len() >= self.chunk_frames {
+            self.flush()?;
+        }
+        Ok(())
+    }
+
+    /// Writes any buffered frames as a (possibly short) chunk.
+    pub fn flush(&mut self) -> Result<(), Error> {
+        if self.frame_ids.is_empty() {
+            return Ok(());
+        }
+        let frames = self.frame_ids.len();
+        let boxes = self.xmin.len();
+        let frame_min = *self.frame_ids.iter().min().unwrap();
+        let frame_max = *self.frame_ids.iter().max().unwrap();
+        let ts_min = *self.timestamps.iter().min().unwrap();
+        let ts_max = *self.timestamps.iter().max().unwrap();
+        let len = chunk_len(frames, boxes);
+
+        let chunk = &mut self.chunk;
+        chunk.clear();
+        chunk.extend_from_slice(CHUNK_MAGIC);
+        chunk.extend_from_slice(&0u32.to_le_bytes());
+        chunk.extend_from_slice(&(frames as u32).to_le_bytes());
+        chunk.extend_from_slice(&(boxes as u32).to_le_bytes());
+        chunk.extend_from_slice(&frame_min.to_le_bytes());
+        chunk.extend_from_slice(&frame_max.to_le_bytes());
+        chunk.extend_from_slice(&ts_min.to_le_bytes());
+        chunk.extend_from_slice(&ts_max.to_le_bytes());
+        chunk.extend_from_slice(&(len as u64).to_le_bytes());
+        chunk.extend_from_slice(&0u64.to_le_bytes());
+        extend_column(chunk, &self.frame_ids);
+        extend_column(chunk, &self.timestamps);
+        extend_column(chunk, &self.offsets);
+        extend_column(chunk, &self.xmin);
+        extend_column(chunk, &self.ymin);
+        extend_column(chunk, &self.xmax);
+        extend_column(chunk, &self.ymax);
+        extend_column(chunk, &self.score);
+        extend_column(chunk, &self.label);
+        debug_assert_eq!(chunk.len(), len);
+        self.file.write_all(chunk)?;
+
+        self.frame_ids.clear();
+        self.timestamps.clear();
+        self.offsets.truncate(1);
+        self.xmin.clear();
+        self.ymin.clear();
+        self.xmax.clear();
+        self.ymax.clear();
+        self.score.clear();
+        self.label.clear();
+        Ok(())
+    }
+}
+
+impl Drop for DetectionWriter {
+    fn drop(&mut self) {
+        let _ = self.flush();
+    }
+}
+
+/// Sparse index entry, one per chunk.
+#[derive(Debug, Clone, Copy)]
+pub struct ChunkInfo {
+    pub frames: usize,
+    pub boxes: usize,
+    pub frame_min: u64,
+    pub frame_max: u64,
+    pub ts_min: i64,
+    pub ts_max: i64,
+    offset: usize,
+}
+
+/// Memory-mapped reader of a `DetectionWriter` file.  Opening only walks the
+/// chunk headers to build the time index, box data is read in place.
+pub struct DetectionStore {
+    map: Mmap,
+    chunks: Vec<ChunkInfo>,
+    /// Running maximum of ts_max over the chunks sorted by ts_min, so the
+    /// first chunk which may reach a start time is a binary search even when
+    /// chunks overlap.
+    ts_max_prefix: Vec<i64>,
+}
+
+impl DetectionStore {
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Self, Error> {
+        let file = File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        let map = Mmap::map(file.as_raw_fd(), len, false)?;
+        let buf = map.as_slice();
+        if len < MAGIC.len() || &buf[..MAGIC.len()] != MAGIC {
+            return Err(Error::WrapperError("not a detection store".to_owned()));
+        }
+
+        let mut chunks = Vec::new();
+        let mut offset = MAGIC.len();
+        while offset + CHUNK_HEADER <= len {
+            if &buf[offset..offset + 4] != CHUNK_MAGIC {
+                return Err(Error::WrapperError(format!(
+                    "corrupt detection chunk at {}",
+                    offset
+                )));
+            }
+            let frames = read_u32(buf, offset + 8) as usize;
+            let boxes = read_u32(buf, offset + 12) as usize;
+            let length = read_u64(buf, offset + 48) as usize;
+            if length != chunk_len(frames, boxes) {
+                return Err(Error::WrapperError(format!(
+                    "corrupt detection chunk at {}",
+                    offset
+                )));
+            }
+            // A chunk cut short by a crash ends the store.
+            if offset + length > len {
+                break;
+            }
+            chunks.push(ChunkInfo {
+                frames,
+                boxes,
+                frame_min: read_u64(buf, offset + 16),
+                frame_max: read_u64(buf, offset + 24),
+                ts_min: read_u64(buf, offset + 32) as i64,
+                ts_max: read_u64(buf, offset + 40) as i64,
+                offset,
+            });
+            offset += length;
+        }
+        chunks.sort_by_key(|c| c.ts_min);
+        let ts_max_prefix = chunks
+            .iter()
+            .scan(i64::MIN, |max, c| {
+                *max = (*max).max(c.ts_max);
+                Some(*max)
+            })
+            .collect();
+
+        Ok(DetectionStore {
+            map,
+            chunks,
+            ts_max_prefix,
+        })
+    }
+
+    pub fn chunks(&self) -> impl Iterator<Item = ChunkView<'_>> {
+        self.chunks.iter().map(|info| self.view(info))
+    }
+
+    pub fn index(&self) -> &[ChunkInfo] {
+        &self.chunks
+    }
+
+    /// Chunks which may hold frames with timestamps in start..=end, found
+    /// through the time index without touching the box data.
+    pub fn range(&self, start: i64, end: i64) -> impl Iterator<Item = ChunkView<'_>> {
+        let first = self.ts_max_prefix.partition_point(|max| *max < start);
+        let last = self.chunks.partition_point(|c| c.ts_min <= end);
+        self.chunks[first..last.max(first)]
+            .iter()
+            .filter(move |c| c.ts_max >= start)
+            .map(|info| self.view(info))
+    }
+
+    pub fn frames(&self) -> usize {
+        self.chunks.iter().map(|c| c.frames).sum()
+    }
+
+    pub fn boxes(&self) -> usize {
+        self.chunks.iter().map(|c| c.boxes).sum()
+    }
+
+    fn view(&self, info: &ChunkInfo) -> ChunkView<'_> {
+        ChunkView {
+            data: &self.map.as_slice()[info.offset..],
+            info: *info,
+        }
+    }
+}
+
+/// Zero-copy view of the columns of one chunk.
+pub struct ChunkView<'a> {
+    data: &'a [u8],
+    info: ChunkInfo,
+}
+
+impl<'a> ChunkView<'a> {
+    fn column<T>(&self, index: usize) -> &'a [T] {
+        let frames = self.info.frames;
+        let boxes = self.info.boxes;
+        let mut offset = CHUNK_HEADER;
+        let count = match index {
+            0 | 1 => {
+                offset += column_len::<u64>(frames) * index;
+                frames
+            }
+            2 => {
+                offset += column_len::<u64>(frames) * 2;
+                frames + 1
+            }
+            _ => {
+                offset += column_len::<u64>(frames) * 2
+                    + column_len::<u32>(frames + 1)
+                    + column_len::<f32>(boxes) * (index - 3);
+                boxes
+            }
+        };
+        let bytes = &self.data[offset..offset + count * size_of::<T>()];
+        unsafe { slice::from_raw_parts(bytes.as_ptr() as *const T, count) }
+    }
+
+    pub fn info(&self) -> &ChunkInfo {
+        &self.info
+    }
+
+    pub fn frame_ids(&self) -> &'a [u64] {
+        self.column(0)
+    }
+
+    pub fn timestamps(&self) -> &'a [i64] {
+        self.column(1)
+    }
+
+    /// Box offsets per frame, the boxes of frame i are
+    /// offsets[i]..offsets[i+1].
+    pub fn offsets(&self) -> &'a [u32] {
+        self.column(2)
+    }
+
+    pub fn xmin(&self) -> &'a [f32] {
+        self.column(3)
+    }
+
+    pub fn ymin(&self) -> &'a [f32] {
+        self.column(4)
+    }
+
+    pub fn xmax(&self) -> &'a [f32] {
+        self.column(5)
+    }
+
+    pub fn ymax(&self) -> &'a [f32] {
+        self.column(6)
+    }
+
+    pub fn score(&self) -> &'a [f32] {
+        self.column(7)
+    }
+
+    pub fn label(&self) -> &'a [i32] {
+        self.column(8)
+    }
+
+    pub fn boxes(&self, frame: usize) -> impl Iterator<Item = VAALBox> + 'a {
+        let offsets = self.offsets();
+        let (xmin, ymin, xmax, ymax) = (self.xmin(), self.ymin(), self.xmax(), self.ymax());
+        let (score, label) = (self.score(), self.label());
+        (offsets[frame] as usize..offsets[frame + 1] as usize).map(move |i| VAALBox {
+            xmin: xmin[i],
+            ymin: ymin[i],
+            xmax: xmax[i],
+            ymax: ymax[i],
+            score: score[i],
+            label: label[i],
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn boxes(frame: u64) -> Vec<VAALBox> {
+        (0..frame % 3)
+            .map(|i| VAALBox {
+                xmin: frame as f32,
+                ymin: i as f32,
+                xmax: 1.0,
+                ymax: 1.0,
+                score: 0.5,
+                label: i as i32,
+            })
+            .collect()
+    }
+
+    #[test]
+    fn reopen_trims_partial_chunk() {
+        let path = std::env::temp_dir().join(format!("vaal-store-{}", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+
+        let mut writer = DetectionWriter::open(&path, 4).unwrap();
+        for frame in 0..8 {
+            writer.append(frame, frame as i64, &boxes(frame)).unwrap();
+        }
+        drop(writer);
+        // A crash in the middle of the second chunk.
+        let len = std::fs::metadata(&path).unwrap().len();
+        OpenOptions::new()
+            .write(true)
+            .open(&path)
+            .unwrap()
+            .set_len(len - 10)
+            .unwrap();
+
+        let mut writer = DetectionWriter::open(&path, 4).unwrap();
+        for frame in 8..16 {
+            writer.append(frame, frame as i64, &boxes(frame)).unwrap();
+        }
+        drop(writer);
+
+        let store = DetectionStore::open(&path).unwrap();
+        let frames: Vec<u64> = store
+            .chunks()
+            .flat_map(|chunk| chunk.frame_ids().to_vec())
+            .collect();
+        assert_eq!(frames, [0, 1, 2, 3, 8, 9, 10, 11, 12, 13, 14, 15]);
+        for chunk in store.chunks() {
+            for (i, frame) in chunk.frame_ids().iter().enumerate() {
+                let read: Vec<_> = chunk.boxes(i).map(|b| (b.xmin, b.ymin, b.label)).collect();
+                let written: Vec<_> = boxes(*frame)
+                    .iter()
+                    .map(|b| (b.xmin, b.ymin, b.label))
+                    .collect();
+                assert_eq!(read, written);
+            }
+        }
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn range_with_overlapping_chunks() {
+        let path = std::env::temp_dir().join(format!("vaal-store-range-{}", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+
+        // Chunks of two frames, the second spans the whole recording.
+        let timestamps = [(0, 10), (5, 100), (20, 30), (40, 50), (60, 70)];
+        let mut writer = DetectionWriter::open(&path, 2).unwrap();
+        for (frame, (a, b)) in timestamps.iter().enumerate() {
+            writer.append(frame as u64 * 2, *a, &[]).unwrap();
+            writer.append(frame as u64 * 2 + 1, *b, &[]).unwrap();
+        }
+        drop(writer);
+
+        let store = DetectionStore::open(&path).unwrap();
+        let found = |start, end| {
+            store
+                .range(start, end)
+                .map(|chunk| chunk.info().ts_min)
+                .collect::<Vec<_>>()
+        };
+        assert_eq!(found(45, 45), [5, 40]);
+        assert_eq!(found(12, 18), [5]);
+        assert_eq!(found(0, 0), [0]);
+        assert_eq!(found(65, 1000), [5, 60]);
+        assert_eq!(found(101, 200), Vec::<i64>::new());
+        assert_eq!(found(-10, -1), Vec::<i64>::new());
+        std::fs::remove_file(&path).unwrap();
+    }
+}
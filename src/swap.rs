@@ -0,0 +1,197 @@
+use crate::{Context, Error, device::fill_inputs};
+use std::{
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+#[derive(Debug, Clone, Copy)]
+pub struct SwapReport {
+    /// Time from begin_swap until the new context was ready, spent on the
+    /// background thread while frames kept running.
+    pub prepare: Duration,
+    /// Time the frame loop was blocked by the switch itself.
+    pub stall: Duration,
+}
+
+struct Prepared {
+    context: Context,
+    elapsed: Duration,
+}
+
+/// Double-buffered context for replacing the model without stopping
+/// inference.  The next model is loaded and warmed up in a shadow context on
+/// a background thread while frames keep running on the current one, at the
+/// next frame boundary the contexts are exchanged and the old context is
+/// released on another thread.
+pub struct HotSwap {
+    current: Context,
+    pending: Option<JoinHandle<Result<Prepared, Error>>>,
+    last: Option<SwapReport>,
+}
+
+impl HotSwap {
+    pub fn new(context: Context) -> Self {
+        HotSwap {
+            current: context,
+            pending: None,
+            last: None,
+        }
+    }
+
+    pub fn context(&self) -> &Context {
+        &self.current
+    }
+
+    pub fn context_mut(&mut self) -> &mut Context {
+        &mut self.current
+    }
+
+    /// A swap has been started and not yet switched in.
+    pub fn is_pending(&self) -> bool {
+        self.pending.is_some()
+    }
+
+    /// The report of the most recent completed swap.
+    pub fn last_swap(&self) -> Option<SwapReport> {
+        self.last
+    }
+
+    /// Starts preparing a context with prepare on a background thread,
+    /// replacing any swap which has not been switched in yet.
+    pub fn begin_swap_with<F>(&mut self, prepare: F)
+    where
+        F: FnOnce() -> Result<Context, Error> + Send + 'static,
+    {
+        let start = Instant::now();
+        let handle = thread::spawn(move || {
+            let context = prepare()?;
+            Ok(Prepared {
+                context,
+                elapsed: start.elapsed(),
+            })
+        });
+        if let Some(previous) = self.pending.replace(handle) {
+            // Drop the abandoned context off the frame loop as well.
+            thread::spawn(move || drop(previous.join()));
+        }
+    }
+
+    /// Loads model on a new context for the device and runs it warmup times
+    /// so the first frame after the switch does not pay for lazy setup.
+    pub fn begin_swap(&mut self, device: &str, model: Vec<u8>, warmup: usize) {
+        let device = device.to_owned();
+        self.begin_swap_with(move || {
+            let mut context = Context::new(&device)?;
+            context.load_model(model)?;
+            if warmup > 0 {
+                fill_inputs(&context)?;
+                for _ in 0..warmup {
+                    context.run_model()?;
+                }
+            }
+            Ok(context)
+        });
+    }
+
+    /// Call between frames, switches to the prepared context once it is
+    /// ready.  Never waits for the background load, a swap which is still in
+    /// progress returns Ok(None) and a failed one returns its error while the
+    /// current context stays in place.
+    pub fn frame_boundary(&mut self) -> Result<Option<SwapReport>, Error> {
+        if !self.pending.as_ref().is_some_and(|h| h.is_finished()) {
+            return Ok(None);
+        }
+        self.switch()
+    }
+
+    /// Blocks until a pending swap is ready and switches to it.
+    pub fn finish_swap(&mut self) -> Result<Option<SwapReport>, Error> {
+        if self.pending.is_none() {
+            return Ok(None);
+        }
+        self.switch()
+    }
+
+    fn switch(&mut self) -> Result<Option<SwapReport>, Error> {
+        let start = Instant::now();
+        let prepared = match self.pending.take().unwrap().join() {
+            Ok(prepared) => prepared?,
+            Err(_) => {
+                return Err(Error::WrapperError("model swap thread panicked".to_owned()));
+            }
+        };
+        let old = std::mem::replace(&mut self.current, prepared.context);
+        let stall = start.elapsed();
+        thread::spawn(move || drop(old));
+
+        let report = SwapReport {
+            prepare: prepared.elapsed,
+            stall,
+        };
+        self.last = Some(report);
+        Ok(Some(report))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::mpsc;
+
+    #[test]
+    fn frame_boundary_switches_once_ready() {
+        let mut swap = HotSwap::new(Context::new("cpu").unwrap());
+        assert!(swap.frame_boundary().unwrap().is_none());
+
+        let (ready, wait) = mpsc::channel::<()>();
+        swap.begin_swap_with(move || {
+            wait.recv().unwrap();
+            Context::new("cpu")
+        });
+        // Still loading, the frame loop keeps the current context.
+        assert!(swap.frame_boundary().unwrap().is_none());
+        assert!(swap.is_pending());
+        assert!(swap.last_swap().is_none());
+
+        ready.send(()).unwrap();
+        let report = loop {
+            if let Some(report) = swap.frame_boundary().unwrap() {
+                break report;
+            }
+            thread::sleep(Duration::from_millis(1));
+        };
+        assert!(!swap.is_pending());
+        assert_eq!(swap.last_swap().map(|r| r.prepare), Some(report.prepare));
+        assert!(swap.frame_boundary().unwrap().is_none());
+    }
+
+    #[test]
+    fn replaced_swap_is_abandoned() {
+        let mut swap = HotSwap::new(Context::new("cpu").unwrap());
+        let (ready, wait) = mpsc::channel::<()>();
+        swap.begin_swap_with(move || {
+            wait.recv().unwrap();
+            Err(Error::WrapperError(
+                "abandoned swap was switched in".to_owned(),
+            ))
+        });
+        swap.begin_swap_with(|| Context::new("cpu"));
+        ready.send(()).unwrap();
+        assert!(swap.finish_swap().unwrap().is_some());
+        assert!(swap.finish_swap().unwrap().is_none());
+    }
+
+    #[test]
+    fn failed_swap_keeps_current() {
+        let mut swap = HotSwap::new(Context::new("cpu").unwrap());
+        swap.begin_swap_with(|| Err(Error::WrapperError("no model".to_owned())));
+        assert!(
+            swap.finish_swap()
+                .unwrap_err()
+                .to_string()
+                .contains("no model")
+        );
+        assert!(!swap.is_pending());
+        assert!(swap.last_swap().is_none());
+    }
+}
@@ -0,0 +1,138 @@
+use crate::{
+    Error,
+    view::{F16, Quantization, convert_f16, dequantize_i8, dequantize_u8},
+};
+use deepviewrt as dvrt;
+use std::slice;
+use vaal_sys as ffi;
+
+pub(crate) fn type_size(vaal_type: ffi::VAALType) -> Option<usize> {
+    match vaal_type {
+        ffi::VAALType_VAAL_I8 | ffi::VAALType_VAAL_U8 => Some(1),
+        ffi::VAALType_VAAL_I16 | ffi::VAALType_VAAL_U16 | ffi::VAALType_VAAL_F16 => Some(2),
+        ffi::VAALType_VAAL_I32 | ffi::VAALType_VAAL_U32 | ffi::VAALType_VAAL_F32 => Some(4),
+        ffi::VAALType_VAAL_I64 | ffi::VAALType_VAAL_U64 | ffi::VAALType_VAAL_F64 => Some(8),
+        _ => None,
+    }
+}
+
+pub(crate) fn vaal_type(tensor: &dvrt::tensor::Tensor) -> ffi::VAALType {
+    match tensor.tensor_type() {
+        dvrt::tensor::TensorType::RAW => ffi::VAALType_VAAL_RAW,
+        dvrt::tensor::TensorType::STR => ffi::VAALType_VAAL_STR,
+        dvrt::tensor::TensorType::I8 => ffi::VAALType_VAAL_I8,
+        dvrt::tensor::TensorType::U8 => ffi::VAALType_VAAL_U8,
+        dvrt::tensor::TensorType::I16 => ffi::VAALType_VAAL_I16,
+        dvrt::tensor::TensorType::U16 => ffi::VAALType_VAAL_U16,
+        dvrt::tensor::TensorType::I32 => ffi::VAALType_VAAL_I32,
+        dvrt::tensor::TensorType::U32 => ffi::VAALType_VAAL_U32,
+        dvrt::tensor::TensorType::I64 => ffi::VAALType_VAAL_I64,
+        dvrt::tensor::TensorType::U64 => ffi::VAALType_VAAL_U64,
+        dvrt::tensor::TensorType::F16 => ffi::VAALType_VAAL_F16,
+        dvrt::tensor::TensorType::F32 => ffi::VAALType_VAAL_F32,
+        dvrt::tensor::TensorType::F64 => ffi::VAALType_VAAL_F64,
+    }
+}
+
+/// Maps the tensor for reading and passes its raw bytes to f, the tensor is
+/// unmapped once f returns.
+pub(crate) fn with_bytes<R>(
+    tensor: &dvrt::tensor::Tensor,
+    f: impl FnOnce(ffi::VAALType, &[u8]) -> R,
+) -> Result<R, Error> {
+    let (vaal_type, bytes) = match tensor.tensor_type() {
+        dvrt::tensor::TensorType::I8 => {
+            let data = tensor.mapro_i8()?;
+            let bytes = unsafe { slice::from_raw_parts(data.as_ptr() as *const u8, data.len()) };
+            (ffi::VAALType_VAAL_I8, bytes)
+        }
+        dvrt::tensor::TensorType::U8 => (ffi::VAALType_VAAL_U8, tensor.mapro_u8()?),
+        dvrt::tensor::TensorType::F32 => {
+            let data = tensor.mapro_f32()?;
+            let bytes =
+                unsafe { slice::from_raw_parts(data.as_ptr() as *const u8, data.len() * 4) };
+            (ffi::VAALType_VAAL_F32, bytes)
+        }
+        _ => {
+            return Err(Error::WrapperError("unsupported tensor type".to_owned()));
+        }
+    };
+    let result = f(vaal_type, bytes);
+    tensor.unmap();
+    Ok(result)
+}
+
+/// Maps the tensor for writing and passes its raw bytes to f, the tensor is
+/// unmapped once f returns.
+pub(crate) fn with_bytes_mut<R>(
+    tensor: &dvrt::tensor::Tensor,
+    f: impl FnOnce(ffi::VAALType, &mut [u8]) -> R,
+) -> Result<R, Error> {
+    let (vaal_type, bytes) = match tensor.tensor_type() {
+        dvrt::tensor::TensorType::I8 => {
+            let data = tensor.maprw_i8()?;
+            let bytes =
+                unsafe { slice::from_raw_parts_mut(data.as_mut_ptr() as *mut u8, data.len()) };
+            (ffi::VAALType_VAAL_I8, bytes)
+        }
+        dvrt::tensor::TensorType::U8 => (ffi::VAALType_VAAL_U8, tensor.maprw_u8()?),
+        dvrt::tensor::TensorType::F32 => {
+            let data = tensor.maprw_f32()?;
+            let bytes =
+                unsafe { slice::from_raw_parts_mut(data.as_mut_ptr() as *mut u8, data.len() * 4) };
+            (ffi::VAALType_VAAL_F32, bytes)
+        }
+        _ => {
+            return Err(Error::WrapperError("unsupported tensor type".to_owned()));
+        }
+    };
+    let result = f(vaal_type, bytes);
+    tensor.unmap();
+    Ok(result)
+}
+
+/// Converts raw tensor data to floats, applying per-tensor quantization.
+pub(crate) fn dequantize_into(
+    vaal_type: ffi::VAALType,
+    data: &[u8],
+    scales: &[f32],
+    zeros: &[i32],
+    output: &mut Vec<f32>,
+) -> Result<(), Error> {
+    let quantization = Quantization {
+        scale: scales.first().copied().unwrap_or(1.0),
+        zero: zeros.first().copied().unwrap_or(0),
+    };
+    match vaal_type {
+        ffi::VAALType_VAAL_F32 => {
+            output.clear();
+            output.extend(
+                data.chunks_exact(4)
+                    .map(|b| f32::from_le_bytes(b.try_into().unwrap())),
+            )
+        }
+        ffi::VAALType_VAAL_F16 => {
+            output.resize(data.len() / 2, 0.0);
+            if (data.as_ptr() as usize).is_multiple_of(2) {
+                let data =
+                    unsafe { slice::from_raw_parts(data.as_ptr() as *const F16, data.len() / 2) };
+                convert_f16(data, output);
+            } else {
+                for (v, b) in output.iter_mut().zip(data.chunks_exact(2)) {
+                    *v = F16(u16::from_le_bytes([b[0], b[1]])).to_f32();
+                }
+            }
+        }
+        ffi::VAALType_VAAL_U8 => {
+            output.resize(data.len(), 0.0);
+            dequantize_u8(data, quantization, output);
+        }
+        ffi::VAALType_VAAL_I8 => {
+            let data = unsafe { slice::from_raw_parts(data.as_ptr() as *const i8, data.len()) };
+            output.resize(data.len(), 0.0);
+            dequantize_i8(data, quantization, output);
+        }
+        _ => return Err(Error::WrapperError("unsupported tensor type".to_owned())),
+    }
+    Ok(())
+}
@@ -0,0 +1,172 @@
+use crate::{VAALBox, postprocess::iou};
+
+#[derive(Debug, Clone, Copy)]
+pub struct TrackedBox {
+    pub id: u64,
+    pub bbox: VAALBox,
+    /// Number of consecutive frames the track has been matched.
+    pub hits: u32,
+}
+
+struct Track {
+    id: u64,
+    bbox: VAALBox,
+    hits: u32,
+    missed: u32,
+}
+
+/// Greedy IoU tracker assigning stable ids to boxes of the same label across
+/// frames.  Tracks which go unmatched for more than max_missed frames are
+/// dropped.
+pub struct Tracker {
+    pub iou_threshold: f32,
+    pub max_missed: u32,
+    next_id: u64,
+    tracks: Vec<Track>,
+    matched: Vec<bool>,
+}
+
+impl Default for Tracker {
+    fn default() -> Self {
+        Tracker {
+            iou_threshold: 0.3,
+            max_missed: 5,
+            next_id: 1,
+            tracks: Vec::new(),
+            matched: Vec::new(),
+        }
+    }
+}
+
+impl Tracker {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn len(&self) -> usize {
+        self.tracks.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.tracks.is_empty()
+    }
+
+    pub fn update(&mut self, boxes: &[VAALBox], output: &mut Vec<TrackedBox>) {
+        output.clear();
+        self.matched.clear();
+        self.matched.resize(self.tracks.len(), false);
+
+        for bbox in boxes {
+            let mut best = None;
+            let mut best_iou = self.iou_threshold;
+            for (i, track) in self.tracks.iter().enumerate() {
+                if self.matched[i] || track.bbox.label != bbox.label {
+                    continue;
+                }
+                let overlap = iou(&track.bbox, bbox);
+                if overlap > best_iou {
+                    best_iou = overlap;
+                    best = Some(i);
+                }
+            }
+
+            let index = match best {
+                Some(i) => {
+                    let track = &mut self.tracks[i];
+                    track.bbox = *bbox;
+                    track.hits += 1;
+                    track.missed = 0;
+                    i
+                }
+                None => {
+                    self.tracks.push(Track {
+                        id: self.next_id,
+                        bbox: *bbox,
+                        hits: 1,
+                        missed: 0,
+                    });
+                    self.matched.push(false);
+                    self.next_id += 1;
+                    self.tracks.len() - 1
+                }
+            };
+            self.matched[index] = true;
+            let track = &self.tracks[index];
+            output.push(TrackedBox {
+                id: track.id,
+                bbox: track.bbox,
+                hits: track.hits,
+            });
+        }
+
+        let max_missed = self.max_missed;
+        let mut i = 0;
+        self.tracks.retain_mut(|track| {
+            if !self.matched[i] {
+                track.missed += 1;
+                track.hits = 0;
+            }
+            i += 1;
+            track.missed <= max_missed
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn bbox(label: i32, x: f32) -> VAALBox {
+        VAALBox {
+            xmin: x,
+            ymin: 0.0,
+            xmax: x + 1.0,
+            ymax: 1.0,
+            score: 0.9,
+            label,
+        }
+    }
+
+    fn ids(tracker: &mut Tracker, boxes: &[VAALBox]) -> Vec<(u64, u32)> {
+        let mut output = Vec::new();
+        tracker.update(boxes, &mut output);
+        output.iter().map(|t| (t.id, t.hits)).collect()
+    }
+
+    #[test]
+    fn ids_follow_moving_boxes() {
+        let mut tracker = Tracker::new();
+        assert_eq!(
+            ids(&mut tracker, &[bbox(0, 0.0), bbox(0, 5.0)]),
+            [(1, 1), (2, 1)]
+        );
+        // Both boxes move a little and arrive in the other order.
+        assert_eq!(
+            ids(&mut tracker, &[bbox(0, 5.2), bbox(0, 0.2)]),
+            [(2, 2), (1, 2)]
+        );
+        assert_eq!(ids(&mut tracker, &[bbox(0, 0.4)]), [(1, 3)]);
+        assert_eq!(tracker.len(), 2);
+        // A box of another label on the same spot starts a new track.
+        assert_eq!(ids(&mut tracker, &[bbox(1, 0.4)]), [(3, 1)]);
+    }
+
+    #[test]
+    fn unmatched_tracks_expire() {
+        let mut tracker = Tracker {
+            max_missed: 2,
+            ..Tracker::default()
+        };
+        ids(&mut tracker, &[bbox(0, 0.0)]);
+        ids(&mut tracker, &[]);
+        ids(&mut tracker, &[]);
+        assert_eq!(tracker.len(), 1);
+        // Back within max_missed keeps the id with the hit count restarted.
+        assert_eq!(ids(&mut tracker, &[bbox(0, 0.0)]), [(1, 1)]);
+        for _ in 0..3 {
+            ids(&mut tracker, &[]);
+        }
+        assert!(tracker.is_empty());
+        assert_eq!(ids(&mut tracker, &[bbox(0, 0.0)]), [(2, 1)]);
+    }
+}
@@ -0,0 +1,762 @@
+use crate::{Error, tensor::vaal_type};
+use deepviewrt as dvrt;
+use std::{marker::PhantomData, ops::Deref, slice};
+use vaal_sys as ffi;
+
+/// IEEE 754 half precision value as stored in F16 tensors.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Hash)]
+#[repr(transparent)]
+pub struct F16(pub u16);
+
+impl F16 {
+    pub fn from_bits(bits: u16) -> Self {
+        F16(bits)
+    }
+
+    pub fn to_bits(self) -> u16 {
+        self.0
+    }
+
+    pub fn to_f32(self) -> f32 {
+        let h = self.0 as u32;
+        let sign = (h & 0x8000) << 16;
+        let exp = (h >> 10) & 0x1f;
+        let man = h & 0x3ff;
+        match exp {
+            0 => {
+                // Zero or subnormal, man * 2^-24.
+                let value = man as f32 * (1.0 / 16_777_216.0);
+                if sign != 0 { -value } else { value }
+            }
+            0x1f => f32::from_bits(sign | 0x7f80_0000 | (man << 13)),
+            _ => f32::from_bits(sign | ((exp + 112) << 23) | (man << 13)),
+        }
+    }
+}
+
+impl From<F16> for f32 {
+    fn from(value: F16) -> Self {
+        value.to_f32()
+    }
+}
+
+/// Per-tensor affine quantization, real = (quantized - zero) * scale.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Quantization {
+    pub scale: f32,
+    pub zero: i32,
+}
+
+impl Default for Quantization {
+    fn default() -> Self {
+        Quantization {
+            scale: 1.0,
+            zero: 0,
+        }
+    }
+}
+
+mod sealed {
+    pub trait Sealed {}
+    impl Sealed for i8 {}
+    impl Sealed for u8 {}
+    impl Sealed for f32 {}
+    impl Sealed for super::F16 {}
+}
+
+/// Element types of output tensors which can be viewed in place.
+pub trait Element: Copy + sealed::Sealed {
+    const VAAL_TYPE: ffi::VAALType;
+
+    #[doc(hidden)]
+    fn map(tensor: &dvrt::tensor::Tensor) -> Result<(*const Self, usize), Error>;
+
+    #[doc(hidden)]
+    fn dequantize(src: &[Self], quantization: Quantization, dst: &mut [f32]);
+
+    #[doc(hidden)]
+    fn dequantize_where(
+        src: &[Self],
+        quantization: Quantization,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    );
+}
+
+impl Element for i8 {
+    const VAAL_TYPE: ffi::VAALType = ffi::VAALType_VAAL_I8;
+
+    fn map(tensor: &dvrt::tensor::Tensor) -> Result<(*const Self, usize), Error> {
+        let data = tensor.mapro_i8()?;
+        Ok((data.as_ptr(), data.len()))
+    }
+
+    fn dequantize(src: &[Self], quantization: Quantization, dst: &mut [f32]) {
+        dequantize_i8(src, quantization, dst)
+    }
+
+    fn dequantize_where(
+        src: &[Self],
+        quantization: Quantization,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) {
+        select_i8(src, quantization, threshold, output)
+    }
+}
+
+impl Element for u8 {
+    const VAAL_TYPE: ffi::VAALType = ffi::VAALType_VAAL_U8;
+
+    fn map(tensor: &dvrt::tensor::Tensor) -> Result<(*const Self, usize), Error> {
+        let data = tensor.mapro_u8()?;
+        Ok((data.as_ptr(), data.len()))
+    }
+
+    fn dequantize(src: &[Self], quantization: Quantization, dst: &mut [f32]) {
+        dequantize_u8(src, quantization, dst)
+    }
+
+    fn dequantize_where(
+        src: &[Self],
+        quantization: Quantization,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) {
+        select_u8(src, quantization, threshold, output)
+    }
+}
+
+impl Element for f32 {
+    const VAAL_TYPE: ffi::VAALType = ffi::VAALType_VAAL_F32;
+
+    fn map(tensor: &dvrt::tensor::Tensor) -> Result<(*const Self, usize), Error> {
+        let data = tensor.mapro_f32()?;
+        Ok((data.as_ptr(), data.len()))
+    }
+
+    fn dequantize(src: &[Self], _: Quantization, dst: &mut [f32]) {
+        dst.copy_from_slice(src)
+    }
+
+    fn dequantize_where(
+        src: &[Self],
+        _: Quantization,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) {
+        output.extend(
+            src.iter()
+                .enumerate()
+                .filter(|(_, v)| **v >= threshold)
+                .map(|(i, v)| (i, *v)),
+        )
+    }
+}
+
+impl Element for F16 {
+    const VAAL_TYPE: ffi::VAALType = ffi::VAALType_VAAL_F16;
+
+    /// deepviewrt has no half precision mapping, the tensor is mapped as raw
+    /// bytes and sized by its volume.
+    fn map(tensor: &dvrt::tensor::Tensor) -> Result<(*const Self, usize), Error> {
+        let data = tensor.mapro_u8()?;
+        Ok((data.as_ptr() as *const F16, tensor.volume().max(0) as usize))
+    }
+
+    fn dequantize(src: &[Self], _: Quantization, dst: &mut [f32]) {
+        convert_f16(src, dst)
+    }
+
+    fn dequantize_where(
+        src: &[Self],
+        _: Quantization,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) {
+        output.extend(
+            src.iter()
+                .enumerate()
+                .map(|(i, v)| (i, v.to_f32()))
+                .filter(|(_, v)| *v >= threshold),
+        )
+    }
+}
+
+/// Typed read-only view of an output tensor, mapped in place without a
+/// copy.  The view borrows the context mutably so the data cannot be
+/// overwritten by another `run_model` while it is alive, the tensor is
+/// unmapped when the view is dropped.
+pub struct OutputView<'a, T: Element> {
+    tensor: dvrt::tensor::Tensor,
+    data: *const T,
+    len: usize,
+    _context: PhantomData<&'a mut crate::Context>,
+}
+
+impl<'a, T: Element> OutputView<'a, T> {
+    pub(crate) fn new(tensor: dvrt::tensor::Tensor) -> Result<Self, Error> {
+        let found = vaal_type(&tensor);
+        if found != T::VAAL_TYPE {
+            return Err(Error::WrapperError(format!(
+                "output tensor is VAAL type {} not {}",
+                found,
+                T::VAAL_TYPE
+            )));
+        }
+        let (data, len) = T::map(&tensor)?;
+        Ok(OutputView {
+            tensor,
+            data,
+            len,
+            _context: PhantomData,
+        })
+    }
+
+    pub fn shape(&self) -> &[i32] {
+        self.tensor.shape()
+    }
+
+    /// Per-channel scales, empty for tensors which are not quantized.
+    pub fn scales(&self) -> &[f32] {
+        self.tensor.scales()
+    }
+
+    pub fn zeros(&self) -> &[i32] {
+        self.tensor.zeros()
+    }
+
+    /// Per-tensor quantization, the first channel of per-channel parameters.
+    pub fn quantization(&self) -> Quantization {
+        Quantization {
+            scale: self.scales().first().copied().unwrap_or(1.0),
+            zero: self.zeros().first().copied().unwrap_or(0),
+        }
+    }
+
+    /// Converts the whole tensor to floats, output must have the length of
+    /// the view.
+    pub fn dequantize_into(&self, output: &mut [f32]) -> Result<(), Error> {
+        if output.len() != self.len {
+            return Err(Error::WrapperError(format!(
+                "output holds {} values, the tensor {}",
+                output.len(),
+                self.len
+            )));
+        }
+        T::dequantize(self, self.quantization(), output);
+        Ok(())
+    }
+
+    /// Appends the index and real value of every element at or above
+    /// threshold to output, returning the number appended.  Quantized
+    /// tensors are compared in the quantized domain so only matches are
+    /// converted.
+    pub fn dequantize_where(&self, threshold: f32, output: &mut Vec<(usize, f32)>) -> usize {
+        let start = output.len();
+        T::dequantize_where(self, self.quantization(), threshold, output);
+        output.len() - start
+    }
+}
+
+impl<T: Element> Deref for OutputView<'_, T> {
+    type Target = [T];
+
+    fn deref(&self) -> &[T] {
+        unsafe { slice::from_raw_parts(self.data, self.len) }
+    }
+}
+
+impl<T: Element> Drop for OutputView<'_, T> {
+    fn drop(&mut self) {
+        self.tensor.unmap();
+    }
+}
+
+pub(crate) fn dequantize_u8(src: &[u8], quantization: Quantization, dst: &mut [f32]) {
+    let n = src.len().min(dst.len());
+    let (src, dst) = (&src[..n], &mut dst[..n]);
+    let scale = quantization.scale;
+    let zero = quantization.zero as f32;
+    #[cfg(target_arch = "x86_64")]
+    if is_x86_feature_detected!("avx2") {
+        return unsafe { x86::dequantize_u8(src, scale, zero, dst) };
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        return unsafe { neon::dequantize_u8(src, scale, zero, dst) };
+    }
+    #[allow(unreachable_code)]
+    for (d, s) in dst.iter_mut().zip(src) {
+        *d = (*s as f32 - zero) * scale;
+    }
+}
+
+pub(crate) fn dequantize_i8(src: &[i8], quantization: Quantization, dst: &mut [f32]) {
+    let n = src.len().min(dst.len());
+    let (src, dst) = (&src[..n], &mut dst[..n]);
+    let scale = quantization.scale;
+    let zero = quantization.zero as f32;
+    #[cfg(target_arch = "x86_64")]
+    if is_x86_feature_detected!("avx2") {
+        return unsafe { x86::dequantize_i8(src, scale, zero, dst) };
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        return unsafe { neon::dequantize_i8(src, scale, zero, dst) };
+    }
+    #[allow(unreachable_code)]
+    for (d, s) in dst.iter_mut().zip(src) {
+        *d = (*s as f32 - zero) * scale;
+    }
+}
+
+pub(crate) fn convert_f16(src: &[F16], dst: &mut [f32]) {
+    let n = src.len().min(dst.len());
+    let (src, dst) = (&src[..n], &mut dst[..n]);
+    #[cfg(target_arch = "x86_64")]
+    if is_x86_feature_detected!("f16c") && is_x86_feature_detected!("avx") {
+        return unsafe { x86::convert_f16(src, dst) };
+    }
+    for (d, s) in dst.iter_mut().zip(src) {
+        *d = s.to_f32();
+    }
+}
+
+/// Smallest quantized value which may dequantize to at least threshold, None
+/// when no value in min..=max can.  One below the exact bound is returned so
+/// rounding never drops a match, callers check the real value.
+fn quantized_threshold(
+    quantization: Quantization,
+    threshold: f32,
+    min: i32,
+    max: i32,
+) -> Option<i32> {
+    let q = (threshold / quantization.scale + quantization.zero as f32).floor() - 1.0;
+    if q.is_nan() || q > max as f32 {
+        return None;
+    }
+    Some((q.max(min as f32)) as i32)
+}
+
+fn push_if(output: &mut Vec<(usize, f32)>, index: usize, value: f32, threshold: f32) {
+    if value >= threshold {
+        output.push((index, value));
+    }
+}
+
+pub(crate) fn select_u8(
+    src: &[u8],
+    quantization: Quantization,
+    threshold: f32,
+    output: &mut Vec<(usize, f32)>,
+) {
+    let scale = quantization.scale;
+    let zero = quantization.zero as f32;
+    if scale <= 0.0 || scale.is_nan() {
+        for (i, v) in src.iter().enumerate() {
+            push_if(output, i, (*v as f32 - zero) * scale, threshold);
+        }
+        return;
+    }
+    let q = match quantized_threshold(quantization, threshold, 0, 255) {
+        Some(q) => q as u8,
+        None => return,
+    };
+    #[cfg(target_arch = "x86_64")]
+    let start = if is_x86_feature_detected!("avx2") {
+        unsafe { x86::select_u8(src, q, scale, zero, threshold, output) }
+    } else {
+        0
+    };
+    #[cfg(target_arch = "aarch64")]
+    let start = unsafe { neon::select_u8(src, q, scale, zero, threshold, output) };
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    let start = 0;
+    for (i, v) in src.iter().enumerate().skip(start) {
+        if *v >= q {
+            push_if(output, i, (*v as f32 - zero) * scale, threshold);
+        }
+    }
+}
+
+pub(crate) fn select_i8(
+    src: &[i8],
+    quantization: Quantization,
+    threshold: f32,
+    output: &mut Vec<(usize, f32)>,
+) {
+    let scale = quantization.scale;
+    let zero = quantization.zero as f32;
+    if scale <= 0.0 || scale.is_nan() {
+        for (i, v) in src.iter().enumerate() {
+            push_if(output, i, (*v as f32 - zero) * scale, threshold);
+        }
+        return;
+    }
+    let q = match quantized_threshold(quantization, threshold, -128, 127) {
+        Some(q) => q as i8,
+        None => return,
+    };
+    #[cfg(target_arch = "x86_64")]
+    let start = if is_x86_feature_detected!("avx2") {
+        unsafe { x86::select_i8(src, q, scale, zero, threshold, output) }
+    } else {
+        0
+    };
+    #[cfg(target_arch = "aarch64")]
+    let start = unsafe { neon::select_i8(src, q, scale, zero, threshold, output) };
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    let start = 0;
+    for (i, v) in src.iter().enumerate().skip(start) {
+        if *v >= q {
+            push_if(output, i, (*v as f32 - zero) * scale, threshold);
+        }
+    }
+}
+
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use super::{F16, push_if};
+    use std::arch::x86_64::*;
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn dequantize_u8(src: &[u8], scale: f32, zero: f32, dst: &mut [f32]) {
+        let n = src.len() / 8 * 8;
+        let scale_v = _mm256_set1_ps(scale);
+        let zero_v = _mm256_set1_ps(zero);
+        let mut i = 0;
+        while i < n {
+            let bytes = _mm_loadl_epi64(src.as_ptr().add(i) as *const __m128i);
+            let values = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+            let real = _mm256_mul_ps(_mm256_sub_ps(values, zero_v), scale_v);
+            _mm256_storeu_ps(dst.as_mut_ptr().add(i), real);
+            i += 8;
+        }
+        for j in n..src.len() {
+            dst[j] = (src[j] as f32 - zero) * scale;
+        }
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn dequantize_i8(src: &[i8], scale: f32, zero: f32, dst: &mut [f32]) {
+        let n = src.len() / 8 * 8;
+        let scale_v = _mm256_set1_ps(scale);
+        let zero_v = _mm256_set1_ps(zero);
+        let mut i = 0;
+        while i < n {
+            let bytes = _mm_loadl_epi64(src.as_ptr().add(i) as *const __m128i);
+            let values = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+            let real = _mm256_mul_ps(_mm256_sub_ps(values, zero_v), scale_v);
+            _mm256_storeu_ps(dst.as_mut_ptr().add(i), real);
+            i += 8;
+        }
+        for j in n..src.len() {
+            dst[j] = (src[j] as f32 - zero) * scale;
+        }
+    }
+
+    #[target_feature(enable = "avx,f16c")]
+    pub unsafe fn convert_f16(src: &[F16], dst: &mut [f32]) {
+        let n = src.len() / 8 * 8;
+        let mut i = 0;
+        while i < n {
+            let half = _mm_loadu_si128(src.as_ptr().add(i) as *const __m128i);
+            _mm256_storeu_ps(dst.as_mut_ptr().add(i), _mm256_cvtph_ps(half));
+            i += 8;
+        }
+        for j in n..src.len() {
+            dst[j] = src[j].to_f32();
+        }
+    }
+
+    /// Scans 32 values at a time for any at or above q, returns the index
+    /// where the scalar tail starts.
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn select_u8(
+        src: &[u8],
+        q: u8,
+        scale: f32,
+        zero: f32,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) -> usize {
+        let n = src.len() / 32 * 32;
+        let q_v = _mm256_set1_epi8(q as i8);
+        let mut i = 0;
+        while i < n {
+            let values = _mm256_loadu_si256(src.as_ptr().add(i) as *const __m256i);
+            let ge = _mm256_cmpeq_epi8(_mm256_max_epu8(values, q_v), values);
+            let mut mask = _mm256_movemask_epi8(ge) as u32;
+            while mask != 0 {
+                let j = i + mask.trailing_zeros() as usize;
+                push_if(output, j, (src[j] as f32 - zero) * scale, threshold);
+                mask &= mask - 1;
+            }
+            i += 32;
+        }
+        n
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn select_i8(
+        src: &[i8],
+        q: i8,
+        scale: f32,
+        zero: f32,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) -> usize {
+        let n = src.len() / 32 * 32;
+        let q_v = _mm256_set1_epi8(q);
+        let mut i = 0;
+        while i < n {
+            let values = _mm256_loadu_si256(src.as_ptr().add(i) as *const __m256i);
+            let ge = _mm256_cmpeq_epi8(_mm256_max_epi8(values, q_v), values);
+            let mut mask = _mm256_movemask_epi8(ge) as u32;
+            while mask != 0 {
+                let j = i + mask.trailing_zeros() as usize;
+                push_if(output, j, (src[j] as f32 - zero) * scale, threshold);
+                mask &= mask - 1;
+            }
+            i += 32;
+        }
+        n
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+mod neon {
+    use super::push_if;
+    use std::arch::aarch64::*;
+
+    pub unsafe fn dequantize_u8(src: &[u8], scale: f32, zero: f32, dst: &mut [f32]) {
+        let n = src.len() / 8 * 8;
+        let scale_v = vdupq_n_f32(scale);
+        let zero_v = vdupq_n_f32(zero);
+        let mut i = 0;
+        while i < n {
+            let wide = vmovl_u8(vld1_u8(src.as_ptr().add(i)));
+            let lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide)));
+            let hi = vcvtq_f32_u32(vmovl_high_u16(wide));
+            let out = dst.as_mut_ptr().add(i);
+            vst1q_f32(out, vmulq_f32(vsubq_f32(lo, zero_v), scale_v));
+            vst1q_f32(out.add(4), vmulq_f32(vsubq_f32(hi, zero_v), scale_v));
+            i += 8;
+        }
+        for j in n..src.len() {
+            dst[j] = (src[j] as f32 - zero) * scale;
+        }
+    }
+
+    pub unsafe fn dequantize_i8(src: &[i8], scale: f32, zero: f32, dst: &mut [f32]) {
+        let n = src.len() / 8 * 8;
+        let scale_v = vdupq_n_f32(scale);
+        let zero_v = vdupq_n_f32(zero);
+        let mut i = 0;
+        while i < n {
+            let wide = vmovl_s8(vld1_s8(src.as_ptr().add(i)));
+            let lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(wide)));
+            let hi = vcvtq_f32_s32(vmovl_high_s16(wide));
+            let out = dst.as_mut_ptr().add(i);
+            vst1q_f32(out, vmulq_f32(vsubq_f32(lo, zero_v), scale_v));
+            vst1q_f32(out.add(4), vmulq_f32(vsubq_f32(hi, zero_v), scale_v));
+            i += 8;
+        }
+        for j in n..src.len() {
+            dst[j] = (src[j] as f32 - zero) * scale;
+        }
+    }
+
+    /// Skips 16 value blocks with nothing at or above q, returns the index
+    /// where the scalar tail starts.
+    pub unsafe fn select_u8(
+        src: &[u8],
+        q: u8,
+        scale: f32,
+        zero: f32,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) -> usize {
+        let n = src.len() / 16 * 16;
+        let q_v = vdupq_n_u8(q);
+        let mut i = 0;
+        while i < n {
+            let ge = vcgeq_u8(vld1q_u8(src.as_ptr().add(i)), q_v);
+            if vmaxvq_u8(ge) != 0 {
+                for j in i..i + 16 {
+                    if src[j] >= q {
+                        push_if(output, j, (src[j] as f32 - zero) * scale, threshold);
+                    }
+                }
+            }
+            i += 16;
+        }
+        n
+    }
+
+    pub unsafe fn select_i8(
+        src: &[i8],
+        q: i8,
+        scale: f32,
+        zero: f32,
+        threshold: f32,
+        output: &mut Vec<(usize, f32)>,
+    ) -> usize {
+        let n = src.len() / 16 * 16;
+        let q_v = vdupq_n_s8(q);
+        let mut i = 0;
+        while i < n {
+            let ge = vcgeq_s8(vld1q_s8(src.as_ptr().add(i)), q_v);
+            if vmaxvq_u8(ge) != 0 {
+                for j in i..i + 16 {
+                    if src[j] >= q {
+                        push_if(output, j, (src[j] as f32 - zero) * scale, threshold);
+                    }
+                }
+            }
+            i += 16;
+        }
+        n
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const QUANTIZATIONS: [Quantization; 5] = [
+        Quantization {
+            scale: 1.0 / 255.0,
+            zero: 0,
+        },
+        Quantization {
+            scale: 0.05,
+            zero: 10,
+        },
+        Quantization {
+            scale: 1.0 / 3.0,
+            zero: -128,
+        },
+        Quantization {
+            scale: 0.7,
+            zero: 128,
+        },
+        Quantization {
+            scale: 0.003_906_25,
+            zero: -5,
+        },
+    ];
+
+    fn dequantized(value: i32, quantization: Quantization) -> f32 {
+        (value as f32 - quantization.zero as f32) * quantization.scale
+    }
+
+    /// Every value of the type over a length which is not a multiple of any
+    /// vector width, so both the vector loop and the tail are covered.
+    fn values_u8() -> Vec<u8> {
+        (0..=255u8).cycle().take(1003).collect()
+    }
+
+    fn values_i8() -> Vec<i8> {
+        values_u8().iter().map(|v| *v as i8).collect()
+    }
+
+    fn select_scalar(
+        values: impl Iterator<Item = i32>,
+        quantization: Quantization,
+        threshold: f32,
+    ) -> Vec<(usize, f32)> {
+        values
+            .map(|v| dequantized(v, quantization))
+            .enumerate()
+            .filter(|(_, v)| *v >= threshold)
+            .collect()
+    }
+
+    #[test]
+    fn dequantize_matches_scalar() {
+        let (src_u8, src_i8) = (values_u8(), values_i8());
+        let mut dst = vec![0.0; src_u8.len()];
+        for quantization in QUANTIZATIONS {
+            dequantize_u8(&src_u8, quantization, &mut dst);
+            for (s, d) in src_u8.iter().zip(&dst) {
+                assert_eq!(*d, dequantized(*s as i32, quantization), "u8 {}", s);
+            }
+            dequantize_i8(&src_i8, quantization, &mut dst);
+            for (s, d) in src_i8.iter().zip(&dst) {
+                assert_eq!(*d, dequantized(*s as i32, quantization), "i8 {}", s);
+            }
+        }
+    }
+
+    #[test]
+    fn select_matches_scalar() {
+        let (src_u8, src_i8) = (values_u8(), values_i8());
+        for quantization in QUANTIZATIONS {
+            for threshold in [-200.0, -3.0, 0.0, 0.05, 0.5, 5.0, 11.75, 12.25, 1000.0] {
+                let mut selected = Vec::new();
+                select_u8(&src_u8, quantization, threshold, &mut selected);
+                let expected =
+                    select_scalar(src_u8.iter().map(|v| *v as i32), quantization, threshold);
+                assert_eq!(selected, expected, "u8 {:?} {}", quantization, threshold);
+
+                selected.clear();
+                select_i8(&src_i8, quantization, threshold, &mut selected);
+                let expected =
+                    select_scalar(src_i8.iter().map(|v| *v as i32), quantization, threshold);
+                assert_eq!(selected, expected, "i8 {:?} {}", quantization, threshold);
+            }
+        }
+    }
+
+    /// A threshold equal to a dequantized value must select that value even
+    /// when threshold / scale rounds below the quantized value.
+    #[test]
+    fn threshold_boundary_keeps_matches() {
+        let (src_u8, src_i8) = (values_u8(), values_i8());
+        for quantization in QUANTIZATIONS {
+            for value in 0..=255 {
+                let threshold = dequantized(value, quantization);
+                let q = quantized_threshold(quantization, threshold, 0, 255).unwrap();
+                assert!(q <= value, "u8 {:?} {}: {}", quantization, value, q);
+                let mut selected = Vec::new();
+                select_u8(&src_u8, quantization, threshold, &mut selected);
+                assert!(selected.iter().any(|(i, _)| src_u8[*i] as i32 == value));
+            }
+            for value in -128..=127 {
+                let threshold = dequantized(value, quantization);
+                let q = quantized_threshold(quantization, threshold, -128, 127).unwrap();
+                assert!(q <= value, "i8 {:?} {}: {}", quantization, value, q);
+                let mut selected = Vec::new();
+                select_i8(&src_i8, quantization, threshold, &mut selected);
+                assert!(selected.iter().any(|(i, _)| src_i8[*i] as i32 == value));
+            }
+        }
+        let quantization = QUANTIZATIONS[0];
+        assert_eq!(quantized_threshold(quantization, 2.0, 0, 255), None);
+        assert_eq!(quantized_threshold(quantization, f32::NAN, 0, 255), None);
+        assert_eq!(quantized_threshold(quantization, -1.0, 0, 255), Some(0));
+    }
+
+    #[test]
+    fn convert_f16_matches_scalar() {
+        let halves: Vec<F16> = (0..=u16::MAX).map(F16).collect();
+        let mut output = vec![0.0; halves.len()];
+        convert_f16(&halves, &mut output);
+        for (half, value) in halves.iter().zip(&output) {
+            let expected = half.to_f32();
+            assert!(
+                expected.to_bits() == value.to_bits() || (expected.is_nan() && value.is_nan()),
+                "{:#06x}: {} != {}",
+                half.0,
+                value,
+                expected
+            );
+        }
+        assert_eq!(F16(0x3c00).to_f32(), 1.0);
+        assert_eq!(F16(0xc000).to_f32(), -2.0);
+        assert_eq!(F16(0x0001).to_f32(), 5.960_464_5e-8);
+        assert_eq!(F16(0x7bff).to_f32(), 65504.0);
+    }
+}
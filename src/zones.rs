@@ -0,0 +1,567 @@
+use crate::{VAALBox, tracker::TrackedBox};
+use std::collections::HashMap;
+
+/// Point of a box tested against zones and lines.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Anchor {
+    Center,
+    /// Bottom center, where a person or vehicle touches the ground.
+    Footprint,
+}
+
+impl Anchor {
+    fn point(&self, bbox: &VAALBox) -> [f32; 2] {
+        let x = (bbox.xmin + bbox.xmax) * 0.5;
+        match self {
+            Anchor::Center => [x, (bbox.ymin + bbox.ymax) * 0.5],
+            Anchor::Footprint => [x, bbox.ymax],
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Direction {
+    /// From the left of the line to its right, looking from its first point
+    /// to its second in image coordinates.
+    Forward,
+    Backward,
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ZoneStats {
+    /// Boxes inside the zone in the last frame.
+    pub occupancy: u32,
+    /// Tracks which moved into the zone.
+    pub entries: u64,
+    /// Tracks which moved out of the zone or were lost inside it.
+    pub exits: u64,
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct LineStats {
+    pub forward: u64,
+    pub backward: u64,
+}
+
+/// A box of the last frame inside a zone, index is the position in the
+/// boxes passed to `update`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ZoneHit {
+    pub index: usize,
+    pub zone: usize,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Crossing {
+    pub id: u64,
+    pub line: usize,
+    pub direction: Direction,
+}
+
+struct Zone {
+    points: Vec<[f32; 2]>,
+}
+
+struct Line {
+    a: [f32; 2],
+    b: [f32; 2],
+}
+
+struct TrackState {
+    point: [f32; 2],
+    /// Sorted zones the track was inside when last seen.
+    zones: Vec<u32>,
+    seen: u64,
+}
+
+/// Even-odd rule point in polygon test.
+fn contains(points: &[[f32; 2]], p: [f32; 2]) -> bool {
+    let mut inside = false;
+    let mut j = points.len() - 1;
+    for i in 0..points.len() {
+        let (a, b) = (points[i], points[j]);
+        if (a[1] > p[1]) != (b[1] > p[1])
+            && p[0] < (b[0] - a[0]) * (p[1] - a[1]) / (b[1] - a[1]) + a[0]
+        {
+            inside = !inside;
+        }
+        j = i;
+    }
+    inside
+}
+
+fn side(a: [f32; 2], b: [f32; 2], p: [f32; 2]) -> f32 {
+    (b[0] - a[0]) * (p[1] - a[1]) - (b[1] - a[1]) * (p[0] - a[0])
+}
+
+/// Bounds of points as xmin, ymin, xmax, ymax.
+fn bounds(points: &[[f32; 2]]) -> [f32; 4] {
+    points.iter().fold(
+        [f32::MAX, f32::MAX, f32::MIN, f32::MIN],
+        |[x0, y0, x1, y1], p| [x0.min(p[0]), y0.min(p[1]), x1.max(p[0]), y1.max(p[1])],
+    )
+}
+
+/// Occupancy and line crossing counters for polygon zones and lines in
+/// normalized coordinates.  Zones and lines are binned into a uniform grid
+/// over the unit square so each box is only tested against the shapes
+/// sharing its cell, shapes reaching outside the square are clamped to the
+/// border cells.  Counters follow tracker ids across frames, a track missing
+/// for more than max_missed frames is forgotten and leaves its zones.
+pub struct ZoneEngine {
+    pub anchor: Anchor,
+    pub max_missed: u64,
+    grid: usize,
+    zones: Vec<Zone>,
+    lines: Vec<Line>,
+    zone_cells: Vec<Vec<u32>>,
+    line_cells: Vec<Vec<u32>>,
+    zone_stats: Vec<ZoneStats>,
+    line_stats: Vec<LineStats>,
+    line_stamp: Vec<u64>,
+    stamp: u64,
+    tracks: HashMap<u64, TrackState>,
+    frame: u64,
+    hits: Vec<ZoneHit>,
+    crossings: Vec<Crossing>,
+    current: Vec<u32>,
+    scratch_cells: Vec<usize>,
+}
+
+impl Default for ZoneEngine {
+    fn default() -> Self {
+        Self::new(32)
+    }
+}
+
+impl ZoneEngine {
+    /// Creates an engine with grid by grid cells, more cells suit many small
+    /// zones.
+    pub fn new(grid: usize) -> Self {
+        let grid = grid.max(1);
+        ZoneEngine {
+            anchor: Anchor::Footprint,
+            max_missed: 5,
+            grid,
+            zones: Vec::new(),
+            lines: Vec::new(),
+            zone_cells: vec![Vec::new(); grid * grid],
+            line_cells: vec![Vec::new(); grid * grid],
+            zone_stats: Vec::new(),
+            line_stats: Vec::new(),
+            line_stamp: Vec::new(),
+            stamp: 0,
+            tracks: HashMap::new(),
+            frame: 0,
+            hits: Vec::new(),
+            crossings: Vec::new(),
+            current: Vec::new(),
+            scratch_cells: Vec::new(),
+        }
+    }
+
+    fn cell(&self, v: f32) -> usize {
+        ((v * self.grid as f32).max(0.0) as usize).min(self.grid - 1)
+    }
+
+    /// Indices of the cells overlapping bounds.
+    fn cells(&self, [x0, y0, x1, y1]: [f32; 4], cells: &mut Vec<usize>) {
+        cells.clear();
+        for y in self.cell(y0)..=self.cell(y1) {
+            cells.extend((self.cell(x0)..=self.cell(x1)).map(|x| y * self.grid + x));
+        }
+    }
+
+    /// Adds a polygon zone of at least three points, returns its index.
+    pub fn add_zone(&mut self, points: &[[f32; 2]]) -> usize {
+        let index = self.zones.len();
+        if points.len() >= 3 {
+            let mut cells = Vec::new();
+            self.cells(bounds(points), &mut cells);
+            for cell in cells {
+                self.zone_cells[cell].push(index as u32);
+            }
+        }
+        self.zones.push(Zone {
+            points: points.to_vec(),
+        });
+        self.zone_stats.push(ZoneStats::default());
+        index
+    }
+
+    /// Adds a counting line from a to b, returns its index.
+    pub fn add_line(&mut self, a: [f32; 2], b: [f32; 2]) -> usize {
+        let index = self.lines.len();
+        let mut cells = Vec::new();
+        self.cells(bounds(&[a, b]), &mut cells);
+        for cell in cells {
+            self.line_cells[cell].push(index as u32);
+        }
+        self.lines.push(Line { a, b });
+        self.line_stats.push(LineStats::default());
+        self.line_stamp.push(0);
+        index
+    }
+
+    pub fn zone_count(&self) -> usize {
+        self.zones.len()
+    }
+
+    pub fn line_count(&self) -> usize {
+        self.lines.len()
+    }
+
+    pub fn zone_stats(&self) -> &[ZoneStats] {
+        &self.zone_stats
+    }
+
+    pub fn line_stats(&self) -> &[LineStats] {
+        &self.line_stats
+    }
+
+    /// Zone memberships of the last frame.
+    pub fn hits(&self) -> &[ZoneHit] {
+        &self.hits
+    }
+
+    /// Line crossings of the last frame.
+    pub fn crossings(&self) -> &[Crossing] {
+        &self.crossings
+    }
+
+    /// Clears all counters and tracks, keeping the zones and lines.
+    pub fn reset(&mut self) {
+        self.zone_stats.fill(ZoneStats::default());
+        self.line_stats.fill(LineStats::default());
+        self.tracks.clear();
+    }
+
+    /// Processes the tracked boxes of one frame.
+    pub fn update(&mut self, boxes: &[TrackedBox]) {
+        self.frame += 1;
+        self.hits.clear();
+        self.crossings.clear();
+        for stats in &mut self.zone_stats {
+            stats.occupancy = 0;
+        }
+
+        for (index, tracked) in boxes.iter().enumerate() {
+            let p = self.anchor.point(&tracked.bbox);
+            let cell = self.cell(p[1]) * self.grid + self.cell(p[0]);
+            self.current.clear();
+            for zone in &self.zone_cells[cell] {
+                if contains(&self.zones[*zone as usize].points, p) {
+                    self.current.push(*zone);
+                    self.zone_stats[*zone as usize].occupancy += 1;
+                    self.hits.push(ZoneHit {
+                        index,
+                        zone: *zone as usize,
+                    });
+                }
+            }
+
+            match self.tracks.get_mut(&tracked.id) {
+                Some(state) => {
+                    let previous = state.point;
+                    diff_zones(&state.zones, &self.current, &mut self.zone_stats);
+                    std::mem::swap(&mut state.zones, &mut self.current);
+                    state.point = p;
+                    state.seen = self.frame;
+                    self.cross(tracked.id, previous, p);
+                }
+                None => {
+                    diff_zones(&[], &self.current, &mut self.zone_stats);
+                    self.tracks.insert(
+                        tracked.id,
+                        TrackState {
+                            point: p,
+                            zones: self.current.clone(),
+                            seen: self.frame,
+                        },
+                    );
+                }
+            }
+        }
+
+        let (frame, max_missed) = (self.frame, self.max_missed);
+        let zone_stats = &mut self.zone_stats;
+        self.tracks.retain(|_, state| {
+            if frame - state.seen <= max_missed {
+                return true;
+            }
+            diff_zones(&state.zones, &[], zone_stats);
+            false
+        });
+    }
+
+    /// Records the lines crossed by a track moving from p0 to p1.
+    fn cross(&mut self, id: u64, p0: [f32; 2], p1: [f32; 2]) {
+        if p0 == p1 || self.lines.is_empty() {
+            return;
+        }
+        self.stamp += 1;
+        let mut cells = std::mem::take(&mut self.scratch_cells);
+        self.cells(bounds(&[p0, p1]), &mut cells);
+        for cell in cells.iter().copied() {
+            for line in &self.line_cells[cell] {
+                let index = *line as usize;
+                if self.line_stamp[index] == self.stamp {
+                    continue;
+                }
+                self.line_stamp[index] = self.stamp;
+                let Line { a, b } = self.lines[index];
+                let (s0, s1) = (side(a, b, p0), side(a, b, p1));
+                if (s0 < 0.0) == (s1 < 0.0) || (side(p0, p1, a) < 0.0) == (side(p0, p1, b) < 0.0) {
+                    continue;
+                }
+                let direction = if s0 < 0.0 {
+                    self.line_stats[index].forward += 1;
+                    Direction::Forward
+                } else {
+                    self.line_stats[index].backward += 1;
+                    Direction::Backward
+                };
+                self.crossings.push(Crossing {
+                    id,
+                    line: index,
+                    direction,
+                });
+            }
+        }
+        self.scratch_cells = cells;
+    }
+}
+
+/// Counts entries and exits between two sorted zone lists.
+fn diff_zones(before: &[u32], after: &[u32], stats: &mut [ZoneStats]) {
+    let (mut i, mut j) = (0, 0);
+    while i < before.len() || j < after.len() {
+        match (before.get(i), after.get(j)) {
+            (Some(b), Some(a)) if b == a => {
+                i += 1;
+                j += 1;
+            }
+            (Some(b), Some(a)) if b < a => {
+                stats[*b as usize].exits += 1;
+                i += 1;
+            }
+            (Some(b), None) => {
+                stats[*b as usize].exits += 1;
+                i += 1;
+            }
+            (_, Some(a)) => {
+                stats[*a as usize].entries += 1;
+                j += 1;
+            }
+            (None, None) => unreachable!(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn tracked(id: u64, x: f32, y: f32) -> TrackedBox {
+        TrackedBox {
+            id,
+            hits: 1,
+            bbox: VAALBox {
+                xmin: x - 0.01,
+                ymin: y - 0.01,
+                xmax: x + 0.01,
+                ymax: y + 0.01,
+                score: 1.0,
+                label: 0,
+            },
+        }
+    }
+
+    fn square(x: f32, y: f32, size: f32) -> [[f32; 2]; 4] {
+        [[x, y], [x + size, y], [x + size, y + size], [x, y + size]]
+    }
+
+    fn center_engine(grid: usize) -> ZoneEngine {
+        let mut engine = ZoneEngine::new(grid);
+        engine.anchor = Anchor::Center;
+        engine
+    }
+
+    #[test]
+    fn contains_polygons() {
+        let square = square(0.2, 0.2, 0.4);
+        assert!(contains(&square, [0.4, 0.4]));
+        assert!(!contains(&square, [0.1, 0.4]));
+        assert!(!contains(&square, [0.4, 0.7]));
+
+        // L shape, the notch at the top right is outside.
+        let l = [
+            [0.0, 0.0],
+            [0.4, 0.0],
+            [0.4, 0.6],
+            [1.0, 0.6],
+            [1.0, 1.0],
+            [0.0, 1.0],
+        ];
+        assert!(contains(&l, [0.2, 0.2]));
+        assert!(contains(&l, [0.8, 0.8]));
+        assert!(!contains(&l, [0.8, 0.2]));
+
+        let triangle = [[0.0, 0.0], [1.0, 0.0], [0.0, 1.0]];
+        assert!(contains(&triangle, [0.2, 0.2]));
+        assert!(!contains(&triangle, [0.6, 0.6]));
+    }
+
+    #[test]
+    fn hits_use_the_grid() {
+        let mut engine = center_engine(16);
+        for i in 0..20 {
+            for j in 0..20 {
+                engine.add_zone(&square(i as f32 * 0.05, j as f32 * 0.05, 0.05));
+            }
+        }
+        // Spans every cell, so it is tested from all of them.
+        let triangle = engine.add_zone(&[[0.0, 0.0], [1.0, 0.0], [0.0, 1.0]]);
+        // Reaches outside the unit square, clamped to the border cells.
+        let outside = engine.add_zone(&[[0.9, 0.9], [1.5, 0.9], [1.5, 1.5], [0.9, 1.5]]);
+
+        engine.update(&[tracked(1, 0.12, 0.12), tracked(2, 0.93, 0.93)]);
+        let hits: Vec<_> = engine.hits().iter().map(|h| (h.index, h.zone)).collect();
+        assert_eq!(
+            hits,
+            [
+                (0, 2 * 20 + 2),
+                (0, triangle),
+                (1, 18 * 20 + 18),
+                (1, outside)
+            ]
+        );
+        assert_eq!(engine.zone_stats()[triangle].occupancy, 1);
+        assert_eq!(engine.zone_stats()[outside].entries, 1);
+    }
+
+    #[test]
+    fn crossing_directions() {
+        let mut engine = center_engine(8);
+        // Pointing down in image coordinates, so its left is +x.
+        let line = engine.add_line([0.5, 0.0], [0.5, 1.0]);
+        let short = engine.add_line([0.2, 0.0], [0.2, 0.3]);
+
+        engine.update(&[
+            tracked(1, 0.4, 0.5),
+            tracked(2, 0.6, 0.5),
+            tracked(3, 0.1, 0.8),
+        ]);
+        assert!(engine.crossings().is_empty());
+
+        // 3 crosses the extension of the short line, not the line itself.
+        engine.update(&[
+            tracked(1, 0.6, 0.6),
+            tracked(2, 0.4, 0.4),
+            tracked(3, 0.3, 0.8),
+        ]);
+        let crossings: Vec<_> = engine
+            .crossings()
+            .iter()
+            .map(|c| (c.id, c.line, c.direction))
+            .collect();
+        assert_eq!(
+            crossings,
+            [
+                (1, line, Direction::Backward),
+                (2, line, Direction::Forward)
+            ]
+        );
+        assert_eq!(
+            engine.line_stats()[line],
+            LineStats {
+                forward: 1,
+                backward: 1
+            }
+        );
+        assert_eq!(engine.line_stats()[short], LineStats::default());
+
+        // Staying on one side counts nothing.
+        engine.update(&[tracked(1, 0.9, 0.9)]);
+        assert!(engine.crossings().is_empty());
+    }
+
+    #[test]
+    fn entries_and_exits() {
+        let mut engine = center_engine(4);
+        let left = engine.add_zone(&square(0.0, 0.0, 0.5));
+        let right = engine.add_zone(&square(0.5, 0.0, 0.5));
+
+        engine.update(&[tracked(1, 0.25, 0.25)]);
+        engine.update(&[tracked(1, 0.3, 0.3)]);
+        assert_eq!(
+            engine.zone_stats()[left],
+            ZoneStats {
+                occupancy: 1,
+                entries: 1,
+                exits: 0
+            }
+        );
+
+        engine.update(&[tracked(1, 0.75, 0.25)]);
+        assert_eq!(
+            engine.zone_stats()[left],
+            ZoneStats {
+                occupancy: 0,
+                entries: 1,
+                exits: 1
+            }
+        );
+        assert_eq!(
+            engine.zone_stats()[right],
+            ZoneStats {
+                occupancy: 1,
+                entries: 1,
+                exits: 0
+            }
+        );
+
+        engine.update(&[tracked(1, 0.75, 0.75)]);
+        assert_eq!(
+            engine.zone_stats()[right],
+            ZoneStats {
+                occupancy: 0,
+                entries: 1,
+                exits: 1
+            }
+        );
+
+        engine.reset();
+        assert_eq!(engine.zone_stats()[right], ZoneStats::default());
+    }
+
+    #[test]
+    fn lost_tracks_expire() {
+        let mut engine = center_engine(4);
+        engine.max_missed = 2;
+        let zone = engine.add_zone(&square(0.0, 0.0, 0.5));
+
+        engine.update(&[tracked(1, 0.25, 0.25), tracked(2, 0.3, 0.3)]);
+        assert_eq!(engine.zone_stats()[zone].entries, 2);
+
+        // Track 2 returns within max_missed and is not counted again.
+        engine.update(&[tracked(1, 0.25, 0.25)]);
+        engine.update(&[tracked(1, 0.25, 0.25)]);
+        engine.update(&[tracked(1, 0.25, 0.25), tracked(2, 0.3, 0.3)]);
+        assert_eq!(engine.zone_stats()[zone].entries, 2);
+        assert_eq!(engine.zone_stats()[zone].exits, 0);
+
+        // Missed for max_missed frames the track is kept, one more and it
+        // leaves the zone.
+        engine.update(&[tracked(2, 0.3, 0.3)]);
+        engine.update(&[tracked(2, 0.3, 0.3)]);
+        assert_eq!(engine.zone_stats()[zone].exits, 0);
+        engine.update(&[tracked(2, 0.3, 0.3)]);
+        assert_eq!(engine.zone_stats()[zone].exits, 1);
+        assert_eq!(engine.zone_stats()[zone].occupancy, 1);
+
+        // A forgotten track coming back is a new entry.
+        engine.update(&[tracked(1, 0.25, 0.25), tracked(2, 0.3, 0.3)]);
+        assert_eq!(engine.zone_stats()[zone].entries, 3);
+    }
+}